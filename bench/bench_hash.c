@@ -0,0 +1,105 @@
+// bench_hash.c - compares the KeyDir hash functions.
+//
+// For a few key shapes it reports the bucket chain-length distribution that
+// each hash produces in a power-of-two table at load factor 1 (the KeyDir
+// growth threshold), and the raw hashing speed.
+//
+// Usage: ./build/bench_hash [num_keys]
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../src/casky.h"
+#include "../src/utils.h"
+#include "../src/hash.h"
+
+#define MAX_CHAIN_BUCKET 8   // chains >= this length share the last column
+
+typedef enum { KEYS_SEQUENTIAL, KEYS_PREFIXED, KEYS_RANDOM } key_shape_t;
+
+static const char *shape_name[] = { "user:%06d", "tenant42:order:%010d", "random hex" };
+
+static void make_key(key_shape_t shape, size_t i, char *buf, size_t size) {
+  switch (shape) {
+    case KEYS_SEQUENTIAL: snprintf(buf, size, "user:%06zu", i); break;
+    case KEYS_PREFIXED:   snprintf(buf, size, "tenant42:order:%010zu", i); break;
+    case KEYS_RANDOM:     snprintf(buf, size, "%08x%08x", (unsigned)rand(), (unsigned)rand()); break;
+  }
+}
+
+static double now_sec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t hash_djb2(const char *key, size_t len) {
+  (void)len;
+  return casky_djb2_hash_xor((unsigned char *)key);
+}
+
+static uint64_t hash_casky(const char *key, size_t len) {
+  return casky_hash(key, len, 0x9e3779b97f4a7c15ULL);
+}
+
+static void report(const char *name, uint64_t (*fn)(const char *, size_t),
+                   char **keys, size_t num_keys) {
+  size_t num_buckets = casky_next_pow2(num_keys);
+  uint32_t *chains = calloc(num_buckets, sizeof(uint32_t));
+  size_t hist[MAX_CHAIN_BUCKET + 1] = {0};
+
+  // Hashing speed alone, without the cache misses of the bucket updates
+  uint64_t sink = 0;
+  double start = now_sec();
+  for (size_t i = 0; i < num_keys; i++)
+    sink ^= fn(keys[i], strlen(keys[i]));
+  double elapsed = now_sec() - start;
+
+  for (size_t i = 0; i < num_keys; i++)
+    chains[fn(keys[i], strlen(keys[i])) & (num_buckets - 1)]++;
+
+  uint32_t max_chain = 0;
+  double probes = 0;  // nodes visited by a successful lookup, on average
+  for (size_t b = 0; b < num_buckets; b++) {
+    uint32_t len = chains[b];
+    hist[len < MAX_CHAIN_BUCKET ? len : MAX_CHAIN_BUCKET]++;
+    if (len > max_chain) max_chain = len;
+    probes += (double)len * (len + 1) / 2;
+  }
+
+  printf("  %-6s %6.1f ns/key  max=%-5u avg-probe=%-6.2f |", name,
+         elapsed / num_keys * 1e9, max_chain, probes / num_keys);
+  if (sink == 42) printf(" ");  // keep the hashing loop alive
+  for (int i = 0; i <= MAX_CHAIN_BUCKET; i++)
+    printf(" %5.1f%%", 100.0 * hist[i] / num_buckets);
+  printf("\n");
+  free(chains);
+}
+
+int main(int argc, char **argv) {
+  size_t num_keys = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+  char **keys = malloc(num_keys * sizeof(char *));
+  char buf[64];
+
+  printf("bench_hash: %zu keys, %zu buckets\n", num_keys, casky_next_pow2(num_keys));
+  printf("  %-6s %-11s  %-9s %-16s |", "hash", "speed", "chains", "");
+  for (int i = 0; i < MAX_CHAIN_BUCKET; i++)
+    printf("  len%d ", i);
+  printf(" len%d+\n", MAX_CHAIN_BUCKET);
+
+  for (key_shape_t shape = KEYS_SEQUENTIAL; shape <= KEYS_RANDOM; shape++) {
+    srand(42);
+    for (size_t i = 0; i < num_keys; i++) {
+      make_key(shape, i, buf, sizeof(buf));
+      keys[i] = strdup(buf);
+    }
+    printf("keys \"%s\"\n", shape_name[shape]);
+    report("djb2", hash_djb2, keys, num_keys);
+    report("casky", hash_casky, keys, num_keys);
+    for (size_t i = 0; i < num_keys; i++)
+      free(keys[i]);
+  }
+
+  free(keys);
+  return 0;
+}
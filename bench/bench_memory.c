@@ -0,0 +1,96 @@
+// bench_memory.c - measures the KeyDir memory cost per key.
+//
+// For a few key shapes and both index engines it fills a KeyDir with
+// value locations (the default CASKY_VALUES_ON_DISK layout, no log) and
+// reports the bytes per key taken by the nodes (arena blocks in use), by
+// the index arrays (bucket heads or Swiss control bytes and slots), and
+// the growth of the resident set size over the whole fill.
+//
+// Usage: ./build/bench_memory [num_keys]
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <malloc.h>
+#include "../src/casky.h"
+#include "../src/utils.h"
+#include "../src/arena.h"
+#include "../src/swiss.h"
+
+typedef enum { KEYS_SHORT, KEYS_SEQUENTIAL, KEYS_PREFIXED } key_shape_t;
+
+static const char *shape_name[] = { "%08x", "user:%06d", "tenant42:order:%010d" };
+
+static size_t make_key(key_shape_t shape, size_t i, char *buf, size_t size) {
+  switch (shape) {
+    case KEYS_SHORT:      return snprintf(buf, size, "%08zx", i);
+    case KEYS_SEQUENTIAL: return snprintf(buf, size, "user:%06zu", i);
+    case KEYS_PREFIXED:   return snprintf(buf, size, "tenant42:order:%010zu", i);
+  }
+  return 0;
+}
+
+static size_t rss_bytes(void) {
+  long pages = 0;
+  FILE *f = fopen("/proc/self/statm", "r");
+  if (f) {
+    if (fscanf(f, "%*s %ld", &pages) != 1) pages = 0;
+    fclose(f);
+  }
+  return (size_t)pages * (size_t)sysconf(_SC_PAGESIZE);
+}
+
+static void report(key_shape_t shape, CaskyEngine engine, size_t num_keys) {
+  CaskyOptions opts;
+  casky_options_init(&opts);
+  opts.engine = engine;
+  size_t rss_before = rss_bytes();
+  // No log: the KeyDir only records where each value would be
+  KeyDir *kd = casky_init_kd_with_options("bench_memory.missing", 0, &opts);
+  if (!kd) {
+    fprintf(stderr, "cannot create the KeyDir\n");
+    exit(1);
+  }
+
+  char key[64];
+  uint64_t offset = 0;
+  for (size_t i = 0; i < num_keys; i++) {
+    size_t len = make_key(shape, i, key, sizeof(key));
+    casky_put_entry(kd, key, len, NULL, 100, 0, offset, 1700000000 + i, 0);
+    offset += CASKY_RECORD_HEADER_SIZE + len + 100;
+  }
+  casky_kd_rehash_finish(kd);
+  size_t rss_after = rss_bytes();
+
+  size_t nodes = 0, index = 0;
+  for (size_t i = 0; i < kd->num_shards; i++) {
+    CaskyShard *s = &kd->shards[i];
+    nodes += s->arena->bytes_in_use;
+    if (s->swiss)
+      index += s->swiss->capacity * (1 + sizeof(*s->swiss->slots));
+    else
+      index += s->num_buckets * sizeof(*s->root);
+  }
+  printf("  %-8s %7.1f %7.1f %7.1f %7.1f\n",
+         engine == CASKY_ENGINE_SWISS ? "swiss" : "chained",
+         (double)nodes / num_keys, (double)index / num_keys,
+         (double)(nodes + index) / num_keys,
+         (double)(rss_after - rss_before) / num_keys);
+  casky_close(kd);
+  // Hand the freed heap back, so that the next run starts from scratch
+  malloc_trim(0);
+}
+
+int main(int argc, char **argv) {
+  size_t num_keys = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+
+  printf("bench_memory: %zu keys, bytes per key\n", num_keys);
+  printf("  %-8s %7s %7s %7s %7s\n", "engine", "nodes", "index", "total", "rss");
+  for (key_shape_t shape = KEYS_SHORT; shape <= KEYS_PREFIXED; shape++) {
+    char key[64];
+    printf("keys \"%s\" (%zu bytes)\n", shape_name[shape], make_key(shape, 0, key, sizeof(key)));
+    report(shape, CASKY_ENGINE_CHAINED, num_keys);
+    report(shape, CASKY_ENGINE_SWISS, num_keys);
+  }
+  return 0;
+}
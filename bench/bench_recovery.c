@@ -0,0 +1,91 @@
+// bench_recovery.c - measures how fast casky_open() rebuilds the KeyDir.
+//
+// Writes a log of the given size (random keys over a key space of half
+// the records, so that half of the records update an earlier key, and one
+// record in ten a tombstone), then opens it with 1, 2, 4, ... recovery
+// threads, up to one per online CPU, and reports the total open time and
+// the records replayed per second. The log stays in the page cache between
+// runs; drop the caches (echo 3 > /proc/sys/vm/drop_caches) before a run to
+// include the disk.
+//
+// Usage: ./build/bench_recovery [log_mib] [value_size]
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "../src/casky.h"
+#include "../src/utils.h"
+
+#define BENCH_LOG "bench_recovery.log"
+
+static double now_sec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Returns: the number of records written
+static size_t write_log(uint64_t log_bytes, size_t value_size) {
+  FILE *f = fopen(BENCH_LOG, "wb");
+  if (!f) {
+    perror(BENCH_LOG);
+    exit(1);
+  }
+  char *value = malloc(value_size);
+  memset(value, 'v', value_size);
+  char key[32];
+  uint64_t written = 0, timestamp = time(NULL);
+  size_t count = 0;
+  size_t key_space = log_bytes / (CASKY_RECORD_HEADER_SIZE + 16 + value_size) / 2 + 1;
+  srand(42);
+  while (written < log_bytes) {
+    uint32_t key_len = snprintf(key, sizeof(key), "user:%010zu", (size_t)rand() % key_space);
+    uint32_t value_len = rand() % 10 == 0 ? 0 : value_size;
+    if (casky_write_record(f, 0, key, key_len, value, value_len, timestamp, 0) != 0) {
+      perror(BENCH_LOG);
+      exit(1);
+    }
+    written += CASKY_RECORD_HEADER_SIZE + key_len + value_len;
+    count++;
+  }
+  free(value);
+  fclose(f);
+  return count;
+}
+
+static void report(uint32_t threads, size_t records, uint64_t log_bytes) {
+  CaskyOptions opts;
+  casky_options_init(&opts);
+  opts.recovery_threads = threads;
+  double start = now_sec();
+  KeyDir *kd = casky_init_kd_with_options(BENCH_LOG, 0, &opts);
+  double elapsed = now_sec() - start;
+  if (!kd) {
+    fprintf(stderr, "cannot open %s\n", BENCH_LOG);
+    exit(1);
+  }
+  printf("  %7u %7u %10.3f %12.0f %10.1f %10zu\n", threads, kd->recovery_threads, elapsed,
+         records / elapsed, log_bytes / elapsed / (1024 * 1024), kd->num_entries);
+  casky_close(kd);
+}
+
+int main(int argc, char **argv) {
+  uint64_t log_mib = argc > 1 ? strtoull(argv[1], NULL, 10) : 2048;
+  size_t value_size = argc > 2 ? strtoul(argv[2], NULL, 10) : 100;
+  uint64_t log_bytes = log_mib * 1024 * 1024;
+
+  printf("Writing a %llu MiB log (%zu-byte values)...\n", (unsigned long long)log_mib, value_size);
+  size_t records = write_log(log_bytes, value_size);
+  printf("%zu records\n\n", records);
+
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  printf("  %7s %7s %10s %12s %10s %10s\n", "threads", "used", "open s", "records/s", "MiB/s", "keys");
+  for (uint32_t threads = 1;; threads *= 2) {
+    report(threads, records, log_bytes);
+    if (threads >= cpus || threads >= CASKY_NUM_SHARDS)
+      break;
+  }
+  remove(BENCH_LOG);
+  return 0;
+}
@@ -0,0 +1,211 @@
+#include <stdlib.h>
+#include <string.h>
+#include "arena.h"
+
+// Chunk numbers the first map has room for
+#define CASKY_ARENA_INITIAL_MAP 16
+
+typedef struct CaskyArenaChunk {
+  struct CaskyArenaChunk *next;
+  // Keeps the blocks that follow the header 16-byte aligned
+  _Alignas(CASKY_ARENA_ALIGN) char data[];
+} CaskyArenaChunk;
+
+// Blocks above CASKY_ARENA_MAX_BLOCK live in a doubly-linked list so that
+// they can be released one by one as well as all at once. Each one takes a
+// chunk number of its own.
+typedef struct CaskyArenaLarge {
+  struct CaskyArenaLarge *prev;
+  struct CaskyArenaLarge *next;
+  uint32_t num;
+  _Alignas(CASKY_ARENA_ALIGN) char data[];
+} CaskyArenaLarge;
+
+/**
+ * casky_arena_block_size - Size of the block actually reserved for a request
+ * of `size` bytes. Callers laying out variable-size records use it to know
+ * how much slack the block leaves after their data.
+ */
+size_t casky_arena_block_size(size_t size) {
+  if (size == 0) size = 1;
+  return (size + CASKY_ARENA_ALIGN - 1) & ~(size_t)(CASKY_ARENA_ALIGN - 1);
+}
+
+/**
+ * casky_arena_new - Allocates an empty arena. No chunk is reserved until the
+ * first allocation.
+ *
+ * Returns: the new arena, or NULL on allocation failure.
+ */
+CaskyArena *casky_arena_new(void) {
+  CaskyArena *a = calloc(1, sizeof(CaskyArena));
+  if (!a) return NULL;
+  a->map = calloc(1, sizeof(CaskyArenaMap) + CASKY_ARENA_INITIAL_MAP * sizeof(char *));
+  if (!a->map) {
+    free(a);
+    return NULL;
+  }
+  a->map->capacity = CASKY_ARENA_INITIAL_MAP;
+  a->next_num = 1;
+  return a;
+}
+
+/**
+ * casky_arena_destroy - Releases every chunk and large block of the arena,
+ * together with the arena itself. References handed out by the arena are
+ * invalid afterwards.
+ */
+void casky_arena_destroy(CaskyArena *a) {
+  if (!a) return;
+  CaskyArenaChunk *chunk = a->chunks;
+  while (chunk) {
+    CaskyArenaChunk *next = chunk->next;
+    free(chunk);
+    chunk = next;
+  }
+  CaskyArenaLarge *large = a->large;
+  while (large) {
+    CaskyArenaLarge *next = large->next;
+    free(large);
+    large = next;
+  }
+  CaskyArenaMap *map = a->map;
+  while (map) {
+    CaskyArenaMap *prev = map->prev;
+    free(map);
+    map = prev;
+  }
+  free(a->free_nums);
+  free(a);
+}
+
+/**
+ * Gives `base` a chunk number, growing the map if needed.
+ *
+ * Returns: the number, or 0 if the arena is out of numbers or memory.
+ */
+static uint32_t casky_arena_number(CaskyArena *a, char *base) {
+  uint32_t num;
+  if (a->num_free_nums > 0) {
+    num = a->free_nums[--a->num_free_nums];
+  } else {
+    if (a->next_num >= CASKY_ARENA_MAX_CHUNKS)
+      return 0;
+    num = a->next_num;
+    if (num >= a->map->capacity) {
+      size_t capacity = a->map->capacity * 2;
+      CaskyArenaMap *map = malloc(sizeof(CaskyArenaMap) + capacity * sizeof(char *));
+      if (!map) return 0;
+      memcpy(map->base, a->map->base, a->map->capacity * sizeof(char *));
+      memset(map->base + a->map->capacity, 0, (capacity - a->map->capacity) * sizeof(char *));
+      map->capacity = capacity;
+      map->prev = a->map;
+      CASKY_PUBLISH(a->map, map);
+    }
+    a->next_num++;
+  }
+  CASKY_PUBLISH(a->map->base[num], base);
+  return num;
+}
+
+static CaskyRef casky_arena_alloc_large(CaskyArena *a, size_t size) {
+  CaskyArenaLarge *large = malloc(sizeof(CaskyArenaLarge) + size);
+  if (!large) return CASKY_REF_NULL;
+  large->num = casky_arena_number(a, large->data);
+  if (!large->num) {
+    free(large);
+    return CASKY_REF_NULL;
+  }
+  large->prev = NULL;
+  large->next = a->large;
+  if (a->large) a->large->prev = large;
+  a->large = large;
+  return large->num << CASKY_ARENA_SLOT_BITS;
+}
+
+/**
+ * casky_arena_alloc - Returns a 16-byte aligned block of at least `size`
+ * bytes.
+ *
+ * Small blocks come from the free list of their size class or, when it is
+ * empty, from the current chunk; the unused tail of a chunk too short for
+ * the request is left behind. The block content is not initialised.
+ *
+ * Returns: the reference of the block, or CASKY_REF_NULL on allocation
+ * failure.
+ */
+CaskyRef casky_arena_alloc(CaskyArena *a, size_t size) {
+  size = casky_arena_block_size(size);
+  if (size > CASKY_ARENA_MAX_BLOCK) {
+    CaskyRef ref = casky_arena_alloc_large(a, size);
+    if (ref) a->bytes_in_use += size;
+    return ref;
+  }
+
+  size_t cls = size / CASKY_ARENA_ALIGN - 1;
+  CaskyRef ref = a->free_lists[cls];
+  if (ref) {
+    memcpy(&a->free_lists[cls], casky_arena_ptr(a, ref), sizeof(CaskyRef));
+    a->bytes_in_use += size;
+    return ref;
+  }
+
+  uint32_t slots = size / CASKY_ARENA_ALIGN;
+  if (a->bump_end - a->bump < slots) {
+    CaskyArenaChunk *chunk = malloc(sizeof(CaskyArenaChunk) + CASKY_ARENA_CHUNK_SIZE);
+    if (!chunk) return CASKY_REF_NULL;
+    uint32_t num = casky_arena_number(a, chunk->data);
+    if (!num) {
+      free(chunk);
+      return CASKY_REF_NULL;
+    }
+    chunk->next = a->chunks;
+    a->chunks = chunk;
+    a->num_chunks++;
+    a->bump = num << CASKY_ARENA_SLOT_BITS;
+    a->bump_end = a->bump + CASKY_ARENA_CHUNK_SIZE / CASKY_ARENA_ALIGN;
+  }
+  ref = a->bump;
+  a->bump += slots;
+  a->bytes_in_use += size;
+  return ref;
+}
+
+/**
+ * casky_arena_free - Gives a block back to the arena.
+ *
+ * `size` must be the size passed to casky_arena_alloc() for this block (or
+ * any size that rounds to the same block size). Small blocks are kept on the
+ * free list of their class, large ones are returned to the system together
+ * with their chunk number.
+ */
+void casky_arena_free(CaskyArena *a, CaskyRef ref, size_t size) {
+  if (!ref) return;
+  size = casky_arena_block_size(size);
+  a->bytes_in_use -= size;
+
+  if (size > CASKY_ARENA_MAX_BLOCK) {
+    char *ptr = casky_arena_ptr(a, ref);
+    CaskyArenaLarge *large = (CaskyArenaLarge *)(ptr - offsetof(CaskyArenaLarge, data));
+    if (large->prev) large->prev->next = large->next;
+    else a->large = large->next;
+    if (large->next) large->next->prev = large->prev;
+    if (a->num_free_nums == a->free_nums_cap) {
+      size_t cap = a->free_nums_cap ? a->free_nums_cap * 2 : 16;
+      uint32_t *nums = realloc(a->free_nums, cap * sizeof(uint32_t));
+      // Without room to remember it, the number is simply not reused
+      if (nums) {
+        a->free_nums = nums;
+        a->free_nums_cap = cap;
+      }
+    }
+    if (a->num_free_nums < a->free_nums_cap)
+      a->free_nums[a->num_free_nums++] = large->num;
+    free(large);
+    return;
+  }
+
+  size_t cls = size / CASKY_ARENA_ALIGN - 1;
+  memcpy(casky_arena_ptr(a, ref), &a->free_lists[cls], sizeof(CaskyRef));
+  a->free_lists[cls] = ref;
+}
@@ -0,0 +1,87 @@
+#ifndef __ARENA_H
+#define __ARENA_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "ebr.h"
+
+// Size of the chunks the arena carves its blocks from.
+#define CASKY_ARENA_CHUNK_SIZE   (64 * 1024)
+// Blocks are handed out in multiples of this many bytes.
+#define CASKY_ARENA_ALIGN        16
+// Larger requests bypass the slabs and get their own allocation.
+#define CASKY_ARENA_MAX_BLOCK    1024
+#define CASKY_ARENA_NUM_CLASSES  (CASKY_ARENA_MAX_BLOCK / CASKY_ARENA_ALIGN)
+
+/**
+ * Reference to an arena block: 32 bits instead of a 64-bit pointer. The
+ * high bits number the chunk (or the large block), the low
+ * CASKY_ARENA_SLOT_BITS bits give the 16-byte slot of the block inside the
+ * chunk. Chunks are numbered from 1, so CASKY_REF_NULL is never a block.
+ * An arena holds at most CASKY_ARENA_MAX_CHUNKS chunks and large blocks.
+ */
+typedef uint32_t CaskyRef;
+#define CASKY_REF_NULL           0
+#define CASKY_ARENA_SLOT_BITS    12
+#define CASKY_ARENA_MAX_CHUNKS   (1u << (32 - CASKY_ARENA_SLOT_BITS))
+
+struct CaskyArenaChunk;
+struct CaskyArenaLarge;
+
+/**
+ * Chunk number -> address of its first byte. The map is replaced by a
+ * bigger copy when full; previous maps stay valid (and are kept in `prev`)
+ * until the arena is destroyed, so lock-free readers never see one go.
+ */
+typedef struct CaskyArenaMap {
+    struct CaskyArenaMap *prev;
+    size_t capacity;
+    char *base[];
+} CaskyArenaMap;
+
+/**
+ * Slab allocator owned by a KeyDir shard.
+ *
+ * Small blocks are rounded up to a multiple of 16 bytes and bump-allocated
+ * from 64 KiB chunks; a freed block goes to the free list of its size class
+ * and is reused by the next request of the same class. Chunks are only
+ * returned to the system when the arena is destroyed, so tearing down a
+ * KeyDir releases a handful of chunks instead of every node one by one.
+ *
+ * Blocks are handed out as CaskyRef and turned into addresses with
+ * casky_arena_ptr(), which needs no lock: a reference only ever reaches a
+ * reader after the map entry it resolves through.
+ *
+ * Not thread-safe otherwise: the arena is protected by the lock of its
+ * shard.
+ */
+typedef struct CaskyArena {
+    struct CaskyArenaChunk *chunks;     // every chunk, most recent first
+    CaskyRef bump;                      // next free slot of the current chunk
+    CaskyRef bump_end;                  // end of the current chunk
+    CaskyRef free_lists[CASKY_ARENA_NUM_CLASSES]; // freed blocks per size class
+    struct CaskyArenaLarge *large;      // blocks above CASKY_ARENA_MAX_BLOCK
+    CaskyArenaMap *map;
+    uint32_t next_num;                  // first chunk number never used
+    uint32_t *free_nums;                // numbers of freed large blocks
+    size_t num_free_nums, free_nums_cap;
+    size_t num_chunks;
+    size_t bytes_in_use;                // sum of the sizes of live blocks
+} CaskyArena;
+
+CaskyArena *casky_arena_new(void);
+void        casky_arena_destroy(CaskyArena *a);
+CaskyRef    casky_arena_alloc(CaskyArena *a, size_t size);
+void        casky_arena_free(CaskyArena *a, CaskyRef ref, size_t size);
+size_t      casky_arena_block_size(size_t size);
+
+/**
+ * casky_arena_ptr - Address of the block behind a reference.
+ */
+static inline void *casky_arena_ptr(const CaskyArena *a, CaskyRef ref) {
+  const CaskyArenaMap *map = CASKY_LOAD(a->map);
+  return CASKY_LOAD(map->base[ref >> CASKY_ARENA_SLOT_BITS]) +
+         (size_t)(ref & ((1u << CASKY_ARENA_SLOT_BITS) - 1)) * CASKY_ARENA_ALIGN;
+}
+
+#endif // !__ARENA_H
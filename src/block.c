@@ -0,0 +1,504 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include "casky.h"
+#include "crc.h"
+#include "utils.h"
+#include "block.h"
+
+// Padding is written from this buffer, a piece at a time
+static const char casky_zeros[CASKY_BLOCK_SIZE_MIN];
+
+// End of the block holding offset `pos`
+static uint64_t casky_block_end(const CaskyLogHeader *h, uint64_t pos) {
+  return pos - pos % h->block_size + h->block_size;
+}
+
+// Offset of the first group of the block holding `pos`
+static uint64_t casky_block_start(const CaskyLogHeader *h, uint64_t pos) {
+  uint64_t start = pos - pos % h->block_size;
+  return start ? start : CASKY_LOG_HEADER_SIZE;
+}
+
+// Padding before a group of `size` bytes written at `pos`: none if it fits
+// in the block, or starts it
+static uint64_t casky_block_pad(const CaskyLogHeader *h, uint64_t pos, uint64_t size) {
+  uint64_t end = casky_block_end(h, pos);
+  return pos + size <= end || pos == casky_block_start(h, pos) ? 0 : end - pos;
+}
+
+static void casky_log_header_encode(const CaskyLogHeader *h, unsigned char buf[CASKY_LOG_HEADER_SIZE]) {
+  uint32_t format = h->format;
+  memcpy(buf, CASKY_LOG_MAGIC, 8);
+  memcpy(buf + 8, &format, 4);
+  memcpy(buf + 12, &h->block_size, 4);
+  memcpy(buf + 16, &h->base_ts, 8);
+}
+
+/**
+ * casky_log_header_init - Fills the header of a new log file in `format`:
+ * CASKY_BLOCK_SIZE blocks, timestamps relative to now.
+ */
+void casky_log_header_init(CaskyLogHeader *h, CaskyLogFormat format) {
+  memset(h, 0, sizeof(*h));
+  h->format = format;
+  if (format != CASKY_LOG_RECORDS) {
+    h->block_size = CASKY_BLOCK_SIZE;
+    h->base_ts = time(NULL);
+  }
+}
+
+/**
+ * casky_log_header_read - Reads the header of a log file. A file that
+ * does not start with CASKY_LOG_MAGIC (older releases, or an empty file)
+ * is a CASKY_LOG_RECORDS log.
+ *
+ * Returns: 0 on success, -1 with casky_errno set: CASKY_ERR_NOT_SUPPORTED
+ * for a format this release does not know, CASKY_ERR_CORRUPT for an
+ * invalid block size.
+ */
+int casky_log_header_read(int fd, CaskyLogHeader *h) {
+  unsigned char buf[CASKY_LOG_HEADER_SIZE];
+  uint32_t format;
+  memset(h, 0, sizeof(*h));
+  if (pread(fd, buf, sizeof(buf), 0) != (ssize_t)sizeof(buf) ||
+      memcmp(buf, CASKY_LOG_MAGIC, 8) != 0)
+    return 0;
+  memcpy(&format, buf + 8, 4);
+  memcpy(&h->block_size, buf + 12, 4);
+  memcpy(&h->base_ts, buf + 16, 8);
+  if (format != CASKY_LOG_BLOCKS && format != CASKY_LOG_VARINT) {
+    casky_errno = CASKY_ERR_NOT_SUPPORTED;
+    return -1;
+  }
+  h->format = format;
+  if (h->block_size < CASKY_BLOCK_SIZE_MIN || h->block_size > CASKY_BLOCK_SIZE_MAX ||
+      (h->block_size & (h->block_size - 1))) {
+    casky_errno = CASKY_ERR_CORRUPT;
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * casky_log_header_write - Starts an empty log file, opened for appending,
+ * with its header. A CASKY_LOG_RECORDS file has none.
+ *
+ * Returns: 0 on success, -1 with casky_errno set to CASKY_ERR_IO.
+ */
+int casky_log_header_write(int fd, const CaskyLogHeader *h) {
+  if (h->format == CASKY_LOG_RECORDS)
+    return 0;
+  unsigned char buf[CASKY_LOG_HEADER_SIZE];
+  casky_log_header_encode(h, buf);
+  struct iovec iov = { buf, sizeof(buf) };
+  return casky_writev_all(fd, &iov, 1);
+}
+
+// LEB128: 7 bits per byte, low bits first
+static size_t casky_varint_put(unsigned char *p, uint64_t v) {
+  size_t n = 0;
+  for (; v >= 0x80; v >>= 7)
+    p[n++] = (unsigned char)(v | 0x80);
+  p[n++] = (unsigned char)v;
+  return n;
+}
+
+// Returns: the bytes read, 0 if the varint is cut short or overlong
+static size_t casky_varint_get(const unsigned char *p, size_t len, uint64_t *v) {
+  *v = 0;
+  for (size_t n = 0; n < len && n < CASKY_VARINT_MAX; n++) {
+    *v |= (uint64_t)(p[n] & 0x7F) << (7 * n);
+    if (!(p[n] & 0x80))
+      return n + 1;
+  }
+  return 0;
+}
+
+/*
+ * Encodes the header of a record of the file of `h` into `p`, room for
+ * CASKY_BLOCK_RECORD_MAX bytes.
+ *
+ * Returns: its size.
+ */
+static size_t casky_block_record_header(const CaskyLogHeader *h, unsigned char *p,
+                                        CaskyRecordType type, uint32_t key_len,
+                                        uint32_t value_len, CaskyCodec codec,
+                                        uint64_t timestamp, uint64_t expires) {
+  uint32_t ttl = 0;
+  if (expires != 0)
+    ttl = expires <= timestamp ? 1 : expires - timestamp > UINT32_MAX ? UINT32_MAX :
+                                     (uint32_t)(expires - timestamp);
+  int64_t delta = (int64_t)(timestamp - h->base_ts);
+  if (h->format == CASKY_LOG_VARINT) {
+    size_t n = 0;
+    p[n++] = (unsigned char)(codec | (ttl ? CASKY_VARINT_HAS_TTL : 0) |
+                             casky_record_type_bits(type, value_len) << CASKY_VARINT_TYPE_SHIFT);
+    n += casky_varint_put(p + n, key_len);
+    n += casky_varint_put(p + n, value_len);
+    n += casky_varint_put(p + n, (uint64_t)delta << 1 ^ (uint64_t)(delta >> 63));  // zigzag
+    if (ttl)
+      n += casky_varint_put(p + n, ttl);
+    return n;
+  }
+  uint32_t key_field = casky_record_key_field(key_len, codec, type, value_len);
+  int32_t ts = delta < INT32_MIN ? INT32_MIN : delta > INT32_MAX ? INT32_MAX : (int32_t)delta;
+  memcpy(p, &key_field, 4);
+  memcpy(p + 4, &value_len, 4);
+  memcpy(p + 8, &ts, 4);
+  memcpy(p + 12, &ttl, 4);
+  return CASKY_BLOCK_RECORD_SIZE;
+}
+
+// Decodes the header of the record at `p`, up to the lengths
+// Returns: its size, 0 if it is cut short or invalid
+static size_t casky_block_record_head(const CaskyLogHeader *h, const unsigned char *p,
+                                      size_t len, CaskyBlockRecord *rec) {
+  uint32_t ttl;
+  int64_t delta;
+  size_t n;
+  if (h->format == CASKY_LOG_VARINT) {
+    uint64_t key_len, value_len, zigzag, ttl64 = 0;
+    size_t k, v, t, e = 0;
+    const unsigned known = CASKY_RECORD_CODEC_MASK | CASKY_VARINT_HAS_TTL |
+                           CASKY_RECORD_TYPE_MASK << CASKY_VARINT_TYPE_SHIFT;
+    if (len < 1 || (p[0] & ~known) ||
+        !(k = casky_varint_get(p + 1, len - 1, &key_len)) ||
+        !(v = casky_varint_get(p + 1 + k, len - 1 - k, &value_len)) ||
+        !(t = casky_varint_get(p + 1 + k + v, len - 1 - k - v, &zigzag)) ||
+        ((p[0] & CASKY_VARINT_HAS_TTL) &&
+         !(e = casky_varint_get(p + 1 + k + v + t, len - 1 - k - v - t, &ttl64))) ||
+        key_len > CASKY_KEY_LEN_MAX || value_len > UINT32_MAX || ttl64 > UINT32_MAX)
+      return 0;
+    rec->key_len = (uint32_t)key_len;
+    rec->value_len = (uint32_t)value_len;
+    rec->codec = (CaskyCodec)(p[0] & CASKY_RECORD_CODEC_MASK);
+    rec->type = casky_record_type_of(p[0] >> CASKY_VARINT_TYPE_SHIFT & CASKY_RECORD_TYPE_MASK,
+                                     rec->value_len);
+    delta = (int64_t)(zigzag >> 1 ^ -(zigzag & 1));
+    ttl = (uint32_t)ttl64;
+    n = 1 + k + v + t + e;
+  } else {
+    if (len < CASKY_BLOCK_RECORD_SIZE)
+      return 0;
+    uint32_t key_field;
+    int32_t ts;
+    memcpy(&key_field, p, 4);
+    memcpy(&rec->value_len, p + 4, 4);
+    memcpy(&ts, p + 8, 4);
+    memcpy(&ttl, p + 12, 4);
+    rec->key_len = casky_record_key_len(key_field);
+    rec->codec = casky_record_codec(key_field);
+    rec->type = casky_record_type(key_field, rec->value_len);
+    delta = ts;
+    n = CASKY_BLOCK_RECORD_SIZE;
+  }
+  rec->timestamp = h->base_ts + (uint64_t)delta;
+  rec->expires = ttl ? rec->timestamp + ttl : 0;
+  return n;
+}
+
+/**
+ * casky_block_record - Decodes the record at the start of the `len` bytes
+ * of `p`, within a group.
+ *
+ * Returns: the size of the record, 0 if it does not fit in `len`.
+ */
+size_t casky_block_record(const CaskyLogHeader *h, const char *p, size_t len,
+                          CaskyBlockRecord *rec) {
+  size_t head = casky_block_record_head(h, (const unsigned char *)p, len, rec);
+  if (head == 0)
+    return 0;
+  uint64_t size = head + (uint64_t)rec->key_len + rec->value_len;
+  if (size > len)
+    return 0;
+  rec->key = p + head;
+  rec->value = rec->key + rec->key_len;
+  return size;
+}
+
+// Ends a group that cannot be used: parsing resumes at the next block, or
+// stops if the file ends before it
+static CaskyGroupStatus casky_block_skip(CaskyBlockGroup *g, uint64_t block_end,
+                                         uint64_t file_size, CaskyGroupStatus status) {
+  g->next = block_end;
+  if (block_end > file_size || (status == CASKY_GROUP_CORRUPT && block_end == file_size))
+    return CASKY_GROUP_TORN;
+  return status;
+}
+
+/**
+ * casky_block_group - Parses the group at file offset `pos` of a block
+ * file, read into the `len` bytes of `buf`.
+ *
+ * A group is only CASKY_GROUP_OK if its CRC matches and its records fill it
+ * exactly. A damaged group, or the padding of a block, is skipped up to the
+ * next block; at the end of the file it is CASKY_GROUP_TORN instead, the
+ * point from which the file can be appended to again.
+ *
+ * Returns: the status of the group, described by `g`.
+ */
+CaskyGroupStatus casky_block_group(const CaskyLogHeader *h, const char *buf, size_t len,
+                                   uint64_t pos, uint64_t file_size, CaskyBlockGroup *g) {
+  uint64_t block_end = casky_block_end(h, pos);
+  if (block_end - pos < CASKY_GROUP_HEADER_SIZE)
+    return casky_block_skip(g, block_end, file_size, CASKY_GROUP_PAD);
+  if (pos + CASKY_GROUP_HEADER_SIZE > file_size)
+    return CASKY_GROUP_TORN;
+  if (len < CASKY_GROUP_HEADER_SIZE) {
+    g->end = pos + CASKY_GROUP_HEADER_SIZE;
+    return CASKY_GROUP_NEED;
+  }
+  memcpy(&g->crc, buf, 4);
+  memcpy(&g->len, buf + 4, 4);
+  if (g->crc == 0 && g->len == 0)
+    return casky_block_skip(g, block_end, file_size, CASKY_GROUP_PAD);
+  if (g->len < (h->format == CASKY_LOG_VARINT ? 4 : CASKY_BLOCK_RECORD_SIZE))  // no record
+    return casky_block_skip(g, block_end, file_size, CASKY_GROUP_CORRUPT);
+
+  uint64_t end = pos + CASKY_GROUP_HEADER_SIZE + g->len;
+  if (end > block_end) {
+    // Only a record too large for a block crosses it, from its start; its
+    // own header must agree
+    const size_t head = CASKY_GROUP_HEADER_SIZE + CASKY_BLOCK_RECORD_MAX;
+    if (pos != casky_block_start(h, pos))
+      return casky_block_skip(g, block_end, file_size, CASKY_GROUP_CORRUPT);
+    if (pos + head > file_size)
+      return CASKY_GROUP_TORN;
+    if (len < head) {
+      g->end = pos + head;
+      return CASKY_GROUP_NEED;
+    }
+    CaskyBlockRecord rec;
+    size_t n = casky_block_record_head(h, (const unsigned char *)buf + CASKY_GROUP_HEADER_SIZE,
+                                       CASKY_BLOCK_RECORD_MAX, &rec);
+    if (n == 0 || n + (uint64_t)rec.key_len + rec.value_len != g->len)
+      return casky_block_skip(g, block_end, file_size, CASKY_GROUP_CORRUPT);
+  }
+  g->end = end;
+  if (end > file_size)
+    return CASKY_GROUP_TORN;
+  if (end - pos > len)
+    return CASKY_GROUP_NEED;
+
+  const unsigned char *p = (const unsigned char *)buf;
+  if (casky_crc32c(p + 4, 4 + (size_t)g->len) != g->crc)
+    return casky_block_skip(g, block_end, file_size, CASKY_GROUP_CORRUPT);
+  g->records = buf + CASKY_GROUP_HEADER_SIZE;
+  for (size_t off = 0; off < g->len;) {
+    CaskyBlockRecord rec;
+    size_t n = casky_block_record(h, g->records + off, g->len - off, &rec);
+    if (n == 0)
+      return casky_block_skip(g, block_end, file_size, CASKY_GROUP_CORRUPT);
+    off += n;
+  }
+  g->next = end;
+  return CASKY_GROUP_OK;
+}
+
+// Group and record headers of a group holding one record, into `hdr`
+// Returns: their size, 0 if the record is too large for a group
+static size_t casky_block_single(const CaskyLogHeader *h,
+                                 unsigned char hdr[CASKY_GROUP_HEADER_SIZE + CASKY_BLOCK_RECORD_MAX],
+                                 CaskyRecordType type, const char *key, uint32_t key_len,
+                                 const char *value, uint32_t value_len, CaskyCodec codec,
+                                 uint64_t timestamp, uint64_t expires) {
+  size_t head = casky_block_record_header(h, hdr + CASKY_GROUP_HEADER_SIZE, type, key_len,
+                                          value_len, codec, timestamp, expires);
+  uint64_t len = head + (uint64_t)key_len + value_len;
+  if (len > UINT32_MAX) {
+    casky_errno = CASKY_ERR_INVALID_VALUE;
+    return 0;
+  }
+  uint32_t len32 = (uint32_t)len;
+  memcpy(hdr + 4, &len32, 4);
+  uint32_t crc = casky_crc32c_update(0, hdr + 4, 4 + head);
+  crc = casky_crc32c_update(crc, (const unsigned char *)key, key_len);
+  if (value_len > 0)
+    crc = casky_crc32c_update(crc, (const unsigned char *)value, value_len);
+  memcpy(hdr, &crc, 4);
+  return CASKY_GROUP_HEADER_SIZE + head;
+}
+
+/**
+ * casky_block_append_size - Bytes appending a record at `pos` takes, as a
+ * group of its own, padding included.
+ */
+uint64_t casky_block_append_size(const CaskyLogHeader *h, uint64_t pos, uint32_t key_len,
+                                 uint32_t value_len, CaskyCodec codec, uint64_t timestamp,
+                                 uint64_t expires) {
+  unsigned char head[CASKY_BLOCK_RECORD_MAX];
+  uint64_t size = CASKY_GROUP_HEADER_SIZE + (uint64_t)key_len + value_len +
+      casky_block_record_header(h, head, CASKY_RECORD_PUT, key_len, value_len, codec, timestamp,
+                                expires);
+  return casky_block_pad(h, pos, size) + size;
+}
+
+/**
+ * casky_block_write_fd - Appends a record, as a group of its own, to the
+ * block file of `h` opened for appending on `fd`, whose size is `pos`.
+ * Padding, headers, key and value leave with a single writev(); together
+ * they take casky_block_append_size() bytes.
+ *
+ * Returns: 0 on success, -1 with casky_errno set.
+ */
+int casky_block_write_fd(int fd, const CaskyLogHeader *h, uint64_t pos, CaskyRecordType type,
+                         const char *key, uint32_t key_len,
+                         const char *value, uint32_t value_len, CaskyCodec codec,
+                         uint64_t timestamp, uint64_t expires) {
+  unsigned char hdr[CASKY_GROUP_HEADER_SIZE + CASKY_BLOCK_RECORD_MAX];
+  size_t hdr_len = casky_block_single(h, hdr, type, key, key_len, value, value_len, codec,
+                                      timestamp, expires);
+  if (hdr_len == 0)
+    return -1;
+
+  struct iovec iov[CASKY_BLOCK_SIZE_MAX / CASKY_BLOCK_SIZE_MIN + 3];
+  int count = 0;
+  for (uint64_t pad = casky_block_pad(h, pos, hdr_len + (uint64_t)key_len + value_len); pad > 0;) {
+    size_t n = pad < sizeof(casky_zeros) ? pad : sizeof(casky_zeros);
+    iov[count++] = (struct iovec){ (void *)casky_zeros, n };
+    pad -= n;
+  }
+  iov[count++] = (struct iovec){ hdr, hdr_len };
+  iov[count++] = (struct iovec){ (void *)key, key_len };
+  if (value_len > 0)
+    iov[count++] = (struct iovec){ (void *)value, value_len };
+  return casky_writev_all(fd, iov, count);
+}
+
+/**
+ * casky_log_writer_init - Starts a new log file in `format` on `f`, an
+ * empty file opened for writing.
+ *
+ * Returns: 0 on success, -1 with casky_errno set.
+ */
+int casky_log_writer_init(CaskyLogWriter *w, FILE *f, CaskyLogFormat format) {
+  memset(w, 0, sizeof(*w));
+  w->f = f;
+  casky_log_header_init(&w->header, format);
+  if (format == CASKY_LOG_RECORDS)
+    return 0;
+  unsigned char buf[CASKY_LOG_HEADER_SIZE];
+  casky_log_header_encode(&w->header, buf);
+  if (!(w->group = malloc(w->header.block_size))) {
+    casky_errno = CASKY_ERR_MEMORY;
+    return -1;
+  }
+  if (fwrite(buf, 1, sizeof(buf), f) != sizeof(buf)) {
+    casky_log_writer_finish(w);
+    casky_errno = CASKY_ERR_IO;
+    return -1;
+  }
+  w->pos = sizeof(buf);
+  return 0;
+}
+
+static int casky_log_writer_write(CaskyLogWriter *w, const void *buf, size_t len) {
+  if (len > 0 && fwrite(buf, 1, len, w->f) != len) {
+    casky_errno = CASKY_ERR_IO;
+    return -1;
+  }
+  return 0;
+}
+
+// Writes out the group being filled, if any
+static int casky_log_writer_flush(CaskyLogWriter *w) {
+  if (w->group_len == 0)
+    return 0;
+  uint32_t len = w->group_len - CASKY_GROUP_HEADER_SIZE;
+  memcpy(w->group + 4, &len, 4);
+  uint32_t crc = casky_crc32c((const unsigned char *)w->group + 4, w->group_len - 4);
+  memcpy(w->group, &crc, 4);
+  size_t group_len = w->group_len;
+  w->group_len = 0;
+  return casky_log_writer_write(w, w->group, group_len);
+}
+
+/**
+ * casky_log_writer_add - Adds the PUT record of a live entry to the file,
+ * `value_len` bytes of value in their stored form. A block file gets it in the group being
+ * filled, or in a new one if the block has no room left for it.
+ *
+ * @value_offset: receives the offset of the value bytes in the file
+ *
+ * Returns: 0 on success, -1 with casky_errno set.
+ */
+int casky_log_writer_add(CaskyLogWriter *w, const char *key, uint32_t key_len,
+                         const char *value, uint32_t value_len, CaskyCodec codec,
+                         uint64_t timestamp, uint64_t expires, uint64_t *value_offset) {
+  if (!value)
+    value_len = 0;
+  if (w->header.format == CASKY_LOG_RECORDS) {
+    if (casky_write_record_codec(w->f, 0, CASKY_RECORD_PUT, key, key_len, value, value_len,
+                                 codec, timestamp, expires) != 0)
+      return -1;
+    *value_offset = w->pos + CASKY_RECORD_HEADER_SIZE + key_len;
+    w->pos = *value_offset + value_len;
+    return 0;
+  }
+
+  const CaskyLogHeader *h = &w->header;
+  unsigned char head[CASKY_BLOCK_RECORD_MAX];
+  size_t head_len = casky_block_record_header(h, head, CASKY_RECORD_PUT, key_len, value_len,
+                                              codec, timestamp, expires);
+  uint64_t len = head_len + (uint64_t)key_len + value_len;
+  if (len > UINT32_MAX) {
+    casky_errno = CASKY_ERR_INVALID_VALUE;
+    return -1;
+  }
+  if (w->group_len > 0 &&
+      w->group_pos + w->group_len + len > casky_block_end(h, w->group_pos) &&
+      casky_log_writer_flush(w) != 0)
+    return -1;
+
+  if (w->group_len == 0) {
+    for (uint64_t pad = casky_block_pad(h, w->pos, CASKY_GROUP_HEADER_SIZE + len); pad > 0;) {
+      size_t n = pad < sizeof(casky_zeros) ? pad : sizeof(casky_zeros);
+      if (casky_log_writer_write(w, casky_zeros, n) != 0)
+        return -1;
+      w->pos += n;
+      pad -= n;
+    }
+    if (w->pos + CASKY_GROUP_HEADER_SIZE + len > casky_block_end(h, w->pos)) {
+      // Too large for a block: a group of its own, written right away
+      unsigned char hdr[CASKY_GROUP_HEADER_SIZE + CASKY_BLOCK_RECORD_MAX];
+      size_t hdr_len = casky_block_single(h, hdr, CASKY_RECORD_PUT, key, key_len, value,
+                                          value_len, codec, timestamp, expires);
+      if (casky_log_writer_write(w, hdr, hdr_len) != 0 ||
+          casky_log_writer_write(w, key, key_len) != 0 ||
+          casky_log_writer_write(w, value, value_len) != 0)
+        return -1;
+      *value_offset = w->pos + hdr_len + key_len;
+      w->pos = *value_offset + value_len;
+      return 0;
+    }
+    w->group_pos = w->pos;
+    w->group_len = CASKY_GROUP_HEADER_SIZE;
+  }
+
+  char *p = w->group + w->group_len;
+  memcpy(p, head, head_len);
+  memcpy(p + head_len, key, key_len);
+  if (value_len > 0)
+    memcpy(p + head_len + key_len, value, value_len);
+  *value_offset = w->group_pos + w->group_len + head_len + key_len;
+  w->group_len += len;
+  w->pos = w->group_pos + w->group_len;
+  return 0;
+}
+
+/**
+ * casky_log_writer_finish - Writes out what the writer still buffers and
+ * releases it. The file is left open, and is w->pos bytes long once
+ * flushed.
+ *
+ * Returns: 0 on success, -1 with casky_errno set to CASKY_ERR_IO.
+ */
+int casky_log_writer_finish(CaskyLogWriter *w) {
+  int ret = w->group ? casky_log_writer_flush(w) : 0;
+  free(w->group);
+  w->group = NULL;
+  return ret;
+}
@@ -0,0 +1,125 @@
+#ifndef __BLOCK_H
+#define __BLOCK_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "casky.h"
+
+/*
+ * Block-framed log files (CASKY_LOG_BLOCKS, CASKY_LOG_VARINT):
+ *
+ *   [file header][group][group]...[padding] | [group]... | ...
+ *
+ * The file is cut into blocks of CaskyLogHeader.block_size bytes, the
+ * first one starting with the file header. Records come in groups, one per
+ * append (a block's worth when compacting), each with a single CRC32C:
+ *
+ *   header: [Magic][Format][BlockSize][BaseTimestamp]
+ *   group:  [CRC32C][Len][record]...        CRC over Len and the records
+ *   record: [KeyLen | flags][ValueLen][TimestampDelta][TTL][Key][Value]
+ *
+ * Timestamps are signed 32-bit deltas from the base timestamp of the file,
+ * expiry times 32-bit TTLs from the record's timestamp (0: never expires).
+ * CASKY_LOG_VARINT records hold the same fields as LEB128 varints after a
+ * flags byte, the TTL only when there is one:
+ *
+ *   record: [flags][KeyLen][ValueLen][TimestampDelta, zigzag][TTL]?[Key][Value]
+ *
+ * A short record without TTL thus takes 4 to 6 bytes of header, against 16
+ * (28 in a CASKY_LOG_RECORDS file).
+ * A group never crosses the end of its block, unless it starts the block
+ * and holds a record too large for one; the rest of a block too short for
+ * the next group is zero-filled. A damaged group thus only loses its own
+ * block: replay resynchronises at the next block boundary. Values stay
+ * contiguous, so the KeyDir still reads them with a single pread().
+ */
+#define CASKY_LOG_MAGIC          "CASKYLOG"
+#define CASKY_LOG_HEADER_SIZE    24
+#define CASKY_BLOCK_SIZE         (32 * 1024)
+#define CASKY_BLOCK_SIZE_MIN     4096
+#define CASKY_BLOCK_SIZE_MAX     (1024 * 1024)
+#define CASKY_GROUP_HEADER_SIZE  8
+#define CASKY_BLOCK_RECORD_SIZE  16  // CASKY_LOG_BLOCKS record header
+#define CASKY_VARINT_MAX         10  // bytes of a 64-bit varint
+#define CASKY_BLOCK_RECORD_MAX   (1 + 3 * 5 + CASKY_VARINT_MAX)  // any format
+#define CASKY_VARINT_HAS_TTL     0x04u  // flags: a TTL follows the timestamp
+#define CASKY_VARINT_TYPE_SHIFT  3      // flags: CaskyRecordType bits
+
+typedef enum {
+    CASKY_GROUP_OK,         // a verified group, see CaskyBlockGroup
+    CASKY_GROUP_NEED,       // the group ends past the buffer, at `end`
+    CASKY_GROUP_PAD,        // the rest of the block is unused
+    CASKY_GROUP_TORN,       // the end of the file: nothing usable from here
+    CASKY_GROUP_CORRUPT,    // CRC mismatch or invalid lengths
+} CaskyGroupStatus;
+
+/**
+ * A group parsed by casky_block_group(). Parsing goes on at `next`, the
+ * end of the group or the next block boundary.
+ */
+typedef struct CaskyBlockGroup {
+    uint64_t end;           // file offset right after the group
+    uint64_t next;
+    const char *records;
+    uint32_t len;           // bytes of records
+    uint32_t crc;           // as stored
+} CaskyBlockGroup;
+
+/**
+ * A record of a group, decoded by casky_block_record(). Key and value
+ * point into the group.
+ */
+typedef struct CaskyBlockRecord {
+    const char *key;
+    const char *value;
+    uint32_t key_len;
+    uint32_t value_len;
+    CaskyCodec codec;
+    CaskyRecordType type;   // never CASKY_RECORD_PUT_EMPTY
+    uint64_t timestamp;
+    uint64_t expires;
+} CaskyBlockRecord;
+
+/**
+ * Writes a new log file through stdio, in either format. The records of a
+ * block-framed file are buffered until their group is complete.
+ */
+typedef struct CaskyLogWriter {
+    FILE *f;
+    CaskyLogHeader header;
+    uint64_t pos;           // file offset right after the last record added
+    char *group;            // group being filled, its header included
+    size_t group_len;       // 0 when no group is open
+    uint64_t group_pos;     // its file offset
+} CaskyLogWriter;
+
+// File offset of the first record
+static inline uint64_t casky_log_header_size(const CaskyLogHeader *h) {
+  return h->format == CASKY_LOG_RECORDS ? 0 : CASKY_LOG_HEADER_SIZE;
+}
+
+void     casky_log_header_init(CaskyLogHeader *h, CaskyLogFormat format);
+int      casky_log_header_read(int fd, CaskyLogHeader *h);
+int      casky_log_header_write(int fd, const CaskyLogHeader *h);
+
+CaskyGroupStatus casky_block_group(const CaskyLogHeader *h, const char *buf, size_t len,
+                                   uint64_t pos, uint64_t file_size, CaskyBlockGroup *g);
+size_t   casky_block_record(const CaskyLogHeader *h, const char *p, size_t len,
+                            CaskyBlockRecord *rec);
+uint64_t casky_block_append_size(const CaskyLogHeader *h, uint64_t pos, uint32_t key_len,
+                                 uint32_t value_len, CaskyCodec codec, uint64_t timestamp,
+                                 uint64_t expires);
+int      casky_block_write_fd(int fd, const CaskyLogHeader *h, uint64_t pos,
+                              CaskyRecordType type,
+                              const char *key, uint32_t key_len,
+                              const char *value, uint32_t value_len, CaskyCodec codec,
+                              uint64_t timestamp, uint64_t expires);
+
+int      casky_log_writer_init(CaskyLogWriter *w, FILE *f, CaskyLogFormat format);
+int      casky_log_writer_add(CaskyLogWriter *w, const char *key, uint32_t key_len,
+                              const char *value, uint32_t value_len, CaskyCodec codec,
+                              uint64_t timestamp, uint64_t expires, uint64_t *value_offset);
+int      casky_log_writer_finish(CaskyLogWriter *w);
+
+#endif // !__BLOCK_H
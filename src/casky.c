@@ -4,23 +4,424 @@
 #include <string.h>
 #include <limits.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include "casky.h"
 #include "crc.h"
 #include "utils.h"
+#include "ebr.h"
+#include "skiplist.h"
+#include "frozen.h"
+#include "diskindex.h"
+#include "segment.h"
+#include "hint.h"
+#include "recovery.h"
+#include "codec.h"
+#include "block.h"
 #include "version.h"
 
 
 
-CaskyError casky_errno = CASKY_OK;
+CASKY_THREAD_LOCAL CaskyError casky_errno = CASKY_OK;
+
+/**
+ * casky_options_init - Fills a CaskyOptions structure with the defaults.
+ *
+ * @opts: Pointer to the options to initialise
+ */
+void casky_options_init(CaskyOptions *opts) {
+  if (!opts) return;
+  memset(opts, 0, sizeof(*opts));
+  opts->initial_buckets = CASKY_INITIAL_BUCKETS_NUM;
+  opts->num_shards = CASKY_NUM_SHARDS;
+  opts->sync_interval_ms = CASKY_SYNC_INTERVAL_MS;
+  opts->sync_bytes = CASKY_SYNC_BYTES;
+  opts->compression_min = CASKY_COMPRESS_MIN;
+}
+
+/*
+ * casky_replay_parse() for a block file: the groups are verified as they
+ * are parsed, and their records queued as verified. A damaged group is
+ * skipped up to the next block, which sets r->resynced.
+ */
+static uint64_t casky_replay_parse_blocks(CaskyRecovery *r, const char *buf, size_t len,
+                                          size_t limit, uint64_t pos, uint64_t file_size,
+                                          CaskyHint *hint, size_t *need, int *done) {
+  int in_memory = r->kd->value_mode == CASKY_VALUES_IN_MEMORY;
+  uint64_t off = 0;
+  *need = CASKY_GROUP_HEADER_SIZE;
+  while (!r->corrupt && off < limit && pos + off < file_size) {
+    CaskyBlockGroup g;
+    CaskyGroupStatus status = casky_block_group(&r->header, buf + off, len - off, pos + off,
+                                                file_size, &g);
+    if (status == CASKY_GROUP_NEED) {
+      *need = g.end - (pos + off);
+      return off;
+    }
+    if (status == CASKY_GROUP_TORN) {
+      *done = 1;
+      return off;
+    }
+    if (status == CASKY_GROUP_CORRUPT)
+      r->resynced = 1;
+    for (uint32_t n = 0; status == CASKY_GROUP_OK && n < g.len;) {
+      CaskyBlockRecord rec;
+      n += casky_block_record(&r->header, g.records + n, g.len - n, &rec);
+      uint64_t value_offset = pos + (rec.value - buf);
+      if (hint)
+        casky_hint_add(hint, rec.type, rec.key, rec.key_len, rec.value_len, rec.codec,
+                       value_offset, rec.timestamp, rec.expires);
+      casky_recovery_add(r, NULL, rec.type, rec.key, rec.key_len, in_memory ? rec.value : NULL,
+                         rec.value_len, value_offset, rec.codec, rec.timestamp, rec.expires);
+    }
+    off = g.next - pos;
+  }
+  return off;
+}
+
+/*
+ * Parses in place the records of `len` bytes of log read from offset
+ * `pos`, queueing them in the recovery batch (and in `hint`, if set), to
+ * be verified and applied. Only the records starting in the first `limit`
+ * bytes are parsed.
+ *
+ * @need: receives the bytes the first record not parsed needs in the
+ *        buffer
+ * @done: set to 1 on a truncated record, the end of the usable log
+ *
+ * Returns: the offset, from `pos`, of the first record not parsed.
+ */
+static uint64_t casky_replay_parse(CaskyRecovery *r, const char *buf, size_t len, size_t limit,
+                                   uint64_t pos, uint64_t file_size, CaskyHint *hint,
+                                   size_t *need, int *done) {
+  if (r->header.format != CASKY_LOG_RECORDS)
+    return casky_replay_parse_blocks(r, buf, len, limit, pos, file_size, hint, need, done);
+  int in_memory = r->kd->value_mode == CASKY_VALUES_IN_MEMORY;
+  uint64_t off = 0;
+  *need = CASKY_RECORD_HEADER_SIZE;
+  while (!r->corrupt && off < limit && off + CASKY_RECORD_HEADER_SIZE <= len) {
+    const char *p = buf + off;
+    uint32_t key_field, key_len, value_len;
+    uint64_t timestamp, expires;
+    memcpy(&timestamp, p + 4, sizeof(timestamp));
+    memcpy(&expires, p + 12, sizeof(expires));
+    memcpy(&key_field, p + 20, sizeof(key_field));
+    memcpy(&value_len, p + 24, sizeof(value_len));
+    key_len = casky_record_key_len(key_field);
+    CaskyCodec codec = casky_record_codec(key_field);
+    CaskyRecordType type = casky_record_type(key_field, value_len);
+
+    uint64_t value_offset = pos + off + CASKY_RECORD_HEADER_SIZE + key_len;
+    if (value_offset + value_len > file_size) {  // truncated record
+      *done = 1;
+      return off;
+    }
+    // The whole record is needed to check its CRC
+    *need = CASKY_RECORD_HEADER_SIZE + key_len + value_len;
+    if (off + *need > len)
+      return off;
+
+    // Key and value are copied by the KeyDir only, if the record lands in it
+    const char *key = p + CASKY_RECORD_HEADER_SIZE;
+    if (hint)
+      casky_hint_add(hint, type, key, key_len, value_len, codec, value_offset, timestamp,
+                     expires);
+    casky_recovery_add(r, p, type, key, key_len, in_memory ? key + key_len : NULL, value_len,
+                       value_offset, codec, timestamp, expires);
+    off = value_offset + value_len - pos;
+  }
+  if (off + CASKY_RECORD_HEADER_SIZE > len && pos + len == file_size && off < len)
+    *done = 1;  // torn header at the end of the log
+  return off;
+}
+
+/*
+ * casky_replay_parse() over a mapping of the log. The records are applied
+ * CASKY_REPLAY_BUFFER bytes at a time, and the pages behind are dropped
+ * from the mapping, so that a large log does not stay mapped as a whole.
+ *
+ * Returns: the offset right after the last record replayed, or UINT64_MAX
+ * if the log cannot be mapped.
+ */
+static uint64_t casky_replay_mapped(CaskyRecovery *r, int fd, uint64_t pos,
+                                    uint64_t file_size, CaskyHint *hint) {
+  uint64_t page = sysconf(_SC_PAGESIZE);
+  uint64_t start = pos - pos % page;
+  size_t map_len = file_size - start;
+  if (map_len != file_size - start)
+    return UINT64_MAX;  // larger than the address space
+  char *map = mmap(NULL, map_len, PROT_READ, MAP_PRIVATE, fd, start);
+  if (map == MAP_FAILED)
+    return UINT64_MAX;
+  madvise(map, map_len, MADV_SEQUENTIAL);
+
+  int done = 0;
+  while (!done && !r->corrupt && pos < file_size) {
+    size_t need, window = file_size - pos < CASKY_REPLAY_BUFFER ? file_size - pos : CASKY_REPLAY_BUFFER;
+    uint64_t off = casky_replay_parse(r, map + (pos - start), file_size - pos, window, pos,
+                                      file_size, hint, &need, &done);
+    // The batch points into the mapping
+    casky_recovery_apply(r);
+    if (off == 0)
+      break;
+    pos += off;
+    uint64_t behind = pos - pos % page;
+    if (behind > start)
+      madvise(map, behind - start, MADV_DONTNEED);
+  }
+  munmap(map, map_len);
+  return pos;
+}
+
+/*
+ * casky_replay_parse() over chunks read into a buffer, when the log cannot
+ * be mapped.
+ *
+ * Returns: the offset right after the last record replayed.
+ */
+static uint64_t casky_replay_read(CaskyRecovery *r, int fd, uint64_t pos,
+                                  uint64_t file_size, CaskyHint *hint) {
+  size_t cap = CASKY_REPLAY_BUFFER;
+  char *buf = malloc(cap);
+  int done = 0;
+  while (buf && !done && !r->corrupt && pos < file_size) {
+    size_t want = file_size - pos < cap ? file_size - pos : cap, len = 0;
+    while (len < want) {
+      ssize_t n = pread(fd, buf + len, want - len, pos + len);
+      if (n <= 0) break;
+      len += n;
+    }
+    size_t need;
+    uint64_t off = casky_replay_parse(r, buf, len, len, pos, file_size, hint, &need, &done);
+    // The batch points into the buffer
+    casky_recovery_apply(r);
+    if (len < want)
+      break;  // read error
+    if (off == 0 && !done) {
+      // A record larger than the buffer
+      char *grown = realloc(buf, need);
+      if (!grown) break;
+      buf = grown;
+      cap = need;
+    }
+    pos += off;
+  }
+  free(buf);
+  return pos;
+}
+
+/**
+ * Replays the records of a log file from offset `pos` into the KeyDir, as
+ * file `file_id`, whose header is `header`. Replay stops at the first
+ * incomplete record, and at the first corrupted one (CRC mismatch), which
+ * also sets kd->corrupted_dir. In a block file replay goes on past a
+ * damaged group, from the next block, but kd->corrupted_dir is set all the
+ * same. With `hint` set, the records replayed are also added to it.
+ *
+ * The log is mapped and parsed in place: nothing is allocated per record,
+ * and key and value bytes are only copied by the KeyDir for the records it
+ * keeps. The records are applied in batches (see CaskyRecovery), by
+ * kd->recovery_threads threads. A log that cannot be mapped, or with
+ * kd->replay_pread set, is read CASKY_REPLAY_BUFFER bytes at a time
+ * instead.
+ *
+ * Returns: the offset right after the last record replayed.
+ */
+static uint64_t casky_replay_log(KeyDir *kd, FILE *f, uint32_t file_id,
+                                 const CaskyLogHeader *header, uint64_t pos,
+                                 uint64_t file_size, CaskyHint *hint) {
+  CaskyRecovery r;
+  if (pos < casky_log_header_size(header))
+    pos = casky_log_header_size(header);
+  if (pos >= file_size || casky_recovery_init(&r, kd, file_id, header) != 0)
+    return pos;
+  uint64_t end = kd->replay_pread ? UINT64_MAX :
+                 casky_replay_mapped(&r, fileno(f), pos, file_size, hint);
+  if (end == UINT64_MAX)
+    end = casky_replay_read(&r, fileno(f), pos, file_size, hint);
+  if (r.corrupt || r.resynced) {
+    kd->corrupted_dir = 1;
+    if (r.corrupt) end = r.corrupt_offset;
+    // The hint holds records past the corrupted one, or lacks those of the
+    // damaged groups: the log stays without a hint, and is verified again
+    // on every open
+    if (hint) hint->lost = 1;
+  }
+  casky_recovery_free(&r);
+  return end;
+}
+
+// Hint file of a single log file, written by casky_compact()
+static char *casky_log_hint_path(const char *file) {
+  char *path = malloc(strlen(file) + sizeof(".hint"));
+  if (path) sprintf(path, "%s.hint", file);
+  return path;
+}
+
+/**
+ * Loads the segments of a database directory, oldest first, and with
+ * `open_log` opens the active one for appending: the last segment when it
+ * was replayed to its end and has room left, a new one otherwise (a torn
+ * record is never appended to).
+ *
+ * With values on disk, a segment with a valid hint file is loaded from it
+ * and only the records past the hint are replayed. The hint records of the
+ * last segment are kept in kd->hint, and written out if it is sealed.
+ *
+ * Returns: 0 on success, -1 on error (casky_errno set).
+ */
+static int casky_load_segments(KeyDir *kd, const char *dir, int open_log) {
+  if (open_log && mkdir(dir, 0755) != 0 && errno != EEXIST) {
+    casky_errno = CASKY_ERR_IO;
+    return -1;
+  }
+  if (open_log && !(kd->hint = calloc(1, sizeof(CaskyHint)))) {
+    casky_errno = CASKY_ERR_MEMORY;
+    return -1;
+  }
+  uint32_t *ids = NULL;
+  size_t count = 0;
+  if (casky_segment_list(dir, &ids, &count) != 0) {
+    casky_errno = CASKY_ERR_IO;
+    return -1;
+  }
+
+  // One table for every segment, plus the slot of a new active one
+  uint32_t first = count ? ids[0] : 0;
+  kd->files = casky_file_table_new(first, count ? ids[count - 1] - first + 2 : 1);
+  if (!kd->files) {
+    free(ids);
+    casky_errno = CASKY_ERR_MEMORY;
+    return -1;
+  }
+
+  uint64_t tail = 0, covered = 0, tail_ino = 0;
+  int tail_clean = 0;
+  CaskyLogHeader header;
+  for (size_t i = 0; i < count; i++) {
+    char *path = casky_segment_path(dir, ids[i]);
+    FILE *f = path ? fopen(path, "rb") : NULL;
+    CaskyReadFile *rf = f ? casky_read_file_open(path, ids[i]) : NULL;
+    free(path);
+    if (!rf) {
+      if (f) fclose(f);
+      free(ids);
+      casky_errno = CASKY_ERR_IO;
+      return -1;
+    }
+    // Every segment has its own format
+    if (casky_log_header_read(fileno(f), &header) != 0) {
+      casky_read_file_free(rf, NULL);
+      fclose(f);
+      free(ids);
+      return -1;
+    }
+    kd->files->files[ids[i] - first] = rf;
+    kd->active_id = ids[i];
+
+    struct stat st;
+    uint64_t size = 0;
+    tail_ino = 0;
+    if (fstat(fileno(f), &st) == 0) {
+      size = st.st_size;
+      tail_ino = st.st_ino;
+    }
+    // Only the last segment may still be appended to
+    CaskyHint *keep = i == count - 1 ? kd->hint : NULL;
+    covered = 0;
+    if (kd->value_mode == CASKY_VALUES_ON_DISK) {
+      char *hint = casky_segment_hint_path(dir, ids[i]);
+      if (!hint || casky_hint_load(kd, hint, ids[i], size, tail_ino, keep, &covered) != 0 ||
+          fseek(f, covered, SEEK_SET) != 0)
+        covered = 0;
+      free(hint);
+    }
+    if (covered == 0 && keep)
+      casky_hint_reset(keep);
+    // A torn or corrupted record only loses the end of its own segment
+    tail = casky_replay_log(kd, f, ids[i], &header, covered, size, keep);
+    tail_clean = tail == size;
+    fclose(f);
+  }
+  free(ids);
+  if (!open_log)
+    return 0;
+
+  if (count == 0 || !tail_clean || tail >= kd->segment_size) {
+    // The last segment is sealed as it is
+    if (count > 0 && covered < tail) {
+      char *hint = casky_segment_hint_path(dir, kd->active_id);
+      if (hint) casky_hint_write(kd->hint, hint, tail, tail_ino);
+      free(hint);
+    }
+    casky_hint_reset(kd->hint);
+    kd->active_id = count ? kd->active_id + 1 : 0;
+    casky_log_header_init(&header, kd->log_format);
+    tail = casky_log_header_size(&header);
+  }
+  char *path = casky_segment_path(dir, kd->active_id);
+  kd->log = path ? fopen(path, "ab+") : NULL;
+  if (kd->log && !kd->files->files[kd->active_id - first] &&
+      casky_log_header_write(fileno(kd->log), &header) == 0)
+    kd->files->files[kd->active_id - first] = casky_read_file_open(path, kd->active_id);
+  free(path);
+  if (!kd->log || !kd->files->files[kd->active_id - first]) {
+    casky_errno = CASKY_ERR_IO;
+    return -1;
+  }
+  kd->log_header = header;
+  kd->log_size = tail;
+  return 0;
+}
 
 KeyDir *casky_init_kd_from_file(const char *file, int open_log) {
+  return casky_init_kd_with_options(file, open_log, NULL);
+}
+
+/**
+ * casky_init_kd_with_options - Builds a KeyDir from a log file.
+ *
+ * Same as casky_init_kd_from_file() but honours the given options. A NULL
+ * opts pointer selects the defaults (see casky_options_init()).
+ */
+KeyDir *casky_init_kd_with_options(const char *file, int open_log, const CaskyOptions *opts) {
+  CaskyOptions defaults;
+  if (!opts) {
+    casky_options_init(&defaults);
+    opts = &defaults;
+  }
+
   if (!file) {
     casky_errno = CASKY_ERR_INVALID_PATH;
     return NULL;
   }
+  struct stat path_st;
+  uint64_t segment_size = opts->segment_size;
+  if (!segment_size && stat(file, &path_st) == 0 && S_ISDIR(path_st.st_mode))
+    segment_size = CASKY_SEGMENT_SIZE;
+  // The on-disk index only stores value locations of a single log of
+  // records, in hash order
+  if (opts->disk_index && open_log &&
+      (opts->ordered_index || opts->value_mode == CASKY_VALUES_IN_MEMORY || segment_size ||
+       opts->log_format != CASKY_LOG_RECORDS)) {
+    casky_errno = CASKY_ERR_NOT_SUPPORTED;
+    return NULL;
+  }
+
+  if (opts->log_format > CASKY_LOG_VARINT) {
+    casky_errno = CASKY_ERR_INVALID_VALUE;
+    return NULL;
+  }
+  if (!casky_codec_available(opts->compression)) {
+    casky_errno = CASKY_ERR_NOT_SUPPORTED;
+    return NULL;
+  }
 
-  FILE *f = fopen(file, "rb");  // prova ad aprire in lettura
-  if (!f && open_log) {
+  // A segmented database is loaded by casky_load_segments()
+  FILE *f = segment_size ? NULL : fopen(file, "rb");  // prova ad aprire in lettura
+  if (!f && open_log && !segment_size) {
     // File inesistente? crea un file vuoto
     f = fopen(file, "wb");
     if (!f) {
@@ -31,6 +432,32 @@ KeyDir *casky_init_kd_from_file(const char *file, int open_log) {
     f = fopen(file, "rb");
   }
 
+  // The header of the log tells how to read it; an empty one gets the
+  // format of new files once opened for appending
+  CaskyLogHeader header = { 0 };
+  struct stat st;
+  uint64_t file_size = 0, log_ino = 0;
+  if (f && fstat(fileno(f), &st) == 0) {
+    file_size = st.st_size;
+    log_ino = st.st_ino;
+  }
+  if (f && file_size == 0) {
+    casky_log_header_init(&header, opts->log_format);
+    // The hint of a log removed since would be taken for this one's once
+    // it grows, if the inode is reused
+    char *hint = open_log ? casky_log_hint_path(file) : NULL;
+    if (hint) remove(hint);
+    free(hint);
+  } else if (f && casky_log_header_read(fileno(f), &header) != 0) {
+    fclose(f);
+    return NULL;
+  }
+  if (f && opts->disk_index && open_log && header.format != CASKY_LOG_RECORDS) {
+    fclose(f);
+    casky_errno = CASKY_ERR_NOT_SUPPORTED;
+    return NULL;
+  }
+
   KeyDir *kd = calloc(1, sizeof(KeyDir));
   if (!kd) {
     if (f) fclose(f);
@@ -38,9 +465,8 @@ KeyDir *casky_init_kd_from_file(const char *file, int open_log) {
     return NULL;
   }
 
-  kd->num_buckets = CASKY_INITIAL_BUCKETS_NUM;
-  kd->root = calloc(kd->num_buckets, sizeof(EntryNode*));
-  if (!kd->root) {
+  if (casky_kd_init_index(kd, opts) != 0) {
+    casky_kd_free_index(kd);
     free(kd);
     if (f) fclose(f);
     casky_errno = CASKY_ERR_MEMORY;
@@ -48,75 +474,139 @@ KeyDir *casky_init_kd_from_file(const char *file, int open_log) {
   }
 
   kd->log = NULL;
-  kd->sync_on_write = open_log ? 1 : 0;  // default sync for main log
+  kd->files = NULL;
+  kd->segment_size = segment_size;
+  kd->value_mode = opts->value_mode;
+  // The on-disk index is a single structure, rebuilt by one thread
+  kd->recovery_threads = opts->disk_index ? 1 : casky_recovery_threads(kd, opts->recovery_threads);
+  kd->replay_pread = opts->replay_pread;
+  kd->sync_on_write = open_log && opts->sync_mode == CASKY_SYNC_ALWAYS;
+  kd->sync_mode = open_log ? opts->sync_mode : CASKY_SYNC_NONE;
+  kd->sync_interval_ms = opts->sync_interval_ms;
+  kd->sync_bytes = opts->sync_bytes;
+  kd->codec = opts->compression;
+  kd->compress_min = opts->compression_min;
+  kd->log_format = opts->log_format;
   kd->filename = strdup(file); 
   if (!kd->filename) {
     casky_errno = CASKY_ERR_MEMORY;
+    casky_kd_free_index(kd);
+    if (f) fclose(f);
     free(kd);
     return NULL;
   }
 #ifdef THREAD_SAFE
   pthread_mutex_init(&kd->lock, NULL);
+  pthread_mutex_init(&kd->sync_lock, NULL);
 #endif
 
+  if (segment_size && casky_load_segments(kd, file, open_log) != 0) {
+    CaskyError err = casky_errno;
+    casky_close(kd);
+    casky_errno = err;
+    return NULL;
+  }
+
   // Load existing entries
+  uint64_t tail = 0;
   if (f) {
-    while (!feof(f)) {
-      uint32_t crc, key_len, value_len;
-      uint64_t timestamp, expires;
-
-      if (fread(&crc, sizeof(crc), 1, f) != 1) break;
-      if (fread(&timestamp, sizeof(timestamp), 1, f) != 1) break;
-      if (fread(&expires, sizeof(expires), 1, f) != 1) break;
-      if (fread(&key_len, sizeof(key_len), 1, f) != 1) break;
-      if (fread(&value_len, sizeof(value_len), 1, f) != 1) break;
-
-      char *key = malloc(key_len + 1);
-      char *value = malloc(value_len + 1);
-      if (!key || (!value && value_len > 0)) { free(key); free(value); break; }
-
-      if (fread(key, 1, key_len, f) != key_len) { free(key); free(value); break; }
-      key[key_len] = '\0';
-      if (value_len > 0) {
-        if (fread(value, 1, value_len, f) != value_len) { free(key); free(value); break; }
-        value[value_len] = '\0';
-      } else {
-        free(value);
-        value = NULL;
-      }
+    uint64_t pos = 0;  // offset of the current record
+    uint32_t file_id = 0;
 
-      // Only load valid (non-expired) entries
-      if (value_len == 0) {
-        // DELETE record → non inserire nulla in memoria
-        casky_delete_from_memory(kd, key);
-      } else if (expires == 0 || expires > (uint64_t)time(NULL)) {
-        // PUT record non scaduto → inserisci o aggiorna
-        casky_put_in_memory(kd, key, value, timestamp, expires);
+    if (opts->disk_index && open_log) {
+      // A clean index already holds the keys of the log up to its
+      // checkpoint: only the records appended since then are replayed
+      char *path = malloc(strlen(file) + sizeof(".idx"));
+      if (path) {
+        sprintf(path, "%s.idx", file);
+        kd->disk = casky_disk_open(path, kd->hash_seed, file_size, log_ino);
+        free(path);
       }
-
-      free(key);
-      if (value) free(value);
+      if (!kd->disk || fseek(f, casky_disk_header(kd->disk)->log_size, SEEK_SET) != 0) {
+        // Unmapped without a checkpoint: rebuilt on the next open
+        casky_disk_close(kd->disk);
+        kd->disk = NULL;
+        casky_kd_free_index(kd);
+        fclose(f);
+        free(kd->filename);
+        free(kd);
+        casky_errno = CASKY_ERR_IO;
+        return NULL;
+      }
+      CaskyDiskHeader *h = casky_disk_header(kd->disk);
+      kd->hash_seed = h->hash_seed;
+      kd->num_entries = h->num_entries;
+      pos = h->log_size;
+      file_id = h->file_id;
+    } else if (kd->value_mode == CASKY_VALUES_ON_DISK) {
+      // The hint of the last compaction holds the keys of the head of the
+      // log: only the records appended since then are replayed
+      char *path = casky_log_hint_path(file);
+      uint64_t covered;
+      if (path && casky_hint_load(kd, path, file_id, file_size, log_ino, NULL, &covered) == 0 &&
+          fseek(f, covered, SEEK_SET) == 0)
+        pos = covered;
+      free(path);
     }
+    // Opened first: the on-disk index compares keys against the log
+    CaskyReadFile *rf = casky_read_file_open(file, file_id);
+    kd->files = rf ? casky_file_table_add(NULL, rf) : NULL;
+    if (rf && !kd->files) casky_read_file_free(rf, NULL);
+    kd->active_id = file_id;
+
+    tail = casky_replay_log(kd, f, file_id, &header, pos, file_size, NULL);
     fclose(f);
   }
 
   // Open the log for further writes (casky_put)
-  if (open_log) {
+  if (open_log && !segment_size) {
     FILE *log_fp = fopen(file, "ab+");
     if (!log_fp) {
       // Se non esiste, crealo
       log_fp = fopen(file, "wb+");
       if (!log_fp) {
-        free(kd->root);
+        casky_kd_free_index(kd);
+        casky_file_table_close(kd->files);
+        free(kd->filename);
         free(kd);
         casky_errno = CASKY_ERR_IO;
         return NULL;
       }
     }
     kd->log = log_fp;
+
+    // A new log gets its header. A torn record at the end is cut off, and
+    // a block file cut back to the end of its last group: a record appended
+    // after a torn one would be lost on the next replay. A log of records
+    // is kept as it is past a corrupted record.
+    int ret = 0;
+    if (file_size == 0)
+      ret = casky_log_header_write(fileno(log_fp), &header);
+    else if (tail < file_size && (header.format != CASKY_LOG_RECORDS || !kd->corrupted_dir))
+      ret = ftruncate(fileno(log_fp), tail);
+    if (ret != 0) {
+      casky_close(kd);
+      casky_errno = CASKY_ERR_IO;
+      return NULL;
+    }
+    kd->log_header = header;
+    if (fstat(fileno(log_fp), &st) == 0)
+      kd->log_size = st.st_size;
   }
 
-  casky_errno = CASKY_OK;
+  // Entries expired before the logs were replayed are only loaded in case
+  // a TOUCH record extended them
+  if (kd->replay_expired)
+    casky_expire(kd);
+
+  if (open_log && kd->sync_mode == CASKY_SYNC_PERIODIC && casky_flusher_start(kd) != 0) {
+    casky_close(kd);
+    casky_errno = CASKY_ERR_MEMORY;
+    return NULL;
+  }
+
+  // The records before the corrupted one are loaded: the database is usable
+  casky_errno = kd->corrupted_dir ? CASKY_ERR_CORRUPT : CASKY_OK;
   return kd;
 }
 
@@ -127,7 +617,7 @@ KeyDir *casky_init_kd_from_file(const char *file, int open_log) {
  * - Initializes a new KeyDir structure with buckets, number of entries, and filename.
  * - Sets `sync_on_write` to 0 by default (can be enabled later for full fsync on each write).
  * - Reads existing records from the file:
- *     - For each record, validates the CRC.
+ *     - For each record, validates the CRC32C (or the CRC32 of older releases).
  *     - If a record is corrupted:
  *         - Stops processing further records (Bitcask-style behavior).
  *         - Sets kd->corrupted_dir = 1 to indicate a compact is recommended.
@@ -152,12 +642,28 @@ KeyDir *casky_init_kd_from_file(const char *file, int open_log) {
  * @return Pointer to KeyDir structure on success, NULL on failure.
  */
 KeyDir* casky_open(const char *path) {
+  return casky_open_with_options(path, NULL);
+}
+
+/**
+ * casky_open_with_options - Opens a database with non-default settings.
+ *
+ * Behaves exactly like casky_open(), but the KeyDir is configured from
+ * `opts` (e.g. pre-sizing the hash table with opts->initial_buckets when the
+ * number of keys is known in advance, so that no resize happens during the
+ * log replay). A NULL opts pointer is the same as calling casky_open().
+ *
+ * @param path Path to the log file.
+ * @param opts Options initialised with casky_options_init(), or NULL.
+ * @return Pointer to KeyDir structure on success, NULL on failure.
+ */
+KeyDir* casky_open_with_options(const char *path, const CaskyOptions *opts) {
   static int initialized = 0;
   if (!initialized) {
     casky_stats_init();
     initialized = 1;
   }
-  return casky_init_kd_from_file(path, 1);
+  return casky_init_kd_with_options(path, 1, opts);
 }
 
 /**
@@ -167,8 +673,8 @@ KeyDir* casky_open(const char *path) {
  *
  * This function releases all resources allocated by Casky for the given
  * KeyDir, including:
- *   - All EntryNode nodes and their dynamically allocated keys and values
- *   - The array of buckets (root)
+ *   - All EntryNode nodes with their keys and values (the KeyDir arena)
+ *   - The index itself (bucket array or Swiss table)
  *   - The KeyDir structure itself
  *
  * After calling this function, the KeyDir pointer should not be used.
@@ -181,22 +687,32 @@ void casky_close(KeyDir *kd) {
     return;
   }
 
-  for (size_t i=0; i<kd->num_buckets; i++) {
-    EntryNode *node = kd->root[i];
-    while(node) {
-      EntryNode *next = node->next;
-      free(node->entry.key);
-      free(node->entry.value);
-      free(node);
-      node = next;
-    }
+  casky_flusher_stop(kd);
+  casky_flush_log(kd);
+  if (kd->hint && kd->log) {
+    // The next casky_open() only replays what the active segment gets
+    // after this
+    struct stat st;
+    char *hint = casky_segment_hint_path(kd->filename, kd->active_id);
+    if (hint && fstat(fileno(kd->log), &st) == 0)
+      casky_hint_write(kd->hint, hint, kd->log_size, st.st_ino);
+    free(hint);
+  }
+  if (kd->disk && kd->log) {
+    // Lets the next casky_open() map the index instead of replaying the log
+    struct stat st;
+    if (fstat(fileno(kd->log), &st) == 0)
+      casky_disk_checkpoint(kd->disk, st.st_size, st.st_ino, kd->active_id);
   }
+  casky_kd_free_index(kd);
 #ifdef THREAD_SAFE
   pthread_mutex_destroy(&kd->lock);
+  pthread_mutex_destroy(&kd->sync_lock);
 #endif
-  casky_flush_log(kd);
-  fclose(kd->log);
-  free(kd->root);
+  if (kd->log) fclose(kd->log);
+  casky_file_table_close(kd->files);
+  casky_hint_free(kd->hint);
+  free(kd->hint);
   if (kd->filename) free(kd->filename);
   free(kd);
 
@@ -207,18 +723,22 @@ void casky_close(KeyDir *kd) {
 /**
  * casky_put - Insert or update a key-value pair in the database
  *
- * This function stores a key-value pair in the given KeyDir (hash table).
- * If the key already exists, its value and timestamp are updated.
- * If the key does not exist, a new EntryNode is created and appended
- * to the corresponding bucket's linked list.
+ * This function appends the record to the log and then stores the key in
+ * the given KeyDir (hash table) together with the position of the value in
+ * the log. If the key already exists, its location and timestamp are
+ * updated. If the key does not exist, a new EntryNode is created.
  *
  * Memory ownership:
- *   - The function makes a copy of both key and value using strdup.
+ *   - The function makes a copy of the key, and of the value only with
+ *     CASKY_VALUES_IN_MEMORY.
  *   - The caller can safely modify or free the original key/value after the call.
  *
  * Bucket selection:
- *   - The bucket is determined by hashing the key with casky_djb2_hash_xor
- *     and taking the modulo with the number of buckets.
+ *   - The key is hashed with the seeded casky_hash(); the top bits of the
+ *     hash select the shard and the low bits the bucket inside the shard.
+ *   - When the number of keys exceeds CASKY_MAX_LOAD_FACTOR per bucket, the
+ *     table doubles and is rehashed incrementally, CASKY_REHASH_STEP old
+ *     buckets per write, so that no single put pays for a full rehash.
  *
  * @kd:    Pointer to the KeyDir (hash table) where the key-value pair is stored
  * @key:   Null-terminated string representing the key
@@ -241,19 +761,97 @@ int casky_put(KeyDir *kd, const char *key, const char *value, uint32_t ttl) {
     casky_errno = CASKY_ERR_INVALID_KEY;
     return -1;
   }
+  return casky_put_n(kd, key, strlen(key), value, strlen(value), ttl);
+}
 
-  LOCK(kd);
+/**
+ * casky_put_n - Insert or update a binary key-value pair in the database
+ *
+ * Same as casky_put(), but keys and values are arbitrary bytes with explicit
+ * lengths: nothing on this path looks for a NUL terminator. Both lengths
+ * are stored as 32-bit fields in the log, the top byte of the key length
+ * holding the record flags.
+ *
+ * With CaskyOptions.compression set, the value is compressed before any
+ * lock is taken, and stored as it is if it does not shrink.
+ *
+ * @kd:        Pointer to the KeyDir (hash table)
+ * @key:       Key bytes
+ * @key_len:   Length of the key, at most CASKY_KEY_LEN_MAX
+ * @value:     Value bytes
+ * @value_len: Length of the value, at most UINT32_MAX
+ * @ttl:       Time to live in seconds, 0 if the record never expires
+ *
+ * Returns:
+ *   0 on success, -1 on failure (sets casky_errno, CASKY_ERR_INVALID_VALUE
+ *   for a value of invalid length)
+ */
+int casky_put_n(KeyDir *kd, const void *key, size_t key_len,
+                const void *value, size_t value_len, uint32_t ttl) {
+  if (!kd) {
+    casky_errno = CASKY_ERR_INVALID_POINTER;
+    return -1;
+  }
+  if (!key || key_len > CASKY_KEY_LEN_MAX) {
+    casky_errno = CASKY_ERR_INVALID_KEY;
+    return -1;
+  }
+  if (!value || value_len > UINT32_MAX) {
+    casky_errno = CASKY_ERR_INVALID_VALUE;
+    return -1;
+  }
+  if (kd->frozen) {
+    casky_errno = CASKY_ERR_NOT_SUPPORTED;
+    return -1;
+  }
+
+  uint64_t hash = casky_kd_hash(kd, key, key_len);
+  CaskyShard *s = casky_kd_shard(kd, hash);
   uint64_t timestamp = time(NULL);
   uint64_t expires = (ttl>0) ? (uint64_t)time(NULL) + ttl : 0;
-  casky_put_in_memory(kd, key, value, timestamp, expires);
+  uint64_t value_offset;
+
+  uint32_t stored_len = (uint32_t)value_len;
+  CaskyCodec codec = CASKY_CODEC_NONE;
+  char *packed = NULL;
+  if (kd->codec != CASKY_CODEC_NONE && value_len >= kd->compress_min &&
+      (packed = casky_codec_compress(kd->codec, value, (uint32_t)value_len, &stored_len)))
+    codec = kd->codec;
+
+  // The shard stays locked across the append, so that two puts of the same
+  // key update the KeyDir in the order of their records in the log
+  SHARD_WRLOCK(s);
 
-  // Write record to log file
-  if (casky_write_data_to_file(kd->log, kd->sync_on_write, key, value, timestamp, expires) != 0) {
+  // Write record to log file first: the KeyDir points into it
+  LOCK(kd);
+  int ret = casky_log_append(kd, CASKY_RECORD_PUT, key, key_len, packed ? packed : value,
+                             stored_len, codec, timestamp, expires, &value_offset);
+  uint32_t file_id = kd->active_id;
+  uint64_t lsn = kd->log_appended;
+  UNLOCK(kd);
+  free(packed);
+  if (ret != 0) {
     casky_errno = CASKY_ERR_IO;
-    UNLOCK(kd);
+    SHARD_UNLOCK(s);
     return -1;
   }
-  UNLOCK(kd);
+
+  // A value kept in memory is kept uncompressed
+  ret = kd->value_mode == CASKY_VALUES_IN_MEMORY ?
+      casky_shard_put(kd, s, key, key_len, hash, value, value_len, file_id, value_offset,
+                      CASKY_CODEC_NONE, timestamp, expires) :
+      casky_shard_put(kd, s, key, key_len, hash, NULL, stored_len, file_id, value_offset,
+                      codec, timestamp, expires);
+  if (ret != 0) {
+    SHARD_UNLOCK(s);
+    return -1;
+  }
+  SHARD_UNLOCK(s);
+
+  // Waits for the record to be on disk without any lock held, so that
+  // other writers can append theirs and share the flush
+  if (kd->sync_on_write && casky_log_sync(kd, lsn) != 0)
+    return -1;
 
   casky_errno = CASKY_OK;
   return 0;
@@ -281,27 +879,170 @@ int casky_put(KeyDir *kd, const char *key, const char *value, uint32_t ttl) {
  */
 
 char*  casky_get(KeyDir *kd, const char *key){
-  if (!kd) {
-    casky_errno = CASKY_ERR_INVALID_POINTER;
+  // Lock-free, see casky_get_from_memory()
+  return casky_get_from_memory(kd, key);
+}
+
+typedef struct {
+  char *value;
+  size_t len;
+} casky_get_n_ctx;
+
+static int casky_get_n_cb(const Entry *e, int fd, void *arg) {
+  casky_get_n_ctx *ctx = arg;
+  return casky_load_value(fd, e, NULL, 0, &ctx->value, &ctx->len);
+}
+
+/**
+ * casky_get_n - Retrieve the value of a binary key from the database
+ *
+ * Same as casky_get() for keys and values that may contain any byte. The
+ * returned buffer holds value_len bytes followed by a NUL, so text values
+ * can still be used as strings.
+ *
+ * @kd:        Pointer to the KeyDir (hash table)
+ * @key:       Key bytes
+ * @key_len:   Length of the key
+ * @value_len: If not NULL, receives the length of the value
+ *
+ * Returns:
+ *   A newly allocated copy of the value, to be freed by the caller, or NULL
+ *   on failure (sets casky_errno as casky_get()).
+ */
+void* casky_get_n(KeyDir *kd, const void *key, size_t key_len, size_t *value_len) {
+  casky_get_n_ctx ctx = { NULL, 0 };
+  if (casky_kd_read(kd, key, key_len, casky_get_n_cb, &ctx) != 0)
     return NULL;
+  if (value_len) *value_len = ctx.len;
+  return ctx.value;
+}
+
+typedef struct {
+  char *buf;
+  size_t cap;
+  size_t len;
+} casky_get_into_ctx;
+
+static int casky_get_into_cb(const Entry *e, int fd, void *arg) {
+  casky_get_into_ctx *ctx = arg;
+  return casky_load_value(fd, e, ctx->buf, ctx->cap, NULL, &ctx->len);
+}
+
+/**
+ * casky_get_into - Copies the value of a key into a caller-provided buffer
+ *
+ * Same lookup as casky_get(), without allocating anything: the value is
+ * copied (or read from the log) straight into `buf` and NUL-terminated.
+ *
+ * @kd:  Pointer to the KeyDir (hash table)
+ * @key: Null-terminated string representing the key, see casky_get_into_n()
+ *       for binary keys
+ * @buf: Destination buffer
+ * @cap: Size of `buf`, which must hold the value and its NUL terminator
+ * @len: If not NULL, receives the length of the value, also when `buf` is
+ *       too small, so that the caller can retry with a larger buffer
+ *
+ * Returns:
+ *   0 on success, -1 on failure.
+ *
+ * Sets casky_errno:
+ *   CASKY_OK if the value was copied,
+ *   CASKY_ERR_BUFFER_TOO_SMALL if cap <= *len,
+ *   CASKY_ERR_KEY_NOT_FOUND if the key does not exist in the database,
+ *   CASKY_ERR_INVALID_POINTER if kd or buf is NULL,
+ *   CASKY_ERR_INVALID_KEY if key is NULL,
+ *   CASKY_ERR_IO if the value could not be read from the log.
+ */
+int casky_get_into(KeyDir *kd, const char *key, char *buf, size_t cap, size_t *len) {
+  return casky_get_into_n(kd, key, key ? strlen(key) : 0, buf, cap, len);
+}
+
+/**
+ * casky_get_into_n - casky_get_into() for a binary key of key_len bytes.
+ */
+int casky_get_into_n(KeyDir *kd, const void *key, size_t key_len,
+                     char *buf, size_t cap, size_t *len) {
+  if (!buf) {
+    casky_errno = CASKY_ERR_INVALID_POINTER;
+    return -1;
   }
-  if (!key) {
-    casky_errno = CASKY_ERR_INVALID_KEY;
-    return NULL;
+  casky_get_into_ctx ctx = { buf, cap, 0 };
+  int ret = casky_kd_read(kd, key, key_len, casky_get_into_cb, &ctx);
+  if (len) *len = ctx.len;
+  return ret;
+}
+
+// Values read from the log up to this size are staged on the stack
+#define CASKY_GET_STACK_BUF 4096
+
+typedef struct {
+  casky_value_cb cb;
+  void *ctx;
+} casky_get_with_ctx;
+
+static int casky_get_with_cb(const Entry *e, int fd, void *arg) {
+  casky_get_with_ctx *ctx = arg;
+  if (e->value) {
+    ctx->cb(e->value, e->value_len, ctx->ctx);
+    return 0;
   }
-  LOCK(kd);
-  char *value = casky_get_from_memory(kd, key);
-  UNLOCK(kd);
 
-  return value;
+  char stack_buf[CASKY_GET_STACK_BUF];
+  char *buf;
+  size_t len;
+  if (casky_load_value(fd, e, stack_buf, sizeof(stack_buf), &buf, &len) != 0)
+    return -1;
+  ctx->cb(buf, len, ctx->ctx);
+  if (buf != stack_buf) free(buf);
+  return 0;
+}
+
+/**
+ * casky_get_with - Hands the value of a key to a callback, without copying
+ * it for the caller
+ *
+ * Values kept in memory are passed in place; values stored in the log are
+ * read (and decompressed) into a stack buffer, a heap one from
+ * CASKY_GET_STACK_BUF bytes.
+ * The pointer is only valid while `cb` runs, which happens without any lock
+ * held but inside an EBR critical section: memory retired meanwhile is not
+ * reclaimed until `cb` returns, so it should not block for long, and it
+ * must not call back into casky_put(), casky_delete() or casky_compact().
+ *
+ * @kd:  Pointer to the KeyDir (hash table)
+ * @key: Null-terminated string representing the key, see casky_get_with_n()
+ *       for binary keys
+ * @cb:  Called once with the value if the key exists
+ * @ctx: Passed through to `cb`
+ *
+ * Returns:
+ *   0 if the key was found and `cb` called, -1 otherwise.
+ *
+ * Sets casky_errno as casky_get().
+ */
+int casky_get_with(KeyDir *kd, const char *key, casky_value_cb cb, void *ctx) {
+  return casky_get_with_n(kd, key, key ? strlen(key) : 0, cb, ctx);
+}
+
+/**
+ * casky_get_with_n - casky_get_with() for a binary key of key_len bytes.
+ */
+int casky_get_with_n(KeyDir *kd, const void *key, size_t key_len,
+                     casky_value_cb cb, void *ctx) {
+  if (!cb) {
+    casky_errno = CASKY_ERR_INVALID_POINTER;
+    return -1;
+  }
+  casky_get_with_ctx with = { cb, ctx };
+  return casky_kd_read(kd, key, key_len, casky_get_with_cb, &with);
 }
 
 /**
  * casky_delete - Remove a key-value pair from the database
  *
  * Searches for the given key in the KeyDir (hash table) and deletes
- * the corresponding EntryNode if it exists. Frees the key and value
- * buffers and updates the linked list and num_entries count.
+ * the corresponding EntryNode if it exists. Returns the node (with its key
+ * and value) to the KeyDir arena and updates the num_entries count.
  *
  * @kd: Pointer to the KeyDir (hash table)
  * @key: Null-terminated string representing the key to delete
@@ -325,28 +1066,444 @@ int    casky_delete(KeyDir *kd, const char *key) {
     casky_errno = CASKY_ERR_INVALID_KEY;
     return -1;
   }
+  return casky_delete_n(kd, key, strlen(key));
+}
 
-  LOCK(kd);
-  // Remove from memory
-  int found = casky_delete_from_memory(kd, key);
-  if (!found) {
-    casky_errno = CASKY_ERR_KEY_NOT_FOUND;
+/**
+ * casky_delete_n - casky_delete() for a binary key of key_len bytes.
+ */
+int casky_delete_n(KeyDir *kd, const void *key, size_t key_len) {
+  if (!kd) {
+    casky_errno = CASKY_ERR_INVALID_POINTER;
     return -1;
-  }  
+  }
+  if (!key || key_len > CASKY_KEY_LEN_MAX) {
+    casky_errno = CASKY_ERR_INVALID_KEY;
+    return -1;
+  }
+  if (kd->frozen) {
+    casky_errno = CASKY_ERR_NOT_SUPPORTED;
+    return -1;
+  }
+
+  uint64_t hash = casky_kd_hash(kd, key, key_len);
+  CaskyShard *s = casky_kd_shard(kd, hash);
+
+  SHARD_WRLOCK(s);
+  int found = kd->disk ? casky_disk_contains(kd, key, key_len, hash, 0) :
+                         casky_shard_find(s, key, key_len, hash) != NULL;
+  if (found <= 0) {
+    if (found == 0) casky_errno = CASKY_ERR_KEY_NOT_FOUND;
+    SHARD_UNLOCK(s);
+    return -1;
+  }
 
   uint64_t timestamp = time(NULL);
 
-  // Append deletion record to log file (value = NULL)
-  if (casky_write_data_to_file(kd->log, kd->sync_on_write, key, NULL, timestamp, 0) != 0) {
+  // Append a DELETE record to the log file, then remove from memory
+  LOCK(kd);
+  int ret = casky_log_append(kd, CASKY_RECORD_DELETE, key, key_len, NULL, 0, CASKY_CODEC_NONE,
+                             timestamp, 0, NULL);
+  uint64_t lsn = kd->log_appended;
+  UNLOCK(kd);
+  if (ret != 0) {
     casky_errno = CASKY_ERR_IO;
-    UNLOCK(kd);
+    SHARD_UNLOCK(s);
+    return -1;
+  }
+  casky_shard_delete(kd, s, key, key_len, hash);
+  SHARD_UNLOCK(s);
+
+  if (kd->sync_on_write && casky_log_sync(kd, lsn) != 0)
+    return -1;
+
+  casky_errno = CASKY_OK;
+  return 0;
+}
+
+/**
+ * casky_touch - Sets the time to live of a key, without rewriting its value
+ *
+ * Appends a TOUCH record, the key and its new expiration time, instead of
+ * the whole value casky_put() would write again. casky_compact() folds it
+ * into the entry it rewrites.
+ *
+ * @kd:  Pointer to the KeyDir (hash table)
+ * @key: Null-terminated string representing the key, see casky_touch_n()
+ *       for binary keys
+ * @ttl: New time to live in seconds, from now; 0 if the key never expires
+ *       any more
+ *
+ * Returns:
+ *   0 on success, -1 on failure.
+ *
+ * Sets casky_errno:
+ *   CASKY_OK if the key was touched,
+ *   CASKY_ERR_KEY_NOT_FOUND if the key does not exist or has expired,
+ *   CASKY_ERR_INVALID_POINTER if kd is NULL,
+ *   CASKY_ERR_INVALID_KEY if key is NULL,
+ *   CASKY_ERR_NOT_SUPPORTED if the KeyDir is frozen,
+ *   CASKY_ERR_IO if the record could not be appended.
+ */
+int casky_touch(KeyDir *kd, const char *key, uint32_t ttl) {
+  if (!kd) {
+    casky_errno = CASKY_ERR_INVALID_POINTER;
+    return -1;
+  }
+  if (!key) {
+    casky_errno = CASKY_ERR_INVALID_KEY;
+    return -1;
+  }
+  return casky_touch_n(kd, key, strlen(key), ttl);
+}
+
+/**
+ * casky_touch_n - casky_touch() for a binary key of key_len bytes.
+ */
+int casky_touch_n(KeyDir *kd, const void *key, size_t key_len, uint32_t ttl) {
+  if (!kd) {
+    casky_errno = CASKY_ERR_INVALID_POINTER;
+    return -1;
+  }
+  if (!key || key_len > CASKY_KEY_LEN_MAX) {
+    casky_errno = CASKY_ERR_INVALID_KEY;
+    return -1;
+  }
+  if (kd->frozen) {
+    casky_errno = CASKY_ERR_NOT_SUPPORTED;
     return -1;
   }
+
+  uint64_t hash = casky_kd_hash(kd, key, key_len);
+  CaskyShard *s = casky_kd_shard(kd, hash);
+  uint64_t timestamp = time(NULL);
+  uint64_t expires = ttl > 0 ? timestamp + ttl : 0;
+
+  // An expired key stays expired: only a live one is worth a record
+  SHARD_WRLOCK(s);
+  EntryNode *node = kd->disk ? NULL : casky_shard_find(s, key, key_len, hash);
+  int found = kd->disk ? casky_disk_contains(kd, key, key_len, hash, timestamp) :
+      node && (node->expiration_ts == 0 ||
+               node->expiration_ts > casky_time_enc(kd, timestamp));
+  if (found <= 0) {
+    if (found == 0) casky_errno = CASKY_ERR_KEY_NOT_FOUND;
+    SHARD_UNLOCK(s);
+    return -1;
+  }
+
+  LOCK(kd);
+  int ret = casky_log_append(kd, CASKY_RECORD_TOUCH, key, key_len, NULL, 0, CASKY_CODEC_NONE,
+                             timestamp, expires, NULL);
+  uint64_t lsn = kd->log_appended;
   UNLOCK(kd);
+  if (ret != 0) {
+    casky_errno = CASKY_ERR_IO;
+    SHARD_UNLOCK(s);
+    return -1;
+  }
+  found = casky_shard_touch(kd, s, key, key_len, hash, timestamp, expires);
+  SHARD_UNLOCK(s);
+  if (found <= 0) {
+    // Expired since and dropped by casky_expire(), which takes no shard
+    // lock on an on-disk index: the record changes nothing on replay
+    if (found == 0) casky_errno = CASKY_ERR_KEY_NOT_FOUND;
+    return -1;
+  }
+
+  if (kd->sync_on_write && casky_log_sync(kd, lsn) != 0)
+    return -1;
 
   casky_errno = CASKY_OK;
   return 0;
+}
+
+// Keys taken from the ordered index per skiplist read lock
+#define CASKY_SCAN_BATCH 64
+
+// A batch of keys copied out of the ordered index
+typedef struct {
+  char *keys;             // NUL-terminated keys, back to back
+  size_t used, cap;
+  size_t off[CASKY_SCAN_BATCH];
+  size_t len[CASKY_SCAN_BATCH];
+  size_t n;
+  const char *end;        // exclusive upper bound, NULL if unbounded
+  size_t end_len;
+  int done;               // end reached, no batch follows
+  int oom;
+} casky_scan_batch;
+
+static int casky_scan_collect(const char *key, size_t key_len, void *arg) {
+  casky_scan_batch *b = arg;
+  if (b->end && casky_key_cmp(key, key_len, b->end, b->end_len) >= 0) {
+    b->done = 1;
+    return 1;
+  }
+  if (b->used + key_len + 1 > b->cap) {
+    size_t cap = b->cap ? b->cap : 1024;
+    while (cap < b->used + key_len + 1) cap *= 2;
+    char *keys = realloc(b->keys, cap);
+    if (!keys) {
+      b->oom = 1;
+      return 1;
+    }
+    b->keys = keys;
+    b->cap = cap;
+  }
+  memcpy(b->keys + b->used, key, key_len);
+  b->keys[b->used + key_len] = '\0';
+  b->off[b->n] = b->used;
+  b->len[b->n] = key_len;
+  b->used += key_len + 1;
+  return ++b->n == CASKY_SCAN_BATCH;
+}
+
+// The value of the current key, copied so that the scan callback runs
+// outside of the read path and may modify the KeyDir
+typedef struct {
+  char *buf;
+  size_t len, cap;
+  int oom;
+} casky_scan_value;
+
+static void casky_scan_copy_value(const char *value, size_t len, void *arg) {
+  casky_scan_value *v = arg;
+  if (len + 1 > v->cap) {
+    char *buf = realloc(v->buf, len + 1);
+    if (!buf) {
+      v->oom = 1;
+      return;
+    }
+    v->buf = buf;
+    v->cap = len + 1;
+  }
+  memcpy(v->buf, value, len + 1);
+  v->len = len;
+}
+
+/**
+ * casky_scan - Visits the keys in [start, end) in ascending order
+ *
+ * Keys are compared bytewise, as memcmp() does, a key sorting before any
+ * longer key it is a prefix of. The keys are taken from the ordered index
+ * CASKY_SCAN_BATCH at a time, and each of them is then looked up like
+ * casky_get() does, so the cost is proportional to the number of keys
+ * visited, not to the size of the KeyDir. No lock is held while `cb` runs:
+ * it may put or delete keys, including the ones being scanned. Keys changed
+ * during the scan are seen or missed depending on their position relative
+ * to the scan.
+ *
+ * @kd:    Pointer to the KeyDir, opened with CaskyOptions.ordered_index
+ * @start: First key of the range, NULL to start from the smallest key
+ * @end:   Key past the range, NULL to run up to the largest key
+ * @limit: Maximum number of keys to visit, 0 for no limit
+ * @cb:    Called for every key, see casky_scan_cb
+ * @ctx:   Passed through to `cb`
+ *
+ * Returns:
+ *   the number of keys passed to `cb`, or -1 on error.
+ *
+ * Sets casky_errno:
+ *   CASKY_OK on success,
+ *   CASKY_ERR_INVALID_POINTER if kd or cb is NULL,
+ *   CASKY_ERR_NOT_SUPPORTED if the KeyDir has no ordered index,
+ *   CASKY_ERR_MEMORY or CASKY_ERR_IO if a key could not be read.
+ */
+long casky_scan(KeyDir *kd, const char *start, const char *end, size_t limit,
+                casky_scan_cb cb, void *ctx) {
+  return casky_scan_n(kd, start, start ? strlen(start) : 0,
+                      end, end ? strlen(end) : 0, limit, cb, ctx);
+}
+
+/**
+ * casky_scan_n - casky_scan() with binary bounds of explicit length.
+ */
+long casky_scan_n(KeyDir *kd, const void *start, size_t start_len,
+                  const void *end, size_t end_len, size_t limit,
+                  casky_scan_cb cb, void *ctx) {
+  if (!kd || !cb) {
+    casky_errno = CASKY_ERR_INVALID_POINTER;
+    return -1;
+  }
+  if (!kd->ordered) {
+    casky_errno = CASKY_ERR_NOT_SUPPORTED;
+    return -1;
+  }
+
+  casky_scan_batch b = { .end = end, .end_len = end_len };
+  casky_scan_value v = { 0 };
+  char *from = NULL;        // last key of the previous batch
+  size_t from_len = 0;
+  long count = 0;
+  CaskyError err = CASKY_OK;
+
+  const char *seek = start;
+  size_t seek_len = start_len;
+  int after = 0;
+  for (;;) {
+    b.used = b.n = 0;
+    casky_skiplist_walk(kd->ordered, seek, seek_len, after, casky_scan_collect, &b);
+    if (b.oom) {
+      err = CASKY_ERR_MEMORY;
+      break;
+    }
+
+    int stop = 0;
+    for (size_t i = 0; i < b.n && !stop; i++) {
+      if (limit > 0 && (size_t)count == limit) {
+        stop = 1;
+        break;
+      }
+      const char *key = b.keys + b.off[i];
+      if (casky_get_with_n(kd, key, b.len[i], casky_scan_copy_value, &v) != 0) {
+        if (casky_errno == CASKY_ERR_KEY_NOT_FOUND)
+          continue; // deleted or expired since it was collected
+        err = casky_errno;
+        stop = 1;
+        break;
+      }
+      if (v.oom) {
+        err = CASKY_ERR_MEMORY;
+        stop = 1;
+        break;
+      }
+      count++;
+      if (cb(key, b.len[i], v.buf, v.len, ctx) != 0)
+        stop = 1;
+    }
+    if (stop || b.done || b.n < CASKY_SCAN_BATCH)
+      break;
+
+    // Resume right after the last key of this batch
+    size_t last_len = b.len[b.n - 1];
+    char *last = realloc(from, last_len ? last_len : 1);
+    if (!last) {
+      err = CASKY_ERR_MEMORY;
+      break;
+    }
+    memcpy(last, b.keys + b.off[b.n - 1], last_len);
+    from = last;
+    from_len = last_len;
+    seek = from;
+    seek_len = from_len;
+    after = 1;
+  }
 
+  free(b.keys);
+  free(v.buf);
+  free(from);
+  casky_errno = err;
+  return err == CASKY_OK ? count : -1;
+}
+
+/**
+ * casky_scan_prefix - Visits the keys starting with `prefix` in ascending
+ * order. Same contract as casky_scan(); a NULL or empty prefix visits every
+ * key.
+ */
+long casky_scan_prefix(KeyDir *kd, const char *prefix, size_t limit,
+                       casky_scan_cb cb, void *ctx) {
+  return casky_scan_prefix_n(kd, prefix, prefix ? strlen(prefix) : 0, limit, cb, ctx);
+}
+
+/**
+ * casky_scan_prefix_n - casky_scan_prefix() for a binary prefix of
+ * prefix_len bytes.
+ *
+ * The prefix range ends at the smallest key greater than every key that
+ * starts with the prefix: the prefix without its trailing 0xff bytes, with
+ * the last byte incremented.
+ */
+long casky_scan_prefix_n(KeyDir *kd, const void *prefix, size_t prefix_len,
+                         size_t limit, casky_scan_cb cb, void *ctx) {
+  if (!prefix || prefix_len == 0)
+    return casky_scan_n(kd, NULL, 0, NULL, 0, limit, cb, ctx);
+
+  unsigned char *end = malloc(prefix_len);
+  if (!end) {
+    casky_errno = CASKY_ERR_MEMORY;
+    return -1;
+  }
+  memcpy(end, prefix, prefix_len);
+  size_t end_len = prefix_len;
+  while (end_len > 0 && end[end_len - 1] == 0xff)
+    end_len--;
+  if (end_len > 0)
+    end[end_len - 1]++;
+
+  // A prefix of 0xff bytes only has no upper bound
+  long ret = casky_scan_n(kd, prefix, prefix_len, end_len > 0 ? (const char *)end : NULL,
+                          end_len, limit, cb, ctx);
+  free(end);
+  return ret;
+}
+
+/**
+ * casky_freeze - Makes a KeyDir read-only and re-indexes it with a minimal
+ * perfect hash
+ *
+ * Meant for KeyDirs that are only read from once loaded, such as snapshot
+ * replicas (see casky_load_snapshot_frozen()). The live entries move to a
+ * single array with one slot per key, found by at most two memory accesses;
+ * the hash index, its nodes and arenas are released, so the index costs a
+ * few bits per key on top of the keys and entries. Reads, scans and
+ * snapshots keep working; casky_put(), casky_delete() and casky_compact()
+ * fail with CASKY_ERR_NOT_SUPPORTED from then on.
+ *
+ * Not thread-safe: no other thread may use the KeyDir during the call.
+ * Afterwards reads need no lock, not even an EBR critical section.
+ *
+ * @kd: Pointer to the KeyDir
+ *
+ * Returns:
+ *   0 on success (or if the KeyDir was already frozen), -1 on failure, in
+ *   which case the KeyDir is left unchanged (sets casky_errno).
+ */
+int casky_freeze(KeyDir *kd) {
+  if (!kd) {
+    casky_errno = CASKY_ERR_INVALID_POINTER;
+    return -1;
+  }
+  if (kd->frozen) {
+    casky_errno = CASKY_OK;
+    return 0;
+  }
+  if (kd->disk) {
+    casky_errno = CASKY_ERR_NOT_SUPPORTED;
+    return -1;
+  }
+
+  CaskyFrozen *frozen = casky_frozen_build(kd);
+  if (!frozen) return -1;
+
+  // The hash index gives way to an empty one, which every code path
+  // walking the shards can still rely on
+  CaskyOptions opts;
+  casky_options_init(&opts);
+  opts.initial_buckets = 1;
+  opts.num_shards = 1;
+  opts.hash_seed = kd->hash_seed;
+  KeyDir empty = { 0 };
+  if (casky_kd_init_index(&empty, &opts) != 0) {
+    casky_kd_free_index(&empty);
+    casky_frozen_free(frozen);
+    casky_errno = CASKY_ERR_MEMORY;
+    return -1;
+  }
+
+  struct CaskySkiplist *ordered = kd->ordered;  // still valid: same keys
+  kd->ordered = NULL;
+  casky_kd_free_index(kd);
+  kd->engine = empty.engine;
+  kd->retired = empty.retired;
+  kd->shards = empty.shards;
+  kd->num_shards = empty.num_shards;
+  kd->ordered = ordered;
+  kd->frozen = frozen;
+  kd->num_entries = frozen->num_entries;
+
+  casky_errno = CASKY_OK;
+  return 0;
 }
 
 /**
@@ -362,6 +1519,202 @@ const char* casky_version(void) {
   return CASKY_VERSION_STRING;
 }
 
+typedef struct {
+  KeyDir *kd;
+  CaskyLogWriter w;    // compacted file being written, w.f NULL once closed
+  char *path;          // its path
+  uint32_t file_id;    // its file_id
+  uint32_t first_id;   // file_id of the first compacted file
+  CaskyHint hint;      // hint records of the compacted file
+  uint64_t ino;        // its inode, once closed
+  CaskyFileTable *files; // the files being replaced and the compacted ones
+  CaskyShard *shard;   // shard being walked
+  EntryNode **olds;    // nodes written so far, shard by shard
+  CaskyRef *clones;    // their relocated copies, not published yet
+  size_t *shard_end;   // per shard, end of its nodes in olds
+  size_t count;
+  CaskyError err;      // CASKY_OK unless the walk failed
+} casky_compact_ctx;
+
+/*
+ * Starts compacted file `file_id`: a new segment of a segmented database,
+ * a temporary file next to the log otherwise, renamed over it once
+ * complete, in the format of new log files. Its read file joins ctx->files
+ * right away, ready to be published with the relocated entries.
+ */
+static int casky_compact_open_file(casky_compact_ctx *ctx, uint32_t file_id) {
+  KeyDir *kd = ctx->kd;
+  FILE *f = NULL;
+  char *path;
+  if (kd->segment_size) {
+    path = casky_segment_path(kd->filename, file_id);
+    if (path) f = fopen(path, "wb");
+  } else {
+    // Create a safe temporary file
+    path = malloc(strlen(kd->filename) + sizeof(".XXXXXX"));
+    if (path) {
+      sprintf(path, "%s.XXXXXX", kd->filename);
+      int fd = mkstemp(path);
+      if (fd != -1 && !(f = fdopen(fd, "wb")))
+        close(fd);
+    }
+  }
+  CaskyLogWriter w;
+  int started = f && casky_log_writer_init(&w, f, kd->log_format) == 0;
+  CaskyReadFile *rf = started ? casky_read_file_open(path, file_id) : NULL;
+  CaskyFileTable *files = rf ? casky_file_table_add(ctx->files ? ctx->files : kd->files, rf) : NULL;
+  if (!files) {
+    if (rf) casky_read_file_free(rf, NULL);
+    if (started) casky_log_writer_finish(&w);
+    if (f) {
+      fclose(f);
+      remove(path);
+    }
+    free(path);
+    ctx->err = !f ? CASKY_ERR_IO : !started ? casky_errno : CASKY_ERR_MEMORY;
+    return -1;
+  }
+  casky_file_table_free(ctx->files, NULL);  // never published
+  ctx->files = files;
+  ctx->w = w;
+  free(ctx->path);
+  ctx->path = path;
+  ctx->file_id = file_id;
+  casky_hint_reset(&ctx->hint);
+  return 0;
+}
+
+// A single fsync per compacted file, once it is complete. A compacted
+// segment gets its hint file right away, the single log once renamed.
+static int casky_compact_close_file(casky_compact_ctx *ctx) {
+  struct stat st;
+  FILE *f = ctx->w.f;
+  int ret = casky_log_writer_finish(&ctx->w);
+  if (ret == 0)
+    ret = fflush(f);
+  if (ret == 0 && (ctx->kd->sync_on_write || ctx->kd->sync_mode == CASKY_SYNC_PERIODIC))
+    ret = fsync(fileno(f));
+  ctx->ino = fstat(fileno(f), &st) == 0 ? (uint64_t)st.st_ino : 0;
+  if (fclose(f) != 0) ret = -1;
+  ctx->w.f = NULL;
+  if (ret != 0) {
+    ctx->err = CASKY_ERR_IO;
+    return ret;
+  }
+  if (ctx->kd->segment_size && ctx->ino) {
+    char *hint = casky_segment_hint_path(ctx->kd->filename, ctx->file_id);
+    if (hint) casky_hint_write(&ctx->hint, hint, ctx->w.pos, ctx->ino);
+    free(hint);
+  }
+  return 0;
+}
+
+/*
+ * Appends a live entry to the compacted files, rolling over to a new one
+ * when a segment is full. Values left uncompressed by older records are
+ * compressed with the codec of the KeyDir, unless the on-disk index keeps
+ * their locations: it relocates them with their current lengths.
+ *
+ * @stored_len: receives the length of the value bytes written
+ * @codec:      receives their codec
+ *
+ * Returns: the offset of the value in the compacted file ctx->file_id, or
+ * UINT64_MAX with ctx->err set.
+ */
+static uint64_t casky_compact_write(casky_compact_ctx *ctx, const Entry *e,
+                                    uint32_t *stored_len, CaskyCodec *codec) {
+  // Compression only shrinks the record; block padding is not counted
+  const CaskyLogHeader *h = &ctx->w.header;
+  uint64_t record_size = (uint64_t)e->key_len + e->value_len +
+      (h->format != CASKY_LOG_RECORDS ? CASKY_GROUP_HEADER_SIZE + CASKY_BLOCK_RECORD_MAX :
+                                       CASKY_RECORD_HEADER_SIZE);
+  if (ctx->kd->segment_size && ctx->w.pos > casky_log_header_size(h) &&
+      ctx->w.pos + record_size > ctx->kd->segment_size &&
+      (casky_compact_close_file(ctx) != 0 || casky_compact_open_file(ctx, ctx->file_id + 1) != 0))
+    return UINT64_MAX;
+
+  uint64_t value_offset;
+  if (casky_write_entry(ctx->kd, &ctx->w, e, !ctx->kd->disk, stored_len, codec,
+                        &value_offset) != 0) {
+    ctx->err = casky_errno == CASKY_ERR_MEMORY ? CASKY_ERR_MEMORY : CASKY_ERR_IO;
+    return UINT64_MAX;
+  }
+  casky_hint_add(&ctx->hint, CASKY_RECORD_PUT, e->key, e->key_len, *stored_len, *codec,
+                 value_offset, e->timestamp, e->expiration_ts);
+  return value_offset;
+}
+
+static int casky_compact_cb(EntryNode *node, const Entry *e, void *arg) {
+  casky_compact_ctx *ctx = arg;
+  uint32_t stored_len;
+  CaskyCodec codec;
+  uint64_t value_offset = casky_compact_write(ctx, e, &stored_len, &codec);
+  if (value_offset == UINT64_MAX)
+    return CASKY_ITER_STOP;
+  // Values kept in memory are not tied to a log location
+  if (e->value)
+    return CASKY_ITER_CONTINUE;
+
+  // Readers may be looking at the node: the relocated entry is a copy,
+  // swapped in once the compacted log is in place
+  CaskyRef clone = casky_shard_clone(ctx->shard, node);
+  if (!clone) {
+    ctx->err = CASKY_ERR_MEMORY;
+    return CASKY_ITER_STOP;
+  }
+  EntryNode *copy = casky_arena_ptr(ctx->shard->arena, clone);
+  copy->file_id = ctx->file_id;
+  copy->value_len = stored_len;
+  casky_node_set_offset(copy, value_offset, codec);
+  ctx->olds[ctx->count] = node;
+  ctx->clones[ctx->count++] = clone;
+  return CASKY_ITER_CONTINUE;
+}
+
+// casky_compact_cb() for the on-disk index, relocated by
+// casky_disk_relocate() once the compacted log is in place
+static int casky_compact_disk_cb(const Entry *e, void *arg) {
+  casky_compact_ctx *ctx = arg;
+  uint32_t stored_len;
+  CaskyCodec codec;
+  return casky_compact_write(ctx, e, &stored_len, &codec) == UINT64_MAX ? CASKY_ITER_STOP :
+                                                                          CASKY_ITER_CONTINUE;
+}
+
+// Drops whatever a failed compaction wrote: clones and compacted files
+static void casky_compact_discard(casky_compact_ctx *ctx) {
+  size_t i = 0;
+  for (size_t n = 0; ctx->shard_end && n < ctx->kd->num_shards; n++)
+    for (; i < ctx->shard_end[n]; i++)
+      casky_shard_discard(&ctx->kd->shards[n], ctx->clones[i]);
+  free(ctx->olds);
+  free(ctx->clones);
+  free(ctx->shard_end);
+
+  if (ctx->w.f) {
+    casky_log_writer_finish(&ctx->w);
+    fclose(ctx->w.f);
+  }
+  for (uint32_t i = 0; ctx->files && i < ctx->files->count; i++) {
+    CaskyReadFile *rf = ctx->files->files[i];
+    if (!rf || rf->file_id < ctx->first_id) continue;
+    if (ctx->kd->segment_size) {
+      char *path = casky_segment_path(ctx->kd->filename, rf->file_id);
+      if (path) remove(path);
+      free(path);
+      path = casky_segment_hint_path(ctx->kd->filename, rf->file_id);
+      if (path) remove(path);
+      free(path);
+    } else {
+      remove(ctx->path);
+    }
+    casky_read_file_free(rf, NULL);
+  }
+  casky_file_table_free(ctx->files, NULL);
+  casky_hint_free(&ctx->hint);
+  free(ctx->path);
+}
+
 /**
  * casky_compact - Compacts the database by writing all valid in-memory records
  *                  to a new temporary log file and replacing the original log.
@@ -375,72 +1728,168 @@ const char* casky_version(void) {
  * Notes:
  *   - Only valid records in memory are written; corrupted records are discarded.
  *   - The operation is atomic: first a temp file is written, then renamed.
+ *     A segmented database gets new segments, numbered after the active
+ *     one and filled up to segment_size, before the old ones are removed:
+ *     replaying both after a crash gives the same KeyDir. The last
+ *     compacted segment becomes the active one.
+ *   - Writers wait for the whole compaction, readers do not: the compacted
+ *     files are new file ids (see CaskyFileTable), and the previous ones
+ *     stay readable until every entry has been moved.
+ *   - A frozen KeyDir cannot be compacted (CASKY_ERR_NOT_SUPPORTED).
  */
 int casky_compact(KeyDir *kd) {
   if (!kd || !kd->filename) {
     casky_errno = CASKY_ERR_INVALID_POINTER;
     return -1;
   }
-  LOCK(kd);
-  // Create a safe temporary file
-  char tmpfile_template[PATH_MAX];
-  snprintf(tmpfile_template, sizeof(tmpfile_template), "%s.XXXXXX", kd->filename);
-
-  int fd = mkstemp(tmpfile_template);
-  if (fd == -1) {
-    casky_errno = CASKY_ERR_IO;
-    UNLOCK(kd);
+  if (kd->frozen) {
+    casky_errno = CASKY_ERR_NOT_SUPPORTED;
     return -1;
   }
+  // Shards first, then the log: the order every writer uses
+  casky_kd_lock_all(kd, 1);
+  LOCK(kd);
 
-  FILE *f = fdopen(fd, "wb");
-  if (!f) {
-    close(fd);
-    casky_errno = CASKY_ERR_IO;
+  // Iterate all buckets and nodes to write current in-memory entries. The
+  // KeyDir keeps pointing to the old log until the new one is in place.
+  casky_compact_ctx ctx = { 0 };
+  ctx.kd = kd;
+  ctx.first_id = kd->files ? kd->active_id + 1 : 0;
+  ctx.err = CASKY_OK;
+  if (!kd->disk) {
+    ctx.olds = malloc((kd->num_entries + 1) * sizeof(EntryNode*));
+    ctx.clones = malloc((kd->num_entries + 1) * sizeof(CaskyRef));
+    // Zeroed: a failed walk leaves the shards after it without clones
+    ctx.shard_end = calloc(kd->num_shards, sizeof(size_t));
+    if (!ctx.olds || !ctx.clones || !ctx.shard_end)
+      ctx.err = CASKY_ERR_MEMORY;
+  }
+  if (ctx.err == CASKY_OK)
+    casky_compact_open_file(&ctx, ctx.first_id);
+  if (ctx.err != CASKY_OK) {
+    // Nothing to walk
+  } else if (kd->disk) {
+    if (casky_disk_foreach(kd, casky_compact_disk_cb, &ctx) != 0 && ctx.err == CASKY_OK)
+      ctx.err = casky_errno;
+  } else {
+    // Nodes only know the low bits of their hash: clones are matched with
+    // their shard by walking the shards one by one
+    for (size_t n = 0; n < kd->num_shards && ctx.err == CASKY_OK; n++) {
+      ctx.shard = &kd->shards[n];
+      casky_shard_foreach(kd, ctx.shard, casky_compact_cb, &ctx);
+      ctx.shard_end[n] = ctx.count;
+    }
+  }
+  if (ctx.err == CASKY_OK)
+    casky_compact_close_file(&ctx);
+  // The log appended to from now on is opened while the compaction can
+  // still be given up: the stream follows the temp file through rename()
+  FILE *log = NULL;
+  if (ctx.err == CASKY_OK && !(log = fopen(ctx.path, "ab+")))
+    ctx.err = CASKY_ERR_IO;
+  // Atomically replace old log file with compacted temp file. The hint of
+  // the old log goes first: it must never be taken for the new one's.
+  if (ctx.err == CASKY_OK && !kd->segment_size) {
+    char *hint = casky_log_hint_path(kd->filename);
+    if (hint) remove(hint);
+    if (rename(ctx.path, kd->filename) != 0)
+      ctx.err = CASKY_ERR_IO;
+    else if (hint && ctx.ino)
+      casky_hint_write(&ctx.hint, hint, ctx.w.pos, ctx.ino);
+    free(hint);
+  }
+  if (ctx.err != CASKY_OK) {
+    if (log) fclose(log);
+    casky_compact_discard(&ctx);
+    casky_errno = ctx.err;
     UNLOCK(kd);
+    casky_kd_unlock_all(kd);
     return -1;
   }
 
-  // Iterate all buckets and nodes to write current in-memory entries
-  if (kd->root && kd->num_entries > 0) {
-    for (size_t i = 0; i < kd->num_buckets; i++) {
-      EntryNode *node = kd->root[i];
-      while (node) {
-        // Append record to temp file
-        if (casky_write_data_to_file(f, kd->sync_on_write,
-                                     node->entry.key, node->entry.value,
-                                     node->entry.timestamp,
-                                     node->entry.expiration_ts) != 0) {
-          fclose(f);
-          remove(tmpfile_template);
-          casky_errno = CASKY_ERR_IO;
-          UNLOCK(kd);
-          return -1;
-        }
-        node = node->next;
-      }
+  // Point every entry to its record in the compacted files. Until the last
+  // one is swapped in, readers find both generations in the file table.
+  CaskyFileTable *old_files = kd->files;
+  CASKY_PUBLISH(kd->files, ctx.files);
+  if (old_files)
+    casky_ebr_retire(kd->retired, old_files, casky_file_table_free, NULL);
+  if (kd->disk)
+    casky_disk_relocate(kd, ctx.file_id);
+  size_t i = 0;
+  for (size_t n = 0; ctx.shard_end && n < kd->num_shards; n++)
+    for (; i < ctx.shard_end[n]; i++)
+      casky_shard_replace(&kd->shards[n], ctx.olds[i], ctx.clones[i]);
+  free(ctx.olds);
+  free(ctx.clones);
+  free(ctx.shard_end);
+
+  // Then the replaced files go. Without memory for a smaller table they
+  // simply stay open until casky_close().
+  CaskyFileTable *files = casky_file_table_from(ctx.files, ctx.first_id);
+  if (files)
+    CASKY_PUBLISH(kd->files, files);
+  for (uint32_t n = 0; n < ctx.files->count; n++) {
+    CaskyReadFile *rf = ctx.files->files[n];
+    if (!rf || rf->file_id >= ctx.first_id) continue;
+    if (kd->segment_size) {
+      char *path = casky_segment_path(kd->filename, rf->file_id);
+      if (path) remove(path);
+      free(path);
+      path = casky_segment_hint_path(kd->filename, rf->file_id);
+      if (path) remove(path);
+      free(path);
     }
+    if (files)
+      casky_ebr_retire(kd->retired, rf, casky_read_file_free, NULL);
   }
-  fflush(f);
-  if (kd->sync_on_write) 
-    fsync(fileno(f));
-  fclose(f);
+  if (files)
+    casky_ebr_retire(kd->retired, ctx.files, casky_file_table_free, NULL);
 
-  // Atomically replace old log file with compacted temp file
-  if (rename(tmpfile_template, kd->filename) != 0) {
-    remove(tmpfile_template);
-    casky_errno = CASKY_ERR_IO;
-    UNLOCK(kd);
-    return -1;
+  // A writer may be flushing the old log: wait for it. Every record not
+  // flushed yet is superseded by the compacted log, synced above.
+#ifdef THREAD_SAFE
+  pthread_mutex_lock(&kd->sync_lock);
+#endif
+  if (kd->log) fclose(kd->log);
+  kd->log = log;
+  kd->active_id = ctx.file_id;
+  kd->log_header = ctx.w.header;
+  kd->log_size = ctx.w.pos;
+  // The last compacted segment is the active one: its hint keeps growing
+  if (kd->hint) {
+    casky_hint_free(kd->hint);
+    *kd->hint = ctx.hint;
+  } else {
+    casky_hint_free(&ctx.hint);
   }
-
-  kd->log = fopen(kd->filename, "ab+");
+  if (kd->sync_on_write || kd->sync_mode == CASKY_SYNC_PERIODIC) {
+    __atomic_store_n(&kd->log_synced, kd->log_appended, __ATOMIC_RELEASE);
+    __atomic_store_n(&kd->log_synced_at, casky_now_ms(), __ATOMIC_RELAXED);
+  }
+#ifdef THREAD_SAFE
+  pthread_mutex_unlock(&kd->sync_lock);
+#endif
+  free(ctx.path);
+  casky_ebr_reclaim(kd->retired);
   UNLOCK(kd);
+  for (size_t i = 0; i < kd->num_shards; i++)
+    casky_ebr_reclaim(kd->shards[i].retired);
+  casky_kd_unlock_all(kd);
   casky_errno = CASKY_OK;
   return 0;
 }
 
 
+static int casky_expire_cb(EntryNode *node, const Entry *e, void *arg) {
+  (void)node;
+  uint64_t now = *(uint64_t *)arg;
+  if (e->expiration_ts > 0 && e->expiration_ts <= now) {
+    casky_stats_inc_delete(casky_entry_bytes(e));
+    return CASKY_ITER_REMOVE;
+  }
+  return CASKY_ITER_CONTINUE;
+}
+
 void casky_expire(KeyDir *kd) {
   if (!kd) {
     casky_errno = CASKY_ERR_INVALID_POINTER;
@@ -448,39 +1897,22 @@ void casky_expire(KeyDir *kd) {
   }
   uint64_t now = (uint64_t)time(NULL);
 
-  LOCK(kd);
-
-  for (size_t i = 0; i < kd->num_buckets; i++) {
-    EntryNode *prev = NULL;
-    EntryNode *node = kd->root[i];
-
-    while (node) {
-      if (node->entry.expiration_ts > 0 &&
-        node->entry.expiration_ts <= now) {
-
-        EntryNode *next = node->next;
-
-        if (prev)
-          prev->next = next;
-        else
-          kd->root[i] = next;
-
-        casky_stats_inc_delete(strlen(node->entry.key) + strlen(node->entry.value));
-
-        kd->num_entries--;
-
-        free(node->entry.key);
-        free(node->entry.value);
-        free(node);
-
-        // Continua con il prossimo
-        node = next;
-      } else {
-        prev = node;
-        node = node->next;
-      }
-    }
+  if (kd->disk) {
+    // Erasing shifts slots back: not between the walk of a compaction and
+    // casky_disk_relocate(), both under kd->lock
+    LOCK(kd);
+    size_t removed = casky_disk_expire(kd, now);
+    UNLOCK(kd);
+    __atomic_sub_fetch(&kd->num_entries, removed, __ATOMIC_RELAXED);
+    return;
   }
 
-  UNLOCK(kd);
+  // One shard at a time: the others keep serving requests meanwhile
+  for (size_t i = 0; i < kd->num_shards; i++) {
+    CaskyShard *s = &kd->shards[i];
+    SHARD_WRLOCK(s);
+    casky_shard_foreach(kd, s, casky_expire_cb, &now);
+    casky_ebr_reclaim(s->retired);
+    SHARD_UNLOCK(s);
+  }
 }
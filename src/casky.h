@@ -3,6 +3,25 @@
 
 
 #define CASKY_INITIAL_BUCKETS_NUM   1024
+// The KeyDir doubles its bucket array once the average chain length exceeds
+// this value.
+#define CASKY_MAX_LOAD_FACTOR       1
+// Number of old buckets migrated into the new bucket array by every write
+// while an incremental rehash is in progress.
+#define CASKY_REHASH_STEP           4
+// Values up to this many bytes that are kept in memory are stored in the
+// same arena block as their node and key.
+#define CASKY_INLINE_VALUE_MAX      64
+// Default number of independently locked KeyDir shards.
+#define CASKY_NUM_SHARDS            16
+// Default bounds of the un-synced window with CASKY_SYNC_PERIODIC.
+#define CASKY_SYNC_INTERVAL_MS      100
+#define CASKY_SYNC_BYTES            (4 * 1024 * 1024)
+// Size past which the active segment of a segmented database rolls over,
+// when the database directory is opened without CaskyOptions.segment_size.
+#define CASKY_SEGMENT_SIZE          (256 * 1024 * 1024)
+// Values shorter than this are never compressed, see CaskyOptions.compression.
+#define CASKY_COMPRESS_MIN          128
 
 #include <stdio.h>
 #include <stddef.h>
@@ -12,9 +31,19 @@
 #include <pthread.h>
 #define LOCK(kd)   pthread_mutex_lock(&(kd)->lock)
 #define UNLOCK(kd) pthread_mutex_unlock(&(kd)->lock)
+#define SHARD_RDLOCK(s) pthread_rwlock_rdlock(&(s)->lock)
+#define SHARD_WRLOCK(s) pthread_rwlock_wrlock(&(s)->lock)
+#define SHARD_UNLOCK(s) pthread_rwlock_unlock(&(s)->lock)
+#define SHARD_TRYWRLOCK(s) (pthread_rwlock_trywrlock(&(s)->lock) == 0)
+#define CASKY_THREAD_LOCAL _Thread_local
 #else
 #define LOCK(kd)
 #define UNLOCK(kd)
+#define SHARD_RDLOCK(s)
+#define SHARD_WRLOCK(s)
+#define SHARD_UNLOCK(s)
+#define SHARD_TRYWRLOCK(s) 1
+#define CASKY_THREAD_LOCAL
 #endif
 
 /**
@@ -27,9 +56,15 @@
  *
  * To provide optional thread-safety, a compile-time flag THREAD_SAFE can be
  * defined (-DTHREAD_SAFE). When enabled:
- *   - All API functions (casky_put, casky_get, casky_delete, casky_compact)
- *     acquire a mutex internally before accessing the KeyDir memory structure
- *     or writing to the log file.
+ *   - The KeyDir is split into shards selected by key hash, each protected
+ *     by its own read-write lock. casky_get takes the read lock of one
+ *     shard, so readers never wait for each other; casky_put and
+ *     casky_delete take the write lock of the shard of their key.
+ *   - Appends to the log are serialized by a separate mutex (kd->lock),
+ *     always taken after the shard lock, so that the order of the records
+ *     in the log matches the order in which the KeyDir was updated.
+ *   - casky_compact and snapshots lock every shard, in index order.
+ *   - casky_errno is thread-local.
  *   - This ensures safe concurrent access across multiple threads within the
  *     same process.
  *   - Performance overhead is minimal when THREAD_SAFE is disabled.
@@ -45,9 +80,79 @@
 #include "version.h"
 
 
+/**
+ * Compression of the values in the log, see CaskyOptions.compression.
+ * Every record carries the codec of its value, so the records of all
+ * codecs can be mixed in a log.
+ */
+typedef enum {
+    CASKY_CODEC_NONE = 0,
+    CASKY_CODEC_LZ4,
+    CASKY_CODEC_ZSTD,
+} CaskyCodec;
+
+/**
+ * Layout of the log files, see CaskyOptions.log_format.
+ *
+ * CASKY_LOG_RECORDS is the original Bitcask log: records back to back, each
+ * with its own CRC and full 64-bit timestamps. CASKY_LOG_BLOCKS files start
+ * with a header (CaskyLogHeader) and cut the log into fixed-size blocks of
+ * record groups, one CRC per group and timestamps relative to the file
+ * (see block.h): less overhead per record, and a torn or damaged group only
+ * costs the rest of its block. CASKY_LOG_VARINT files are block files
+ * whose record headers are varint-encoded, a few bytes for short records.
+ */
+typedef enum {
+    CASKY_LOG_RECORDS = 0,
+    CASKY_LOG_BLOCKS,
+    CASKY_LOG_VARINT,
+} CaskyLogFormat;
+
+/**
+ * What a record of the log does to its key. Records of older releases are
+ * all CASKY_RECORD_PUT, an empty value standing for a delete: a PUT of an
+ * empty value is stored as CASKY_RECORD_PUT_EMPTY instead, read back as a
+ * CASKY_RECORD_PUT.
+ */
+typedef enum {
+    CASKY_RECORD_PUT = 0,
+    CASKY_RECORD_DELETE,
+    CASKY_RECORD_TOUCH,       // new expiration time of the key, no value
+    CASKY_RECORD_PUT_EMPTY,   // in the log only
+} CaskyRecordType;
+
+/**
+ * What the header of a log file tells, CASKY_LOG_RECORDS with all zeros
+ * for a file without one.
+ */
+typedef struct CaskyLogHeader {
+    CaskyLogFormat format;
+    uint32_t block_size;    // block files: bytes per block
+    uint64_t base_ts;       // block files: timestamps of the records are
+                            // relative to it
+} CaskyLogHeader;
+
+/**
+ * A KeyDir entry, as in the Bitcask paper: the key plus the position of the
+ * latest value in the log, so a lookup costs one pread() and the memory
+ * footprint is a small fixed overhead plus the key.
+ *
+ * With CASKY_VALUES_IN_MEMORY (or when the entry was created through
+ * casky_put_in_memory()) a copy of the value is also kept in `value` and
+ * served from there.
+ */
 typedef struct Entry {
-    char *key;
-    char *value;
+    char *key;              // key bytes, followed by a NUL that is not part
+                            // of the key
+    char *value;            // in-memory copy of the value, NULL when the
+                            // value is read from the log
+    uint32_t file_id;       // log generation holding the value, see CaskyReadFile
+    uint32_t key_len;       // key length in bytes
+    uint32_t value_len;     // value length in bytes: the stored length, prefix
+                            // included, of a compressed value (see codec.h)
+    uint32_t codec;         // CaskyCodec of the value bytes in the log;
+                            // CASKY_CODEC_NONE for a value kept in memory
+    uint64_t value_offset;  // offset of the value bytes inside the log file
     uint64_t timestamp;
     // This is the entry time to live. This is not part of the original bitcask
     // paper, however it's a nice and modern feature to have the possibility to
@@ -57,27 +162,253 @@ typedef struct Entry {
     uint64_t expiration_ts;
 } Entry;
 
+/**
+ * A KeyDir node: the Entry of a key in a compact form. Nodes are allocated
+ * from the arena of their shard in a single block laid out as
+ *
+ *   [ EntryNode | key bytes + NUL | inline value + NUL (optional) ]
+ *
+ * so the key is always found right after the structure (see
+ * casky_node_key()) and needs no pointer. Links and out-of-line values are
+ * 32-bit arena references (CaskyRef, see arena.h), timestamps are 32-bit
+ * offsets from KeyDir.time_base. casky_node_entry() expands a node into an
+ * Entry.
+ */
 typedef struct EntryNode {
-    Entry entry;
-    struct EntryNode *next;
+    uint32_t hash;          // low 32 bits of casky_hash(), cached so that
+                            // lookups reject other keys without memcmp and
+                            // resizes never rehash the key bytes
+    uint32_t next;          // next node of the chain (CASKY_ENGINE_CHAINED)
+    uint32_t offset_lo;     // value_offset, split so that the node needs no
+    uint32_t offset_hi;     // 8-byte alignment (see casky_node_offset()),
+                            // the codec of the value in the top two bits.
+                            // For a value kept in memory, the arena
+                            // reference of its out-of-line copy, 0 when it
+                            // is inline
+    uint32_t file_id;       // log generation holding the value, or
+                            // CASKY_FILE_ID_MEMORY
+    uint32_t key_len;       // key length in bytes
+    uint32_t value_len;     // value length in bytes
+    uint32_t timestamp;     // see casky_time_enc()
+    uint32_t expiration_ts; // see casky_time_enc(), 0 if the key never expires
 } EntryNode;
 
+// EntryNode.file_id of a node whose value is kept in memory
+#define CASKY_FILE_ID_MEMORY UINT32_MAX
+
+/**
+ * In-memory index engines.
+ *
+ * CASKY_ENGINE_CHAINED is the original hash table with a linked list of
+ * EntryNode per bucket (kd->root). CASKY_ENGINE_SWISS is an open-addressing
+ * table probed 16 control bytes at a time (kd->swiss), usually one or two
+ * cache misses per lookup instead of one per chain hop.
+ */
+typedef enum {
+    CASKY_ENGINE_CHAINED = 0,
+    CASKY_ENGINE_SWISS,
+} CaskyEngine;
+
+/**
+ * Where the KeyDir keeps the values.
+ *
+ * CASKY_VALUES_ON_DISK (the default) only records the value location, and
+ * casky_get() fetches it from the log with a single pread(). With
+ * CASKY_VALUES_IN_MEMORY every value is also copied into the KeyDir, so reads
+ * never touch the disk but resident memory grows with the live dataset.
+ */
+typedef enum {
+    CASKY_VALUES_ON_DISK = 0,
+    CASKY_VALUES_IN_MEMORY,
+} CaskyValueMode;
+
+/**
+ * When the log is flushed to disk.
+ *
+ * CASKY_SYNC_ALWAYS (the default) only lets a write return once its record
+ * is on disk; concurrent writers share the flushes (group commit).
+ * CASKY_SYNC_PERIODIC flushes in the background every sync_interval_ms, or
+ * as soon as sync_bytes are pending, whichever comes first: a crash loses at
+ * most that window, and writes never wait for the disk. CASKY_SYNC_NONE
+ * leaves it to the operating system.
+ */
+typedef enum {
+    CASKY_SYNC_ALWAYS = 0,
+    CASKY_SYNC_PERIODIC,
+    CASKY_SYNC_NONE,
+} CaskySyncMode;
+
+struct CaskySwiss;
+struct CaskyArena;
+struct CaskyRetireList;
+struct CaskyDiskIndex;
+
+/**
+ * A log file values are read from.
+ */
+typedef struct CaskyReadFile {
+    int fd;                       // read-only descriptor used to pread() values
+    uint32_t file_id;             // matches Entry.file_id
+} CaskyReadFile;
+
+/**
+ * The log files of a KeyDir, by file_id: the segments of a segmented
+ * database, or the single log file. During a compaction the files being
+ * replaced stay in the table until every entry points to the new ones, so
+ * that readers holding an entry of the old generation can still fetch its
+ * value.
+ *
+ * Never modified once published: adding or dropping a file publishes a new
+ * table and retires the previous one (see ebr.h).
+ */
+typedef struct CaskyFileTable {
+    uint32_t first_id;            // file_id of files[0]
+    uint32_t count;
+    CaskyReadFile *files[];       // NULL for the ids not in use
+} CaskyFileTable;
+
+/**
+ * A KeyDir partition. Keys are spread over the shards by the top bits of
+ * their hash; each shard is a complete index with its own memory and lock,
+ * so operations on keys of different shards never wait for each other.
+ * Shards are cache-line aligned to keep their locks from sharing a line.
+ */
+typedef struct CaskyShard {
+    size_t num_entries;   // keys in this shard
+    size_t num_buckets;   // total num of items in root array (power of two)
+    uint32_t *root;       // the directory root, arena references of the
+                          // first node of each chain (CASKY_ENGINE_CHAINED)
+    // Incremental rehash state. When the table grows, the previous bucket
+    // array is kept in old_root and migrated a few buckets at a time;
+    // buckets below rehash_index have already been moved into root.
+    uint32_t *old_root;
+    size_t old_num_buckets;
+    size_t rehash_index;
+    uint64_t resize_seq;  // odd while a rehash step moves nodes around
+    struct CaskySwiss *swiss; // CASKY_ENGINE_SWISS index
+    struct CaskyArena *arena; // memory of the nodes, keys and cached values
+    struct CaskyRetireList *retired; // unlinked memory readers may still see
+#ifdef THREAD_SAFE
+    pthread_rwlock_t lock;
+#endif
+} __attribute__((aligned(64))) CaskyShard;
+
 typedef struct KeyDir {
-    size_t num_entries;   // total num of keys
-    size_t num_buckets;   // total num of items in root array
-    EntryNode **root;     // the directory root
-    char *filename;       // path to the log file
-    FILE *log;            // the log file handler
-    int sync_on_write;    // if set to 1 forces an fsync on *every* write on
-                          // disk. Useful for maximum resilience but it has
-                          // impact on performances
+    size_t num_entries;   // total num of keys, over all the shards
+    uint64_t hash_seed;   // seed of casky_hash() for this KeyDir
+    uint64_t time_base;   // epoch of the 32-bit node timestamps
+    CaskyEngine engine;   // index engine used by every shard
+    size_t num_shards;    // power of two
+    CaskyShard *shards;
+    char *filename;       // path to the log file, or to the database
+                          // directory when segment_size is set
+    FILE *log;            // the log file handler: the active segment
+    CaskyFileTable *files; // every readable log file, see CaskyFileTable
+    uint32_t active_id;   // file_id of the log appended to
+    uint64_t segment_size; // the active segment rolls over to a new one
+                           // past this size; 0 for a single log file
+    struct CaskyHint *hint; // hint records of the active segment, written
+                            // out when it is sealed (see hint.h)
+    struct CaskyRetireList *retired; // replaced read files, under lock
+    struct CaskySkiplist *ordered; // ordered key index, NULL unless
+                                   // CaskyOptions.ordered_index is set
+    struct CaskyFrozen *frozen; // read-only index set by casky_freeze(),
+                                // NULL while the KeyDir accepts writes
+    struct CaskyDiskIndex *disk; // on-disk index replacing the shards, NULL
+                                 // unless CaskyOptions.disk_index is set
+    uint64_t log_size;    // bytes in the active segment, i.e. offset of the
+                          // next record
+    CaskyLogHeader log_header; // format of the active segment
+    CaskyLogFormat log_format; // format of the log files created from now on
+    // Group commit (see casky_log_sync()). Both count the bytes appended
+    // since the KeyDir was opened, whatever compactions did to the file.
+    uint64_t log_appended; // bytes written to the log, under lock
+    // The three below are written under sync_lock and read without it
+    uint64_t log_synced;   // bytes known to be on disk
+    uint64_t log_syncs;    // fdatasync() calls issued on the log
+    uint64_t log_synced_at; // CLOCK_MONOTONIC ms of the last flush
+    CaskySyncMode sync_mode;
+    uint32_t sync_interval_ms; // CASKY_SYNC_PERIODIC bounds
+    uint64_t sync_bytes;
+    CaskyValueMode value_mode; // see CaskyValueMode
+    uint32_t recovery_threads; // threads replaying the logs on open
+    int replay_pread;     // logs are read rather than mapped on open
+    CaskyCodec codec;     // codec of the values appended to the log
+    uint32_t compress_min; // shorter values are stored uncompressed
+    int sync_on_write;    // if set to 1 a write only returns once its record
+                          // is on disk. Concurrent writers share the flush
+                          // (group commit), but a lone writer still pays a
+                          // full disk flush per write
     int corrupted_dir;    // if set to 1 casky_open() found a corrupted entry and
                           // a COMPACT operation is suggested
+    uint64_t replay_expired; // expired records met while loading the logs
 #ifdef THREAD_SAFE
-    pthread_mutex_t lock; // mutex for thread-safe access
+    pthread_mutex_t lock; // serializes log appends and log replacement
+    pthread_mutex_t sync_lock; // held by the writer flushing the log, taken
+                               // after lock when both are needed
+    pthread_cond_t flush_cond; // wakes the flusher, with sync_lock
+    pthread_t flusher;         // CASKY_SYNC_PERIODIC background thread
+    int flusher_running;
+    int flusher_stop;          // under sync_lock
+    int flush_requested;       // sync_bytes reached, flusher signalled
 #endif
 } KeyDir;
 
+/**
+ * Options accepted by casky_open_with_options().
+ *
+ * Always initialise the structure with casky_options_init() before changing
+ * single fields, so that new options added in later releases get a sane
+ * default.
+ */
+typedef struct CaskyOptions {
+    size_t initial_buckets; // pre-size the KeyDir hash table (split over the
+                            // shards); rounded up to a power of two.
+                            // 0 means CASKY_INITIAL_BUCKETS_NUM
+    CaskyEngine engine;     // in-memory index engine, CASKY_ENGINE_CHAINED
+                            // by default
+    CaskyValueMode value_mode; // CASKY_VALUES_ON_DISK by default
+    uint64_t hash_seed;     // seed of the key hash; 0 picks a random one
+    size_t num_shards;      // KeyDir partitions, rounded up to a power of
+                            // two. 0 means CASKY_NUM_SHARDS
+    int ordered_index;      // if set to 1 the keys are also kept in order,
+                            // enabling casky_scan() and casky_scan_prefix()
+    int disk_index;         // if set to 1 the KeyDir lives in an mmap'd hash
+                            // file next to the log (<path>.idx) instead of
+                            // memory, for key sets larger than RAM
+    CaskySyncMode sync_mode; // CASKY_SYNC_ALWAYS by default
+    uint32_t sync_interval_ms; // CASKY_SYNC_PERIODIC: longest time a write
+                               // stays un-synced, CASKY_SYNC_INTERVAL_MS
+                               // by default
+    uint64_t sync_bytes;    // CASKY_SYNC_PERIODIC: most bytes left un-synced,
+                            // CASKY_SYNC_BYTES by default; 0 for no bound
+    uint64_t segment_size;  // if set, the path is a database directory of
+                            // segments, the active one rolling over past
+                            // this many bytes. 0 keeps a single log file,
+                            // unless the path is a directory already
+                            // (then CASKY_SEGMENT_SIZE)
+    uint32_t recovery_threads; // threads rebuilding the KeyDir on open, each
+                               // owning some of the shards. 0 means one
+                               // per online CPU, 1 a sequential replay
+    int replay_pread;       // if set to 1 the logs are read with pread(),
+                            // CASKY_REPLAY_BUFFER bytes at a time, instead
+                            // of mapped, e.g. on file systems where mmap()
+                            // is slow or unreliable
+    CaskyCodec compression; // codec of the values written from now on,
+                            // CASKY_CODEC_NONE by default. Records already
+                            // in the log keep theirs. casky_open() fails
+                            // with CASKY_ERR_NOT_SUPPORTED if the codec
+                            // was not built in
+    uint32_t compression_min; // values shorter than this are stored as they
+                              // are, CASKY_COMPRESS_MIN by default
+    CaskyLogFormat log_format; // format of the log files created from now on
+                               // (new logs and segments, compactions,
+                               // snapshots), CASKY_LOG_RECORDS by default.
+                               // Existing files are read in their own
+                               // format. Block files do not go with
+                               // disk_index
+} CaskyOptions;
+
 typedef enum {
     CASKY_OK = 0,
     CASKY_ERR_INVALID_PATH,
@@ -87,20 +418,61 @@ typedef enum {
     CASKY_ERR_CORRUPT,
     CASKY_ERR_INVALID_KEY,
     CASKY_ERR_KEY_NOT_FOUND,
+    CASKY_ERR_BUFFER_TOO_SMALL,
+    CASKY_ERR_INVALID_VALUE,
+    CASKY_ERR_NOT_SUPPORTED,
 } CaskyError;
 
 
-extern CaskyError casky_errno;
+/**
+ * Callback of casky_get_with(). `value` points to the `len` bytes of the
+ * value, followed by a NUL, and is only valid until the callback returns.
+ */
+typedef void (*casky_value_cb)(const char *value, size_t len, void *ctx);
+
+/**
+ * Callback of casky_scan() and casky_scan_prefix(), called once per live
+ * key in key order. `key` and `value` are NUL-terminated and only valid
+ * until the callback returns. A non-zero return value ends the scan.
+ */
+typedef int (*casky_scan_cb)(const char *key, size_t key_len,
+                             const char *value, size_t value_len, void *ctx);
+
+// Thread-local in THREAD_SAFE builds
+extern CASKY_THREAD_LOCAL CaskyError casky_errno;
 
+void    casky_options_init(CaskyOptions *opts);
 KeyDir *casky_init_kd_from_file(const char *file, int open_log);
+KeyDir *casky_init_kd_with_options(const char *file, int open_log, const CaskyOptions *opts);
 KeyDir* casky_open(const char *path);
+KeyDir* casky_open_with_options(const char *path, const CaskyOptions *opts);
 void    casky_close(KeyDir *kd);
 
 int     casky_put(KeyDir *kd, const char *key, const char *value, uint32_t ttl);
 char*   casky_get(KeyDir *kd, const char *key);
+int     casky_get_into(KeyDir *kd, const char *key, char *buf, size_t cap, size_t *len);
+int     casky_get_with(KeyDir *kd, const char *key, casky_value_cb cb, void *ctx);
 int     casky_delete(KeyDir *kd, const char *key);
+int     casky_touch(KeyDir *kd, const char *key, uint32_t ttl);
+
+// Binary-safe variants: keys and values are byte strings of explicit length
+int     casky_put_n(KeyDir *kd, const void *key, size_t key_len, const void *value, size_t value_len, uint32_t ttl);
+void*   casky_get_n(KeyDir *kd, const void *key, size_t key_len, size_t *value_len);
+int     casky_get_into_n(KeyDir *kd, const void *key, size_t key_len, char *buf, size_t cap, size_t *len);
+int     casky_get_with_n(KeyDir *kd, const void *key, size_t key_len, casky_value_cb cb, void *ctx);
+int     casky_delete_n(KeyDir *kd, const void *key, size_t key_len);
+int     casky_touch_n(KeyDir *kd, const void *key, size_t key_len, uint32_t ttl);
+
+// Ordered access, requires CaskyOptions.ordered_index
+long    casky_scan(KeyDir *kd, const char *start, const char *end, size_t limit, casky_scan_cb cb, void *ctx);
+long    casky_scan_prefix(KeyDir *kd, const char *prefix, size_t limit, casky_scan_cb cb, void *ctx);
+long    casky_scan_n(KeyDir *kd, const void *start, size_t start_len, const void *end, size_t end_len,
+                     size_t limit, casky_scan_cb cb, void *ctx);
+long    casky_scan_prefix_n(KeyDir *kd, const void *prefix, size_t prefix_len, size_t limit,
+                            casky_scan_cb cb, void *ctx);
 int     casky_compact(KeyDir *kd);
 void    casky_expire(KeyDir *kd);
+int     casky_freeze(KeyDir *kd);
 
 const char*        casky_version(void);
 #endif
@@ -2,7 +2,99 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include "casky.h"
 #include "crc.h"
+#include "utils.h"
+#include "codec.h"
+#include "block.h"
+
+static const char *type_name(CaskyRecordType type) {
+    switch (type) {
+    case CASKY_RECORD_DELETE: return "DELETE";
+    case CASKY_RECORD_TOUCH:  return "TOUCH";
+    default:                  return "PUT";
+    }
+}
+
+/*
+ * A compressed value is printed decompressed, when this build has its
+ * codec: `raw` receives it (NULL otherwise, to print the value as stored)
+ * and `tag` a note on the compression.
+ */
+static void decode_value(CaskyCodec codec, const char *value, uint32_t value_len,
+                         char **raw, uint32_t *raw_len, char *tag, size_t tag_size) {
+    *raw = NULL;
+    *raw_len = value_len;
+    tag[0] = '\0';
+    if (codec == CASKY_CODEC_NONE)
+        return;
+    if (casky_codec_raw_len(value, value_len, raw_len) == 0 &&
+        (*raw = malloc(*raw_len ? *raw_len : 1)) &&
+        casky_codec_decompress(codec, value, value_len, *raw, *raw_len) != 0) {
+        free(*raw);
+        *raw = NULL;
+    }
+    snprintf(tag, tag_size, " [%s, %u -> %u bytes%s]", casky_codec_name(codec),
+             *raw_len, value_len, *raw ? "" : ", not decompressed");
+}
+
+/*
+ * Dumps a block-framed log, group by group. A damaged group is reported
+ * and skipped up to the next block, as replay does.
+ *
+ * Returns: the number of damaged groups.
+ */
+static size_t dump_blocks(FILE *f, const CaskyLogHeader *h) {
+    printf("Block log%s: %u-byte blocks, base timestamp %lu\n",
+           h->format == CASKY_LOG_VARINT ? " (varint record headers)" : "",
+           h->block_size, h->base_ts);
+    char *buf = NULL;
+    long size;
+    if (fseek(f, 0, SEEK_END) != 0 || (size = ftell(f)) < 0 ||
+        !(buf = malloc(size ? size : 1)) || fseek(f, 0, SEEK_SET) != 0 ||
+        fread(buf, 1, size, f) != (size_t)size) {
+        fprintf(stderr, "Failed to read the log file\n");
+        free(buf);
+        return 1;
+    }
+
+    size_t groups = 0, records = 0, damaged = 0;
+    uint64_t pos = casky_log_header_size(h);
+    while (pos < (uint64_t)size) {
+        CaskyBlockGroup g;
+        CaskyGroupStatus status = casky_block_group(h, buf + pos, size - pos, pos, size, &g);
+        if (status == CASKY_GROUP_TORN) {
+            printf("Truncated or damaged group at offset %lu: the last %lu bytes of the log "
+                   "are cut off on open\n", pos, (uint64_t)size - pos);
+            break;
+        }
+        if (status == CASKY_GROUP_CORRUPT) {
+            printf("Damaged group at offset %lu [CRC MISMATCH or invalid lengths], "
+                   "skipped to %lu\n", pos, g.next);
+            damaged++;
+        }
+        if (status == CASKY_GROUP_OK) {
+            printf("Group at offset %lu: CRC=0x%08X, %u bytes\n", pos, g.crc, g.len);
+            groups++;
+        }
+        for (uint32_t n = 0; status == CASKY_GROUP_OK && n < g.len; records++) {
+            CaskyBlockRecord rec;
+            n += casky_block_record(h, g.records + n, g.len - n, &rec);
+            char *raw;
+            uint32_t raw_len;
+            char tag[64];
+            decode_value(rec.codec, rec.value, rec.value_len, &raw, &raw_len, tag, sizeof(tag));
+            printf("  Record: %s, TS=%lu, EX=%lu, Key='%.*s', Value='%.*s'%s\n",
+                   type_name(rec.type), rec.timestamp, rec.expires, (int)rec.key_len, rec.key,
+                   raw ? (int)raw_len : (int)rec.value_len, raw ? raw : rec.value, tag);
+            free(raw);
+        }
+        pos = g.next;
+    }
+    printf("%zu records in %zu groups, %zu damaged groups\n", records, groups, damaged);
+    free(buf);
+    return damaged;
+}
 
 int main(int argc, char **argv) {
     if (argc != 2) {
@@ -19,58 +111,77 @@ int main(int argc, char **argv) {
 
     printf("Debug log file: %s\n", logfile);
 
-    while (1) {
-        uint32_t crc_stored, key_len, value_len;
-    uint64_t timestamp, expires;
-
-        if (fread(&crc_stored, sizeof(crc_stored), 1, f) != 1) break;
-        if (fread(&timestamp, sizeof(timestamp), 1, f) != 1) break;
-        if (fread(&expires, sizeof(expires), 1, f) != 1) break;
-        if (fread(&key_len, sizeof(key_len), 1, f) != 1) break;
-        if (fread(&value_len, sizeof(value_len), 1, f) != 1) break;
-
-        char *key = malloc(key_len + 1);
-        char *value = malloc(value_len + 1);
+    CaskyLogHeader header;
+    if (casky_log_header_read(fileno(f), &header) != 0) {
+        fprintf(stderr, "Unsupported log header: %s\n", casky_strerror(casky_errno));
+        fclose(f);
+        return 1;
+    }
+    if (header.format != CASKY_LOG_RECORDS) {
+        size_t damaged = dump_blocks(f, &header);
+        fclose(f);
+        return damaged ? 2 : 0;
+    }
 
-        if (fread(key, 1, key_len, f) != key_len) break;
-        key[key_len] = '\0';
+    size_t records = 0, legacy = 0, mismatches = 0;
+    unsigned char hdr[CASKY_RECORD_HEADER_SIZE];
+    while (fread(hdr, sizeof(hdr), 1, f) == 1) {
+        uint32_t crc_stored, key_field, key_len, value_len;
+        uint64_t timestamp, expires;
+        memcpy(&crc_stored, hdr, 4);
+        memcpy(&timestamp, hdr + 4, 8);
+        memcpy(&expires, hdr + 12, 8);
+        memcpy(&key_field, hdr + 20, 4);
+        memcpy(&value_len, hdr + 24, 4);
+        key_len = casky_record_key_len(key_field);
+        CaskyCodec codec = casky_record_codec(key_field);
 
-        if (value_len > 0) {
-            if (fread(value, 1, value_len, f) != value_len) break;
-            value[value_len] = '\0';
-        } else {
-            value[0] = '\0';
+        // The whole record, to check its CRC over header, key and value
+        size_t record_len = sizeof(hdr) + (size_t)key_len + value_len;
+        unsigned char *record = malloc(record_len);
+        if (!record) {
+            fprintf(stderr, "Record too large: key %u bytes, value %u bytes\n", key_len, value_len);
+            break;
         }
+        memcpy(record, hdr, sizeof(hdr));
+        if (fread(record + sizeof(hdr), 1, record_len - sizeof(hdr), f) != record_len - sizeof(hdr)) {
+            printf("Truncated record at the end of the log\n");
+            free(record);
+            break;
+        }
+        const char *key = (const char *)record + sizeof(hdr);
+        const char *value = key + key_len;
 
-        // compute CRC over [timestamp][key_len][value_len][key][value]
-        size_t buf_len = sizeof(timestamp) + +sizeof(expires) + sizeof(key_len) + sizeof(value_len) + key_len + value_len;
-        unsigned char *buf = malloc(buf_len);
-        unsigned char *p = buf;
-        memcpy(p, &timestamp, sizeof(timestamp)); p += sizeof(timestamp);
-        memcpy(p, &expires, sizeof(expires)); p += sizeof(expires);
-        memcpy(p, &key_len, sizeof(key_len)); p += sizeof(key_len);
-        memcpy(p, &value_len, sizeof(value_len)); p += sizeof(value_len);
-        memcpy(p, key, key_len); p += key_len;
-        if (value_len > 0) memcpy(p, value, value_len);
-
-        uint32_t crc_calc = casky_crc32(buf, buf_len);
-        free(buf);
+        int check = casky_record_verify(record, record_len);
+        records++;
+        if (check == 1) legacy++;
+        if (check < 0) mismatches++;
+
+        char *raw;
+        uint32_t raw_len;
+        char tag[64];
+        decode_value(codec, value, value_len, &raw, &raw_len, tag, sizeof(tag));
 
-        printf("Record: CRC=0x%08X%s, TS=%lu, EX=%lu, Key='%s', Value='%s'\n",
-               crc_stored,
-               (crc_stored != crc_calc) ? " [CRC MISMATCH]" : "",
+        // Keys and values are binary: print them by length
+        printf("Record: %s, CRC=0x%08X%s, TS=%lu, EX=%lu, Key='%.*s', Value='%.*s'%s\n",
+               type_name(casky_record_type(key_field, value_len)), crc_stored,
+               check < 0 ? " [CRC MISMATCH]" : check == 1 ? " [legacy CRC32]" : "",
                timestamp,
                expires,
-               key,
-               value);
-    if (crc_stored != crc_calc) 
-      printf("Expected 0x%08X, Found: 0x%08X\n", crc_stored, crc_calc);
+               (int)key_len, key,
+               raw ? (int)raw_len : (int)value_len, raw ? raw : value,
+               tag);
+        free(raw);
+        if (check < 0)
+            printf("Expected 0x%08X (CRC32C), Found: 0x%08X\n",
+                   casky_crc32c(record + 4, record_len - 4), crc_stored);
 
-        free(key);
-        free(value);
+        free(record);
     }
+    printf("%zu records, %zu with a legacy CRC32, %zu CRC mismatches\n",
+           records, legacy, mismatches);
 
     fclose(f);
-    return 0;
+    return mismatches ? 2 : 0;
 }
 
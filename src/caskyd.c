@@ -15,6 +15,7 @@
 #include <time.h>
 #include <stdarg.h>
 #include <errno.h>
+#include <getopt.h>
 #include "../src/casky.h"
 #include "../src/utils.h"
 #include "../src/version.h"
@@ -168,10 +169,19 @@ static void *handle_client(void *arg) {
       if (n < 2) {
         fprintf(client, "ERROR usage: GET <key>\n");
       } else {
-        char *v = casky_get(db, key);
-        if (v) {
-          fprintf(client, "VALUE %s\n", v);
-          free(v);
+        // The value is copied out before the reply is written: a slow
+        // client must not hold up the reclamation of the KeyDir (see
+        // casky_get_with()). Values too large for the buffer are allocated.
+        size_t len = 0;
+        char *val = value;
+        if (casky_get_into(db, key, value, sizeof(value), &len) != 0)
+          val = casky_errno == CASKY_ERR_BUFFER_TOO_SMALL ?
+                casky_get_n(db, key, strlen(key), &len) : NULL;
+        if (val) {
+          fputs("VALUE ", client);
+          fwrite(val, 1, len, client);
+          fputc('\n', client);
+          if (val != value) free(val);
           log_msg(LOG_DEBUG, "GET key='%s' hit", key);
         } else {
           fprintf(client, "NOT_FOUND\n");
@@ -212,6 +222,11 @@ static void *handle_client(void *arg) {
               stats.num_puts,
               stats.num_deletes,
               stats.memory_bytes);
+      casky_sync_stat_t sync = casky_sync_stats(db);
+      fprintf(client, " unsynced bytes=%llu\n unsynced ms=%llu\n syncs=%llu\n",
+              (unsigned long long)sync.unsynced_bytes,
+              (unsigned long long)sync.unsynced_ms,
+              (unsigned long long)sync.num_syncs);
     }
     else {
       fprintf(client, "ERROR unknown command\n");
@@ -225,8 +240,45 @@ static void *handle_client(void *arg) {
   return NULL;
 }
 
+static void usage(const char *prog) {
+  fprintf(stderr,
+          "usage: %s [--sync always|periodic|none] [--sync-interval-ms N] [--sync-bytes N]\n",
+          prog);
+}
+
 /* ===== server main ===== */
-int main(void) {
+int main(int argc, char **argv) {
+  CaskyOptions opts;
+  casky_options_init(&opts);
+
+  static const struct option long_opts[] = {
+    { "sync",             required_argument, NULL, 's' },
+    { "sync-interval-ms", required_argument, NULL, 'i' },
+    { "sync-bytes",       required_argument, NULL, 'b' },
+    { "help",             no_argument,       NULL, 'h' },
+    { NULL, 0, NULL, 0 }
+  };
+  int c;
+  while ((c = getopt_long(argc, argv, "h", long_opts, NULL)) != -1) {
+    switch (c) {
+    case 's':
+      if (strcasecmp(optarg, "always") == 0) opts.sync_mode = CASKY_SYNC_ALWAYS;
+      else if (strcasecmp(optarg, "periodic") == 0) opts.sync_mode = CASKY_SYNC_PERIODIC;
+      else if (strcasecmp(optarg, "none") == 0) opts.sync_mode = CASKY_SYNC_NONE;
+      else { usage(argv[0]); return EXIT_FAILURE; }
+      break;
+    case 'i':
+      opts.sync_interval_ms = (uint32_t)strtoul(optarg, NULL, 10);
+      break;
+    case 'b':
+      opts.sync_bytes = strtoull(optarg, NULL, 10);
+      break;
+    default:
+      usage(argv[0]);
+      return c == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+  }
+
   set_log_level_from_env();
   log_msg(LOG_INFO, "caskyd starting (pid=%d)", getpid());
 
@@ -234,7 +286,7 @@ int main(void) {
   socklen_t addrlen = sizeof(addr);
 
   /* open DB */
-  KeyDir *db = casky_open("caskyd.db");
+  KeyDir *db = casky_open_with_options("caskyd.db", &opts);
   if (!db) {
     log_msg(LOG_ERROR, "failed to open database");
     return EXIT_FAILURE;
@@ -0,0 +1,222 @@
+#include <stdlib.h>
+#include <string.h>
+#ifdef CASKY_HAVE_LZ4
+#include <lz4.h>
+#endif
+#ifdef CASKY_HAVE_ZSTD
+#include <zstd.h>
+#endif
+#include "casky.h"
+#include "codec.h"
+
+/*
+ * Value compression. A compressed value is stored in the log as
+ *
+ *   [uncompressed length, 4 bytes][compressed bytes]
+ *
+ * with the codec in the flags of its record (see utils.h): the KeyDir only
+ * knows the stored length, and a reader learns the size of the value from
+ * the prefix. Each codec is only built in when its library is installed
+ * (CASKY_HAVE_LZ4, CASKY_HAVE_ZSTD, see the Makefile).
+ */
+
+#ifdef CASKY_HAVE_ZSTD
+/*
+ * zstd contexts are large: every thread keeps its own pair, created on
+ * first use and released when the thread exits.
+ */
+typedef struct {
+  ZSTD_CCtx *cctx;
+  ZSTD_DCtx *dctx;
+} casky_zstd_ctx;
+
+static CASKY_THREAD_LOCAL casky_zstd_ctx zstd_ctx;
+
+#ifdef THREAD_SAFE
+static pthread_key_t zstd_key;
+static pthread_once_t zstd_once = PTHREAD_ONCE_INIT;
+
+static void casky_zstd_release(void *arg) {
+  casky_zstd_ctx *c = arg;
+  ZSTD_freeCCtx(c->cctx);
+  ZSTD_freeDCtx(c->dctx);
+  c->cctx = NULL;
+  c->dctx = NULL;
+}
+
+static void casky_zstd_key_init(void) {
+  pthread_key_create(&zstd_key, casky_zstd_release);
+}
+#endif
+
+static casky_zstd_ctx *casky_zstd(void) {
+#ifdef THREAD_SAFE
+  if (!zstd_ctx.cctx && !zstd_ctx.dctx) {
+    pthread_once(&zstd_once, casky_zstd_key_init);
+    pthread_setspecific(zstd_key, &zstd_ctx);
+  }
+#endif
+  return &zstd_ctx;
+}
+#endif
+
+/**
+ * casky_codec_available - Tells whether this build can compress and
+ * decompress values with `codec`. CASKY_CODEC_NONE always is.
+ */
+int casky_codec_available(CaskyCodec codec) {
+  switch (codec) {
+    case CASKY_CODEC_NONE: return 1;
+#ifdef CASKY_HAVE_LZ4
+    case CASKY_CODEC_LZ4:  return 1;
+#endif
+#ifdef CASKY_HAVE_ZSTD
+    case CASKY_CODEC_ZSTD: return 1;
+#endif
+    default:               return 0;
+  }
+}
+
+const char *casky_codec_name(CaskyCodec codec) {
+  switch (codec) {
+    case CASKY_CODEC_NONE: return "none";
+    case CASKY_CODEC_LZ4:  return "lz4";
+    case CASKY_CODEC_ZSTD: return "zstd";
+    default:               return "unknown";
+  }
+}
+
+/**
+ * casky_codec_compress - Compresses a value into its stored form.
+ *
+ * @stored_len: receives the length of the stored form, prefix included
+ *
+ * Returns: the stored form (to be freed by the caller), or NULL if the
+ * value does not shrink, or cannot be compressed: it is then stored as it
+ * is.
+ */
+char *casky_codec_compress(CaskyCodec codec, const char *value, uint32_t value_len,
+                           uint32_t *stored_len) {
+  size_t bound;
+  switch (codec) {
+#ifdef CASKY_HAVE_LZ4
+    case CASKY_CODEC_LZ4:
+      if (value_len > LZ4_MAX_INPUT_SIZE) return NULL;
+      bound = LZ4_compressBound(value_len);
+      break;
+#endif
+#ifdef CASKY_HAVE_ZSTD
+    case CASKY_CODEC_ZSTD:
+      bound = ZSTD_compressBound(value_len);
+      break;
+#endif
+    default:
+      (void)value;
+      (void)stored_len;
+      return NULL;
+  }
+
+  char *out = malloc(CASKY_CODEC_PREFIX + bound);
+  if (!out) return NULL;
+  char *dst = out + CASKY_CODEC_PREFIX;
+  size_t n = 0;
+  switch (codec) {
+#ifdef CASKY_HAVE_LZ4
+    case CASKY_CODEC_LZ4: {
+      int ret = LZ4_compress_default(value, dst, (int)value_len, (int)bound);
+      n = ret > 0 ? (size_t)ret : 0;
+      break;
+    }
+#endif
+#ifdef CASKY_HAVE_ZSTD
+    case CASKY_CODEC_ZSTD: {
+      casky_zstd_ctx *c = casky_zstd();
+      if (!c->cctx) c->cctx = ZSTD_createCCtx();
+      size_t ret = c->cctx ? ZSTD_compressCCtx(c->cctx, dst, bound, value, value_len,
+                                               CASKY_ZSTD_LEVEL) : 0;
+      n = c->cctx && !ZSTD_isError(ret) ? ret : 0;
+      break;
+    }
+#endif
+    default:
+      (void)dst;
+      break;
+  }
+  if (n == 0 || CASKY_CODEC_PREFIX + n >= value_len) {
+    free(out);
+    return NULL;
+  }
+  memcpy(out, &value_len, CASKY_CODEC_PREFIX);
+  *stored_len = CASKY_CODEC_PREFIX + n;
+  return out;
+}
+
+/**
+ * casky_codec_raw_len - Reads the uncompressed length of a value from its
+ * stored form.
+ *
+ * Returns: 0 on success, -1 with casky_errno set to CASKY_ERR_CORRUPT.
+ */
+int casky_codec_raw_len(const char *stored, uint32_t stored_len, uint32_t *raw_len) {
+  if (stored_len < CASKY_CODEC_PREFIX) {
+    casky_errno = CASKY_ERR_CORRUPT;
+    return -1;
+  }
+  memcpy(raw_len, stored, CASKY_CODEC_PREFIX);
+  return 0;
+}
+
+/**
+ * casky_codec_decompress - Decompresses the stored form of a value into
+ * `dst`, which holds `raw_len` bytes, the length casky_codec_raw_len()
+ * read.
+ *
+ * Returns: 0 on success, -1 with casky_errno set: CASKY_ERR_NOT_SUPPORTED
+ * if this build lacks the codec, CASKY_ERR_CORRUPT if the value does not
+ * decompress to `raw_len` bytes.
+ */
+int casky_codec_decompress(CaskyCodec codec, const char *stored, uint32_t stored_len,
+                           char *dst, uint32_t raw_len) {
+  uint32_t len;
+  if (casky_codec_raw_len(stored, stored_len, &len) != 0)
+    return -1;
+  if (!casky_codec_available(codec) || codec == CASKY_CODEC_NONE) {
+    casky_errno = CASKY_ERR_NOT_SUPPORTED;
+    return -1;
+  }
+  const char *src = stored + CASKY_CODEC_PREFIX;
+  size_t src_len = stored_len - CASKY_CODEC_PREFIX;
+  int ok = 0;
+  switch (codec) {
+#ifdef CASKY_HAVE_LZ4
+    case CASKY_CODEC_LZ4:
+      ok = len == raw_len && src_len <= INT32_MAX && raw_len <= INT32_MAX &&
+           LZ4_decompress_safe(src, dst, (int)src_len, (int)raw_len) == (int)raw_len;
+      break;
+#endif
+#ifdef CASKY_HAVE_ZSTD
+    case CASKY_CODEC_ZSTD: {
+      casky_zstd_ctx *c = casky_zstd();
+      if (!c->dctx) c->dctx = ZSTD_createDCtx();
+      if (!c->dctx) {
+        casky_errno = CASKY_ERR_MEMORY;
+        return -1;
+      }
+      ok = len == raw_len &&
+           ZSTD_decompressDCtx(c->dctx, dst, raw_len, src, src_len) == raw_len;
+      break;
+    }
+#endif
+    default:
+      (void)src;
+      (void)src_len;
+      (void)dst;
+      (void)raw_len;
+      break;
+  }
+  if (!ok) {
+    casky_errno = CASKY_ERR_CORRUPT;
+    return -1;
+  }
+  return 0;
+}
@@ -0,0 +1,21 @@
+#ifndef __CODEC_H
+#define __CODEC_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "casky.h"
+
+// A compressed value starts with its uncompressed length
+#define CASKY_CODEC_PREFIX 4
+// zstd level of the compressed values: the fastest, writes pay for it
+#define CASKY_ZSTD_LEVEL   1
+
+int         casky_codec_available(CaskyCodec codec);
+const char *casky_codec_name(CaskyCodec codec);
+char       *casky_codec_compress(CaskyCodec codec, const char *value, uint32_t value_len,
+                                 uint32_t *stored_len);
+int         casky_codec_raw_len(const char *stored, uint32_t stored_len, uint32_t *raw_len);
+int         casky_codec_decompress(CaskyCodec codec, const char *stored, uint32_t stored_len,
+                                   char *dst, uint32_t raw_len);
+
+#endif // !__CODEC_H
@@ -1,19 +1,17 @@
 #include <stdint.h>
 #include <stddef.h>
+#include <string.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
 #include "crc.h"
 
-static uint32_t crc32_table[256];
-static int crc32_table_initialized = 0;
+#define CRC32_POLY  0xEDB88320  // IEEE 802.3, reflected
+#define CRC32C_POLY 0x82F63B78  // Castagnoli, reflected
 
-static void init_crc32_table(void) {
-  for (uint32_t i = 0; i < 256; i++) {
-    uint32_t c = i;
-    for (int j = 0; j < 8; j++)
-      c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : (c >> 1);
-    crc32_table[i] = c;
-  }
-  crc32_table_initialized = 1;
-}
+static uint32_t crc32_table[256];
+static uint32_t crc32c_table[8][256];  // slicing-by-8
+static uint32_t (*crc32c_update_fn)(uint32_t crc, const unsigned char *buf, size_t len);
 
 /**
  * casky_crc32
@@ -30,13 +28,223 @@ static void init_crc32_table(void) {
  * Notes:
  *  - Uses a precomputed CRC32 table for performance
  *  - Can be called repeatedly on different buffers or combined with streaming
+ *  - Records are checksummed with casky_crc32c(); this is the checksum of
+ *    the records of older releases, still accepted on replay
  */
 uint32_t casky_crc32(const unsigned char *buf, size_t len) {
-  if (!crc32_table_initialized)
-    init_crc32_table();
+  return casky_crc32_update(0, buf, len);
+}
 
-  uint32_t crc = 0xFFFFFFFF;
+/**
+ * casky_crc32_update - Extends the CRC32 of some bytes with the next ones.
+ *
+ * Starting from 0, casky_crc32_update(casky_crc32_update(0, a, n), b, m)
+ * equals the casky_crc32() of a followed by b: a record can be checksummed
+ * piece by piece without being copied into one buffer.
+ */
+uint32_t casky_crc32_update(uint32_t crc, const unsigned char *buf, size_t len) {
+  crc ^= 0xFFFFFFFF;
   for (size_t i = 0; i < len; i++)
     crc = crc32_table[(crc ^ buf[i]) & 0xFF] ^ (crc >> 8);
   return crc ^ 0xFFFFFFFF;
 }
+
+// Table-driven CRC32C, eight bytes per step
+static uint32_t crc32c_update_sw(uint32_t crc, const unsigned char *buf, size_t len) {
+  crc ^= 0xFFFFFFFF;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  while (len >= 8) {
+    uint32_t lo, hi;
+    memcpy(&lo, buf, 4);
+    memcpy(&hi, buf + 4, 4);
+    lo ^= crc;
+    crc = crc32c_table[7][lo & 0xFF] ^ crc32c_table[6][(lo >> 8) & 0xFF] ^
+          crc32c_table[5][(lo >> 16) & 0xFF] ^ crc32c_table[4][lo >> 24] ^
+          crc32c_table[3][hi & 0xFF] ^ crc32c_table[2][(hi >> 8) & 0xFF] ^
+          crc32c_table[1][(hi >> 16) & 0xFF] ^ crc32c_table[0][hi >> 24];
+    buf += 8;
+    len -= 8;
+  }
+#endif
+  while (len--)
+    crc = crc32c_table[0][(crc ^ *buf++) & 0xFF] ^ (crc >> 8);
+  return crc ^ 0xFFFFFFFF;
+}
+
+#if defined(__x86_64__)
+/*
+ * SSE4.2 crc32 instruction: one per cycle, but with a latency of three.
+ * Long buffers are split in three streams checksummed side by side, whose
+ * CRCs are then combined: the CRC of a stream is moved past the bytes of
+ * the next ones by appending as many zeros, which is linear and tabulated
+ * below for the two block sizes used (see Mark Adler's crc32c.c).
+ */
+#define CRC32C_LONG  8192
+#define CRC32C_SHORT 256
+
+static uint32_t crc32c_long[4][256];
+static uint32_t crc32c_short[4][256];
+
+static uint32_t gf2_matrix_times(const uint32_t *mat, uint32_t vec) {
+  uint32_t sum = 0;
+  while (vec) {
+    if (vec & 1) sum ^= *mat;
+    vec >>= 1;
+    mat++;
+  }
+  return sum;
+}
+
+static void gf2_matrix_square(uint32_t *square, const uint32_t *mat) {
+  for (int n = 0; n < 32; n++)
+    square[n] = gf2_matrix_times(mat, mat[n]);
+}
+
+// Operator appending `len` zero bytes to a CRC (`len` a power of two)
+static void crc32c_zeros_op(uint32_t *even, size_t len) {
+  uint32_t odd[32], row = 1;
+  odd[0] = CRC32C_POLY;  // one zero bit
+  for (int n = 1; n < 32; n++) {
+    odd[n] = row;
+    row <<= 1;
+  }
+  gf2_matrix_square(even, odd);  // two zero bits
+  gf2_matrix_square(odd, even);  // four zero bits
+  // Each square doubles the zeros: the first one gives a zero byte
+  do {
+    gf2_matrix_square(even, odd);
+    len >>= 1;
+    if (len == 0)
+      return;
+    gf2_matrix_square(odd, even);
+    len >>= 1;
+  } while (len);
+  memcpy(even, odd, sizeof(odd));
+}
+
+static void crc32c_zeros(uint32_t zeros[4][256], size_t len) {
+  uint32_t op[32];
+  crc32c_zeros_op(op, len);
+  for (uint32_t n = 0; n < 256; n++) {
+    zeros[0][n] = gf2_matrix_times(op, n);
+    zeros[1][n] = gf2_matrix_times(op, n << 8);
+    zeros[2][n] = gf2_matrix_times(op, n << 16);
+    zeros[3][n] = gf2_matrix_times(op, n << 24);
+  }
+}
+
+static inline uint32_t crc32c_shift(uint32_t zeros[4][256], uint32_t crc) {
+  return zeros[0][crc & 0xFF] ^ zeros[1][(crc >> 8) & 0xFF] ^
+         zeros[2][(crc >> 16) & 0xFF] ^ zeros[3][crc >> 24];
+}
+
+static inline uint64_t load64(const unsigned char *p) {
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_update_hw(uint32_t crc, const unsigned char *buf, size_t len) {
+  uint64_t crc0 = crc ^ 0xFFFFFFFF, crc1, crc2;
+
+  // Up to seven bytes, to reach an 8-byte boundary
+  while (len && ((uintptr_t)buf & 7) != 0) {
+    crc0 = _mm_crc32_u8(crc0, *buf++);
+    len--;
+  }
+  while (len >= CRC32C_LONG * 3) {
+    crc1 = crc2 = 0;
+    const unsigned char *end = buf + CRC32C_LONG;
+    do {
+      crc0 = _mm_crc32_u64(crc0, load64(buf));
+      crc1 = _mm_crc32_u64(crc1, load64(buf + CRC32C_LONG));
+      crc2 = _mm_crc32_u64(crc2, load64(buf + CRC32C_LONG * 2));
+      buf += 8;
+    } while (buf < end);
+    crc0 = crc32c_shift(crc32c_long, crc0) ^ crc1;
+    crc0 = crc32c_shift(crc32c_long, crc0) ^ crc2;
+    buf += CRC32C_LONG * 2;
+    len -= CRC32C_LONG * 3;
+  }
+  while (len >= CRC32C_SHORT * 3) {
+    crc1 = crc2 = 0;
+    const unsigned char *end = buf + CRC32C_SHORT;
+    do {
+      crc0 = _mm_crc32_u64(crc0, load64(buf));
+      crc1 = _mm_crc32_u64(crc1, load64(buf + CRC32C_SHORT));
+      crc2 = _mm_crc32_u64(crc2, load64(buf + CRC32C_SHORT * 2));
+      buf += 8;
+    } while (buf < end);
+    crc0 = crc32c_shift(crc32c_short, crc0) ^ crc1;
+    crc0 = crc32c_shift(crc32c_short, crc0) ^ crc2;
+    buf += CRC32C_SHORT * 2;
+    len -= CRC32C_SHORT * 3;
+  }
+  for (; len >= 8; buf += 8, len -= 8)
+    crc0 = _mm_crc32_u64(crc0, load64(buf));
+  while (len--)
+    crc0 = _mm_crc32_u8(crc0, *buf++);
+  return (uint32_t)crc0 ^ 0xFFFFFFFF;
+}
+#endif
+
+// Tables and implementation are set up before main(), so that no thread
+// ever sees them half-built
+__attribute__((constructor))
+static void casky_crc_init(void) {
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t c = i, d = i;
+    for (int j = 0; j < 8; j++) {
+      c = (c & 1) ? CRC32_POLY ^ (c >> 1) : (c >> 1);
+      d = (d & 1) ? CRC32C_POLY ^ (d >> 1) : (d >> 1);
+    }
+    crc32_table[i] = c;
+    crc32c_table[0][i] = d;
+  }
+  for (uint32_t i = 0; i < 256; i++)
+    for (int k = 1; k < 8; k++)
+      crc32c_table[k][i] = (crc32c_table[k - 1][i] >> 8) ^
+                           crc32c_table[0][crc32c_table[k - 1][i] & 0xFF];
+
+  crc32c_update_fn = crc32c_update_sw;
+#if defined(__x86_64__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse4.2")) {
+    crc32c_zeros(crc32c_long, CRC32C_LONG);
+    crc32c_zeros(crc32c_short, CRC32C_SHORT);
+    crc32c_update_fn = crc32c_update_hw;
+  }
+#endif
+}
+
+/**
+ * casky_crc32c - CRC32C (Castagnoli) of a buffer, the checksum of the log
+ * records.
+ *
+ * Uses the SSE4.2 crc32 instruction when the CPU has it, selected at
+ * startup, and a slicing-by-8 table otherwise; both give the same result.
+ */
+uint32_t casky_crc32c(const unsigned char *buf, size_t len) {
+  return crc32c_update_fn(0, buf, len);
+}
+
+/**
+ * casky_crc32c_update - Extends the CRC32C of some bytes with the next
+ * ones, as casky_crc32_update() does for CRC32.
+ */
+uint32_t casky_crc32c_update(uint32_t crc, const unsigned char *buf, size_t len) {
+  return crc32c_update_fn(crc, buf, len);
+}
+
+/**
+ * casky_crc32c_impl - Name of the CRC32C implementation in use, for
+ * benchmarks and diagnostics.
+ */
+const char *casky_crc32c_impl(void) {
+#if defined(__x86_64__)
+  if (crc32c_update_fn == crc32c_update_hw)
+    return "sse4.2";
+#endif
+  return "slicing-by-8";
+}
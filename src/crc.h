@@ -2,5 +2,9 @@
 #define __CRC_H
 
 uint32_t casky_crc32(const unsigned char *buf, size_t len);
+uint32_t casky_crc32_update(uint32_t crc, const unsigned char *buf, size_t len);
+uint32_t casky_crc32c(const unsigned char *buf, size_t len);
+uint32_t casky_crc32c_update(uint32_t crc, const unsigned char *buf, size_t len);
+const char *casky_crc32c_impl(void);
 
 #endif // !__CRC_H
@@ -0,0 +1,597 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "casky.h"
+#include "utils.h"
+#include "diskindex.h"
+
+#ifdef THREAD_SAFE
+#define DISK_RDLOCK(d) pthread_rwlock_rdlock(&(d)->lock)
+#define DISK_WRLOCK(d) pthread_rwlock_wrlock(&(d)->lock)
+#define DISK_UNLOCK(d) pthread_rwlock_unlock(&(d)->lock)
+#else
+#define DISK_RDLOCK(d)
+#define DISK_WRLOCK(d)
+#define DISK_UNLOCK(d)
+#endif
+
+// Pages of a newly created index file: header, directory, first bucket
+#define CASKY_DISK_INITIAL_PAGES 4
+
+/*
+ * Every pointer into the mapping is re-derived after a page allocation,
+ * which may grow the file and move the mapping.
+ */
+static inline CaskyDiskHeader *casky_disk_hdr(const CaskyDiskIndex *d) {
+  return (CaskyDiskHeader *)d->map;
+}
+
+static inline CaskyDiskPage *casky_disk_page(const CaskyDiskIndex *d, uint32_t n) {
+  return (CaskyDiskPage *)(d->map + (size_t)n * CASKY_DISK_PAGE_SIZE);
+}
+
+static inline uint32_t *casky_disk_dir(const CaskyDiskIndex *d) {
+  return (uint32_t *)(d->map + (size_t)casky_disk_hdr(d)->dir_page * CASKY_DISK_PAGE_SIZE);
+}
+
+static inline uint32_t casky_disk_page_of(const CaskyDiskIndex *d, uint64_t hash) {
+  uint64_t mask = (1ULL << casky_disk_hdr(d)->global_depth) - 1;
+  return casky_disk_dir(d)[hash & mask];
+}
+
+// A value follows its record header, so no used slot has offset 0
+static inline int casky_disk_slot_used(const CaskyDiskSlot *s) {
+  return s->value_offset != 0;
+}
+
+// First slot probed for a hash: bits not used by the directory
+static inline size_t casky_disk_home(uint64_t hash) {
+  return (hash >> 32) % CASKY_DISK_PAGE_SLOTS;
+}
+
+/**
+ * casky_disk_header - Returns the header of the index, e.g. to learn after
+ * casky_disk_open() which part of the log still has to be replayed.
+ */
+CaskyDiskHeader *casky_disk_header(const CaskyDiskIndex *d) {
+  return casky_disk_hdr(d);
+}
+
+// Maps the first `size` bytes of the file, replacing the previous mapping
+static int casky_disk_map(CaskyDiskIndex *d, size_t size) {
+  char *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, d->fd, 0);
+  if (map == MAP_FAILED)
+    return -1;
+  if (d->map)
+    munmap(d->map, d->map_size);
+  d->map = map;
+  d->map_size = size;
+  return 0;
+}
+
+/**
+ * Appends `n` zeroed pages to the index, doubling the file when it is full.
+ *
+ * Returns: the number of the first page, or 0 on failure.
+ */
+static uint32_t casky_disk_alloc_pages(CaskyDiskIndex *d, uint32_t n) {
+  uint32_t first = casky_disk_hdr(d)->num_pages;
+  if ((uint64_t)first + n > UINT32_MAX)
+    return 0;
+  size_t need = ((size_t)first + n) * CASKY_DISK_PAGE_SIZE;
+  if (need > d->map_size) {
+    size_t size = d->map_size * 2;
+    while (size < need) size *= 2;
+    if (ftruncate(d->fd, size) != 0 || casky_disk_map(d, size) != 0)
+      return 0;
+  }
+  casky_disk_hdr(d)->num_pages = first + n;
+  memset(casky_disk_page(d, first), 0, (size_t)n * CASKY_DISK_PAGE_SIZE);
+  return first;
+}
+
+// Lays out an empty index over the (truncated) file
+static int casky_disk_format(CaskyDiskIndex *d, uint64_t hash_seed) {
+  size_t size = CASKY_DISK_INITIAL_PAGES * CASKY_DISK_PAGE_SIZE;
+  if (ftruncate(d->fd, 0) != 0 || ftruncate(d->fd, size) != 0 ||
+      casky_disk_map(d, size) != 0)
+    return -1;
+  CaskyDiskHeader *h = casky_disk_hdr(d);
+  memcpy(h->magic, CASKY_DISK_MAGIC, sizeof(h->magic));
+  h->page_size = CASKY_DISK_PAGE_SIZE;
+  h->hash_seed = hash_seed;
+  h->num_pages = 3;
+  h->global_depth = 0;
+  h->dir_page = 1;
+  h->dir_pages = 1;
+  casky_disk_dir(d)[0] = 2;
+  d->fresh = 1;
+  return 0;
+}
+
+/**
+ * casky_disk_open - Maps the index file at `path`, creating it if needed.
+ *
+ * An existing index is reused only if it was closed cleanly and still
+ * describes the log (same inode, not longer than the log): the caller then
+ * replays the log from the header's log_size on. Otherwise the file is
+ * reset to an empty index using `hash_seed`, d->fresh is set, and the whole
+ * log has to be replayed.
+ *
+ * Returns: the index, or NULL on error.
+ */
+CaskyDiskIndex *casky_disk_open(const char *path, uint64_t hash_seed,
+                                uint64_t log_size, uint64_t log_ino) {
+  CaskyDiskIndex *d = calloc(1, sizeof(CaskyDiskIndex));
+  if (!d) return NULL;
+  d->fd = open(path, O_RDWR | O_CREAT, 0644);
+  if (d->fd < 0) {
+    free(d);
+    return NULL;
+  }
+
+  struct stat st;
+  int valid = fstat(d->fd, &st) == 0 &&
+              st.st_size >= CASKY_DISK_INITIAL_PAGES * CASKY_DISK_PAGE_SIZE &&
+              st.st_size % CASKY_DISK_PAGE_SIZE == 0 &&
+              casky_disk_map(d, st.st_size) == 0;
+  if (valid) {
+    CaskyDiskHeader *h = casky_disk_hdr(d);
+    valid = memcmp(h->magic, CASKY_DISK_MAGIC, sizeof(h->magic)) == 0 &&
+            h->page_size == CASKY_DISK_PAGE_SIZE && h->clean &&
+            h->log_ino == log_ino && h->log_size <= log_size &&
+            (size_t)h->num_pages * CASKY_DISK_PAGE_SIZE <= d->map_size;
+  }
+  if (!valid && casky_disk_format(d, hash_seed) != 0) {
+    casky_disk_close(d);
+    return NULL;
+  }
+
+  // Dirty until the next checkpoint
+  casky_disk_hdr(d)->clean = 0;
+  msync(d->map, CASKY_DISK_PAGE_SIZE, MS_SYNC);
+#ifdef THREAD_SAFE
+  pthread_rwlock_init(&d->lock, NULL);
+#endif
+  return d;
+}
+
+/**
+ * casky_disk_checkpoint - Flushes the index to disk and marks it clean, as
+ * covering the first `log_size` bytes of the log `log_ino`, whose
+ * generation is `file_id`.
+ *
+ * Not thread-safe: called on close, once no other thread uses the KeyDir.
+ */
+void casky_disk_checkpoint(CaskyDiskIndex *d, uint64_t log_size, uint64_t log_ino,
+                           uint32_t file_id) {
+  CaskyDiskHeader *h = casky_disk_hdr(d);
+  h->log_size = log_size;
+  h->log_ino = log_ino;
+  h->file_id = file_id;
+  if (msync(d->map, d->map_size, MS_SYNC) != 0)
+    return;
+  h->clean = 1;
+  msync(d->map, CASKY_DISK_PAGE_SIZE, MS_SYNC);
+}
+
+/**
+ * casky_disk_close - Unmaps the index. Unless casky_disk_checkpoint() was
+ * called first, the next casky_disk_open() will reset it.
+ */
+void casky_disk_close(CaskyDiskIndex *d) {
+  if (!d) return;
+  if (d->map) munmap(d->map, d->map_size);
+  close(d->fd);
+#ifdef THREAD_SAFE
+  pthread_rwlock_destroy(&d->lock);
+#endif
+  free(d);
+}
+
+/**
+ * Compares the key of a slot, read back from the log, with `key`.
+ *
+ * Returns: 1 if equal, 0 if not, -1 on read error (casky_errno set).
+ */
+static int casky_disk_key_eq(KeyDir *kd, const CaskyDiskSlot *s,
+                             const char *key, size_t key_len) {
+  if (key_len == 0) return 1;
+  int fd = casky_kd_read_fd(kd, s->file_id);
+  if (fd < 0) {
+    casky_errno = CASKY_ERR_IO;
+    return -1;
+  }
+  char stack_buf[256];
+  char *buf = key_len <= sizeof(stack_buf) ? stack_buf : malloc(key_len);
+  if (!buf) {
+    casky_errno = CASKY_ERR_MEMORY;
+    return -1;
+  }
+  // The key sits right before the value in the record
+  Entry e = { .value_len = key_len, .value_offset = s->value_offset - key_len };
+  int ret = casky_copy_value(fd, &e, buf);
+  if (ret == 0)
+    ret = memcmp(buf, key, key_len) == 0;
+  if (buf != stack_buf) free(buf);
+  return ret;
+}
+
+/**
+ * Looks a key up in its page.
+ *
+ * Returns: the slot, or NULL if the key is not there or on read error
+ * (then *err is set to -1).
+ */
+static CaskyDiskSlot *casky_disk_lookup(KeyDir *kd, CaskyDiskPage *p, const char *key,
+                                        size_t key_len, uint64_t hash, int *err) {
+  size_t i = casky_disk_home(hash);
+  for (size_t n = 0; n < CASKY_DISK_PAGE_SLOTS; n++) {
+    CaskyDiskSlot *s = &p->slots[i];
+    if (!casky_disk_slot_used(s))
+      return NULL;
+    if (s->hash == hash && s->key_len == key_len) {
+      int eq = casky_disk_key_eq(kd, s, key, key_len);
+      if (eq < 0) {
+        *err = -1;
+        return NULL;
+      }
+      if (eq) return s;
+    }
+    i = (i + 1) % CASKY_DISK_PAGE_SLOTS;
+  }
+  return NULL;
+}
+
+// Stores a slot in the first free position of its probe sequence
+static void casky_disk_insert_slot(CaskyDiskPage *p, const CaskyDiskSlot *slot) {
+  size_t i = casky_disk_home(slot->hash);
+  while (casky_disk_slot_used(&p->slots[i]))
+    i = (i + 1) % CASKY_DISK_PAGE_SLOTS;
+  p->slots[i] = *slot;
+  p->count++;
+}
+
+// Frees slot i, shifting back the slots of the probe sequence behind it so
+// that no lookup stops early on the hole
+static void casky_disk_erase_slot(CaskyDiskPage *p, size_t i) {
+  size_t j = i;
+  for (;;) {
+    j = (j + 1) % CASKY_DISK_PAGE_SLOTS;
+    if (!casky_disk_slot_used(&p->slots[j]))
+      break;
+    size_t k = casky_disk_home(p->slots[j].hash);
+    // Slot j stays if its home lies cyclically in (i, j]
+    if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+      continue;
+    p->slots[i] = p->slots[j];
+    i = j;
+  }
+  memset(&p->slots[i], 0, sizeof(CaskyDiskSlot));
+  p->count--;
+}
+
+// Doubles the directory, moving it to a bigger run of pages if needed
+static int casky_disk_grow_dir(CaskyDiskIndex *d) {
+  CaskyDiskHeader *h = casky_disk_hdr(d);
+  if (h->global_depth >= 32)
+    return -1;
+  size_t entries = (size_t)1 << h->global_depth;
+  if (2 * entries * sizeof(uint32_t) > (size_t)h->dir_pages * CASKY_DISK_PAGE_SIZE) {
+    uint32_t pages = h->dir_pages * 2;
+    uint32_t first = casky_disk_alloc_pages(d, pages);
+    if (!first) return -1;
+    h = casky_disk_hdr(d);
+    // The previous run is left unused: at most as big as the new one
+    memcpy(casky_disk_page(d, first), casky_disk_dir(d), entries * sizeof(uint32_t));
+    h->dir_page = first;
+    h->dir_pages = pages;
+  }
+  uint32_t *dir = casky_disk_dir(d);
+  memcpy(dir + entries, dir, entries * sizeof(uint32_t));
+  h->global_depth++;
+  return 0;
+}
+
+// Splits a full page on one more hash bit
+static int casky_disk_split(CaskyDiskIndex *d, uint32_t pn) {
+  uint32_t depth = casky_disk_page(d, pn)->depth;
+  if (depth >= 32)
+    return -1;
+  if (depth == casky_disk_hdr(d)->global_depth && casky_disk_grow_dir(d) != 0)
+    return -1;
+  uint32_t qn = casky_disk_alloc_pages(d, 1);
+  if (!qn) return -1;
+
+  CaskyDiskPage *p = casky_disk_page(d, pn), *q = casky_disk_page(d, qn);
+  CaskyDiskSlot moved[CASKY_DISK_PAGE_SLOTS];
+  size_t n = 0;
+  for (size_t i = 0; i < CASKY_DISK_PAGE_SLOTS; i++)
+    if (casky_disk_slot_used(&p->slots[i]))
+      moved[n++] = p->slots[i];
+  memset(p->slots, 0, sizeof(p->slots));
+  p->count = 0;
+  p->depth = q->depth = depth + 1;
+  for (size_t i = 0; i < n; i++)
+    casky_disk_insert_slot((moved[i].hash >> depth) & 1 ? q : p, &moved[i]);
+
+  // Directory entries sharing the page's low `depth` bits and with bit
+  // `depth` set now lead to the new page
+  uint32_t *dir = casky_disk_dir(d);
+  size_t prefix = n > 0 ? moved[0].hash & ((1ULL << depth) - 1) : 0;
+  size_t entries = (size_t)1 << casky_disk_hdr(d)->global_depth;
+  for (size_t i = prefix | ((size_t)1 << depth); i < entries; i += (size_t)2 << depth)
+    dir[i] = qn;
+  return 0;
+}
+
+/**
+ * casky_disk_read - casky_kd_read() on a KeyDir with an on-disk index.
+ *
+ * `fn` gets an Entry whose key is the caller's key and runs under the read
+ * lock of the index.
+ */
+int casky_disk_read(KeyDir *kd, const char *key, size_t key_len, uint64_t hash,
+                    uint64_t now, casky_entry_fn fn, void *ctx) {
+  CaskyDiskIndex *d = kd->disk;
+  int err = 0, ret = -1;
+
+  DISK_RDLOCK(d);
+  CaskyDiskSlot *s = casky_disk_lookup(kd, casky_disk_page(d, casky_disk_page_of(d, hash)),
+                                       key, key_len, hash, &err);
+  if (!s || (s->expiration_ts > 0 && s->expiration_ts <= now)) {
+    if (!err) casky_errno = CASKY_ERR_KEY_NOT_FOUND;
+    DISK_UNLOCK(d);
+    return -1;
+  }
+  Entry e = {
+    .key = (char *)key,
+    .file_id = s->file_id,
+    .key_len = s->key_len,
+    .value_len = s->value_len,
+    .codec = s->codec,
+    .value_offset = s->value_offset,
+    .timestamp = s->timestamp,
+    .expiration_ts = s->expiration_ts,
+  };
+  int fd = casky_kd_read_fd(kd, e.file_id);
+  if (fd < 0)
+    casky_errno = CASKY_ERR_IO;
+  else
+    ret = fn(&e, fd, ctx);
+  DISK_UNLOCK(d);
+
+  if (ret != 0)
+    return -1;
+  casky_errno = CASKY_OK;
+  casky_stats_inc_get();
+  return 0;
+}
+
+/**
+ * casky_disk_contains - Tells whether a key is in the index and not
+ * expired at `now`, or expired or not if `now` is 0.
+ *
+ * Returns: 1 if present, 0 if not, -1 on read error (casky_errno set).
+ */
+int casky_disk_contains(KeyDir *kd, const char *key, size_t key_len, uint64_t hash,
+                        uint64_t now) {
+  CaskyDiskIndex *d = kd->disk;
+  int err = 0;
+  DISK_RDLOCK(d);
+  CaskyDiskSlot *s = casky_disk_lookup(kd, casky_disk_page(d, casky_disk_page_of(d, hash)),
+                                       key, key_len, hash, &err);
+  int found = s && (now == 0 || s->expiration_ts == 0 || s->expiration_ts > now);
+  DISK_UNLOCK(d);
+  return err ? -1 : found;
+}
+
+/**
+ * casky_disk_put - Inserts or updates the location of a key.
+ *
+ * Returns: 1 if the key is new, 0 if it was updated, -1 on error
+ * (casky_errno set).
+ */
+int casky_disk_put(KeyDir *kd, const char *key, uint32_t key_len, uint64_t hash,
+                   uint32_t value_len, uint32_t file_id, uint64_t value_offset,
+                   CaskyCodec codec, uint64_t timestamp, uint64_t expires) {
+  CaskyDiskIndex *d = kd->disk;
+  CaskyDiskSlot slot = {
+    .hash = hash,
+    .value_offset = value_offset,
+    .timestamp = timestamp,
+    .expiration_ts = expires,
+    .file_id = file_id,
+    .key_len = key_len,
+    .value_len = value_len,
+    .codec = codec,
+  };
+
+  DISK_WRLOCK(d);
+  for (;;) {
+    uint32_t pn = casky_disk_page_of(d, hash);
+    CaskyDiskPage *p = casky_disk_page(d, pn);
+    int err = 0;
+    CaskyDiskSlot *s = casky_disk_lookup(kd, p, key, key_len, hash, &err);
+    if (err) {
+      DISK_UNLOCK(d);
+      return -1;
+    }
+    if (s) {
+      *s = slot;
+      DISK_UNLOCK(d);
+      return 0;
+    }
+    if (p->count < CASKY_DISK_PAGE_FILL) {
+      casky_disk_insert_slot(p, &slot);
+      casky_disk_hdr(d)->num_entries++;
+      DISK_UNLOCK(d);
+      return 1;
+    }
+    if (casky_disk_split(d, pn) != 0) {
+      DISK_UNLOCK(d);
+      casky_errno = CASKY_ERR_IO;
+      return -1;
+    }
+  }
+}
+
+/**
+ * casky_disk_delete - Removes a key from the index.
+ *
+ * Returns: 1 if the key was found and removed, 0 otherwise.
+ */
+int casky_disk_delete(KeyDir *kd, const char *key, uint32_t key_len, uint64_t hash) {
+  CaskyDiskIndex *d = kd->disk;
+  int err = 0;
+  DISK_WRLOCK(d);
+  CaskyDiskPage *p = casky_disk_page(d, casky_disk_page_of(d, hash));
+  CaskyDiskSlot *s = casky_disk_lookup(kd, p, key, key_len, hash, &err);
+  if (s) {
+    casky_disk_erase_slot(p, s - p->slots);
+    casky_disk_hdr(d)->num_entries--;
+  }
+  DISK_UNLOCK(d);
+  return s != NULL;
+}
+
+/**
+ * casky_disk_touch - Sets the expiration time of a key not expired at
+ * `now`, keeping its location.
+ *
+ * Returns: 1 if the key was found and updated, 0 if not, -1 on read error
+ * (casky_errno set).
+ */
+int casky_disk_touch(KeyDir *kd, const char *key, uint32_t key_len, uint64_t hash,
+                     uint64_t now, uint64_t expires) {
+  CaskyDiskIndex *d = kd->disk;
+  int err = 0;
+  DISK_WRLOCK(d);
+  CaskyDiskSlot *s = casky_disk_lookup(kd, casky_disk_page(d, casky_disk_page_of(d, hash)),
+                                       key, key_len, hash, &err);
+  int found = s && (s->expiration_ts == 0 || s->expiration_ts > now);
+  if (found)
+    s->expiration_ts = expires;
+  DISK_UNLOCK(d);
+  return err ? -1 : found;
+}
+
+/*
+ * Walks visit every page once, in directory order: page p is visited at
+ * its lowest directory index, the only one below 2^p->depth.
+ */
+#define CASKY_DISK_FOREACH_PAGE(d, p)                                        \
+  for (size_t _i = 0; _i < ((size_t)1 << casky_disk_hdr(d)->global_depth); _i++) \
+    if (((p) = casky_disk_page((d), casky_disk_dir(d)[_i])),                 \
+        _i < ((size_t)1 << (p)->depth))
+
+/**
+ * casky_disk_foreach - Calls `fn` on every key of the index, until it
+ * returns non-zero. Keys are read back from the log; the order is stable as
+ * long as the index does not change, see casky_disk_relocate().
+ *
+ * Runs under the read lock of the index.
+ *
+ * Returns: 0 on success, -1 if a key could not be read (casky_errno set).
+ */
+int casky_disk_foreach(KeyDir *kd, casky_disk_fn fn, void *ctx) {
+  CaskyDiskIndex *d = kd->disk;
+  CaskyDiskPage *p;
+  char *key = NULL;
+  size_t cap = 0;
+  int ret = 0;
+
+  DISK_RDLOCK(d);
+  CASKY_DISK_FOREACH_PAGE(d, p) {
+    for (size_t j = 0; j < CASKY_DISK_PAGE_SLOTS; j++) {
+      const CaskyDiskSlot *s = &p->slots[j];
+      if (!casky_disk_slot_used(s)) continue;
+      if (s->key_len + 1 > cap) {
+        char *buf = realloc(key, s->key_len + 1);
+        if (!buf) {
+          casky_errno = CASKY_ERR_MEMORY;
+          ret = -1;
+          goto out;
+        }
+        key = buf;
+        cap = s->key_len + 1;
+      }
+      int fd = casky_kd_read_fd(kd, s->file_id);
+      Entry k = { .value_len = s->key_len, .value_offset = s->value_offset - s->key_len };
+      if (fd < 0 || casky_copy_value(fd, &k, key) != 0) {
+        casky_errno = CASKY_ERR_IO;
+        ret = -1;
+        goto out;
+      }
+      key[s->key_len] = '\0';
+      Entry e = {
+        .key = key,
+        .file_id = s->file_id,
+        .key_len = s->key_len,
+        .value_len = s->value_len,
+        .codec = s->codec,
+        .value_offset = s->value_offset,
+        .timestamp = s->timestamp,
+        .expiration_ts = s->expiration_ts,
+      };
+      if (fn(&e, ctx))
+        goto out;
+    }
+  }
+out:
+  DISK_UNLOCK(d);
+  free(key);
+  return ret;
+}
+
+/**
+ * casky_disk_relocate - Points every slot to the log written by a
+ * casky_disk_foreach() that copied each record back to back from offset 0,
+ * as generation `file_id`. The index must not have changed in between.
+ */
+void casky_disk_relocate(KeyDir *kd, uint32_t file_id) {
+  CaskyDiskIndex *d = kd->disk;
+  CaskyDiskPage *p;
+  uint64_t pos = 0;
+
+  DISK_WRLOCK(d);
+  CASKY_DISK_FOREACH_PAGE(d, p) {
+    for (size_t j = 0; j < CASKY_DISK_PAGE_SLOTS; j++) {
+      CaskyDiskSlot *s = &p->slots[j];
+      if (!casky_disk_slot_used(s)) continue;
+      s->file_id = file_id;
+      s->value_offset = pos + CASKY_RECORD_HEADER_SIZE + s->key_len;
+      pos = s->value_offset + s->value_len;
+    }
+  }
+  DISK_UNLOCK(d);
+}
+
+/**
+ * casky_disk_expire - Removes the keys expired at `now`.
+ *
+ * Returns: the number of keys removed.
+ */
+size_t casky_disk_expire(KeyDir *kd, uint64_t now) {
+  CaskyDiskIndex *d = kd->disk;
+  CaskyDiskPage *p;
+  size_t removed = 0;
+
+  DISK_WRLOCK(d);
+  CASKY_DISK_FOREACH_PAGE(d, p) {
+    for (size_t j = 0; j < CASKY_DISK_PAGE_SLOTS; j++) {
+      // Erasing shifts the next slot of the probe sequence into j
+      while (casky_disk_slot_used(&p->slots[j]) && p->slots[j].expiration_ts > 0 &&
+             p->slots[j].expiration_ts <= now) {
+        casky_disk_erase_slot(p, j);
+        casky_disk_hdr(d)->num_entries--;
+        removed++;
+      }
+    }
+  }
+  DISK_UNLOCK(d);
+  return removed;
+}
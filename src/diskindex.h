@@ -0,0 +1,119 @@
+#ifndef __DISKINDEX_H
+#define __DISKINDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+#ifdef THREAD_SAFE
+#include <pthread.h>
+#endif
+#include "casky.h"
+#include "utils.h"
+
+#define CASKY_DISK_MAGIC      "CASKYIX1"
+#define CASKY_DISK_PAGE_SIZE  4096
+// A page splits once this many of its slots are used, keeping in-page
+// probe sequences short
+#define CASKY_DISK_PAGE_FILL  72
+
+/**
+ * A slot of the on-disk index: the Entry of a key minus the key bytes,
+ * which are read back from the log (they sit right before the value) when
+ * the hash matches. Free slots are zero-filled: value_offset 0 marks them,
+ * as no value starts a log file.
+ */
+typedef struct CaskyDiskSlot {
+    uint64_t hash;
+    uint64_t value_offset;
+    uint64_t timestamp;
+    uint64_t expiration_ts;
+    uint32_t file_id;
+    uint32_t key_len;
+    uint32_t value_len;     // stored length, see Entry
+    uint32_t codec;         // CaskyCodec of the value bytes
+} CaskyDiskSlot;
+
+#define CASKY_DISK_PAGE_SLOTS \
+    ((CASKY_DISK_PAGE_SIZE - 16) / sizeof(CaskyDiskSlot))
+
+/**
+ * A bucket page: an open-addressed table of CASKY_DISK_PAGE_SLOTS slots,
+ * probed linearly from the hash. All its keys share the low `depth` bits of
+ * their hash.
+ */
+typedef struct CaskyDiskPage {
+    uint32_t count;         // used slots
+    uint32_t depth;         // local depth
+    uint64_t reserved;
+    CaskyDiskSlot slots[CASKY_DISK_PAGE_SLOTS];
+} CaskyDiskPage;
+
+/**
+ * Page 0 of the index file.
+ *
+ * `clean` is cleared when the index is opened and set again by
+ * casky_disk_checkpoint(): an index that was not closed cleanly may be
+ * halfway through a page split, and is rebuilt from the log.
+ */
+typedef struct CaskyDiskHeader {
+    char magic[8];
+    uint32_t page_size;
+    uint32_t clean;
+    uint64_t hash_seed;     // seed of every hash stored in the slots
+    uint64_t num_entries;
+    uint64_t log_size;      // log bytes reflected in the index
+    uint64_t log_ino;       // inode of that log: a compaction without the
+                            // index replaces it
+    uint32_t file_id;       // log generation the slots refer to
+    uint32_t num_pages;     // pages in the file, header included
+    uint32_t global_depth;  // the directory has 2^global_depth entries
+    uint32_t dir_page;      // first page of the directory
+    uint32_t dir_pages;     // pages reserved for the directory
+} CaskyDiskHeader;
+
+/**
+ * Persistent KeyDir index kept in a memory-mapped file next to the log,
+ * for key sets that do not fit in memory: the page cache decides which
+ * pages stay resident.
+ *
+ * The file grows by extendible hashing. A directory of 2^global_depth page
+ * numbers, indexed by the low bits of the hash, leads to the bucket page of
+ * a key; a full page splits in two on one more hash bit, doubling the
+ * directory only when its depth was already the global one. A lookup
+ * touches one directory entry and one page, plus the key bytes in the log
+ * when a slot hash matches.
+ *
+ * Readers share `lock`, writers take it exclusively: a split may move
+ * slots and growing the file remaps it.
+ */
+typedef struct CaskyDiskIndex {
+    int fd;
+    char *map;
+    size_t map_size;
+    int fresh;              // created empty by casky_disk_open()
+#ifdef THREAD_SAFE
+    pthread_rwlock_t lock;
+#endif
+} CaskyDiskIndex;
+
+typedef int (*casky_disk_fn)(const Entry *e, void *ctx);
+
+CaskyDiskIndex *casky_disk_open(const char *path, uint64_t hash_seed, uint64_t log_size, uint64_t log_ino);
+void            casky_disk_checkpoint(CaskyDiskIndex *d, uint64_t log_size, uint64_t log_ino, uint32_t file_id);
+void            casky_disk_close(CaskyDiskIndex *d);
+CaskyDiskHeader *casky_disk_header(const CaskyDiskIndex *d);
+
+int  casky_disk_read(KeyDir *kd, const char *key, size_t key_len, uint64_t hash,
+                     uint64_t now, casky_entry_fn fn, void *ctx);
+int  casky_disk_contains(KeyDir *kd, const char *key, size_t key_len, uint64_t hash,
+                         uint64_t now);
+int  casky_disk_put(KeyDir *kd, const char *key, uint32_t key_len, uint64_t hash,
+                    uint32_t value_len, uint32_t file_id, uint64_t value_offset,
+                    CaskyCodec codec, uint64_t timestamp, uint64_t expires);
+int  casky_disk_delete(KeyDir *kd, const char *key, uint32_t key_len, uint64_t hash);
+int  casky_disk_touch(KeyDir *kd, const char *key, uint32_t key_len, uint64_t hash,
+                      uint64_t now, uint64_t expires);
+int  casky_disk_foreach(KeyDir *kd, casky_disk_fn fn, void *ctx);
+void casky_disk_relocate(KeyDir *kd, uint32_t file_id);
+size_t casky_disk_expire(KeyDir *kd, uint64_t now);
+
+#endif // !__DISKINDEX_H
@@ -0,0 +1,189 @@
+#include <stdlib.h>
+#include <string.h>
+#include "ebr.h"
+
+#ifdef THREAD_SAFE
+#include <pthread.h>
+#include <sched.h>
+
+// One record per thread that ever entered a critical section. Records are
+// never freed: a thread that exits gives its record back for reuse.
+typedef struct CaskyEbrThread {
+  uint64_t epoch;               // epoch seen on entry, 0 when quiescent
+  int in_use;
+  unsigned depth;               // nesting of casky_ebr_enter()
+  struct CaskyEbrThread *next;
+} __attribute__((aligned(64))) CaskyEbrThread;
+
+static uint64_t casky_ebr_epoch = 1;
+static CaskyEbrThread *casky_ebr_threads;
+static _Thread_local CaskyEbrThread *casky_ebr_self;
+static pthread_key_t casky_ebr_key;
+static pthread_once_t casky_ebr_once = PTHREAD_ONCE_INIT;
+
+static void casky_ebr_thread_exit(void *rec) {
+  CaskyEbrThread *t = rec;
+  __atomic_store_n(&t->epoch, 0, __ATOMIC_RELEASE);
+  t->depth = 0;
+  __atomic_store_n(&t->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void casky_ebr_init(void) {
+  pthread_key_create(&casky_ebr_key, casky_ebr_thread_exit);
+}
+
+static CaskyEbrThread *casky_ebr_register(void) {
+  pthread_once(&casky_ebr_once, casky_ebr_init);
+
+  // Reuse the record of a thread that has exited
+  CaskyEbrThread *t;
+  for (t = __atomic_load_n(&casky_ebr_threads, __ATOMIC_ACQUIRE); t; t = t->next) {
+    int expected = 0;
+    if (__atomic_compare_exchange_n(&t->in_use, &expected, 1, 0,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+      break;
+  }
+
+  if (!t) {
+    void *mem = NULL;
+    if (posix_memalign(&mem, _Alignof(CaskyEbrThread), sizeof(CaskyEbrThread)) != 0)
+      return NULL;
+    t = memset(mem, 0, sizeof(CaskyEbrThread));
+    t->in_use = 1;
+    t->next = __atomic_load_n(&casky_ebr_threads, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&casky_ebr_threads, &t->next, t, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+      ;
+  }
+  pthread_setspecific(casky_ebr_key, t);
+  casky_ebr_self = t;
+  return t;
+}
+
+/**
+ * Returns the smallest epoch announced by a thread inside a critical
+ * section, or UINT64_MAX if no thread is in one.
+ */
+static uint64_t casky_ebr_min_active(void) {
+  uint64_t min = UINT64_MAX;
+  for (CaskyEbrThread *t = __atomic_load_n(&casky_ebr_threads, __ATOMIC_ACQUIRE); t; t = t->next) {
+    uint64_t e = __atomic_load_n(&t->epoch, __ATOMIC_SEQ_CST);
+    if (e != 0 && e < min)
+      min = e;
+  }
+  return min;
+}
+#endif
+
+/**
+ * casky_ebr_enter - Starts a read-side critical section.
+ *
+ * Memory reachable from the KeyDir when this returns stays valid until the
+ * matching casky_ebr_exit(). Sections can nest.
+ *
+ * Returns: 0 on success, -1 if the per-thread record could not be
+ * allocated (the caller must not traverse the KeyDir).
+ */
+int casky_ebr_enter(void) {
+#ifdef THREAD_SAFE
+  CaskyEbrThread *t = casky_ebr_self;
+  if (!t && !(t = casky_ebr_register()))
+    return -1;
+  if (t->depth++ == 0) {
+    __atomic_store_n(&t->epoch, __atomic_load_n(&casky_ebr_epoch, __ATOMIC_RELAXED),
+                     __ATOMIC_RELAXED);
+    // Either a writer scanning the records sees this epoch, or the loads
+    // that follow see everything the writer unlinked before its scan
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  }
+#endif
+  return 0;
+}
+
+/**
+ * casky_ebr_exit - Ends a read-side critical section. Pointers obtained
+ * inside it must not be used anymore.
+ */
+void casky_ebr_exit(void) {
+#ifdef THREAD_SAFE
+  CaskyEbrThread *t = casky_ebr_self;
+  if (--t->depth == 0)
+    __atomic_store_n(&t->epoch, 0, __ATOMIC_RELEASE);
+#endif
+}
+
+/**
+ * casky_ebr_retire - Schedules memory that has just been unlinked from a
+ * shared structure to be freed with fn(ptr, ctx) once no reader can hold a
+ * reference to it anymore.
+ *
+ * If the list cannot grow, waits for the readers currently inside a
+ * critical section to leave it and frees the memory right away.
+ */
+void casky_ebr_retire(CaskyRetireList *l, void *ptr, casky_free_fn fn, void *ctx) {
+#ifdef THREAD_SAFE
+  uint64_t epoch = __atomic_load_n(&casky_ebr_epoch, __ATOMIC_SEQ_CST);
+
+  if (l->count == l->capacity) {
+    size_t capacity = l->capacity ? l->capacity * 2 : CASKY_EBR_BATCH;
+    CaskyRetired *items = realloc(l->items, capacity * sizeof(CaskyRetired));
+    if (!items) {
+      __atomic_add_fetch(&casky_ebr_epoch, 1, __ATOMIC_SEQ_CST);
+      while (casky_ebr_min_active() <= epoch)
+        sched_yield();
+      fn(ptr, ctx);
+      return;
+    }
+    l->items = items;
+    l->capacity = capacity;
+  }
+  l->items[l->count++] = (CaskyRetired){ ptr, fn, ctx, epoch };
+#else
+  (void)l;
+  fn(ptr, ctx);
+#endif
+}
+
+/**
+ * casky_ebr_reclaim - Frees the retired memory that no reader can see
+ * anymore.
+ *
+ * Advances the global epoch, so that threads entering a critical section
+ * from now on cannot reach anything retired so far, then frees every entry
+ * retired before the oldest epoch still announced by a reader.
+ *
+ * Returns: the number of entries still waiting on the list.
+ */
+size_t casky_ebr_reclaim(CaskyRetireList *l) {
+#ifdef THREAD_SAFE
+  if (l->count == 0) return 0;
+  __atomic_add_fetch(&casky_ebr_epoch, 1, __ATOMIC_SEQ_CST);
+  uint64_t min = casky_ebr_min_active();
+
+  size_t kept = 0;
+  for (size_t i = 0; i < l->count; i++) {
+    CaskyRetired *r = &l->items[i];
+    if (r->epoch < min)
+      r->fn(r->ptr, r->ctx);
+    else
+      l->items[kept++] = *r;
+  }
+  l->count = kept;
+  return kept;
+#else
+  (void)l;
+  return 0;
+#endif
+}
+
+/**
+ * casky_ebr_drain - Frees every entry of a list without looking at the
+ * readers, and releases the list. Only for structures being destroyed,
+ * which no thread can be reading anymore.
+ */
+void casky_ebr_drain(CaskyRetireList *l) {
+  for (size_t i = 0; i < l->count; i++)
+    l->items[i].fn(l->items[i].ptr, l->items[i].ctx);
+  free(l->items);
+  memset(l, 0, sizeof(*l));
+}
@@ -0,0 +1,53 @@
+#ifndef __EBR_H
+#define __EBR_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Epoch-based reclamation.
+ *
+ * Readers traverse the KeyDir without taking any lock, inside a critical
+ * section delimited by casky_ebr_enter() and casky_ebr_exit(). Writers
+ * never free memory a reader may still be looking at: they unlink it, then
+ * retire it on a list together with the current global epoch, and it is
+ * only freed once every thread that was inside a critical section at that
+ * time has left it.
+ *
+ * Retire lists are owned by the structure whose memory they hold (a shard,
+ * the KeyDir) and protected by the same lock as that structure, so the
+ * free callbacks run with that lock held.
+ *
+ * Without THREAD_SAFE there are no concurrent readers: retired memory is
+ * freed immediately and entering a critical section costs nothing.
+ */
+
+// Publication of pointers read by lock-free readers
+#define CASKY_LOAD(p)       __atomic_load_n(&(p), __ATOMIC_ACQUIRE)
+#define CASKY_PUBLISH(p, v) __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+
+// Retire lists are scanned once they hold this many entries
+#define CASKY_EBR_BATCH 64
+
+typedef void (*casky_free_fn)(void *ptr, void *ctx);
+
+typedef struct {
+    void *ptr;
+    casky_free_fn fn;
+    void *ctx;
+    uint64_t epoch;         // global epoch when the memory was unlinked
+} CaskyRetired;
+
+typedef struct CaskyRetireList {
+    CaskyRetired *items;
+    size_t count;
+    size_t capacity;
+} CaskyRetireList;
+
+int    casky_ebr_enter(void);
+void   casky_ebr_exit(void);
+void   casky_ebr_retire(CaskyRetireList *l, void *ptr, casky_free_fn fn, void *ctx);
+size_t casky_ebr_reclaim(CaskyRetireList *l);
+void   casky_ebr_drain(CaskyRetireList *l);
+
+#endif // !__EBR_H
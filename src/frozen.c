@@ -0,0 +1,273 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "casky.h"
+#include "utils.h"
+#include "hash.h"
+#include "frozen.h"
+
+// Seeds tried before giving up on a key set
+#define CASKY_FROZEN_MAX_ATTEMPTS 16
+
+static inline uint64_t casky_frozen_mix(uint64_t x) {
+  x ^= x >> 33;
+  x *= 0xff51afd7ed558ccdULL;
+  x ^= x >> 33;
+  x *= 0xc4ceb9fe1a85ec53ULL;
+  x ^= x >> 33;
+  return x;
+}
+
+static inline size_t casky_frozen_bucket(uint64_t hash, size_t num_buckets) {
+  return (size_t)(((hash & 0xffffffffULL) * num_buckets) >> 32);
+}
+
+static inline size_t casky_frozen_slot(uint64_t hash, uint32_t pilot, size_t num_slots) {
+  uint64_t x = casky_frozen_mix(hash ^ (pilot * 0x9e3779b97f4a7c15ULL));
+  return (size_t)(((x >> 32) * num_slots) >> 32);
+}
+
+typedef struct {
+  Entry *entries;       // expanded nodes, pointing into the KeyDir
+  size_t n, cap;
+  size_t data_size;
+  uint64_t now;
+  int oom;
+} casky_frozen_input;
+
+static int casky_frozen_collect_cb(EntryNode *node, const Entry *e, void *arg) {
+  (void)node;
+  casky_frozen_input *in = arg;
+  if (e->expiration_ts != 0 && e->expiration_ts <= in->now)
+    return CASKY_ITER_CONTINUE;
+  if (in->n == in->cap) {
+    size_t cap = in->cap ? in->cap * 2 : 1024;
+    Entry *entries = realloc(in->entries, cap * sizeof(*entries));
+    if (!entries) {
+      in->oom = 1;
+      return CASKY_ITER_STOP;
+    }
+    in->entries = entries;
+    in->cap = cap;
+  }
+  in->entries[in->n++] = *e;
+  in->data_size += (size_t)e->key_len + 1 + (e->value ? (size_t)e->value_len + 1 : 0);
+  return CASKY_ITER_CONTINUE;
+}
+
+// Scratch memory of one build
+typedef struct {
+  uint64_t *hashes;     // per key
+  uint32_t *slot_of;    // per key, the slot it was given
+  uint32_t *by_bucket;  // keys grouped by bucket
+  uint32_t *start;      // per bucket, first key in by_bucket (+1 sentinel)
+  uint32_t *buckets;    // bucket indexes, largest buckets first
+  uint8_t *taken;       // per slot
+} casky_frozen_work;
+
+/**
+ * Assigns every key a distinct slot with the given seed. Buckets are placed
+ * largest first, while most slots are still free; single-key buckets come
+ * last and simply take the remaining slots.
+ *
+ * Returns: 0 on success, -1 if a bucket found no pilot.
+ */
+static int casky_frozen_place(CaskyFrozen *f, const casky_frozen_input *in,
+                              casky_frozen_work *w) {
+  size_t n = f->num_entries, nb = f->num_buckets;
+
+  memset(w->start, 0, (nb + 1) * sizeof(uint32_t));
+  for (size_t i = 0; i < n; i++) {
+    const Entry *e = &in->entries[i];
+    w->hashes[i] = casky_hash(e->key, e->key_len, f->seed);
+    w->start[casky_frozen_bucket(w->hashes[i], nb) + 1]++;
+  }
+  size_t max_size = 0;
+  for (size_t b = 0; b < nb; b++) {
+    if (w->start[b + 1] > max_size) max_size = w->start[b + 1];
+    w->start[b + 1] += w->start[b];
+  }
+  // Counting sorts: keys by bucket, then buckets by decreasing size (the
+  // slot_of and taken arrays serve as cursors, they are reset below)
+  memcpy(w->slot_of, w->start, nb * sizeof(uint32_t));
+  for (size_t i = 0; i < n; i++)
+    w->by_bucket[w->slot_of[casky_frozen_bucket(w->hashes[i], nb)]++] = i;
+  uint32_t *count = calloc(max_size + 2, sizeof(uint32_t));
+  if (!count) return -1;
+  for (size_t b = 0; b < nb; b++)
+    count[max_size - (w->start[b + 1] - w->start[b]) + 1]++;
+  for (size_t k = 0; k <= max_size; k++)
+    count[k + 1] += count[k];
+  for (size_t b = 0; b < nb; b++)
+    w->buckets[count[max_size - (w->start[b + 1] - w->start[b])]++] = b;
+  free(count);
+
+  memset(w->taken, 0, n);
+  memset(f->pilots, 0, nb * sizeof(uint32_t));
+  size_t next_free = 0;
+  for (size_t k = 0; k < nb; k++) {
+    size_t b = w->buckets[k];
+    uint32_t first = w->start[b], size = w->start[b + 1] - first;
+    if (size == 0) break;
+
+    if (size == 1) {
+      while (w->taken[next_free]) next_free++;
+      w->taken[next_free] = 1;
+      w->slot_of[w->by_bucket[first]] = next_free;
+      f->pilots[b] = CASKY_FROZEN_DIRECT | (uint32_t)next_free;
+      continue;
+    }
+
+    uint32_t pilot;
+    for (pilot = 0; pilot < CASKY_FROZEN_MAX_PILOT; pilot++) {
+      uint32_t j;
+      for (j = 0; j < size; j++) {
+        uint32_t key = w->by_bucket[first + j];
+        size_t slot = casky_frozen_slot(w->hashes[key], pilot, n);
+        if (w->taken[slot]) break;
+        w->taken[slot] = 1;
+        w->slot_of[key] = slot;
+      }
+      if (j == size) break;
+      while (j-- > 0)
+        w->taken[w->slot_of[w->by_bucket[first + j]]] = 0;
+    }
+    if (pilot == CASKY_FROZEN_MAX_PILOT)
+      return -1;
+    f->pilots[b] = pilot;
+  }
+  return 0;
+}
+
+/**
+ * casky_frozen_build - Builds a frozen index of the live keys of a KeyDir.
+ *
+ * Keys and the values the KeyDir keeps in memory are copied; values stored
+ * in a log keep their location. Expired keys are left out.
+ *
+ * Not thread-safe: no writer may use the KeyDir during the build.
+ *
+ * Returns: the index, or NULL with casky_errno set (CASKY_ERR_MEMORY, or
+ * CASKY_ERR_NOT_SUPPORTED if no perfect hash was found for the keys).
+ */
+CaskyFrozen *casky_frozen_build(KeyDir *kd) {
+  casky_frozen_input in = { .now = (uint64_t)time(NULL) };
+  casky_kd_foreach(kd, casky_frozen_collect_cb, &in);
+  if (in.oom || in.n >= CASKY_FROZEN_DIRECT) {
+    free(in.entries);
+    casky_errno = in.oom ? CASKY_ERR_MEMORY : CASKY_ERR_NOT_SUPPORTED;
+    return NULL;
+  }
+
+  size_t n = in.n;
+  CaskyFrozen *f = calloc(1, sizeof(CaskyFrozen));
+  casky_frozen_work w = { 0 };
+  void *slots = NULL;
+  if (!f) goto oom;
+  f->num_entries = n;
+  f->num_buckets = n / CASKY_FROZEN_BUCKET_KEYS + 1;
+  f->pilots = malloc(f->num_buckets * sizeof(uint32_t));
+  f->data = malloc(in.data_size + 1);
+  if (n > 0 && posix_memalign(&slots, 64, n * sizeof(CaskyFrozenSlot)) != 0)
+    slots = NULL;
+  f->slots = slots;
+  f->data_size = in.data_size;
+  w.hashes = malloc((n + 1) * sizeof(uint64_t));
+  w.slot_of = malloc((f->num_buckets + n) * sizeof(uint32_t));
+  w.by_bucket = malloc((n + 1) * sizeof(uint32_t));
+  w.start = malloc((f->num_buckets + 1) * sizeof(uint32_t));
+  w.buckets = malloc(f->num_buckets * sizeof(uint32_t));
+  w.taken = malloc(n + 1);
+  if (!f->pilots || !f->data || (n > 0 && !f->slots) || !w.hashes || !w.slot_of ||
+      !w.by_bucket || !w.start || !w.buckets || !w.taken)
+    goto oom;
+
+  int attempt;
+  f->seed = kd->hash_seed;
+  for (attempt = 0; attempt < CASKY_FROZEN_MAX_ATTEMPTS; attempt++) {
+    if (casky_frozen_place(f, &in, &w) == 0)
+      break;
+    f->seed = casky_frozen_mix(f->seed + 0x9e3779b97f4a7c15ULL);
+  }
+  if (attempt == CASKY_FROZEN_MAX_ATTEMPTS) {
+    casky_frozen_free(f);
+    f = NULL;
+    casky_errno = CASKY_ERR_NOT_SUPPORTED;
+    goto out;
+  }
+
+  char *p = f->data;
+  for (size_t i = 0; i < n; i++) {
+    const Entry *e = &in.entries[i];
+    CaskyFrozenSlot *slot = &f->slots[w.slot_of[i]];
+    slot->entry = *e;
+    slot->hash = w.hashes[i];
+    slot->entry.key = p;
+    memcpy(p, e->key, e->key_len);
+    p[e->key_len] = '\0';
+    p += e->key_len + 1;
+    if (e->value) {
+      slot->entry.value = p;
+      memcpy(p, e->value, e->value_len);
+      p[e->value_len] = '\0';
+      p += e->value_len + 1;
+    }
+  }
+  casky_errno = CASKY_OK;
+  goto out;
+
+oom:
+  casky_frozen_free(f);
+  f = NULL;
+  casky_errno = CASKY_ERR_MEMORY;
+out:
+  free(w.hashes);
+  free(w.slot_of);
+  free(w.by_bucket);
+  free(w.start);
+  free(w.buckets);
+  free(w.taken);
+  free(in.entries);
+  return f;
+}
+
+/**
+ * casky_frozen_free - Frees a frozen index. Values it points to in a log
+ * are not affected.
+ */
+void casky_frozen_free(CaskyFrozen *f) {
+  if (!f) return;
+  free(f->pilots);
+  free(f->slots);
+  free(f->data);
+  free(f);
+}
+
+/**
+ * casky_frozen_find - Looks a key up: the pilot of its bucket, then its
+ * slot, then the key bytes only if the cached hash matches.
+ *
+ * Returns: the entry of the key, or NULL if the key is not in the index.
+ */
+const Entry *casky_frozen_find(const CaskyFrozen *f, const char *key, size_t key_len) {
+  if (f->num_entries == 0) return NULL;
+  uint64_t hash = casky_hash(key, key_len, f->seed);
+  uint32_t pilot = f->pilots[casky_frozen_bucket(hash, f->num_buckets)];
+  size_t slot = pilot & CASKY_FROZEN_DIRECT ? pilot & ~CASKY_FROZEN_DIRECT :
+                                              casky_frozen_slot(hash, pilot, f->num_entries);
+  const CaskyFrozenSlot *s = &f->slots[slot];
+  if (s->hash != hash || s->entry.key_len != key_len ||
+      memcmp(s->entry.key, key, key_len) != 0)
+    return NULL;
+  return &s->entry;
+}
+
+/**
+ * casky_frozen_foreach - Calls `fn` on every entry, in slot order, until it
+ * returns non-zero.
+ */
+void casky_frozen_foreach(const CaskyFrozen *f, casky_frozen_fn fn, void *ctx) {
+  for (size_t i = 0; i < f->num_entries; i++)
+    if (fn(&f->slots[i].entry, ctx))
+      return;
+}
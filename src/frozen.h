@@ -0,0 +1,59 @@
+#ifndef __FROZEN_H
+#define __FROZEN_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "casky.h"
+
+// Average number of keys per bucket of the perfect hash. Larger buckets
+// take fewer bits per key but longer to build.
+#define CASKY_FROZEN_BUCKET_KEYS 4
+// Pilots tried for one bucket before the build starts over with a new seed
+#define CASKY_FROZEN_MAX_PILOT   (1u << 20)
+// Pilot flag: the bucket holds a single key, stored at the slot in the low
+// bits
+#define CASKY_FROZEN_DIRECT      0x80000000u
+
+/**
+ * A frozen entry: the Entry the KeyDir would hold, plus the full hash of the
+ * key so that lookups of other keys are rejected without touching the key
+ * bytes. 64 bytes, one cache line.
+ */
+typedef struct CaskyFrozenSlot {
+    Entry entry;
+    uint64_t hash;
+} CaskyFrozenSlot;
+
+/**
+ * Read-only KeyDir index over a fixed set of keys, built with a minimal
+ * perfect hash in the CHD / PTHash style.
+ *
+ * Keys are spread over buckets by hash; every bucket stores a 32-bit pilot
+ * that moves its keys to free slots of a single array with exactly one slot
+ * per key. Buckets with one key store their slot directly. A lookup reads
+ * the pilot of its bucket and then the slot: two memory accesses, plus the
+ * key bytes when the hash matches. The index itself costs
+ * 32 / CASKY_FROZEN_BUCKET_KEYS bits per key; keys and in-memory values are
+ * packed in one block.
+ *
+ * Never modified after casky_frozen_build(): lookups need no lock and no
+ * EBR critical section.
+ */
+typedef struct CaskyFrozen {
+    uint64_t seed;              // seed of casky_hash() for this table
+    size_t num_entries;         // number of keys and of slots
+    size_t num_buckets;
+    uint32_t *pilots;           // one per bucket
+    CaskyFrozenSlot *slots;     // num_entries slots, cache-line aligned
+    char *data;                 // keys and in-memory values, NUL-terminated
+    size_t data_size;
+} CaskyFrozen;
+
+typedef int (*casky_frozen_fn)(const Entry *e, void *ctx);
+
+CaskyFrozen *casky_frozen_build(KeyDir *kd);
+void         casky_frozen_free(CaskyFrozen *f);
+const Entry *casky_frozen_find(const CaskyFrozen *f, const char *key, size_t key_len);
+void         casky_frozen_foreach(const CaskyFrozen *f, casky_frozen_fn fn, void *ctx);
+
+#endif // !__FROZEN_H
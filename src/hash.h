@@ -0,0 +1,10 @@
+#ifndef __HASH_H
+#define __HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+uint64_t casky_hash(const void *key, size_t len, uint64_t seed);
+uint64_t casky_hash_random_seed(void);
+
+#endif // !__HASH_H
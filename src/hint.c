@@ -0,0 +1,192 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "casky.h"
+#include "crc.h"
+#include "utils.h"
+#include "hint.h"
+#include "recovery.h"
+
+/**
+ * casky_hint_add - Appends the hint record of a log record. Its key length
+ * field carries the record flags, as in the log.
+ *
+ * Returns: 0 on success, -1 on allocation failure.
+ */
+int casky_hint_add(CaskyHint *h, CaskyRecordType type, const char *key, uint32_t key_len,
+                   uint32_t value_len, CaskyCodec codec, uint64_t value_offset, uint64_t timestamp,
+                   uint64_t expires) {
+  uint32_t key_field = casky_record_key_field(key_len, codec, type, value_len);
+  size_t need = CASKY_HINT_RECORD_SIZE + (size_t)key_len;
+  if (h->cap - h->len < need) {
+    size_t cap = h->cap ? h->cap : 4096;
+    while (cap - h->len < need) cap *= 2;
+    char *buf = realloc(h->buf, cap);
+    if (!buf) {
+      h->lost = 1;
+      return -1;
+    }
+    h->buf = buf;
+    h->cap = cap;
+  }
+  char *p = h->buf + h->len;
+  memcpy(p, &timestamp, 8);
+  memcpy(p + 8, &expires, 8);
+  memcpy(p + 16, &key_field, 4);
+  memcpy(p + 20, &value_len, 4);
+  memcpy(p + 24, &value_offset, 8);
+  memcpy(p + CASKY_HINT_RECORD_SIZE, key, key_len);
+  h->len += need;
+  return 0;
+}
+
+/**
+ * casky_hint_reset - Forgets the collected records, keeping the buffer.
+ */
+void casky_hint_reset(CaskyHint *h) {
+  h->len = 0;
+  h->lost = 0;
+}
+
+void casky_hint_free(CaskyHint *h) {
+  if (!h) return;
+  free(h->buf);
+  h->buf = NULL;
+  h->len = h->cap = 0;
+  h->lost = 0;
+}
+
+/**
+ * casky_hint_write - Writes the collected records as the hint file of the
+ * first `log_size` bytes of a log file.
+ *
+ * The file is written aside and renamed into place, so a hint file is
+ * always complete. It is not synced: a hint lost in a crash only costs a
+ * replay of its log file.
+ *
+ * Returns: 0 on success, -1 on error or if records were lost.
+ */
+int casky_hint_write(const CaskyHint *h, const char *path, uint64_t log_size, uint64_t log_ino) {
+  if (h->lost) return -1;
+  char *tmp = malloc(strlen(path) + sizeof(".tmp"));
+  if (!tmp) return -1;
+  sprintf(tmp, "%s.tmp", path);
+  FILE *f = fopen(tmp, "wb");
+  if (!f) {
+    free(tmp);
+    return -1;
+  }
+  CaskyHintHeader hdr = { CASKY_HINT_MAGIC, CASKY_HINT_VERSION, log_size, log_ino };
+  uint32_t crc = casky_crc32c_update(0, (const unsigned char *)&hdr, sizeof(hdr));
+  crc = casky_crc32c_update(crc, (const unsigned char *)h->buf, h->len);
+  int ok = fwrite(&hdr, sizeof(hdr), 1, f) == 1 &&
+           (h->len == 0 || fwrite(h->buf, 1, h->len, f) == h->len) &&
+           fwrite(&crc, sizeof(crc), 1, f) == 1;
+  if (fclose(f) != 0) ok = 0;
+  if (ok && rename(tmp, path) != 0) ok = 0;
+  if (!ok) remove(tmp);
+  free(tmp);
+  return ok ? 0 : -1;
+}
+
+/**
+ * casky_hint_load - Rebuilds the KeyDir entries of a log file from its hint
+ * file, instead of replaying its records.
+ *
+ * The hint is only used when it is intact (magic, version and CRC), covers
+ * no more than the `log_size` bytes of the log file and was written for
+ * the same inode `log_ino`. Records are applied in log order, as a replay
+ * would: expired ones are loaded too, in case a later TOUCH extended them,
+ * and removed by casky_expire() once every log file is loaded.
+ *
+ * @file_id: file_id the entries point to
+ * @keep:    if not NULL, receives a copy of the hint records, e.g. to keep
+ *           collecting those of the active segment
+ * @covered: receives the number of log bytes the hint stands for; the
+ *           caller replays the rest of the log file
+ *
+ * Returns: 0 on success, -1 if there is no usable hint. A hint found
+ * malformed midway may have been partially applied: replaying the whole
+ * log file afterwards applies the same records again, in the same order.
+ */
+int casky_hint_load(KeyDir *kd, const char *path, uint32_t file_id, uint64_t log_size,
+                    uint64_t log_ino, CaskyHint *keep, uint64_t *covered) {
+  FILE *f = fopen(path, "rb");
+  if (!f) return -1;
+  struct stat st;
+  if (fstat(fileno(f), &st) != 0 ||
+      (uint64_t)st.st_size < sizeof(CaskyHintHeader) + sizeof(uint32_t)) {
+    fclose(f);
+    return -1;
+  }
+  size_t size = st.st_size;
+  char *data = malloc(size);
+  if (!data || fread(data, 1, size, f) != size) {
+    free(data);
+    fclose(f);
+    return -1;
+  }
+  fclose(f);
+
+  CaskyHintHeader hdr;
+  uint32_t crc;
+  memcpy(&hdr, data, sizeof(hdr));
+  memcpy(&crc, data + size - sizeof(crc), sizeof(crc));
+  if (hdr.magic != CASKY_HINT_MAGIC || hdr.version != CASKY_HINT_VERSION ||
+      hdr.log_size > log_size || hdr.log_ino != log_ino ||
+      casky_crc32c((const unsigned char *)data, size - sizeof(crc)) != crc) {
+    free(data);
+    return -1;
+  }
+
+  const char *p = data + sizeof(hdr), *end = data + size - sizeof(crc);
+  // Hint records carry no log record to verify, whatever the log format
+  CaskyRecovery r;
+  CaskyLogHeader header = { 0 };
+  if (casky_recovery_init(&r, kd, file_id, &header) != 0) {
+    free(data);
+    return -1;
+  }
+  if (keep) {
+    casky_hint_reset(keep);
+    if (end > p) {
+      char *buf = realloc(keep->buf, end - p);
+      if (!buf) {
+        casky_recovery_free(&r);
+        free(data);
+        return -1;
+      }
+      memcpy(buf, p, end - p);
+      keep->buf = buf;
+      keep->len = keep->cap = end - p;
+    }
+  }
+  while (p < end) {
+    uint64_t timestamp, expires, value_offset;
+    uint32_t key_field, key_len, value_len;
+    if ((size_t)(end - p) < CASKY_HINT_RECORD_SIZE) break;
+    memcpy(&timestamp, p, 8);
+    memcpy(&expires, p + 8, 8);
+    memcpy(&key_field, p + 16, 4);
+    key_len = casky_record_key_len(key_field);
+    memcpy(&value_len, p + 20, 4);
+    memcpy(&value_offset, p + 24, 8);
+    if ((size_t)(end - p) - CASKY_HINT_RECORD_SIZE < key_len) break;
+    const char *key = p + CASKY_HINT_RECORD_SIZE;
+    casky_recovery_add(&r, NULL, casky_record_type(key_field, value_len), key, key_len, NULL,
+                       value_len, value_offset, casky_record_codec(key_field), timestamp,
+                       expires);
+    p = key + key_len;
+  }
+  if (p == end)
+    casky_recovery_apply(&r);
+  casky_recovery_free(&r);
+  free(data);
+  if (p != end) {
+    if (keep) casky_hint_reset(keep);
+    return -1;
+  }
+  *covered = hdr.log_size;
+  return 0;
+}
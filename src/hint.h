@@ -0,0 +1,53 @@
+#ifndef __HINT_H
+#define __HINT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "casky.h"
+
+#define CASKY_HINT_MAGIC   0x544E4948u   // "HINT"
+#define CASKY_HINT_VERSION 1
+// [Timestamp][Expires][KeyLen | flags][ValueLen][ValueOffset] preceding
+// the key, the flags and the value length as in the log record
+#define CASKY_HINT_RECORD_SIZE 32
+
+/**
+ * Header of a hint file. A hint file lists, in log order, the records of
+ * the first `log_size` bytes of one log file without their values:
+ *
+ *   [CaskyHintHeader][record header + key]...[CRC32C of everything before]
+ *
+ * which is all casky_open() needs to rebuild the KeyDir entries of that
+ * part of the log. Tombstones and TOUCH records are listed too, with their
+ * type in the flags, so that a hint applied after the ones of older
+ * segments deletes or updates what it must.
+ */
+typedef struct CaskyHintHeader {
+    uint32_t magic;         // CASKY_HINT_MAGIC
+    uint32_t version;       // CASKY_HINT_VERSION
+    uint64_t log_size;      // bytes of the log file covered
+    uint64_t log_ino;       // inode of the log file: a hint left behind by
+                            // a log file that was replaced is ignored
+} CaskyHintHeader;
+
+/**
+ * Hint records being collected for a log file, e.g. the active segment,
+ * in the on-disk record format.
+ */
+typedef struct CaskyHint {
+    char *buf;
+    size_t len;
+    size_t cap;
+    int lost;   // a record could not be added: no hint file is written
+} CaskyHint;
+
+int  casky_hint_add(CaskyHint *h, CaskyRecordType type, const char *key, uint32_t key_len,
+                    uint32_t value_len, CaskyCodec codec, uint64_t value_offset,
+                    uint64_t timestamp, uint64_t expires);
+void casky_hint_reset(CaskyHint *h);
+void casky_hint_free(CaskyHint *h);
+int  casky_hint_write(const CaskyHint *h, const char *path, uint64_t log_size, uint64_t log_ino);
+int  casky_hint_load(KeyDir *kd, const char *path, uint32_t file_id, uint64_t log_size,
+                     uint64_t log_ino, CaskyHint *keep, uint64_t *covered);
+
+#endif // !__HINT_H
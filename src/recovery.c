@@ -0,0 +1,231 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "casky.h"
+#include "utils.h"
+#include "codec.h"
+#include "recovery.h"
+#include "block.h"
+
+/**
+ * casky_recovery_threads - Number of threads replaying the logs of `kd`.
+ *
+ * @wanted: CaskyOptions.recovery_threads, 0 for one per online CPU
+ *
+ * There is no point in more threads than shards. Builds without
+ * THREAD_SAFE always replay in the calling thread.
+ */
+uint32_t casky_recovery_threads(const KeyDir *kd, uint32_t wanted) {
+#ifdef THREAD_SAFE
+  if (wanted == 0) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    wanted = cpus > 0 ? (uint32_t)cpus : 1;
+  }
+  return wanted < kd->num_shards ? wanted : (uint32_t)kd->num_shards;
+#else
+  (void)kd;
+  (void)wanted;
+  return 1;
+#endif
+}
+
+/**
+ * casky_recovery_init - Prepares the replay of log file `file_id`, with
+ * the number of threads set in kd->recovery_threads.
+ *
+ * @header: the header of the file, see casky_log_header_read()
+ *
+ * Returns: 0 on success, -1 on allocation failure.
+ */
+int casky_recovery_init(CaskyRecovery *r, KeyDir *kd, uint32_t file_id,
+                        const CaskyLogHeader *header) {
+  r->kd = kd;
+  r->file_id = file_id;
+  r->header = *header;
+  r->resynced = 0;
+  r->threads = kd->recovery_threads ? kd->recovery_threads : 1;
+  r->now = time(NULL);
+  r->corrupt = 0;
+  r->corrupt_offset = 0;
+  r->count = 0;
+  r->cap = CASKY_RECOVERY_BATCH;
+  r->recs = malloc(r->cap * sizeof(CaskyRecoveryRecord));
+  return r->recs ? 0 : -1;
+}
+
+void casky_recovery_free(CaskyRecovery *r) {
+  free(r->recs);
+  r->recs = NULL;
+  r->count = r->cap = 0;
+}
+
+/**
+ * casky_recovery_add - Queues a record. A full batch is applied right
+ * away, so the buffers the queued records point into must stay valid until
+ * the next casky_recovery_apply(). Records following a corrupted one are
+ * dropped.
+ *
+ * @record: the whole log record (header, key and value) to verify, or NULL
+ *          for a record verified already, e.g. with its block group
+ */
+void casky_recovery_add(CaskyRecovery *r, const char *record, CaskyRecordType type,
+                        const char *key, uint32_t key_len,
+                        const char *value, uint32_t value_len, uint64_t value_offset,
+                        CaskyCodec codec, uint64_t timestamp, uint64_t expires) {
+  if (r->count == r->cap)
+    casky_recovery_apply(r);
+  if (r->corrupt)
+    return;
+  CaskyRecoveryRecord *rec = &r->recs[r->count++];
+  rec->record = record;
+  rec->type = type;
+  rec->key = key;
+  rec->key_len = key_len;
+  rec->value = value;
+  rec->value_len = value_len;
+  rec->value_offset = value_offset;
+  rec->codec = codec;
+  rec->raw = NULL;
+  rec->timestamp = timestamp;
+  rec->expires = expires;
+  if (expires != 0 && expires <= r->now)
+    r->kd->replay_expired++;
+}
+
+// Hashes the key of a record, checks its CRC and decompresses its value if
+// the KeyDir keeps it
+static void casky_recovery_prepare(CaskyRecovery *r, CaskyRecoveryRecord *rec) {
+  rec->hash = casky_kd_hash(r->kd, rec->key, rec->key_len);
+  rec->corrupt = rec->record &&
+      casky_record_verify((const unsigned char *)rec->record,
+                          CASKY_RECORD_HEADER_SIZE + (size_t)rec->key_len + rec->value_len) < 0;
+  if (rec->corrupt || !rec->value || rec->codec == CASKY_CODEC_NONE)
+    return;
+  rec->corrupt = casky_codec_raw_len(rec->value, rec->value_len, &rec->raw_len) != 0 ||
+      !(rec->raw = malloc(rec->raw_len ? rec->raw_len : 1)) ||
+      casky_codec_decompress(rec->codec, rec->value, rec->value_len, rec->raw, rec->raw_len) != 0;
+}
+
+// Ends the batch before record `i`, corrupted. In a block file the record
+// is only skipped, as its group would be.
+//
+// Returns: 1 if the batch was cut.
+static int casky_recovery_cut(CaskyRecovery *r, size_t i) {
+  const CaskyRecoveryRecord *rec = &r->recs[i];
+  if (r->header.format != CASKY_LOG_RECORDS) {
+    r->resynced = 1;
+    return 0;
+  }
+  r->corrupt = 1;
+  r->corrupt_offset = rec->value_offset - rec->key_len - CASKY_RECORD_HEADER_SIZE;
+  r->count = i;
+  return 1;
+}
+
+// Applies a hashed record to its shard: a tombstone deletes the key, and a
+// TOUCH changes the expiration time of a key that was live when it was
+// written. Expired entries are loaded as well, as a later TOUCH may have
+// extended them: casky_open() drops the ones still expired in the end.
+static void casky_recovery_apply_one(CaskyRecovery *r, const CaskyRecoveryRecord *rec,
+                                     CaskyShard *s) {
+  if (rec->corrupt)
+    return;
+  if (rec->type == CASKY_RECORD_DELETE)
+    casky_shard_delete(r->kd, s, rec->key, rec->key_len, rec->hash);
+  else if (rec->type == CASKY_RECORD_TOUCH)
+    casky_shard_touch(r->kd, s, rec->key, rec->key_len, rec->hash, rec->timestamp,
+                      rec->expires);
+  else if (rec->raw)
+    casky_shard_put(r->kd, s, rec->key, rec->key_len, rec->hash, rec->raw, rec->raw_len,
+                    r->file_id, rec->value_offset, CASKY_CODEC_NONE, rec->timestamp,
+                    rec->expires);
+  else
+    casky_shard_put(r->kd, s, rec->key, rec->key_len, rec->hash, rec->value, rec->value_len,
+                    r->file_id, rec->value_offset, rec->codec, rec->timestamp, rec->expires);
+}
+
+#ifdef THREAD_SAFE
+typedef struct {
+  CaskyRecovery *r;
+  uint32_t id;
+} casky_recovery_worker;
+
+// First pass: hashes and CRCs of one slice of the batch
+static void *casky_recovery_prepare_main(void *arg) {
+  casky_recovery_worker *w = arg;
+  CaskyRecovery *r = w->r;
+  size_t from = r->count * w->id / r->threads, to = r->count * (w->id + 1) / r->threads;
+  for (size_t i = from; i < to; i++)
+    casky_recovery_prepare(r, &r->recs[i]);
+  return NULL;
+}
+
+// Second pass: the records of the shards owned by the worker, in order
+static void *casky_recovery_apply_main(void *arg) {
+  casky_recovery_worker *w = arg;
+  CaskyRecovery *r = w->r;
+  for (size_t i = 0; i < r->count; i++) {
+    CaskyShard *s = casky_kd_shard(r->kd, r->recs[i].hash);
+    if ((size_t)(s - r->kd->shards) % r->threads == w->id)
+      casky_recovery_apply_one(r, &r->recs[i], s);
+  }
+  return NULL;
+}
+
+// Runs `fn` on every worker. The calling thread is worker 0, and takes
+// over the share of any thread that cannot be started.
+static void casky_recovery_run(CaskyRecovery *r, void *(*fn)(void *)) {
+  pthread_t tids[r->threads];
+  casky_recovery_worker workers[r->threads];
+  int started[r->threads];
+  for (uint32_t t = 0; t < r->threads; t++) {
+    workers[t].r = r;
+    workers[t].id = t;
+    started[t] = t > 0 && pthread_create(&tids[t], NULL, fn, &workers[t]) == 0;
+  }
+  fn(&workers[0]);
+  for (uint32_t t = 1; t < r->threads; t++) {
+    if (started[t])
+      pthread_join(tids[t], NULL);
+    else
+      fn(&workers[t]);
+  }
+}
+#endif
+
+// Empties the batch of `queued` records, applied or cut
+static void casky_recovery_release(CaskyRecovery *r, size_t queued) {
+  for (size_t i = 0; i < queued; i++)
+    free(r->recs[i].raw);
+  r->count = 0;
+}
+
+/**
+ * casky_recovery_apply - Applies the queued records to the KeyDir, in log
+ * order per key, and empties the batch. Only the records before the first
+ * corrupted one are applied, and r->corrupt is set.
+ */
+void casky_recovery_apply(CaskyRecovery *r) {
+  size_t queued = r->count;
+#ifdef THREAD_SAFE
+  if (r->threads > 1 && r->count >= CASKY_RECOVERY_MIN_PARALLEL) {
+    casky_recovery_run(r, casky_recovery_prepare_main);
+    for (size_t i = 0; i < r->count; i++) {
+      if (r->recs[i].corrupt && casky_recovery_cut(r, i))
+        break;
+    }
+    casky_recovery_run(r, casky_recovery_apply_main);
+    casky_recovery_release(r, queued);
+    return;
+  }
+#endif
+  for (size_t i = 0; i < r->count; i++) {
+    CaskyRecoveryRecord *rec = &r->recs[i];
+    casky_recovery_prepare(r, rec);
+    if (rec->corrupt && casky_recovery_cut(r, i))
+      break;
+    casky_recovery_apply_one(r, rec, casky_kd_shard(r->kd, rec->hash));
+  }
+  casky_recovery_release(r, queued);
+}
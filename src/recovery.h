@@ -0,0 +1,77 @@
+#ifndef __RECOVERY_H
+#define __RECOVERY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "casky.h"
+
+#define CASKY_RECOVERY_BATCH        65536 // records applied at once
+#define CASKY_RECOVERY_MIN_PARALLEL 4096  // smaller batches are applied by
+                                          // the calling thread alone
+#define CASKY_REPLAY_BUFFER (16 * 1024 * 1024) // log bytes parsed at once
+
+/**
+ * A record read back from a log or hint file, waiting to be applied to the
+ * KeyDir. Key and value point into the caller's buffer.
+ */
+typedef struct CaskyRecoveryRecord {
+    const char *key;
+    const char *value;      // NULL unless the values are kept in memory
+    const char *record;     // the whole log record, whose CRC is checked
+                            // before it is applied; NULL for hint records
+    char *raw;              // value decompressed for the KeyDir, owned
+    uint64_t hash;
+    uint64_t value_offset;
+    uint64_t timestamp;
+    uint64_t expires;
+    uint32_t key_len;
+    uint32_t value_len;     // stored length if compressed
+    uint32_t raw_len;       // length of `raw`
+    CaskyCodec codec;       // of the value bytes in the log
+    CaskyRecordType type;   // never CASKY_RECORD_PUT_EMPTY
+    int corrupt;            // CRC mismatch, or a value that fails to
+                            // decompress
+} CaskyRecoveryRecord;
+
+/**
+ * Records of one log file being applied to the KeyDir, in batches.
+ *
+ * With several threads a batch is applied in two passes: the keys are
+ * hashed in parallel, then every thread applies the records of its own
+ * shards, in log order. No shard is shared, so no lock is taken, and the
+ * KeyDir ends up exactly as after a sequential replay: the last record of
+ * a key wins.
+ *
+ * Log records are verified along with the hashing, and compressed values
+ * kept in memory decompressed. The first corrupted
+ * record ends the replay: the records before it are applied, the ones
+ * after it are ignored (Bitcask style). The groups of a block file are
+ * verified as they are parsed instead, and a damaged one only loses its
+ * block (see block.h).
+ */
+typedef struct CaskyRecovery {
+    KeyDir *kd;
+    uint32_t file_id;       // file the records come from
+    CaskyLogHeader header;  // its format
+    uint32_t threads;       // 1 applies every batch in the calling thread
+    uint64_t now;           // records expired at this time are counted in
+                            // kd->replay_expired
+    int corrupt;            // a corrupted record was found
+    uint64_t corrupt_offset; // its offset in the log
+    int resynced;           // damaged groups of a block file were skipped
+    CaskyRecoveryRecord *recs;
+    size_t count;
+    size_t cap;
+} CaskyRecovery;
+
+int  casky_recovery_init(CaskyRecovery *r, KeyDir *kd, uint32_t file_id,
+                         const CaskyLogHeader *header);
+void casky_recovery_add(CaskyRecovery *r, const char *record, CaskyRecordType type,
+                        const char *key, uint32_t key_len,
+                        const char *value, uint32_t value_len, uint64_t value_offset,
+                        CaskyCodec codec, uint64_t timestamp, uint64_t expires);
+void casky_recovery_apply(CaskyRecovery *r);
+void casky_recovery_free(CaskyRecovery *r);
+uint32_t casky_recovery_threads(const KeyDir *kd, uint32_t wanted);
+
+#endif // !__RECOVERY_H
@@ -0,0 +1,177 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include "casky.h"
+#include "segment.h"
+
+/**
+ * casky_read_file_open - Opens a log file for reading values, as `file_id`.
+ *
+ * Returns: the read file, or NULL if it could not be opened or allocated.
+ */
+CaskyReadFile *casky_read_file_open(const char *path, uint32_t file_id) {
+  CaskyReadFile *rf = calloc(1, sizeof(CaskyReadFile));
+  if (!rf) return NULL;
+  rf->fd = open(path, O_RDONLY);
+  if (rf->fd < 0) {
+    free(rf);
+    return NULL;
+  }
+  rf->file_id = file_id;
+  return rf;
+}
+
+// Also the EBR free callback of replaced read files
+void casky_read_file_free(void *ptr, void *ctx) {
+  CaskyReadFile *rf = ptr;
+  (void)ctx;
+  close(rf->fd);
+  free(rf);
+}
+
+/**
+ * casky_file_table_new - Allocates a table for `count` file ids from
+ * `first_id`, all of them unused.
+ */
+CaskyFileTable *casky_file_table_new(uint32_t first_id, uint32_t count) {
+  CaskyFileTable *t = calloc(1, sizeof(CaskyFileTable) + count * sizeof(CaskyReadFile *));
+  if (!t) return NULL;
+  t->first_id = first_id;
+  t->count = count;
+  return t;
+}
+
+/**
+ * casky_file_table_add - Returns a copy of `t` (which may be NULL) that also
+ * holds `rf`. The read files are shared between both tables.
+ *
+ * Returns: the new table, or NULL on allocation failure.
+ */
+CaskyFileTable *casky_file_table_add(const CaskyFileTable *t, CaskyReadFile *rf) {
+  uint32_t first = rf->file_id, last = rf->file_id;
+  if (t && t->count > 0) {
+    if (t->first_id < first) first = t->first_id;
+    if (t->first_id + t->count - 1 > last) last = t->first_id + t->count - 1;
+  }
+  CaskyFileTable *fresh = casky_file_table_new(first, last - first + 1);
+  if (!fresh) return NULL;
+  for (uint32_t i = 0; t && i < t->count; i++)
+    fresh->files[t->first_id + i - first] = t->files[i];
+  fresh->files[rf->file_id - first] = rf;
+  return fresh;
+}
+
+/**
+ * casky_file_table_from - Returns a copy of `t` without the files whose id
+ * is below `first_id`. The read files kept are shared between both tables,
+ * the others are left to the caller.
+ *
+ * Returns: the new table, or NULL on allocation failure.
+ */
+CaskyFileTable *casky_file_table_from(const CaskyFileTable *t, uint32_t first_id) {
+  uint32_t end = t->first_id + t->count;
+  if (first_id < t->first_id) first_id = t->first_id;
+  CaskyFileTable *fresh = casky_file_table_new(first_id, end > first_id ? end - first_id : 0);
+  if (!fresh) return NULL;
+  for (uint32_t i = 0; i < fresh->count; i++)
+    fresh->files[i] = t->files[first_id - t->first_id + i];
+  return fresh;
+}
+
+// Also the EBR free callback of replaced tables: the read files are not
+// released
+void casky_file_table_free(void *ptr, void *ctx) {
+  (void)ctx;
+  free(ptr);
+}
+
+/**
+ * casky_file_table_close - Releases a table together with its read files.
+ */
+void casky_file_table_close(CaskyFileTable *t) {
+  if (!t) return;
+  for (uint32_t i = 0; i < t->count; i++)
+    if (t->files[i]) casky_read_file_free(t->files[i], NULL);
+  free(t);
+}
+
+/**
+ * casky_segment_path - Path of segment `file_id` of the database directory
+ * `dir`.
+ *
+ * Returns: the path, to be freed by the caller, or NULL on allocation
+ * failure.
+ */
+char *casky_segment_path(const char *dir, uint32_t file_id) {
+  size_t len = strlen(dir) + 1 + CASKY_SEGMENT_NAME_LEN + 1;
+  char *path = malloc(len);
+  if (!path) return NULL;
+  int n = snprintf(path, len, "%s/", dir);
+  snprintf(path + n, len - n, CASKY_SEGMENT_NAME_FMT, file_id);
+  return path;
+}
+
+/**
+ * casky_segment_hint_path - Path of the hint file of segment `file_id`.
+ *
+ * Returns: the path, to be freed by the caller, or NULL on allocation
+ * failure.
+ */
+char *casky_segment_hint_path(const char *dir, uint32_t file_id) {
+  size_t len = strlen(dir) + 1 + CASKY_HINT_NAME_LEN + 1;
+  char *path = malloc(len);
+  if (!path) return NULL;
+  int n = snprintf(path, len, "%s/", dir);
+  snprintf(path + n, len - n, CASKY_HINT_NAME_FMT, file_id);
+  return path;
+}
+
+static int casky_id_cmp(const void *a, const void *b) {
+  uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+/**
+ * casky_segment_list - Lists the segments of a database directory. Other
+ * files are ignored.
+ *
+ * @ids:   receives the file ids, in increasing order (to be freed by the
+ *         caller)
+ * @count: receives their number
+ *
+ * Returns: 0 on success, -1 if the directory cannot be read or on
+ * allocation failure.
+ */
+int casky_segment_list(const char *dir, uint32_t **ids, size_t *count) {
+  DIR *d = opendir(dir);
+  if (!d) return -1;
+  uint32_t *list = NULL;
+  size_t n = 0, cap = 0;
+  struct dirent *de;
+  while ((de = readdir(d)) != NULL) {
+    unsigned int id;
+    char tail;
+    if (strlen(de->d_name) != CASKY_SEGMENT_NAME_LEN ||
+        sscanf(de->d_name, "%10u.lo%c", &id, &tail) != 2 || tail != 'g')
+      continue;
+    if (n == cap) {
+      cap = cap ? cap * 2 : 16;
+      uint32_t *grown = realloc(list, cap * sizeof(uint32_t));
+      if (!grown) {
+        free(list);
+        closedir(d);
+        return -1;
+      }
+      list = grown;
+    }
+    list[n++] = id;
+  }
+  closedir(d);
+  if (n > 1) qsort(list, n, sizeof(uint32_t), casky_id_cmp);
+  *ids = list;
+  *count = n;
+  return 0;
+}
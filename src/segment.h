@@ -0,0 +1,29 @@
+#ifndef __SEGMENT_H
+#define __SEGMENT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "casky.h"
+
+// Segment files are named after their file_id, zero-padded so that a
+// directory listing sorts them in log order
+#define CASKY_SEGMENT_NAME_FMT "%010u.log"
+#define CASKY_SEGMENT_NAME_LEN 14
+// Hint file of a segment (see hint.h)
+#define CASKY_HINT_NAME_FMT "%010u.hint"
+#define CASKY_HINT_NAME_LEN 15
+
+CaskyReadFile  *casky_read_file_open(const char *path, uint32_t file_id);
+void            casky_read_file_free(void *ptr, void *ctx);
+
+CaskyFileTable *casky_file_table_new(uint32_t first_id, uint32_t count);
+CaskyFileTable *casky_file_table_add(const CaskyFileTable *t, CaskyReadFile *rf);
+CaskyFileTable *casky_file_table_from(const CaskyFileTable *t, uint32_t first_id);
+void            casky_file_table_free(void *ptr, void *ctx);
+void            casky_file_table_close(CaskyFileTable *t);
+
+char *casky_segment_path(const char *dir, uint32_t file_id);
+char *casky_segment_hint_path(const char *dir, uint32_t file_id);
+int   casky_segment_list(const char *dir, uint32_t **ids, size_t *count);
+
+#endif // !__SEGMENT_H
@@ -0,0 +1,184 @@
+#include <stdlib.h>
+#include <string.h>
+#include "skiplist.h"
+
+#ifdef THREAD_SAFE
+#define SKIP_RDLOCK(l) pthread_rwlock_rdlock(&(l)->lock)
+#define SKIP_WRLOCK(l) pthread_rwlock_wrlock(&(l)->lock)
+#define SKIP_UNLOCK(l) pthread_rwlock_unlock(&(l)->lock)
+#else
+#define SKIP_RDLOCK(l)
+#define SKIP_WRLOCK(l)
+#define SKIP_UNLOCK(l)
+#endif
+
+static inline const char *casky_skip_key(const CaskySkipNode *n) {
+  return (const char *)&n->next[n->height];
+}
+
+/**
+ * casky_key_cmp - Bytewise comparison of two keys, memcmp() style. When one
+ * key is a prefix of the other, the shorter one sorts first.
+ */
+int casky_key_cmp(const char *a, size_t a_len, const char *b, size_t b_len) {
+  int c = memcmp(a, b, a_len < b_len ? a_len : b_len);
+  if (c != 0) return c;
+  return (a_len > b_len) - (a_len < b_len);
+}
+
+static CaskySkipNode *casky_skip_node_new(uint32_t height, const char *key, size_t key_len) {
+  CaskySkipNode *n = malloc(sizeof(CaskySkipNode) + height * sizeof(CaskySkipNode*) + key_len);
+  if (!n) return NULL;
+  n->key_len = key_len;
+  n->height = height;
+  memset(n->next, 0, height * sizeof(CaskySkipNode*));
+  if (key_len) memcpy((char *)&n->next[height], key, key_len);
+  return n;
+}
+
+/**
+ * casky_skiplist_new - Allocates an empty skiplist. `seed` initialises the
+ * generator of the tower heights.
+ *
+ * Returns: the skiplist, or NULL on allocation failure.
+ */
+CaskySkiplist *casky_skiplist_new(uint64_t seed) {
+  CaskySkiplist *l = calloc(1, sizeof(CaskySkiplist));
+  if (!l) return NULL;
+  l->head = casky_skip_node_new(CASKY_SKIPLIST_MAX_LEVEL, NULL, 0);
+  if (!l->head) {
+    free(l);
+    return NULL;
+  }
+  l->level = 1;
+  l->rng = seed ? seed : 0x9e3779b97f4a7c15ULL;
+#ifdef THREAD_SAFE
+  pthread_rwlock_init(&l->lock, NULL);
+#endif
+  return l;
+}
+
+/**
+ * casky_skiplist_free - Frees the skiplist and all its nodes.
+ */
+void casky_skiplist_free(CaskySkiplist *l) {
+  if (!l) return;
+  CaskySkipNode *n = l->head;
+  while (n) {
+    CaskySkipNode *next = n->next[0];
+    free(n);
+    n = next;
+  }
+#ifdef THREAD_SAFE
+  pthread_rwlock_destroy(&l->lock);
+#endif
+  free(l);
+}
+
+// Each level keeps one node in four of the level below
+static uint32_t casky_skip_random_height(CaskySkiplist *l) {
+  l->rng ^= l->rng << 13;
+  l->rng ^= l->rng >> 7;
+  l->rng ^= l->rng << 17;
+  uint64_t r = l->rng;
+  uint32_t height = 1;
+  while (height < CASKY_SKIPLIST_MAX_LEVEL && (r & 3) == 0) {
+    height++;
+    r >>= 2;
+  }
+  return height;
+}
+
+/**
+ * Finds, on every level, the last node whose key is below `key`. Returns
+ * the node that follows it on the bottom level: the first key >= `key`.
+ */
+static CaskySkipNode *casky_skip_seek(const CaskySkiplist *l, const char *key, size_t key_len,
+                                      CaskySkipNode **update) {
+  CaskySkipNode *x = l->head;
+  for (uint32_t i = l->level; i-- > 0;) {
+    while (x->next[i] &&
+           casky_key_cmp(casky_skip_key(x->next[i]), x->next[i]->key_len, key, key_len) < 0)
+      x = x->next[i];
+    if (update) update[i] = x;
+  }
+  return x->next[0];
+}
+
+/**
+ * casky_skiplist_insert - Adds a key. Adding a key already present does
+ * nothing.
+ *
+ * Returns: 0 on success, -1 on allocation failure.
+ */
+int casky_skiplist_insert(CaskySkiplist *l, const char *key, size_t key_len) {
+  CaskySkipNode *update[CASKY_SKIPLIST_MAX_LEVEL];
+
+  SKIP_WRLOCK(l);
+  CaskySkipNode *x = casky_skip_seek(l, key, key_len, update);
+  if (x && casky_key_cmp(casky_skip_key(x), x->key_len, key, key_len) == 0) {
+    SKIP_UNLOCK(l);
+    return 0;
+  }
+
+  uint32_t height = casky_skip_random_height(l);
+  CaskySkipNode *n = casky_skip_node_new(height, key, key_len);
+  if (!n) {
+    SKIP_UNLOCK(l);
+    return -1;
+  }
+  for (; l->level < height; l->level++)
+    update[l->level] = l->head;
+  for (uint32_t i = 0; i < height; i++) {
+    n->next[i] = update[i]->next[i];
+    update[i]->next[i] = n;
+  }
+  l->size++;
+  SKIP_UNLOCK(l);
+  return 0;
+}
+
+/**
+ * casky_skiplist_remove - Removes a key.
+ *
+ * Returns: 1 if the key was found and removed, 0 otherwise.
+ */
+int casky_skiplist_remove(CaskySkiplist *l, const char *key, size_t key_len) {
+  CaskySkipNode *update[CASKY_SKIPLIST_MAX_LEVEL];
+
+  SKIP_WRLOCK(l);
+  CaskySkipNode *x = casky_skip_seek(l, key, key_len, update);
+  if (!x || casky_key_cmp(casky_skip_key(x), x->key_len, key, key_len) != 0) {
+    SKIP_UNLOCK(l);
+    return 0;
+  }
+  for (uint32_t i = 0; i < x->height; i++)
+    update[i]->next[i] = x->next[i];
+  while (l->level > 1 && !l->head->next[l->level - 1])
+    l->level--;
+  l->size--;
+  SKIP_UNLOCK(l);
+  free(x);
+  return 1;
+}
+
+/**
+ * casky_skiplist_walk - Calls `fn` on the keys in ascending order, starting
+ * from the first key >= `from` (> `from` when `after` is set; a NULL `from`
+ * starts at the smallest key), until `fn` returns non-zero or the keys run
+ * out.
+ *
+ * `fn` runs under the read lock of the skiplist: it must not modify the
+ * KeyDir, and the key is only valid until it returns.
+ */
+void casky_skiplist_walk(CaskySkiplist *l, const char *from, size_t from_len,
+                         int after, casky_skip_fn fn, void *ctx) {
+  SKIP_RDLOCK(l);
+  CaskySkipNode *x = from ? casky_skip_seek(l, from, from_len, NULL) : l->head->next[0];
+  if (x && after && casky_key_cmp(casky_skip_key(x), x->key_len, from, from_len) == 0)
+    x = x->next[0];
+  for (; x; x = x->next[0])
+    if (fn(casky_skip_key(x), x->key_len, ctx))
+      break;
+  SKIP_UNLOCK(l);
+}
@@ -0,0 +1,55 @@
+#ifndef __SKIPLIST_H
+#define __SKIPLIST_H
+
+#include <stddef.h>
+#include <stdint.h>
+#ifdef THREAD_SAFE
+#include <pthread.h>
+#endif
+
+// Tallest tower; with one node in four promoted per level this covers
+// billions of keys.
+#define CASKY_SKIPLIST_MAX_LEVEL 24
+
+/**
+ * A key of the ordered index. The forward links are followed by the key
+ * bytes, so a node is a single allocation.
+ */
+typedef struct CaskySkipNode {
+    uint32_t key_len;
+    uint32_t height;                    // number of forward links
+    struct CaskySkipNode *next[];
+} CaskySkipNode;
+
+/**
+ * Ordered index of the keys of a KeyDir, kept next to the hash index when
+ * CaskyOptions.ordered_index is set. It only holds the keys, in bytewise
+ * order (memcmp, a prefix sorts before its extensions): values and their
+ * location are always looked up in the hash index, so updating an existing
+ * key never touches the skiplist.
+ *
+ * Unlike the shards, the skiplist spans every key, so it has a lock of its
+ * own, always taken after the shard lock.
+ */
+typedef struct CaskySkiplist {
+    CaskySkipNode *head;                // sentinel, CASKY_SKIPLIST_MAX_LEVEL links
+    uint32_t level;                     // levels in use
+    size_t size;                        // number of keys
+    uint64_t rng;                       // xorshift state for tower heights
+#ifdef THREAD_SAFE
+    pthread_rwlock_t lock;
+#endif
+} CaskySkiplist;
+
+// Called in key order by casky_skiplist_walk(); non-zero stops the walk
+typedef int (*casky_skip_fn)(const char *key, size_t key_len, void *ctx);
+
+CaskySkiplist *casky_skiplist_new(uint64_t seed);
+void           casky_skiplist_free(CaskySkiplist *l);
+int            casky_skiplist_insert(CaskySkiplist *l, const char *key, size_t key_len);
+int            casky_skiplist_remove(CaskySkiplist *l, const char *key, size_t key_len);
+void           casky_skiplist_walk(CaskySkiplist *l, const char *from, size_t from_len,
+                                   int after, casky_skip_fn fn, void *ctx);
+int            casky_key_cmp(const char *a, size_t a_len, const char *b, size_t b_len);
+
+#endif // !__SKIPLIST_H
@@ -0,0 +1,303 @@
+#include <stdlib.h>
+#include <string.h>
+// ThreadSanitizer cannot see the 16-byte control loads racing with the
+// atomic byte stores of a writer, so it gets the portable code
+#if defined(__SSE2__) && !defined(__SANITIZE_THREAD__)
+#define CASKY_SWISS_SSE2
+#include <emmintrin.h>
+#endif
+#include "casky.h"
+#include "utils.h"
+#include "swiss.h"
+#include "ebr.h"
+#include "arena.h"
+
+#define CTRL_EMPTY   ((int8_t)-128)   // 0b10000000
+#define CTRL_DELETED ((int8_t)-2)     // 0b11111110
+// Full slots store H2, the low 7 bits of the hash, so their sign bit is clear.
+
+// Nodes cache the low 32 bits of the hash, which is all a table is ever
+// rebuilt from: H1 must not look further
+#define H1(hash) ((uint32_t)(hash) >> 7)
+#define H2(hash) ((int8_t)((hash) & 0x7F))
+
+/*
+ * Lookups run without any lock while a writer may be updating the table, so
+ * the writer always stores a slot before its control byte (and clears the
+ * control byte before the slot), and readers load them in the opposite
+ * order. A reader can therefore find an empty slot behind a matching tag,
+ * and skips it. The arrays themselves never change size: growing builds a new
+ * table, see casky_swiss_reserve().
+ */
+
+/**
+ * Returns a bitmask with bit i set when control byte i of the group equals
+ * `tag`.
+ */
+static inline uint32_t group_match(const int8_t *group, int8_t tag) {
+#ifdef CASKY_SWISS_SSE2
+  __m128i ctrl = _mm_load_si128((const __m128i *)group);
+  return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8(tag)));
+#else
+  uint32_t mask = 0;
+  for (int i = 0; i < CASKY_SWISS_GROUP_SIZE; i++)
+    if (__atomic_load_n(&group[i], __ATOMIC_RELAXED) == tag) mask |= 1u << i;
+  return mask;
+#endif
+}
+
+/**
+ * Returns a bitmask of the EMPTY or DELETED slots of a group. Both have the
+ * sign bit set, so SSE2 gets them with a single movemask.
+ */
+static inline uint32_t group_match_free(const int8_t *group) {
+#ifdef CASKY_SWISS_SSE2
+  __m128i ctrl = _mm_load_si128((const __m128i *)group);
+  return (uint32_t)_mm_movemask_epi8(ctrl);
+#else
+  uint32_t mask = 0;
+  for (int i = 0; i < CASKY_SWISS_GROUP_SIZE; i++)
+    if (__atomic_load_n(&group[i], __ATOMIC_RELAXED) < 0) mask |= 1u << i;
+  return mask;
+#endif
+}
+
+static int casky_swiss_alloc(CaskySwiss *t, size_t capacity) {
+  if (capacity < CASKY_SWISS_GROUP_SIZE)
+    capacity = CASKY_SWISS_GROUP_SIZE;
+  capacity = casky_next_pow2(capacity);
+
+  void *ctrl = NULL;
+  if (posix_memalign(&ctrl, CASKY_SWISS_GROUP_SIZE, capacity) != 0)
+    return -1;
+  uint32_t *slots = calloc(capacity, sizeof(uint32_t));
+  if (!slots) {
+    free(ctrl);
+    return -1;
+  }
+  memset(ctrl, CTRL_EMPTY, capacity);
+
+  t->ctrl = ctrl;
+  t->slots = slots;
+  t->capacity = capacity;
+  t->size = 0;
+  t->tombstones = 0;
+  return 0;
+}
+
+/**
+ * casky_swiss_new - Allocates an empty table with at least `capacity` slots,
+ * for nodes allocated from `arena`.
+ *
+ * Returns: the new table, or NULL on allocation failure.
+ */
+CaskySwiss *casky_swiss_new(size_t capacity, CaskyArena *arena) {
+  CaskySwiss *t = calloc(1, sizeof(CaskySwiss));
+  if (!t) return NULL;
+  t->arena = arena;
+  if (casky_swiss_alloc(t, capacity) != 0) {
+    free(t);
+    return NULL;
+  }
+  return t;
+}
+
+/**
+ * casky_swiss_free - Releases the table arrays. The nodes are owned by the
+ * KeyDir and must be freed by the caller beforehand.
+ */
+void casky_swiss_free(CaskySwiss *t) {
+  if (!t) return;
+  free(t->ctrl);
+  free(t->slots);
+  free(t);
+}
+
+/**
+ * Returns the first EMPTY or DELETED slot of the probe sequence of `hash`.
+ * The table always keeps at least one free slot, so this terminates.
+ */
+static size_t casky_swiss_find_free(const CaskySwiss *t, uint64_t hash) {
+  size_t group_mask = t->capacity / CASKY_SWISS_GROUP_SIZE - 1;
+  size_t g = H1(hash) & group_mask;
+
+  for (size_t probe = 1;; probe++) {
+    uint32_t free_mask = group_match_free(t->ctrl + g * CASKY_SWISS_GROUP_SIZE);
+    if (free_mask)
+      return g * CASKY_SWISS_GROUP_SIZE + __builtin_ctz(free_mask);
+    // Triangular probing visits every group when their number is a power
+    // of two
+    g = (g + probe) & group_mask;
+  }
+}
+
+static void casky_swiss_set(CaskySwiss *t, size_t slot, CaskyRef ref, uint64_t hash) {
+  if (t->ctrl[slot] == CTRL_DELETED)
+    t->tombstones--;
+  CASKY_PUBLISH(t->slots[slot], ref);
+  CASKY_PUBLISH(t->ctrl[slot], H2(hash));
+  t->size++;
+}
+
+/**
+ * Returns the slot of a node, or -1. Writer side: the node is in the table.
+ */
+static ptrdiff_t casky_swiss_slot_of(const CaskySwiss *t, const char *key, size_t key_len, uint64_t hash) {
+  size_t group_mask = t->capacity / CASKY_SWISS_GROUP_SIZE - 1;
+  size_t g = H1(hash) & group_mask;
+  int8_t tag = H2(hash);
+
+  for (size_t probe = 1; probe <= group_mask + 1; probe++) {
+    const int8_t *group = t->ctrl + g * CASKY_SWISS_GROUP_SIZE;
+    uint32_t match = group_match(group, tag);
+    while (match) {
+      size_t slot = g * CASKY_SWISS_GROUP_SIZE + __builtin_ctz(match);
+      EntryNode *node = casky_arena_ptr(t->arena, t->slots[slot]);
+      if (casky_key_eq(node, key, key_len, hash))
+        return slot;
+      match &= match - 1;
+    }
+    if (group_match(group, CTRL_EMPTY))
+      return -1;
+    g = (g + probe) & group_mask;
+  }
+  return -1;
+}
+
+/**
+ * casky_swiss_reserve - Makes room for one more insert.
+ *
+ * When live slots plus tombstones would exceed 7/8 of the capacity, the
+ * content is copied into a new table: twice as large if it is really full,
+ * same size if the load is mostly made of tombstones. The hash cached in
+ * each node is reused, no key is hashed again. The old table is left
+ * untouched, so that concurrent readers can finish their lookups in it.
+ *
+ * Returns: `t` itself when it has room, a new table that replaces it (the
+ * caller publishes it and retires `t`), or NULL if `t` is full and no new
+ * table could be allocated.
+ */
+CaskySwiss *casky_swiss_reserve(CaskySwiss *t) {
+  if ((t->size + t->tombstones + 1) * 8 <= t->capacity * 7)
+    return t;
+
+  size_t capacity = (t->size + 1) * 8 > t->capacity * 4 ? t->capacity * 2 : t->capacity;
+  CaskySwiss *fresh = casky_swiss_new(capacity, t->arena);
+  if (!fresh)
+    return t->size + t->tombstones + 1 < t->capacity ? t : NULL;
+
+  for (size_t i = 0; i < t->capacity; i++) {
+    if (t->ctrl[i] < 0) continue;
+    const EntryNode *node = casky_arena_ptr(t->arena, t->slots[i]);
+    casky_swiss_set(fresh, casky_swiss_find_free(fresh, node->hash), t->slots[i], node->hash);
+  }
+  return fresh;
+}
+
+/**
+ * casky_swiss_find - Looks up a key.
+ *
+ * Probes one group of 16 control bytes at a time; only the slots whose tag
+ * equals H2(hash) are dereferenced, and their key is only compared with
+ * memcmp when the hash cached in the node matches as well. The probe
+ * stops at the first group that contains an EMPTY slot.
+ *
+ * Safe without locks against a concurrent writer, inside an EBR critical
+ * section.
+ *
+ * Returns: the node holding the key, or NULL if it is not in the table.
+ */
+EntryNode *casky_swiss_find(const CaskySwiss *t, const char *key, size_t key_len, uint64_t hash) {
+  size_t group_mask = t->capacity / CASKY_SWISS_GROUP_SIZE - 1;
+  size_t g = H1(hash) & group_mask;
+  int8_t tag = H2(hash);
+
+  for (size_t probe = 1; probe <= group_mask + 1; probe++) {
+    const int8_t *group = t->ctrl + g * CASKY_SWISS_GROUP_SIZE;
+    uint32_t match = group_match(group, tag);
+    // Slots are loaded after the control bytes that announced them
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    while (match) {
+      CaskyRef ref = CASKY_LOAD(t->slots[g * CASKY_SWISS_GROUP_SIZE + __builtin_ctz(match)]);
+      if (ref) {
+        EntryNode *node = casky_arena_ptr(t->arena, ref);
+        if (casky_key_eq(node, key, key_len, hash))
+          return node;
+      }
+      match &= match - 1;
+    }
+    if (group_match(group, CTRL_EMPTY))
+      return NULL;
+    g = (g + probe) & group_mask;
+  }
+  return NULL;
+}
+
+/**
+ * casky_swiss_insert - Adds a node whose key is known not to be present.
+ * `hash` is the one cached in the node.
+ *
+ * The caller makes room first with casky_swiss_reserve().
+ *
+ * Returns: 0 on success, -1 if the table is full.
+ */
+int casky_swiss_insert(CaskySwiss *t, CaskyRef ref, uint64_t hash) {
+  if (t->size + t->tombstones + 1 >= t->capacity)
+    return -1;
+  casky_swiss_set(t, casky_swiss_find_free(t, hash), ref, hash);
+  return 0;
+}
+
+/**
+ * casky_swiss_replace - Swaps the node of a key for a new version of it, in
+ * place. Readers see either the old or the new node.
+ *
+ * Returns: the reference of the old node, or CASKY_REF_NULL if it is not
+ * in the table.
+ */
+CaskyRef casky_swiss_replace(CaskySwiss *t, EntryNode *old_node, CaskyRef new_ref) {
+  ptrdiff_t slot = casky_swiss_slot_of(t, casky_node_key(old_node), old_node->key_len,
+                                       old_node->hash);
+  if (slot < 0)
+    return CASKY_REF_NULL;
+  CaskyRef old_ref = t->slots[slot];
+  if (casky_arena_ptr(t->arena, old_ref) != (void *)old_node)
+    return CASKY_REF_NULL;
+  ((EntryNode *)casky_arena_ptr(t->arena, new_ref))->hash = old_node->hash;
+  CASKY_PUBLISH(t->slots[slot], new_ref);
+  return old_ref;
+}
+
+/**
+ * casky_swiss_erase_slot - Frees a slot, e.g. while iterating the table.
+ *
+ * A slot can go straight back to EMPTY when its group already has an EMPTY
+ * slot: no probe sequence ever continued past such a group. Otherwise it
+ * becomes a DELETED tombstone.
+ */
+void casky_swiss_erase_slot(CaskySwiss *t, size_t slot) {
+  const int8_t *group = t->ctrl + (slot & ~(size_t)(CASKY_SWISS_GROUP_SIZE - 1));
+  if (group_match(group, CTRL_EMPTY)) {
+    CASKY_PUBLISH(t->ctrl[slot], CTRL_EMPTY);
+  } else {
+    CASKY_PUBLISH(t->ctrl[slot], CTRL_DELETED);
+    t->tombstones++;
+  }
+  CASKY_PUBLISH(t->slots[slot], CASKY_REF_NULL);
+  t->size--;
+}
+
+/**
+ * casky_swiss_remove - Unlinks a key from the table.
+ *
+ * Returns: the reference of the removed node (still to be freed by the
+ * caller), or CASKY_REF_NULL if the key was not found.
+ */
+CaskyRef casky_swiss_remove(CaskySwiss *t, const char *key, size_t key_len, uint64_t hash) {
+  ptrdiff_t slot = casky_swiss_slot_of(t, key, key_len, hash);
+  if (slot < 0)
+    return CASKY_REF_NULL;
+  CaskyRef ref = t->slots[slot];
+  casky_swiss_erase_slot(t, slot);
+  return ref;
+}
@@ -0,0 +1,42 @@
+#ifndef __SWISS_H
+#define __SWISS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "arena.h"
+
+// Number of control bytes inspected at once. 16 matches one SSE2 register.
+#define CASKY_SWISS_GROUP_SIZE 16
+
+struct EntryNode;
+
+/**
+ * Open-addressing KeyDir engine in the style of Swiss tables.
+ *
+ * Every slot has a one byte control tag: EMPTY, DELETED or the low 7 bits of
+ * the key hash. Lookups load a whole group of 16 tags and compare them in
+ * parallel, so that only slots whose tag matches are dereferenced: on a
+ * populated table a lookup touches the tag group and the matching node.
+ *
+ * One writer at a time (the shard lock); lookups need no lock. A table never
+ * changes capacity: casky_swiss_reserve() returns a bigger copy instead.
+ */
+typedef struct CaskySwiss {
+    size_t capacity;            // number of slots (power of two, >= group size)
+    size_t size;                // live slots
+    size_t tombstones;          // DELETED slots still part of probe sequences
+    int8_t *ctrl;               // one control byte per slot, 16-byte aligned
+    CaskyRef *slots;            // the nodes, parallel to ctrl
+    CaskyArena *arena;          // resolves the slots, owned by the shard
+} CaskySwiss;
+
+CaskySwiss       *casky_swiss_new(size_t capacity, CaskyArena *arena);
+void              casky_swiss_free(CaskySwiss *t);
+struct EntryNode *casky_swiss_find(const CaskySwiss *t, const char *key, size_t key_len, uint64_t hash);
+CaskySwiss       *casky_swiss_reserve(CaskySwiss *t);
+int               casky_swiss_insert(CaskySwiss *t, CaskyRef ref, uint64_t hash);
+CaskyRef          casky_swiss_replace(CaskySwiss *t, struct EntryNode *old_node, CaskyRef new_ref);
+CaskyRef          casky_swiss_remove(CaskySwiss *t, const char *key, size_t key_len, uint64_t hash);
+void              casky_swiss_erase_slot(CaskySwiss *t, size_t slot);
+
+#endif // !__SWISS_H
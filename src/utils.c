@@ -2,23 +2,27 @@
 #include <time.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <unistd.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include "casky.h"
 #include "crc.h"
 #include "utils.h"
+#include "swiss.h"
+#include "arena.h"
+#include "hash.h"
+#include "ebr.h"
+#include "skiplist.h"
+#include "frozen.h"
+#include "diskindex.h"
+#include "segment.h"
+#include "hint.h"
+#include "codec.h"
+#include "block.h"
 
 static casky_stat_t casky_statistics;
 
-#ifdef THREAD_SAFE
-#include <pthread.h>
-#define LOCK_STATS(s) pthread_mutex_lock(&(s).lock)
-#define UNLOCK_STATS(s) pthread_mutex_unlock(&(s).lock)
-#else
-#define LOCK_STATS(s)
-#define UNLOCK_STATS(s)
-#endif
-
 
 /**
  * Checks whether the given path refers to a regular file.
@@ -61,6 +65,9 @@ const char* casky_strerror(CaskyError err) {
     case CASKY_ERR_CORRUPT: return "Data corrupt";
     case CASKY_ERR_INVALID_KEY: return "Invalid key";
     case CASKY_ERR_KEY_NOT_FOUND: return "Key not found";
+    case CASKY_ERR_BUFFER_TOO_SMALL: return "Buffer too small";
+    case CASKY_ERR_INVALID_VALUE: return "Invalid value";
+    case CASKY_ERR_NOT_SUPPORTED: return "Operation not supported";
     default: return "Unknown error";
   }
 }
@@ -72,6 +79,9 @@ const char* casky_strerror(CaskyError err) {
  * and XOR operation. This variant is widely used for hash tables 
  * and has proven effective in practice.
  *
+ * The KeyDir itself uses the seeded casky_hash() (see hash.c); this
+ * function is kept for API compatibility and for comparison benchmarks.
+ *
  * Formula:
  *     hash(i) = hash(i-1) * 33 ^ str[i]
  *
@@ -92,38 +102,93 @@ unsigned long casky_djb2_hash_xor(unsigned char *str)
 }
 
 /**
- * casky_write_data_to_file
+ * Encodes the header of a record into `hdr`, CRC included. The CRC is
+ * computed incrementally over the header fields, the key and the value, so
+ * that the record never has to be assembled in one buffer.
+ */
+static void casky_record_header(unsigned char hdr[CASKY_RECORD_HEADER_SIZE], CaskyRecordType type,
+                                const char *key, uint32_t key_len,
+                                const char *value, uint32_t value_len, CaskyCodec codec,
+                                uint64_t timestamp, uint64_t expires) {
+  uint32_t key_field = casky_record_key_field(key_len, codec, type, value_len);
+  unsigned char *p = hdr + sizeof(uint32_t);
+  memcpy(p, &timestamp, sizeof(timestamp)); p += sizeof(timestamp);
+  memcpy(p, &expires, sizeof(expires)); p += sizeof(expires);
+  memcpy(p, &key_field, sizeof(key_field)); p += sizeof(key_field);
+  memcpy(p, &value_len, sizeof(value_len));
+
+  uint32_t crc = casky_crc32c_update(0, hdr + sizeof(uint32_t),
+                                     CASKY_RECORD_HEADER_SIZE - sizeof(uint32_t));
+  crc = casky_crc32c_update(crc, (const unsigned char *)key, key_len);
+  if (value_len > 0)
+    crc = casky_crc32c_update(crc, (const unsigned char *)value, value_len);
+  memcpy(hdr, &crc, sizeof(crc));
+}
+
+/**
+ * casky_record_verify - Checks the CRC of a whole record, header, key and
+ * value, held in memory.
+ *
+ * Returns: 0 if the CRC32C matches, 1 if the record carries the CRC32 of
+ * older releases instead, -1 if the record is corrupted.
+ */
+int casky_record_verify(const unsigned char *record, size_t record_len) {
+  uint32_t stored;
+  memcpy(&stored, record, sizeof(stored));
+  const unsigned char *p = record + sizeof(stored);
+  size_t len = record_len - sizeof(stored);
+  if (casky_crc32c(p, len) == stored)
+    return 0;
+  return casky_crc32(p, len) == stored ? 1 : -1;
+}
+
+/**
+ * casky_write_record
  *
- * Writes a key/value record to the append-only log file.
+ * Writes a key/value record to the append-only log file. Keys and values
+ * are arbitrary bytes: only the given lengths are written, never a NUL.
  * 
- * Record format (Bitcask style):
+ * Record format (Bitcask style), the type in the flags of KeyLen:
  *  - PUT:    [CRC][Timestamp][ExpirationTs][KeyLen][ValueLen][Key][Value]
  *  - DELETE: [CRC][Timestamp][ExpirationTs][KeyLen][0][Key]
+ *  - TOUCH:  [CRC][Timestamp][ExpirationTs][KeyLen][0][Key]
  *
  * Parameters:
  *  - fp: the FILE handle. Closing the file will be up to the callee function
  *  when checking for a bad result
  *  - sync_on_write: if non-zero, forces an fsync() after writing to ensure
  *                   crash-resilient persistence
- *  - key: the key to store or delete
- *  - value: the value to store; NULL if this is a DELETE record
+ *  - key, key_len: the key to store or delete, at most CASKY_KEY_LEN_MAX
+ *                  bytes
+ *  - value, value_len: the value to store; NULL if this is a DELETE record
  *
  * Returns:
  *  - 0 on success
  *  - -1 on error (errno set in casky_errno)
  *
  * Notes:
- *  - Calculates CRC32 over the record (excluding the CRC field itself)
- *  - Allocates a temporary buffer for CRC calculation
+ *  - Calculates CRC32C over the record (excluding the CRC field itself)
  *  - Writes in binary append mode
+ *  - The KeyDir log goes through casky_write_record_fd() instead
  */
-int casky_write_data_to_file(FILE *fp, int sync_on_write, 
-                             const char *key, const char *value, 
-                             uint64_t timestamp, uint64_t expires) {
-
-  // PUT  record: [CRC][Timestamp][Expires][KeyLen][ValueLen][Key][Value]
-  // DELETE record: [CRC][Timestamp][Expires][KeyLen][0][Key]
+int casky_write_record(FILE *fp, int sync_on_write,
+                       const char *key, uint32_t key_len,
+                       const char *value, uint32_t value_len,
+                       uint64_t timestamp, uint64_t expires) {
+  return casky_write_record_codec(fp, sync_on_write,
+                                  value ? CASKY_RECORD_PUT : CASKY_RECORD_DELETE, key, key_len,
+                                  value, value_len, CASKY_CODEC_NONE, timestamp, expires);
+}
 
+/**
+ * casky_write_record_codec - casky_write_record() of a record of any type,
+ * for a value already in its stored form: `value_len` bytes compressed
+ * with `codec` (see codec.h).
+ */
+int casky_write_record_codec(FILE *fp, int sync_on_write, CaskyRecordType type,
+                             const char *key, uint32_t key_len,
+                             const char *value, uint32_t value_len, CaskyCodec codec,
+                             uint64_t timestamp, uint64_t expires) {
   if (!fp) {
     casky_errno =  CASKY_ERR_INVALID_PATH;
     return -1;
@@ -135,305 +200,1772 @@ int casky_write_data_to_file(FILE *fp, int sync_on_write,
     return -1;
   }
 
-  uint32_t key_len   = strlen(key);
-  uint32_t value_len = value ? strlen(value) : 0;
+  if (!value)
+    value_len = 0;
 
-  size_t buf_len = sizeof(timestamp) + sizeof(expires) + sizeof(key_len) + sizeof(value_len) + key_len + value_len;
-  unsigned char *buf = malloc(buf_len);
-  if (!buf) {
-    casky_errno = CASKY_ERR_MEMORY;
+  unsigned char hdr[CASKY_RECORD_HEADER_SIZE];
+  casky_record_header(hdr, type, key, key_len, value, value_len, codec, timestamp, expires);
+
+  if (fwrite(hdr, 1, sizeof(hdr), fp) != sizeof(hdr) ||
+      fwrite(key, 1, key_len, fp) != key_len ||
+      (value_len > 0 && fwrite(value, 1, value_len, fp) != value_len) ||
+      fflush(fp) != 0) {
+    casky_errno = CASKY_ERR_IO;
     return -1;
   }
 
-  unsigned char *p = buf;
-  memcpy(p, &timestamp, sizeof(timestamp)); p += sizeof(timestamp);
-  memcpy(p, &expires, sizeof(expires)); p+= sizeof(expires);
-  memcpy(p, &key_len, sizeof(key_len)); p += sizeof(key_len);
-  memcpy(p, &value_len, sizeof(value_len)); p += sizeof(value_len);
-  memcpy(p, key, key_len); p += key_len;
-  if (value)
-    memcpy(p, value, value_len);
-
-  uint32_t crc = casky_crc32(buf, buf_len);
-  free(buf);
-
-  fwrite(&crc, sizeof(crc), 1, fp);
-  fwrite(&timestamp, sizeof(timestamp), 1, fp);
-  fwrite(&expires, sizeof(expires), 1, fp);
-  fwrite(&key_len, sizeof(key_len), 1, fp);
-  fwrite(&value_len, sizeof(value_len), 1, fp);
-  fwrite(key, 1, key_len, fp);
-  if (value_len > 0)
-    fwrite(value, 1, value_len, fp);
-
-  fflush(fp);
   if (sync_on_write == 1)
     fsync(fileno(fp));
 
   return 0;
 }
+
 /**
- * Inserts or updates a key-value pair **in memory** (KeyDir only),
- * without writing to the log file. Used internally when loading
- * the database from disk.
+ * casky_write_record_fd - casky_write_record() for an unbuffered file
+ * descriptor: header, key and value leave with a single writev(), which
+ * is only repeated for what a short write left behind.
  *
- * If the key exists, updates the value and timestamp.
- * If the key does not exist, appends a new EntryNode in the correct bucket.
- *
- * @param kd        Pointer to KeyDir
- * @param key       Key string (null-terminated)
- * @param value     Value string (null-terminated)
- * @param timestamp Optional timestamp to set (e.g., from log)
- * @param expires   The timestamp where this entry is expired and no longer
- *                  valid
+ * Returns: 0 on success, -1 with casky_errno set.
  */
-void casky_put_in_memory(KeyDir *kd, const char *key, const char *value, uint64_t timestamp, uint64_t expires) {
-  if (!kd || !key || !value) return;
+int casky_write_record_fd(int fd, int sync_on_write, CaskyRecordType type,
+                          const char *key, uint32_t key_len,
+                          const char *value, uint32_t value_len, CaskyCodec codec,
+                          uint64_t timestamp, uint64_t expires) {
+  if (fd < 0) {
+    casky_errno = CASKY_ERR_INVALID_PATH;
+    return -1;
+  }
+  if (!key) {
+    casky_errno = CASKY_ERR_INVALID_POINTER;
+    return -1;
+  }
+  if (!value)
+    value_len = 0;
 
-  unsigned long hash = casky_djb2_hash_xor((unsigned char*)key);
-  size_t bucket_index = hash % kd->num_buckets;
+  unsigned char hdr[CASKY_RECORD_HEADER_SIZE];
+  casky_record_header(hdr, type, key, key_len, value, value_len, codec, timestamp, expires);
+
+  struct iovec iov[3] = {
+    { hdr, sizeof(hdr) },
+    { (void *)key, key_len },
+    { (void *)value, value_len },
+  };
+  if (casky_writev_all(fd, iov, value_len > 0 ? 3 : 2) != 0)
+    return -1;
 
-  EntryNode *node = kd->root[bucket_index];
-  EntryNode *prev = NULL;
+  if (sync_on_write == 1)
+    fsync(fd);
 
-  while (node) {
-    if (strcmp(key, node->entry.key) == 0) {
-      // update existing value
-      free(node->entry.value);
-      node->entry.value = strdup(value);
-      node->entry.timestamp = timestamp;
-      node->entry.expiration_ts = expires;
+  return 0;
+}
 
-      casky_stats_inc_put(strlen(node->entry.key) + strlen(node->entry.value));
-      return;
+/**
+ * casky_writev_all - writev() of the `count` pieces of `iov`, repeated for
+ * whatever a short write left behind. `iov` is consumed.
+ *
+ * Returns: 0 on success, -1 with casky_errno set to CASKY_ERR_IO.
+ */
+int casky_writev_all(int fd, struct iovec *iov, int count) {
+  while (count > 0) {
+    ssize_t n = writev(fd, iov, count);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0) {
+      casky_errno = CASKY_ERR_IO;
+      return -1;
+    }
+    while (count > 0 && (size_t)n >= iov->iov_len) {
+      n -= iov->iov_len;
+      iov++;
+      count--;
     }
-    prev = node;
-    node = node->next;
+    if (count > 0) {
+      iov->iov_base = (char *)iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+  return 0;
+}
+
+/**
+ * casky_write_data_to_file - casky_write_record() for NUL-terminated keys
+ * and values.
+ */
+int casky_write_data_to_file(FILE *fp, int sync_on_write,
+                             const char *key, const char *value,
+                             uint64_t timestamp, uint64_t expires) {
+  if (!key) {
+    casky_errno = CASKY_ERR_INVALID_POINTER;
+    return -1;
   }
+  return casky_write_record(fp, sync_on_write, key, strlen(key),
+                            value, value ? strlen(value) : 0, timestamp, expires);
+}
 
-  // key not found → create new node
-  EntryNode *new_node = calloc(1, sizeof(EntryNode));
-  new_node->entry.key = strdup(key);
-  new_node->entry.value = strdup(value);
-  new_node->entry.timestamp = timestamp;
-  new_node->entry.expiration_ts = expires;
-  new_node->next = NULL;
+// Bytes appending a record to the active segment takes
+static uint64_t casky_log_record_size(const KeyDir *kd, uint32_t key_len, uint32_t value_len,
+                                      CaskyCodec codec, uint64_t timestamp, uint64_t expires) {
+  if (kd->log_header.format != CASKY_LOG_RECORDS)
+    return casky_block_append_size(&kd->log_header, kd->log_size, key_len, value_len, codec,
+                                   timestamp, expires);
+  return CASKY_RECORD_HEADER_SIZE + (uint64_t)key_len + value_len;
+}
+
+/**
+ * casky_log_append - Appends a record to the KeyDir log.
+ *
+ * Same as casky_write_record_fd() on kd->log (casky_block_write_fd() if the
+ * active segment is a block file), but also keeps track of the log size so
+ * that the caller learns where the value bytes of the record landed, which
+ * is what the KeyDir stores instead of the value itself.
+ *
+ * @kd:           Pointer to the KeyDir
+ * @value:        the value in its stored form, compressed with `codec`
+ * @value_offset: if not NULL, receives the offset of the value in the log
+ *
+ * Returns: 0 on success, -1 on error (casky_errno set)
+ */
+int casky_log_append(KeyDir *kd, CaskyRecordType type, const char *key, uint32_t key_len,
+                     const char *value, uint32_t value_len, CaskyCodec codec,
+                     uint64_t timestamp, uint64_t expires, uint64_t *value_offset) {
+  if (!kd || !kd->log || !key) {
+    casky_errno = CASKY_ERR_INVALID_POINTER;
+    return -1;
+  }
+  if (!value)
+    value_len = 0;
 
-  casky_stats_inc_entries();
-  casky_stats_inc_put(strlen(new_node->entry.key) + strlen(new_node->entry.value));
+  uint64_t record_size = casky_log_record_size(kd, key_len, value_len, codec, timestamp, expires);
+  if (kd->segment_size && kd->log_size > casky_log_header_size(&kd->log_header) &&
+      kd->log_size + record_size > kd->segment_size) {
+    if (casky_log_rotate(kd) != 0)
+      return -1;
+    record_size = casky_log_record_size(kd, key_len, value_len, codec, timestamp, expires);
+  }
 
-  if (!prev) {
-    // empty bucket
-    kd->root[bucket_index] = new_node;
-  } else {
-    prev->next = new_node;
+  // With sync_on_write, the caller waits for the flush with
+  // casky_log_sync() once it has released its locks
+  int fd = fileno(kd->log);
+  int ret = kd->log_header.format != CASKY_LOG_RECORDS ?
+      casky_block_write_fd(fd, &kd->log_header, kd->log_size, type, key, key_len,
+                           value, value_len, codec, timestamp, expires) :
+      casky_write_record_fd(fd, 0, type, key, key_len, value, value_len, codec, timestamp,
+                            expires);
+  if (ret != 0) {
+    // Part of the record may have reached the file. The log is cut back to
+    // its last record (or group): replay stops at a torn record and skips
+    // a damaged group, so anything appended after it would be lost.
+    struct stat st;
+    if (ftruncate(fd, kd->log_size) != 0 && fstat(fd, &st) == 0)
+      kd->log_size = st.st_size;
+    // The hint can no longer describe the segment
+    if (kd->hint) kd->hint->lost = 1;
+    return -1;
   }
 
-  kd->num_entries++;
+  // The value closes the record
+  uint64_t offset = kd->log_size + record_size - value_len;
+  if (kd->hint)
+    casky_hint_add(kd->hint, type, key, key_len, value_len, codec, offset, timestamp, expires);
+  if (value_offset)
+    *value_offset = offset;
+  kd->log_size += record_size;
+  __atomic_store_n(&kd->log_appended, kd->log_appended + record_size, __ATOMIC_RELEASE);
+#ifdef THREAD_SAFE
+  // Wakes the flusher early, once per batch. A signal the flusher misses
+  // only delays the flush to the end of its interval.
+  if (kd->flusher_running && kd->sync_bytes &&
+      kd->log_appended - __atomic_load_n(&kd->log_synced, __ATOMIC_ACQUIRE) >= kd->sync_bytes &&
+      !__atomic_exchange_n(&kd->flush_requested, 1, __ATOMIC_ACQ_REL))
+    pthread_cond_signal(&kd->flush_cond);
+#else
+  if (kd->sync_mode == CASKY_SYNC_PERIODIC)
+    casky_log_sync_due(kd);
+#endif
+  // Log files replaced by a compaction, once their last reader is gone
+  casky_ebr_reclaim(kd->retired);
+  return 0;
+}
+/**
+ * casky_next_pow2 - Rounds a bucket count up to the next power of two.
+ *
+ * The KeyDir selects buckets with a mask instead of a modulo, and doubling a
+ * power-of-two table splits every old bucket i into exactly the new buckets
+ * i and i + old_size, which keeps incremental rehashing simple.
+ */
+size_t casky_next_pow2(size_t n) {
+  size_t p = 1;
+  while (p < n)
+    p <<= 1;
+  return p;
+}
+
+/*
+ * Concurrency model of the index
+ *
+ * Writers of a shard are serialized by the shard lock. Readers take no lock
+ * at all: they run inside an EBR critical section (see ebr.h) and rely on
+ * the following rules.
+ *
+ *  - A node is never modified once it is reachable, except for its `next`
+ *    link. An update builds a new node and swaps it in with a single
+ *    pointer store; the old node is retired.
+ *  - Every pointer a reader follows (bucket heads, next links, Swiss slots,
+ *    table pointers) is written with CASKY_PUBLISH() and read with
+ *    CASKY_LOAD().
+ *  - Unlinked nodes, bucket arrays and Swiss tables are retired on the
+ *    retire list of their shard and only freed when no reader can still
+ *    hold them.
+ *  - Incremental rehashing moves nodes between chains, which can make a
+ *    reader that is walking a chain miss its key. Rehash steps are wrapped
+ *    in a sequence counter (resize_seq), and a chained lookup that misses
+ *    while it changed is retried. Hits never need a retry: keys are always
+ *    compared.
+ */
+
+static void casky_free_cb(void *ptr, void *ctx) {
+  (void)ctx;
+  free(ptr);
+}
+
+static void casky_swiss_free_cb(void *ptr, void *ctx) {
+  (void)ctx;
+  casky_swiss_free(ptr);
 }
 
 /**
- * Deletes a key from memory (KeyDir only), without writing to the log file.
- * Used internally when replaying DELETE records from the log.
+ * casky_kd_shard - Returns the shard that owns a key hash.
  *
- * If the key is not found, does nothing.
+ * Shards are selected with the top bits of the hash, while the tables inside
+ * a shard index with the low bits, so every shard sees a uniform spread of
+ * hashes.
+ */
+CaskyShard *casky_kd_shard(const KeyDir *kd, uint64_t hash) {
+  return &kd->shards[(hash >> 48) & (kd->num_shards - 1)];
+}
+
+/**
+ * casky_kd_lock_all - Locks every shard, for operations that need a stable
+ * view of the whole KeyDir (compaction, snapshots). Shards are always taken
+ * in index order, and before the log lock, so this cannot deadlock with
+ * single-key operations. Readers are not held off, they take no lock.
  *
- * @param kd  Pointer to KeyDir
- * @param key Key string to delete
- * @return 1 if the key was found and deleted, 0 otherwise
+ * @write: non-zero to take the write locks, zero for the read locks
  */
-int casky_delete_from_memory(KeyDir *kd, const char *key) {
-  if (!kd || !key)
-    return 0;
+void casky_kd_lock_all(KeyDir *kd, int write) {
+#ifdef THREAD_SAFE
+  for (size_t i = 0; i < kd->num_shards; i++) {
+    if (write) SHARD_WRLOCK(&kd->shards[i]);
+    else SHARD_RDLOCK(&kd->shards[i]);
+  }
+#else
+  (void)kd;
+  (void)write;
+#endif
+}
 
-  unsigned long hash = casky_djb2_hash_xor((unsigned char *)key);
-  size_t bucket_index = hash % kd->num_buckets;
+/**
+ * casky_kd_unlock_all - Releases the locks taken by casky_kd_lock_all().
+ */
+void casky_kd_unlock_all(KeyDir *kd) {
+#ifdef THREAD_SAFE
+  for (size_t i = kd->num_shards; i-- > 0;)
+    SHARD_UNLOCK(&kd->shards[i]);
+#else
+  (void)kd;
+#endif
+}
 
-  EntryNode *node = kd->root[bucket_index];
-  EntryNode *prev = NULL;
+/**
+ * casky_kd_reclaim - Frees the retired memory of every shard that no reader
+ * can see anymore. Takes the shard locks one at a time.
+ */
+void casky_kd_reclaim(KeyDir *kd) {
+  for (size_t i = 0; i < kd->num_shards; i++) {
+    CaskyShard *s = &kd->shards[i];
+    SHARD_WRLOCK(s);
+    casky_ebr_reclaim(s->retired);
+    SHARD_UNLOCK(s);
+  }
+}
 
-  while (node) {
-    if (strcmp(node->entry.key, key) == 0) {
-      // Found the key, remove it
-      if (prev == NULL) {
-        kd->root[bucket_index] = node->next;
-      } else {
-        prev->next = node->next;
-      }
-      casky_stats_inc_delete(strlen(node->entry.key) + strlen(node->entry.value));
-      casky_stats_dec_entries();
+// Writer side of resize_seq: odd while nodes are moving between chains
+static void casky_shard_resize_begin(CaskyShard *s) {
+  __atomic_store_n(&s->resize_seq, s->resize_seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
 
-      free(node->entry.key);
-      free(node->entry.value);
-      free(node);
+static void casky_shard_resize_end(CaskyShard *s) {
+  __atomic_store_n(&s->resize_seq, s->resize_seq + 1, __ATOMIC_RELEASE);
+}
 
-      kd->num_entries--;
-      return 1; // key was found and deleted
-    }
-    prev = node;
-    node = node->next;
+/**
+ * Returns the address of the bucket head that owns the given hash.
+ *
+ * While an incremental rehash is running, old buckets that have not been
+ * migrated yet still own their keys, so lookups and inserts must go there.
+ * Writer side, under the shard lock.
+ */
+static uint32_t *casky_bucket_for(CaskyShard *s, uint64_t hash) {
+  if (s->old_root) {
+    size_t old_index = hash & (s->old_num_buckets - 1);
+    if (old_index >= s->rehash_index)
+      return &s->old_root[old_index];
   }
+  return &s->root[hash & (s->num_buckets - 1)];
+}
 
-  return 0; // key not found
+/**
+ * Reader side of casky_bucket_for(), without the shard lock.
+ *
+ * An array is never indexed with the size of a bigger one: num_buckets is
+ * published after root, and old_root is read again after old_num_buckets
+ * in case a later resize already reused the field. A bucket picked from
+ * stale values can only make the lookup miss, which resize_seq catches.
+ */
+static uint32_t *casky_bucket_for_read(CaskyShard *s, uint64_t hash) {
+  uint32_t *old = CASKY_LOAD(s->old_root);
+  if (old) {
+    size_t old_index = hash & (CASKY_LOAD(s->old_num_buckets) - 1);
+    if (CASKY_LOAD(s->old_root) == old && old_index >= CASKY_LOAD(s->rehash_index))
+      return &old[old_index];
+  }
+  size_t num_buckets = CASKY_LOAD(s->num_buckets);
+  uint32_t *root = CASKY_LOAD(s->root);
+  return &root[hash & (num_buckets - 1)];
 }
 
 /**
- * casky_get_from_memory - Core function to retrieve a value from the in-memory KeyDir
- * @kd: pointer to the KeyDir structure
- * @key: key to look up
+ * casky_shard_rehash_step - Migrates up to `steps` old buckets into the new
+ * table of a shard.
  *
- * This function searches the in-memory hash table for the given key and returns
- * a dynamically allocated copy of its value if found. It does NOT perform any
- * locking and is therefore NOT thread-safe. Use casky_get() if you need thread
- * safety (it wraps this core function with a mutex when compiled with -DTHREAD_SAFE).
+ * Each node of an old bucket is moved (not copied) to its bucket in the new
+ * array, using the hash cached in the node. Once the last old bucket has
+ * been migrated the old array is retired and the shard leaves the
+ * rehashing state.
  *
- * Return: strdup'ed value on success, NULL on error (sets casky_errno)
+ * @s:     Shard, write-locked by the caller
+ * @steps: Maximum number of old buckets to migrate
  */
-char* casky_get_from_memory(KeyDir *kd, const char *key) {
-  if (!kd) {
-    casky_errno = CASKY_ERR_INVALID_POINTER;
-    return NULL;
+void casky_shard_rehash_step(CaskyShard *s, size_t steps) {
+  if (!s || !s->old_root) return;
+
+  casky_shard_resize_begin(s);
+  while (steps-- > 0 && s->rehash_index < s->old_num_buckets) {
+    CaskyRef ref = s->old_root[s->rehash_index];
+    CASKY_PUBLISH(s->old_root[s->rehash_index], CASKY_REF_NULL);
+    while (ref) {
+      EntryNode *node = casky_arena_ptr(s->arena, ref);
+      CaskyRef next = node->next;
+      size_t index = node->hash & (s->num_buckets - 1);
+      CASKY_PUBLISH(node->next, s->root[index]);
+      CASKY_PUBLISH(s->root[index], ref);
+      ref = next;
+    }
+    CASKY_PUBLISH(s->rehash_index, s->rehash_index + 1);
   }
-  if (!key) {
-    casky_errno = CASKY_ERR_INVALID_KEY;
-    return NULL;
+
+  if (s->rehash_index >= s->old_num_buckets) {
+    // old_num_buckets is left as is: a reader may still be using it with
+    // the retired array
+    casky_ebr_retire(s->retired, s->old_root, casky_free_cb, NULL);
+    CASKY_PUBLISH(s->old_root, NULL);
+  }
+  casky_shard_resize_end(s);
+}
+
+/**
+ * casky_kd_rehash_finish - Completes every pending incremental rehash at
+ * once. The caller must hold the write locks of all shards (or be the only
+ * user of the KeyDir).
+ */
+void casky_kd_rehash_finish(KeyDir *kd) {
+  if (!kd) return;
+  for (size_t i = 0; i < kd->num_shards; i++) {
+    CaskyShard *s = &kd->shards[i];
+    if (s->old_root)
+      casky_shard_rehash_step(s, s->old_num_buckets - s->rehash_index);
   }
+}
+
+/**
+ * Starts doubling the bucket array of a shard when its load factor has been
+ * crossed.
+ *
+ * The new array is only allocated here; moving the nodes is spread over the
+ * following writes by casky_shard_rehash_step(). If the allocation fails the
+ * shard simply keeps working with longer chains.
+ */
+static void casky_shard_maybe_grow(CaskyShard *s) {
+  if (s->swiss ||
+      s->num_entries <= s->num_buckets * CASKY_MAX_LOAD_FACTOR)
+    return;
+  // A previous rehash has not completed yet: finish it before starting
+  // another one. With CASKY_REHASH_STEP >= 1 this basically never happens.
+  if (s->old_root)
+    casky_shard_rehash_step(s, s->old_num_buckets - s->rehash_index);
+
+  uint32_t *new_root = calloc(s->num_buckets * 2, sizeof(uint32_t));
+  if (!new_root) return;
 
-  unsigned long hash = casky_djb2_hash_xor((unsigned char *)key);
-  size_t bucket_index = hash % kd->num_buckets;
+  casky_shard_resize_begin(s);
+  CASKY_PUBLISH(s->old_num_buckets, s->num_buckets);
+  CASKY_PUBLISH(s->rehash_index, 0);
+  CASKY_PUBLISH(s->old_root, s->root);
+  CASKY_PUBLISH(s->root, new_root);
+  CASKY_PUBLISH(s->num_buckets, s->num_buckets * 2);
+  casky_shard_resize_end(s);
+}
 
-  EntryNode *node = kd->root[bucket_index];
+/**
+ * casky_kd_init_index - Allocates the in-memory index of a KeyDir.
+ *
+ * The index is split into opts->num_shards shards. Depending on opts->engine
+ * each of them holds either the bucket array of the chained hash table or an
+ * open-addressing Swiss table; opts->initial_buckets is the initial number of
+ * buckets (chained) or slots (Swiss) over all the shards. With
+ * opts->ordered_index an ordered index of the keys is allocated as well.
+ *
+ * Returns: 0 on success, -1 on allocation failure.
+ */
+int casky_kd_init_index(KeyDir *kd, const CaskyOptions *opts) {
+  size_t num_shards = casky_next_pow2(opts->num_shards > 0 ?
+                                      opts->num_shards : CASKY_NUM_SHARDS);
+  size_t total = opts->initial_buckets > 0 ? opts->initial_buckets :
+                                             CASKY_INITIAL_BUCKETS_NUM;
+  size_t size = casky_next_pow2(total > num_shards ? total / num_shards : 1);
 
+  kd->hash_seed = opts->hash_seed ? opts->hash_seed : casky_hash_random_seed();
   uint64_t now = (uint64_t)time(NULL);
+  kd->time_base = now > (1ULL << 31) ? now - (1ULL << 31) : 0;
+  kd->engine = opts->engine == CASKY_ENGINE_SWISS ? CASKY_ENGINE_SWISS :
+                                                    CASKY_ENGINE_CHAINED;
+  kd->retired = calloc(1, sizeof(CaskyRetireList));
+  if (!kd->retired) return -1;
+  if (opts->ordered_index) {
+    kd->ordered = casky_skiplist_new(kd->hash_seed);
+    if (!kd->ordered) return -1;
+  }
 
-  while (node) {
-    if (strcmp(key, node->entry.key) == 0) {
-      if (node->entry.expiration_ts > 0 && node->entry.expiration_ts <= now) {
-        // expired key
-        casky_stats_inc_delete(strlen(node->entry.key) + strlen(node->entry.value));
-        casky_delete_from_memory(kd, key);
-      } else {
-        casky_errno = CASKY_OK;
-        casky_stats_inc_get();
-        return strdup(node->entry.value);
-      }
+  void *shards = NULL;
+  if (posix_memalign(&shards, _Alignof(CaskyShard), num_shards * sizeof(CaskyShard)) != 0)
+    return -1;
+  memset(shards, 0, num_shards * sizeof(CaskyShard));
+  kd->shards = shards;
+  kd->num_shards = num_shards;
+
+#ifdef THREAD_SAFE
+  for (size_t i = 0; i < num_shards; i++)
+    pthread_rwlock_init(&kd->shards[i].lock, NULL);
+#endif
+  for (size_t i = 0; i < num_shards; i++) {
+    CaskyShard *s = &kd->shards[i];
+    s->arena = casky_arena_new();
+    s->retired = calloc(1, sizeof(CaskyRetireList));
+    if (!s->arena || !s->retired) return -1;
+    if (kd->engine == CASKY_ENGINE_SWISS) {
+      s->swiss = casky_swiss_new(size, s->arena);
+      if (!s->swiss) return -1;
+    } else {
+      s->num_buckets = size;
+      s->root = calloc(s->num_buckets, sizeof(uint32_t));
+      if (!s->root) return -1;
     }
-    node = node->next;
   }
+  return 0;
+}
 
-  casky_errno = CASKY_ERR_KEY_NOT_FOUND;
-  return NULL;
+// Size of the arena block holding a node, its key and its inline value
+static size_t casky_node_size(const EntryNode *node) {
+  size_t size = sizeof(EntryNode) + node->key_len + 1;
+  if (node->file_id == CASKY_FILE_ID_MEMORY && node->offset_lo == CASKY_REF_NULL)
+    size += (size_t)node->value_len + 1;
+  return size;
 }
 
-// STAT utility routines
 /**
- * Initialize a casky_stat_t structure.
- * Sets all counters to zero and initializes the mutex if thread-safety is enabled.
+ * Allocates a node with its key, and the value when it is small enough,
+ * in a single arena block. Larger values kept in memory get a block of
+ * their own, whose reference takes the place of the value offset.
  *
- * Parameters:
- *  - stats: pointer to the casky_stat_t structure to initialize 
+ * Returns: the node, with *ref set to its reference, or NULL.
  */
-void casky_stats_init() {
-  LOCK_STATS(casky_statistics);
-  casky_statistics.total_keys = 0;
-  casky_statistics.memory_bytes = 0;
-  casky_statistics.num_puts = 0;
-  casky_statistics.num_gets = 0;
-  casky_statistics.num_deletes = 0;
-  UNLOCK_STATS(casky_statistics);
-  
+static EntryNode *casky_node_new(CaskyShard *s, const char *key, uint32_t key_len,
+                                 const char *value, uint32_t value_len, CaskyRef *ref) {
+  size_t size = sizeof(EntryNode) + key_len + 1;
+  int inline_value = value && value_len < CASKY_INLINE_VALUE_MAX;
+  if (inline_value)
+    size += (size_t)value_len + 1;
+  if (size > UINT32_MAX) return NULL;
+
+  *ref = casky_arena_alloc(s->arena, size);
+  if (!*ref) return NULL;
+  EntryNode *node = casky_arena_ptr(s->arena, *ref);
+  memset(node, 0, sizeof(EntryNode));
+  char *node_key = (char *)(node + 1);
+  memcpy(node_key, key, key_len);
+  node_key[key_len] = '\0';
+  node->key_len = key_len;
+  node->value_len = value_len;
+
+  if (value) {
+    char *copy = node_key + key_len + 1;
+    if (!inline_value) {
+      CaskyRef value_ref = casky_arena_alloc(s->arena, (size_t)value_len + 1);
+      if (!value_ref) {
+        casky_arena_free(s->arena, *ref, size);
+        return NULL;
+      }
+      copy = casky_arena_ptr(s->arena, value_ref);
+      node->offset_lo = value_ref;
+    }
+    memcpy(copy, value, value_len);
+    copy[value_len] = '\0';
+    node->file_id = CASKY_FILE_ID_MEMORY;
+  }
+  return node;
 }
 
-void casky_stats_inc_put(size_t bytes) {
-  LOCK_STATS(casky_statistics);
-  casky_statistics.num_puts++;
-  casky_statistics.memory_bytes += bytes;
-  UNLOCK_STATS(casky_statistics);
+static void casky_node_free(CaskyShard *s, CaskyRef ref) {
+  EntryNode *node = casky_arena_ptr(s->arena, ref);
+  if (node->file_id == CASKY_FILE_ID_MEMORY && node->offset_lo != CASKY_REF_NULL)
+    casky_arena_free(s->arena, node->offset_lo, (size_t)node->value_len + 1);
+  casky_arena_free(s->arena, ref, casky_node_size(node));
 }
 
-void casky_stats_inc_delete(size_t bytes) {
-  LOCK_STATS(casky_statistics);
-  casky_statistics.num_deletes++;
-  if (bytes > 0 && casky_statistics.memory_bytes >= bytes)
-    casky_statistics.memory_bytes -= bytes;
-  UNLOCK_STATS(casky_statistics);
+static void casky_node_free_cb(void *ref, void *shard) {
+  casky_node_free(shard, (CaskyRef)(uintptr_t)ref);
+}
 
+// Hands an unlinked node over to EBR
+static void casky_node_retire(CaskyShard *s, CaskyRef ref) {
+  casky_ebr_retire(s->retired, (void *)(uintptr_t)ref, casky_node_free_cb, s);
 }
-casky_stat_t casky_stats_get(void) {
-  LOCK_STATS(casky_statistics);
-  casky_stat_t copy;
-  copy = casky_statistics;
-  UNLOCK_STATS(casky_statistics);
-  return copy;
+
+// Drops a key unlinked from its shard: ordered index, counters and node
+static void casky_node_forget(KeyDir *kd, CaskyShard *s, CaskyRef ref, const EntryNode *node) {
+  if (kd->ordered)
+    casky_skiplist_remove(kd->ordered, casky_node_key(node), node->key_len);
+  casky_node_retire(s, ref);
+  s->num_entries--;
+  __atomic_sub_fetch(&kd->num_entries, 1, __ATOMIC_RELAXED);
 }
-void casky_stats_inc_entries(void) {
-  LOCK_STATS(casky_statistics);
-  casky_statistics.total_keys++;
-  UNLOCK_STATS(casky_statistics);
+
+/**
+ * casky_node_entry - Expands a node into the Entry it stands for. The key
+ * and value pointers of `e` point into the node.
+ */
+void casky_node_entry(const KeyDir *kd, const CaskyShard *s, const EntryNode *node, Entry *e) {
+  e->key = (char *)casky_node_key(node);
+  e->key_len = node->key_len;
+  e->value = (char *)casky_node_value(s, node);
+  e->value_len = node->value_len;
+  e->file_id = e->value ? 0 : node->file_id;
+  e->value_offset = e->value ? 0 : casky_node_offset(node);
+  e->codec = e->value ? CASKY_CODEC_NONE : casky_node_codec(node);
+  e->timestamp = casky_time_dec(kd, node->timestamp);
+  e->expiration_ts = casky_time_dec(kd, node->expiration_ts);
 }
-void casky_stats_dec_entries(void) {
-  LOCK_STATS(casky_statistics);
-  if (casky_statistics.total_keys > 0)
-    casky_statistics.total_keys--;
-  UNLOCK_STATS(casky_statistics);
+
+/**
+ * casky_shard_clone - Returns an unpublished copy of a node (key, value
+ * kept in memory, location and timestamps), to be changed and swapped in
+ * with casky_shard_replace(), or released with casky_shard_discard().
+ *
+ * Returns: the reference of the copy, or CASKY_REF_NULL on allocation
+ * failure.
+ */
+CaskyRef casky_shard_clone(CaskyShard *s, const EntryNode *node) {
+  CaskyRef ref;
+  EntryNode *copy = casky_node_new(s, casky_node_key(node), node->key_len,
+                                   casky_node_value(s, node), node->value_len, &ref);
+  if (!copy) return CASKY_REF_NULL;
+  copy->hash = node->hash;
+  if (copy->file_id != CASKY_FILE_ID_MEMORY) {
+    copy->file_id = node->file_id;
+    copy->offset_lo = node->offset_lo;
+    copy->offset_hi = node->offset_hi;
+  }
+  copy->timestamp = node->timestamp;
+  copy->expiration_ts = node->expiration_ts;
+  return ref;
 }
-void casky_stats_inc_get(void) {
-  LOCK_STATS(casky_statistics);
-  casky_statistics.num_gets++;
-  UNLOCK_STATS(casky_statistics);
+
+/**
+ * casky_shard_discard - Frees a node that was never published.
+ */
+void casky_shard_discard(CaskyShard *s, CaskyRef ref) {
+  casky_node_free(s, ref);
 }
 
-void casky_flush_log(KeyDir *kd) {
-  if (!kd || !kd->log) return;
-  fflush(kd->log);
-  if (kd->sync_on_write)
-    fsync(fileno(kd->log));
+/**
+ * casky_entry_bytes - Memory accounted to an entry in the statistics: the key
+ * plus the value when a copy of it is kept in memory.
+ */
+size_t casky_entry_bytes(const Entry *e) {
+  return e->key_len + (e->value ? e->value_len : 0);
 }
 
-// HANDLING SNAPSHOT
+/**
+ * casky_kd_read_fd - Returns the descriptor to pread() the values of a log
+ * file from, or -1 if `file_id` is not readable anymore (the entry has been
+ * relocated by a compaction since it was looked up).
+ *
+ * Safe without locks inside an EBR critical section: the table and its
+ * files are retired, not freed, when a compaction replaces them.
+ */
+int casky_kd_read_fd(KeyDir *kd, uint32_t file_id) {
+  const CaskyFileTable *t = CASKY_LOAD(kd->files);
+  if (!t || file_id - t->first_id >= t->count) return -1;
+  const CaskyReadFile *rf = t->files[file_id - t->first_id];
+  return rf ? rf->fd : -1;
+}
 
-int casky_do_snapshot(KeyDir *kd, const char *snapshot_file) {
-  if (!kd) {
-    casky_errno = CASKY_ERR_INVALID_POINTER;
-    return -1;
-  }
-  if (!snapshot_file) {
-    casky_errno = CASKY_ERR_INVALID_PATH;
-    return -1;
-  }
-  FILE *f = fopen(snapshot_file, "wb");
-  if (!f) {
-    fclose(f);
-    casky_errno = CASKY_ERR_IO;
-    UNLOCK(kd);
-    return -1;
+/**
+ * casky_copy_value - Copies the value bytes of an entry to `buf`, which has
+ * room for at least e->value_len bytes. No NUL is appended.
+ *
+ * @fd: descriptor to pread() the value from, ignored when the value is kept
+ *      in memory (see casky_kd_read_fd())
+ *
+ * Returns: 0 on success, -1 with casky_errno set to CASKY_ERR_IO.
+ */
+int casky_copy_value(int fd, const Entry *e, char *buf) {
+  if (e->value) {
+    memcpy(buf, e->value, e->value_len);
+    return 0;
   }
-
-  LOCK(kd);
-  for (size_t i = 0; i < kd->num_buckets; i++) {
-    EntryNode *node = kd->root[i];
-    while (node) {
-      if (node->entry.expiration_ts == 0 || node->entry.expiration_ts > (uint64_t)time(NULL)) {
-        if (casky_write_data_to_file(f, kd->sync_on_write,
-                                     node->entry.key, node->entry.value,
-                                     node->entry.timestamp,
-                                     node->entry.expiration_ts) != 0) {
-          fclose(f);
-          casky_errno = CASKY_ERR_IO;
-          UNLOCK(kd);
-          return -1;
-        }
-      }
-      node = node->next;
+  size_t done = 0;
+  while (done < e->value_len) {
+    ssize_t n = pread(fd, buf + done, e->value_len - done, e->value_offset + done);
+    if (n <= 0) {
+      casky_errno = CASKY_ERR_IO;
+      return -1;
     }
+    done += n;
   }
-  fflush(f);
-  if (kd->sync_on_write) fsync(fileno(f));
-  fclose(f);
-  UNLOCK(kd);
-  casky_errno = CASKY_OK;
   return 0;
 }
-KeyDir *casky_load_snapshot(const char *snapshot_file) {
-  return casky_init_kd_from_file(snapshot_file, 0);
+
+// Compressed values up to this size are read on the stack
+#define CASKY_LOAD_STACK_BUF 4096
+
+/**
+ * casky_load_value - Gets the value of an entry, decompressed, followed by
+ * a NUL.
+ *
+ * The value is copied into `buf` if it fits with its NUL in the `cap`
+ * bytes, otherwise, when `value` is not NULL, into a buffer allocated for
+ * it, to be freed by the caller. A compressed value is read whole first:
+ * its stored form tells its length.
+ *
+ * @fd:    descriptor to pread() the value from, see casky_copy_value()
+ * @value: if not NULL, receives `buf` or the allocated buffer
+ * @len:   receives the length of the value, also when it does not fit
+ *
+ * Returns: 0 on success, -1 with casky_errno set: CASKY_ERR_BUFFER_TOO_SMALL
+ * if the value does not fit and `value` is NULL, CASKY_ERR_MEMORY,
+ * CASKY_ERR_IO, or as casky_codec_decompress().
+ */
+int casky_load_value(int fd, const Entry *e, char *buf, size_t cap, char **value, size_t *len) {
+  char stack_buf[CASKY_LOAD_STACK_BUF];
+  char *stored = NULL, *dst = NULL;
+  uint32_t raw_len = e->value_len;
+  if (e->codec != CASKY_CODEC_NONE) {
+    stored = e->value_len <= sizeof(stack_buf) ? stack_buf : malloc(e->value_len);
+    if (!stored) {
+      casky_errno = CASKY_ERR_MEMORY;
+      return -1;
+    }
+    if (casky_copy_value(fd, e, stored) != 0 ||
+        casky_codec_raw_len(stored, e->value_len, &raw_len) != 0)
+      goto fail;
+  }
+  *len = raw_len;
+  dst = buf;
+  if (raw_len >= cap) {
+    if (!value) {
+      casky_errno = CASKY_ERR_BUFFER_TOO_SMALL;
+      goto fail;
+    }
+    if (!(dst = malloc((size_t)raw_len + 1))) {
+      casky_errno = CASKY_ERR_MEMORY;
+      goto fail;
+    }
+  }
+  if (stored ? casky_codec_decompress(e->codec, stored, e->value_len, dst, raw_len) != 0
+             : casky_copy_value(fd, e, dst) != 0)
+    goto fail;
+  dst[raw_len] = '\0';
+  if (stored != stack_buf) free(stored);
+  if (value) *value = dst;
+  return 0;
+
+fail:
+  if (dst != buf) free(dst);
+  if (stored != stack_buf) free(stored);
+  return -1;
+}
+
+static char *casky_pread_value(int fd, const Entry *e) {
+  char *value;
+  size_t len;
+  return casky_load_value(fd, e, NULL, 0, &value, &len) == 0 ? value : NULL;
+}
+
+/**
+ * casky_read_value - Returns a newly allocated, NUL-terminated copy of the
+ * value of an entry, decompressed.
+ *
+ * The in-memory copy is used when present, otherwise the value is fetched
+ * from the log with a single pread() at the recorded offset.
+ *
+ * Returns: the value (to be freed by the caller), or NULL with casky_errno
+ * set to CASKY_ERR_MEMORY or CASKY_ERR_IO.
+ */
+char *casky_read_value(KeyDir *kd, const Entry *e) {
+  return casky_pread_value(e->value ? -1 : casky_kd_read_fd(kd, e->file_id), e);
+}
+
+/**
+ * casky_write_entry - Adds the record of an entry to a new log file, e.g. a
+ * compacted log or a snapshot. A compressed value is copied as stored; with
+ * `compress` set, an uncompressed one is compressed with the codec of the
+ * KeyDir, as casky_put() would.
+ *
+ * @stored_len:   receives the length of the value bytes written
+ * @codec:        receives their codec
+ * @value_offset: receives their offset in the file
+ *
+ * Returns: 0 on success, -1 with casky_errno set.
+ */
+int casky_write_entry(KeyDir *kd, CaskyLogWriter *w, const Entry *e, int compress,
+                      uint32_t *stored_len, CaskyCodec *codec, uint64_t *value_offset) {
+  char *buf = NULL, *packed = NULL;
+  const char *value = e->value;
+  *stored_len = e->value_len;
+  *codec = e->codec;
+  if (!value) {
+    int fd = casky_kd_read_fd(kd, e->file_id);
+    if (!(buf = malloc(e->value_len ? e->value_len : 1))) {
+      casky_errno = CASKY_ERR_MEMORY;
+      return -1;
+    }
+    if (fd < 0 || casky_copy_value(fd, e, buf) != 0) {
+      free(buf);
+      casky_errno = CASKY_ERR_IO;
+      return -1;
+    }
+    value = buf;
+  }
+  if (compress && *codec == CASKY_CODEC_NONE && kd->codec != CASKY_CODEC_NONE &&
+      e->value_len >= kd->compress_min &&
+      (packed = casky_codec_compress(kd->codec, value, e->value_len, stored_len))) {
+    value = packed;
+    *codec = kd->codec;
+  }
+  int ret = casky_log_writer_add(w, e->key, e->key_len, value, *stored_len, *codec,
+                                 e->timestamp, e->expiration_ts, value_offset);
+  free(packed);
+  free(buf);
+  return ret;
+}
+
+/**
+ * casky_kd_hash - Hashes a key with the seed of the KeyDir.
+ */
+uint64_t casky_kd_hash(const KeyDir *kd, const char *key, size_t key_len) {
+  return casky_hash(key, key_len, kd->hash_seed);
+}
+
+/**
+ * casky_shard_find - Looks up a key in a shard, whatever the engine. The
+ * hash cached in each node rejects other keys before memcmp ever
+ * touches the key bytes.
+ *
+ * Needs no lock: callers either hold the shard write lock or are inside an
+ * EBR critical section.
+ */
+EntryNode *casky_shard_find(CaskyShard *s, const char *key, size_t key_len, uint64_t hash) {
+  CaskySwiss *t = CASKY_LOAD(s->swiss);
+  if (t)
+    return casky_swiss_find(t, key, key_len, hash);
+
+  for (;;) {
+    uint64_t seq = CASKY_LOAD(s->resize_seq);
+    for (CaskyRef ref = CASKY_LOAD(*casky_bucket_for_read(s, hash)); ref; ) {
+      EntryNode *node = casky_arena_ptr(s->arena, ref);
+      if (casky_key_eq(node, key, key_len, hash))
+        return node;
+      ref = CASKY_LOAD(node->next);
+    }
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (!(seq & 1) && __atomic_load_n(&s->resize_seq, __ATOMIC_RELAXED) == seq)
+      return NULL;
+  }
+}
+
+/**
+ * Adds a node whose key is not in the shard yet.
+ *
+ * Returns: 0 on success, -1 if the index could not make room for it.
+ */
+static int casky_shard_insert(CaskyShard *s, CaskyRef ref, EntryNode *node, uint64_t hash) {
+  node->hash = (uint32_t)hash;
+  if (s->swiss) {
+    CaskySwiss *t = casky_swiss_reserve(s->swiss);
+    if (!t) return -1;
+    if (t != s->swiss) {
+      casky_ebr_retire(s->retired, s->swiss, casky_swiss_free_cb, NULL);
+      CASKY_PUBLISH(s->swiss, t);
+    }
+    return casky_swiss_insert(t, ref, hash);
+  }
+
+  uint32_t *bucket = casky_bucket_for(s, hash);
+  node->next = *bucket;
+  CASKY_PUBLISH(*bucket, ref);
+  return 0;
+}
+
+/**
+ * Unlinks a key from the shard and returns the reference of its node, or
+ * CASKY_REF_NULL if missing. The node is still visible to readers until it
+ * is retired.
+ */
+static CaskyRef casky_shard_remove(CaskyShard *s, const char *key, size_t key_len, uint64_t hash) {
+  if (s->swiss)
+    return casky_swiss_remove(s->swiss, key, key_len, hash);
+
+  uint32_t *link = casky_bucket_for(s, hash);
+  while (*link) {
+    CaskyRef ref = *link;
+    EntryNode *node = casky_arena_ptr(s->arena, ref);
+    if (casky_key_eq(node, key, key_len, hash)) {
+      CASKY_PUBLISH(*link, node->next);
+      return ref;
+    }
+    link = &node->next;
+  }
+  return CASKY_REF_NULL;
+}
+
+/**
+ * casky_shard_replace - Swaps a node for a new version of the same key and
+ * retires the old one. Readers see either version, never a mix of the two.
+ * The shard is write-locked by the caller.
+ *
+ * Returns: 0 on success, -1 if old_node is not in the shard.
+ */
+int casky_shard_replace(CaskyShard *s, EntryNode *old_node, CaskyRef new_ref) {
+  EntryNode *new_node = casky_arena_ptr(s->arena, new_ref);
+  new_node->hash = old_node->hash;
+  if (s->swiss) {
+    CaskyRef old_ref = casky_swiss_replace(s->swiss, old_node, new_ref);
+    if (!old_ref)
+      return -1;
+    casky_node_retire(s, old_ref);
+    return 0;
+  }
+
+  uint32_t *link = casky_bucket_for(s, old_node->hash);
+  while (*link && casky_arena_ptr(s->arena, *link) != (void *)old_node)
+    link = &((EntryNode *)casky_arena_ptr(s->arena, *link))->next;
+  if (!*link)
+    return -1;
+  CaskyRef old_ref = *link;
+  new_node->next = old_node->next;
+  CASKY_PUBLISH(*link, new_ref);
+  casky_node_retire(s, old_ref);
+  return 0;
+}
+
+/**
+ * Visits the nodes of one bucket chain, unlinking the ones the callback
+ * removes.
+ *
+ * Returns: 1 if the callback asked to stop, 0 otherwise.
+ */
+static int casky_chain_foreach(KeyDir *kd, CaskyShard *s, uint32_t *link,
+                               casky_iter_cb cb, void *ctx) {
+  while (*link) {
+    CaskyRef ref = *link;
+    EntryNode *node = casky_arena_ptr(s->arena, ref);
+    Entry e;
+    casky_node_entry(kd, s, node, &e);
+    int ret = cb(node, &e, ctx);
+    if (ret == CASKY_ITER_REMOVE) {
+      CASKY_PUBLISH(*link, node->next);
+      casky_node_forget(kd, s, ref, node);
+    } else if (ret == CASKY_ITER_STOP) {
+      return 1;
+    } else {
+      link = &node->next;
+    }
+  }
+  return 0;
+}
+
+/**
+ * casky_shard_foreach - Calls `cb` on every node of one shard.
+ *
+ * Same contract as casky_kd_foreach(). The walk never moves nodes between
+ * tables, so with callbacks that only return CASKY_ITER_CONTINUE a read
+ * lock on the shard is enough, and two walks over an unchanged shard visit
+ * the nodes in the same order.
+ *
+ * Returns: 1 if the callback asked to stop, 0 otherwise.
+ */
+int casky_shard_foreach(KeyDir *kd, CaskyShard *s, casky_iter_cb cb, void *ctx) {
+  if (s->swiss) {
+    CaskySwiss *t = s->swiss;
+    for (size_t i = 0; i < t->capacity; i++) {
+      CaskyRef ref = t->slots[i];
+      if (!ref) continue;
+      EntryNode *node = casky_arena_ptr(s->arena, ref);
+      Entry e;
+      casky_node_entry(kd, s, node, &e);
+      int ret = cb(node, &e, ctx);
+      if (ret == CASKY_ITER_REMOVE) {
+        casky_swiss_erase_slot(t, i);
+        casky_node_forget(kd, s, ref, node);
+      } else if (ret == CASKY_ITER_STOP) {
+        return 1;
+      }
+    }
+    return 0;
+  }
+
+  for (size_t i = 0; i < s->num_buckets; i++)
+    if (casky_chain_foreach(kd, s, &s->root[i], cb, ctx))
+      return 1;
+  // Buckets not migrated yet by an incremental rehash
+  if (s->old_root)
+    for (size_t i = s->rehash_index; i < s->old_num_buckets; i++)
+      if (casky_chain_foreach(kd, s, &s->old_root[i], cb, ctx))
+        return 1;
+  return 0;
+}
+
+/**
+ * casky_kd_foreach - Calls `cb` on every node of the KeyDir.
+ *
+ * The callback returns CASKY_ITER_CONTINUE to go on, CASKY_ITER_STOP to end
+ * the walk, or CASKY_ITER_REMOVE to have the node unlinked and retired (the
+ * callback is responsible for any statistics update). Nodes must not be
+ * modified: lock-free readers may be looking at them. The walk goes shard
+ * by shard, in the hash order of the current engine.
+ *
+ * Not thread-safe: callers hold the locks of all shards (see
+ * casky_kd_lock_all()).
+ */
+void casky_kd_foreach(KeyDir *kd, casky_iter_cb cb, void *ctx) {
+  if (!kd || !cb) return;
+  for (size_t i = 0; i < kd->num_shards; i++)
+    if (casky_shard_foreach(kd, &kd->shards[i], cb, ctx))
+      return;
+}
+
+/**
+ * casky_kd_free_index - Frees every node and the index of a KeyDir.
+ *
+ * Nodes are not visited: releasing the arena of each shard frees all of
+ * them at once. Everything still on the retire lists is freed as well: no
+ * reader may be using the KeyDir anymore. An on-disk index is unmapped
+ * without a checkpoint (see casky_close()). The KeyDir structure itself,
+ * its log, its current read file and its filename are left untouched.
+ */
+void casky_kd_free_index(KeyDir *kd) {
+  if (!kd) return;
+  if (kd->retired) casky_ebr_drain(kd->retired);
+  free(kd->retired);
+  kd->retired = NULL;
+  casky_skiplist_free(kd->ordered);
+  kd->ordered = NULL;
+  casky_frozen_free(kd->frozen);
+  kd->frozen = NULL;
+  casky_disk_close(kd->disk);
+  kd->disk = NULL;
+  if (!kd->shards) return;
+  for (size_t i = 0; i < kd->num_shards; i++) {
+    CaskyShard *s = &kd->shards[i];
+    if (s->retired) casky_ebr_drain(s->retired);
+    free(s->retired);
+    free(s->root);
+    free(s->old_root);
+    casky_swiss_free(s->swiss);
+    casky_arena_destroy(s->arena);
+#ifdef THREAD_SAFE
+    pthread_rwlock_destroy(&s->lock);
+#endif
+  }
+  free(kd->shards);
+  kd->shards = NULL;
+  kd->num_shards = 0;
+  kd->num_entries = 0;
+}
+
+/**
+ * casky_shard_put - Inserts or updates a key in a shard.
+ *
+ * Records where the value lives in the log (file, offset, length) together
+ * with its timestamps. If `value` is not NULL a copy of it is kept in memory
+ * and served by casky_get() without touching the disk. An existing entry is
+ * never changed in place: a new node replaces it.
+ *
+ * @param kd           Pointer to KeyDir
+ * @param s            Shard owning `hash`, write-locked by the caller
+ * @param key          Key bytes
+ * @param key_len      Length of the key in bytes
+ * @param hash         casky_kd_hash() of the key
+ * @param value        Value to cache in memory, or NULL
+ * @param value_len    Length of the value in bytes: of its stored form,
+ *                     unless it is kept in memory
+ * @param file_id      Log file holding the value
+ * @param value_offset Offset of the value bytes inside that file
+ * @param codec        CaskyCodec of the value bytes in the log
+ * @param timestamp    Record timestamp
+ * @param expires      Expiration timestamp, 0 if the entry never expires
+ * @return 0 on success, -1 on allocation failure (casky_errno set)
+ */
+int casky_shard_put(KeyDir *kd, CaskyShard *s, const char *key, uint32_t key_len,
+                    uint64_t hash, const char *value, uint32_t value_len,
+                    uint32_t file_id, uint64_t value_offset, CaskyCodec codec,
+                    uint64_t timestamp, uint64_t expires) {
+  if (kd->disk) {
+    // The shard lock still orders the writers of a key; only the location
+    // of the value is stored
+    int added = casky_disk_put(kd, key, key_len, hash, value_len, file_id, value_offset,
+                               codec, timestamp, expires);
+    if (added < 0)
+      return -1;
+    if (added) {
+      casky_stats_inc_entries();
+      __atomic_add_fetch(&kd->num_entries, 1, __ATOMIC_RELAXED);
+    }
+    casky_stats_inc_put(key_len);
+    return 0;
+  }
+
+  casky_shard_rehash_step(s, CASKY_REHASH_STEP);
+
+  EntryNode *old_node = casky_shard_find(s, key, key_len, hash);
+  CaskyRef ref;
+  EntryNode *node = casky_node_new(s, key, key_len, value, value_len, &ref);
+  if (!node) {
+    casky_errno = CASKY_ERR_MEMORY;
+    return -1;
+  }
+  // Values kept in memory need no location in the log
+  if (!value) {
+    node->file_id = file_id;
+    casky_node_set_offset(node, value_offset, codec);
+  }
+  node->timestamp = casky_time_enc(kd, timestamp);
+  node->expiration_ts = casky_time_enc(kd, expires);
+
+  if (old_node) {
+    // update existing entry, the key is already in the ordered index
+    casky_shard_replace(s, old_node, ref);
+  } else if ((kd->ordered && casky_skiplist_insert(kd->ordered, key, key_len) != 0) ||
+             casky_shard_insert(s, ref, node, hash) != 0) {
+    if (kd->ordered)
+      casky_skiplist_remove(kd->ordered, key, key_len);
+    casky_node_free(s, ref);
+    casky_errno = CASKY_ERR_MEMORY;
+    return -1;
+  } else {
+    casky_stats_inc_entries();
+    s->num_entries++;
+    __atomic_add_fetch(&kd->num_entries, 1, __ATOMIC_RELAXED);
+    casky_shard_maybe_grow(s);
+  }
+  casky_stats_inc_put(key_len + (value ? value_len : 0));
+
+  if (s->retired->count >= CASKY_EBR_BATCH)
+    casky_ebr_reclaim(s->retired);
+  return 0;
+}
+
+/**
+ * casky_shard_delete - Removes a key from a shard, write-locked by the
+ * caller.
+ *
+ * Returns: 1 if the key was found and deleted, 0 otherwise.
+ */
+int casky_shard_delete(KeyDir *kd, CaskyShard *s, const char *key, uint32_t key_len,
+                       uint64_t hash) {
+  if (kd->disk) {
+    if (!casky_disk_delete(kd, key, key_len, hash))
+      return 0;
+    casky_stats_inc_delete(key_len);
+    casky_stats_dec_entries();
+    __atomic_sub_fetch(&kd->num_entries, 1, __ATOMIC_RELAXED);
+    return 1;
+  }
+
+  casky_shard_rehash_step(s, CASKY_REHASH_STEP);
+
+  CaskyRef ref = casky_shard_remove(s, key, key_len, hash);
+  if (!ref)
+    return 0; // key not found
+
+  EntryNode *node = casky_arena_ptr(s->arena, ref);
+  casky_stats_inc_delete(node->key_len + (casky_node_value(s, node) ? node->value_len : 0));
+  casky_stats_dec_entries();
+  casky_node_forget(kd, s, ref, node);
+  if (s->retired->count >= CASKY_EBR_BATCH)
+    casky_ebr_reclaim(s->retired);
+  return 1; // key was found and deleted
+}
+
+/**
+ * casky_shard_touch - Sets the expiration time of a key not expired at
+ * `now`, keeping its value and timestamp. As with casky_shard_put(), a new
+ * node replaces the old one. The shard is write-locked by the caller.
+ *
+ * @expires: new expiration timestamp, 0 if the entry never expires
+ *
+ * Returns: 1 if the key was found and updated, 0 if not, -1 on error
+ * (casky_errno set).
+ */
+int casky_shard_touch(KeyDir *kd, CaskyShard *s, const char *key, uint32_t key_len,
+                      uint64_t hash, uint64_t now, uint64_t expires) {
+  if (kd->disk)
+    return casky_disk_touch(kd, key, key_len, hash, now, expires);
+
+  EntryNode *node = casky_shard_find(s, key, key_len, hash);
+  if (!node || (node->expiration_ts > 0 && node->expiration_ts <= casky_time_enc(kd, now)))
+    return 0;
+  CaskyRef ref = casky_shard_clone(s, node);
+  if (!ref) {
+    casky_errno = CASKY_ERR_MEMORY;
+    return -1;
+  }
+  ((EntryNode *)casky_arena_ptr(s->arena, ref))->expiration_ts = casky_time_enc(kd, expires);
+  casky_shard_replace(s, node, ref);
+  if (s->retired->count >= CASKY_EBR_BATCH)
+    casky_ebr_reclaim(s->retired);
+  return 1;
+}
+
+/**
+ * casky_put_entry - Inserts or updates a key in the KeyDir.
+ *
+ * Unlocked convenience wrapper around casky_shard_put() that hashes the key
+ * and picks its shard; used while replaying the log, when the KeyDir is not
+ * shared yet.
+ *
+ * @return 0 on success, -1 on allocation failure (casky_errno set)
+ */
+int casky_put_entry(KeyDir *kd, const char *key, uint32_t key_len,
+                    const char *value, uint32_t value_len,
+                    uint32_t file_id, uint64_t value_offset,
+                    uint64_t timestamp, uint64_t expires) {
+  if (!kd || !key) {
+    casky_errno = CASKY_ERR_INVALID_POINTER;
+    return -1;
+  }
+  uint64_t hash = casky_kd_hash(kd, key, key_len);
+  return casky_shard_put(kd, casky_kd_shard(kd, hash), key, key_len, hash, value, value_len,
+                         file_id, value_offset, CASKY_CODEC_NONE, timestamp, expires);
+}
+
+/**
+ * Inserts or updates a key-value pair **in memory** (KeyDir only),
+ * without writing to the log file.
+ *
+ * The value is kept in memory, since there is no log record to point to.
+ *
+ * @param kd        Pointer to KeyDir
+ * @param key       Key string (null-terminated)
+ * @param value     Value string (null-terminated)
+ * @param timestamp Optional timestamp to set (e.g., from log)
+ * @param expires   The timestamp where this entry is expired and no longer
+ *                  valid
+ */
+void casky_put_in_memory(KeyDir *kd, const char *key, const char *value, uint64_t timestamp, uint64_t expires) {
+  if (!kd || !key || !value) return;
+  casky_put_entry(kd, key, strlen(key), value, strlen(value), 0, 0, timestamp, expires);
+}
+
+/**
+ * casky_put_in_memory_n - casky_put_in_memory() with explicit lengths, for
+ * binary keys and values.
+ */
+void casky_put_in_memory_n(KeyDir *kd, const char *key, uint32_t key_len,
+                           const char *value, uint32_t value_len,
+                           uint64_t timestamp, uint64_t expires) {
+  if (!kd || !key || !value) return;
+  casky_put_entry(kd, key, key_len, value, value_len, 0, 0, timestamp, expires);
+}
+
+/**
+ * Deletes a key from memory (KeyDir only), without writing to the log file.
+ * Used internally when replaying DELETE records from the log.
+ *
+ * If the key is not found, does nothing.
+ *
+ * @param kd  Pointer to KeyDir
+ * @param key Key string to delete
+ * @return 1 if the key was found and deleted, 0 otherwise
+ */
+int casky_delete_from_memory(KeyDir *kd, const char *key) {
+  if (!key)
+    return 0;
+  return casky_delete_from_memory_n(kd, key, strlen(key));
+}
+
+/**
+ * casky_delete_from_memory_n - casky_delete_from_memory() with an explicit
+ * key length, for binary keys.
+ */
+int casky_delete_from_memory_n(KeyDir *kd, const char *key, uint32_t key_len) {
+  if (!kd || !key)
+    return 0;
+
+  uint64_t hash = casky_kd_hash(kd, key, key_len);
+  return casky_shard_delete(kd, casky_kd_shard(kd, hash), key, key_len, hash);
+}
+
+// casky_kd_read() on a frozen KeyDir: nothing is ever unlinked or
+// relocated, so no EBR critical section and no retry
+static int casky_frozen_read(KeyDir *kd, const char *key, size_t key_len,
+                             uint64_t now, casky_entry_fn fn, void *ctx) {
+  const Entry *e = casky_frozen_find(kd->frozen, key, key_len);
+  if (!e || (e->expiration_ts > 0 && e->expiration_ts <= now)) {
+    casky_errno = CASKY_ERR_KEY_NOT_FOUND;
+    return -1;
+  }
+  int fd = -1;
+  if (!e->value && (fd = casky_kd_read_fd(kd, e->file_id)) < 0) {
+    casky_errno = CASKY_ERR_IO;
+    return -1;
+  }
+  if (fn(e, fd, ctx) != 0)
+    return -1;
+  casky_errno = CASKY_OK;
+  casky_stats_inc_get();
+  return 0;
+}
+
+/**
+ * casky_kd_read - Looks a key up and hands its entry to `fn`, without
+ * taking any lock.
+ *
+ * The lookup and `fn` run inside an EBR critical section, so a reader never
+ * waits for a writer, even one stuck in fsync, nor for casky_compact() or
+ * casky_expire(). The entry and the descriptor passed to `fn` are only
+ * valid until it returns. `fn` returns 0 on success, or -1 with casky_errno
+ * set. An expired key is dropped only if the shard lock is free at that
+ * moment; otherwise casky_expire() will.
+ *
+ * @key_len: length of the key in bytes
+ * @fn:      called with the entry and the descriptor to read its value from
+ *           (-1 when the value is kept in memory, see casky_copy_value())
+ *
+ * Returns: 0 on success, -1 on error or if the key does not exist (sets
+ * casky_errno)
+ */
+int casky_kd_read(KeyDir *kd, const char *key, size_t key_len,
+                  casky_entry_fn fn, void *ctx) {
+  if (!kd) {
+    casky_errno = CASKY_ERR_INVALID_POINTER;
+    return -1;
+  }
+  if (!key || key_len > UINT32_MAX) {
+    casky_errno = CASKY_ERR_INVALID_KEY;
+    return -1;
+  }
+
+  uint64_t now = (uint64_t)time(NULL);
+  if (kd->frozen)
+    return casky_frozen_read(kd, key, key_len, now, fn, ctx);
+
+  uint64_t hash = casky_kd_hash(kd, key, key_len);
+  if (kd->disk)
+    return casky_disk_read(kd, key, key_len, hash, now, fn, ctx);
+  CaskyShard *s = casky_kd_shard(kd, hash);
+
+  if (casky_ebr_enter() != 0) {
+    casky_errno = CASKY_ERR_MEMORY;
+    return -1;
+  }
+  uint32_t enc_now = casky_time_enc(kd, now);
+  EntryNode *node, *stale = NULL;
+  int ret = -1;
+  int expired = 0;
+  for (;;) {
+    node = casky_shard_find(s, key, key_len, hash);
+    if (!node) break;
+    if (node->expiration_ts > 0 && node->expiration_ts <= enc_now) {
+      expired = 1;
+      break;
+    }
+    Entry e;
+    casky_node_entry(kd, s, node, &e);
+    int fd = -1;
+    if (!e.value && (fd = casky_kd_read_fd(kd, e.file_id)) < 0) {
+      // A compaction relocated the entry since the lookup: the new node is
+      // already published, look it up again
+      if (node != stale) {
+        stale = node;
+        continue;
+      }
+      casky_errno = CASKY_ERR_IO;
+      break;
+    }
+    ret = fn(&e, fd, ctx);
+    break;
+  }
+  casky_ebr_exit();
+
+  if (ret == 0) {
+    casky_errno = CASKY_OK;
+    casky_stats_inc_get();
+    return 0;
+  }
+  if (node && !expired)
+    return -1;  // read error, casky_errno set
+
+  if (expired && SHARD_TRYWRLOCK(s)) {
+    // Dropped unless another thread renewed or removed it in the meantime
+    node = casky_shard_find(s, key, key_len, hash);
+    if (node && node->expiration_ts > 0 && node->expiration_ts <= enc_now)
+      casky_shard_delete(kd, s, key, key_len, hash);
+    SHARD_UNLOCK(s);
+  }
+
+  casky_errno = CASKY_ERR_KEY_NOT_FOUND;
+  return -1;
+}
+
+static int casky_dup_value_cb(const Entry *e, int fd, void *ctx) {
+  char **value = ctx;
+  *value = casky_pread_value(fd, e);
+  return *value ? 0 : -1;
+}
+
+/**
+ * casky_get_from_memory - Core function to retrieve a value from the in-memory KeyDir
+ * @kd: pointer to the KeyDir structure
+ * @key: key to look up
+ *
+ * This function searches the in-memory hash table for the given key and returns
+ * a dynamically allocated copy of its value if found, read from the log unless
+ * the KeyDir keeps a copy in memory (see casky_read_value()). It takes no
+ * lock, see casky_kd_read().
+ *
+ * Return: strdup'ed value on success, NULL on error (sets casky_errno)
+ */
+char* casky_get_from_memory(KeyDir *kd, const char *key) {
+  if (!key) {
+    casky_errno = kd ? CASKY_ERR_INVALID_KEY : CASKY_ERR_INVALID_POINTER;
+    return NULL;
+  }
+  char *value = NULL;
+  if (casky_kd_read(kd, key, strlen(key), casky_dup_value_cb, &value) != 0)
+    return NULL;
+  return value;
+}
+
+// STAT utility routines
+//
+// The counters are updated with atomic operations rather than under a
+// mutex: every casky_get() bumps num_gets, and a global lock there would
+// serialize readers of different shards again.
+
+#define STAT_ADD(field, n) __atomic_add_fetch(&casky_statistics.field, (n), __ATOMIC_RELAXED)
+
+// Subtracts n from a counter without letting it wrap below zero
+static void casky_stats_sub(uint64_t *counter, uint64_t n) {
+  uint64_t cur = __atomic_load_n(counter, __ATOMIC_RELAXED);
+  uint64_t next;
+  do {
+    next = cur >= n ? cur - n : cur;
+  } while (next != cur &&
+           !__atomic_compare_exchange_n(counter, &cur, next, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+/**
+ * Initialize a casky_stat_t structure.
+ * Sets all counters to zero.
+ */
+void casky_stats_init() {
+  __atomic_store_n(&casky_statistics.total_keys, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&casky_statistics.memory_bytes, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&casky_statistics.num_puts, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&casky_statistics.num_gets, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&casky_statistics.num_deletes, 0, __ATOMIC_RELAXED);
+}
+
+void casky_stats_inc_put(size_t bytes) {
+  STAT_ADD(num_puts, 1);
+  STAT_ADD(memory_bytes, bytes);
+}
+
+void casky_stats_inc_delete(size_t bytes) {
+  STAT_ADD(num_deletes, 1);
+  if (bytes > 0)
+    casky_stats_sub(&casky_statistics.memory_bytes, bytes);
+}
+
+/**
+ * casky_stats_get - Returns a copy of the counters. Each counter is read
+ * atomically, but the copy is not a snapshot taken at a single instant.
+ */
+casky_stat_t casky_stats_get(void) {
+  casky_stat_t copy;
+  copy.total_keys = __atomic_load_n(&casky_statistics.total_keys, __ATOMIC_RELAXED);
+  copy.memory_bytes = __atomic_load_n(&casky_statistics.memory_bytes, __ATOMIC_RELAXED);
+  copy.num_puts = __atomic_load_n(&casky_statistics.num_puts, __ATOMIC_RELAXED);
+  copy.num_gets = __atomic_load_n(&casky_statistics.num_gets, __ATOMIC_RELAXED);
+  copy.num_deletes = __atomic_load_n(&casky_statistics.num_deletes, __ATOMIC_RELAXED);
+  return copy;
+}
+void casky_stats_inc_entries(void) {
+  STAT_ADD(total_keys, 1);
+}
+void casky_stats_dec_entries(void) {
+  casky_stats_sub(&casky_statistics.total_keys, 1);
+}
+void casky_stats_inc_get(void) {
+  STAT_ADD(num_gets, 1);
+}
+
+/**
+ * casky_now_ms - CLOCK_MONOTONIC in milliseconds, for the sync window.
+ */
+uint64_t casky_now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Flushes everything appended to the log so far. Called with sync_lock
+ * held, which keeps kd->log in place.
+ */
+static int casky_log_flush_locked(KeyDir *kd) {
+  uint64_t appended = __atomic_load_n(&kd->log_appended, __ATOMIC_ACQUIRE);
+  __atomic_add_fetch(&kd->log_syncs, 1, __ATOMIC_RELAXED);
+  if (fdatasync(fileno(kd->log)) != 0)
+    return -1;
+  __atomic_store_n(&kd->log_synced, appended, __ATOMIC_RELEASE);
+  __atomic_store_n(&kd->log_synced_at, casky_now_ms(), __ATOMIC_RELAXED);
+  return 0;
+}
+
+/**
+ * casky_log_sync - Returns once the first `lsn` bytes appended to the log
+ * (see KeyDir.log_appended) are on disk.
+ *
+ * Group commit: the first writer to get here flushes everything appended
+ * so far with a single fdatasync(), while the writers arriving meanwhile
+ * queue on sync_lock. When it is done, most of them find their record
+ * covered and return without a flush of their own; the first one that is
+ * not flushes for the whole next batch.
+ *
+ * Called without any other lock held.
+ *
+ * Returns: 0 on success, -1 with casky_errno set to CASKY_ERR_IO if the
+ * flush failed (the record is in the log but may not survive a crash).
+ */
+int casky_log_sync(KeyDir *kd, uint64_t lsn) {
+  int ret = 0;
+#ifdef THREAD_SAFE
+  pthread_mutex_lock(&kd->sync_lock);
+#endif
+  if (kd->log_synced < lsn && casky_log_flush_locked(kd) != 0) {
+    casky_errno = CASKY_ERR_IO;
+    ret = -1;
+  }
+#ifdef THREAD_SAFE
+  pthread_mutex_unlock(&kd->sync_lock);
+#endif
+  return ret;
+}
+
+/**
+ * casky_log_rotate - Seals the active segment and starts appending to the
+ * next one. Called with kd->lock held.
+ *
+ * Unless the KeyDir never syncs, the sealed segment is flushed first: the
+ * writers waiting in casky_log_sync() for its last records only ever flush
+ * the active segment. Segments are immutable once sealed; the new one joins
+ * the file table before any entry can point to it, and the sealed one gets
+ * its hint file.
+ *
+ * Returns: 0 on success, -1 on error (casky_errno set), in which case the
+ * active segment is left in place.
+ */
+int casky_log_rotate(KeyDir *kd) {
+  uint32_t id = kd->active_id + 1;
+  char *path = casky_segment_path(kd->filename, id);
+  FILE *log = path ? fopen(path, "ab+") : NULL;
+  CaskyLogHeader header;
+  casky_log_header_init(&header, kd->log_format);
+  CaskyReadFile *rf = log && casky_log_header_write(fileno(log), &header) == 0 ?
+                      casky_read_file_open(path, id) : NULL;
+  CaskyFileTable *files = rf ? casky_file_table_add(kd->files, rf) : NULL;
+  if (!files) {
+    casky_errno = path ? CASKY_ERR_IO : CASKY_ERR_MEMORY;
+    if (rf) casky_read_file_free(rf, NULL);
+    if (log) {
+      fclose(log);
+      remove(path);
+    }
+    free(path);
+    return -1;
+  }
+
+  struct stat st;
+  uint64_t sealed_ino = fstat(fileno(kd->log), &st) == 0 ? (uint64_t)st.st_ino : 0;
+#ifdef THREAD_SAFE
+  pthread_mutex_lock(&kd->sync_lock);
+#endif
+  int ret = 0;
+  if (kd->sync_mode != CASKY_SYNC_NONE && kd->log_synced < kd->log_appended)
+    ret = casky_log_flush_locked(kd);
+  if (ret == 0) {
+    fclose(kd->log);
+    kd->log = log;
+  }
+#ifdef THREAD_SAFE
+  pthread_mutex_unlock(&kd->sync_lock);
+#endif
+  if (ret != 0) {
+    casky_file_table_free(files, NULL);
+    casky_read_file_free(rf, NULL);
+    fclose(log);
+    remove(path);
+    free(path);
+    casky_errno = CASKY_ERR_IO;
+    return -1;
+  }
+  free(path);
+
+  CaskyFileTable *old = kd->files;
+  CASKY_PUBLISH(kd->files, files);
+  if (old)
+    casky_ebr_retire(kd->retired, old, casky_file_table_free, NULL);
+  // The hint of the sealed segment is complete: it is never appended to
+  if (kd->hint) {
+    char *hint = sealed_ino ? casky_segment_hint_path(kd->filename, kd->active_id) : NULL;
+    if (hint) casky_hint_write(kd->hint, hint, kd->log_size, sealed_ino);
+    free(hint);
+    casky_hint_reset(kd->hint);
+  }
+  kd->active_id = id;
+  kd->log_header = header;
+  kd->log_size = casky_log_header_size(&header);
+  return 0;
+}
+
+/**
+ * casky_log_sync_due - CASKY_SYNC_PERIODIC without a flusher thread
+ * (single-threaded builds): flushes the log from the writer itself once
+ * one of the bounds of the window has been reached.
+ */
+void casky_log_sync_due(KeyDir *kd) {
+  uint64_t pending = kd->log_appended - kd->log_synced;
+  if (pending > 0 &&
+      ((kd->sync_bytes && pending >= kd->sync_bytes) ||
+       casky_now_ms() - kd->log_synced_at >= kd->sync_interval_ms))
+    casky_log_flush_locked(kd);
+}
+
+#ifdef THREAD_SAFE
+/*
+ * Background flusher of CASKY_SYNC_PERIODIC. It sleeps on flush_cond until
+ * sync_interval_ms have passed since the previous flush, or until a writer
+ * reports that sync_bytes are pending, and flushes whatever was appended.
+ */
+static void *casky_flusher_main(void *arg) {
+  KeyDir *kd = arg;
+  pthread_mutex_lock(&kd->sync_lock);
+  while (!kd->flusher_stop) {
+    uint64_t deadline = kd->log_synced_at + kd->sync_interval_ms;
+    if (!__atomic_load_n(&kd->flush_requested, __ATOMIC_ACQUIRE) &&
+        casky_now_ms() < deadline) {
+      struct timespec ts = { (time_t)(deadline / 1000), (long)(deadline % 1000) * 1000000 };
+      pthread_cond_timedwait(&kd->flush_cond, &kd->sync_lock, &ts);
+      continue;
+    }
+    __atomic_store_n(&kd->flush_requested, 0, __ATOMIC_RELEASE);
+    if (__atomic_load_n(&kd->log_appended, __ATOMIC_ACQUIRE) > kd->log_synced)
+      casky_log_flush_locked(kd);
+    else
+      __atomic_store_n(&kd->log_synced_at, casky_now_ms(), __ATOMIC_RELAXED);
+  }
+  pthread_mutex_unlock(&kd->sync_lock);
+  return NULL;
+}
+#endif
+
+/**
+ * casky_flusher_start - Starts the background flusher of a KeyDir opened
+ * with CASKY_SYNC_PERIODIC. Without -DTHREAD_SAFE writers flush on their
+ * own, see casky_log_sync_due().
+ *
+ * Returns: 0 on success, -1 if the thread could not be created.
+ */
+int casky_flusher_start(KeyDir *kd) {
+  __atomic_store_n(&kd->log_synced_at, casky_now_ms(), __ATOMIC_RELAXED);
+#ifdef THREAD_SAFE
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&kd->flush_cond, &attr);
+  pthread_condattr_destroy(&attr);
+  if (pthread_create(&kd->flusher, NULL, casky_flusher_main, kd) != 0) {
+    pthread_cond_destroy(&kd->flush_cond);
+    return -1;
+  }
+  kd->flusher_running = 1;
+#endif
+  return 0;
+}
+
+/**
+ * casky_flusher_stop - Stops the background flusher, if any. The log is
+ * not flushed one last time: casky_close() does it.
+ */
+void casky_flusher_stop(KeyDir *kd) {
+#ifdef THREAD_SAFE
+  if (!kd->flusher_running) return;
+  pthread_mutex_lock(&kd->sync_lock);
+  kd->flusher_stop = 1;
+  pthread_cond_signal(&kd->flush_cond);
+  pthread_mutex_unlock(&kd->sync_lock);
+  pthread_join(kd->flusher, NULL);
+  pthread_cond_destroy(&kd->flush_cond);
+  kd->flusher_running = 0;
+#else
+  (void)kd;
+#endif
+}
+
+/**
+ * casky_sync_stats - Reports the current un-synced window of a KeyDir:
+ * what a crash right now could lose.
+ *
+ * Takes no lock, so it never waits for a flush in progress: the counters
+ * are read one by one and may straddle a flush.
+ */
+casky_sync_stat_t casky_sync_stats(KeyDir *kd) {
+  casky_sync_stat_t st = { 0 };
+  if (!kd) return st;
+  // log_synced first: log_appended only grows, and never falls behind it
+  uint64_t synced = __atomic_load_n(&kd->log_synced, __ATOMIC_ACQUIRE);
+  st.unsynced_bytes = __atomic_load_n(&kd->log_appended, __ATOMIC_ACQUIRE) - synced;
+  if (st.unsynced_bytes) {
+    uint64_t now = casky_now_ms();
+    uint64_t synced_at = __atomic_load_n(&kd->log_synced_at, __ATOMIC_RELAXED);
+    st.unsynced_ms = now > synced_at ? now - synced_at : 0;
+  }
+  st.num_syncs = __atomic_load_n(&kd->log_syncs, __ATOMIC_RELAXED);
+  return st;
+}
+
+void casky_flush_log(KeyDir *kd) {
+  if (!kd || !kd->log) return;
+  fflush(kd->log);
+  if (kd->sync_on_write || kd->sync_mode == CASKY_SYNC_PERIODIC)
+    fsync(fileno(kd->log));
+}
+
+// HANDLING SNAPSHOT
+
+typedef struct {
+  KeyDir *kd;
+  CaskyLogWriter w;
+  uint64_t now;
+  int failed;
+} casky_dump_ctx;
+
+static int casky_snapshot_entry(const Entry *e, void *arg) {
+  casky_dump_ctx *ctx = arg;
+  if (e->expiration_ts != 0 && e->expiration_ts <= ctx->now)
+    return CASKY_ITER_CONTINUE;
+  // Values are written compressed, whatever the log holds
+  uint32_t stored_len;
+  CaskyCodec codec;
+  uint64_t value_offset;
+  if (casky_write_entry(ctx->kd, &ctx->w, e, 1, &stored_len, &codec, &value_offset) != 0) {
+    ctx->failed = 1;
+    return CASKY_ITER_STOP;
+  }
+  return CASKY_ITER_CONTINUE;
+}
+
+static int casky_snapshot_cb(EntryNode *node, const Entry *e, void *arg) {
+  (void)node;
+  return casky_snapshot_entry(e, arg);
+}
+
+int casky_do_snapshot(KeyDir *kd, const char *snapshot_file) {
+  if (!kd) {
+    casky_errno = CASKY_ERR_INVALID_POINTER;
+    return -1;
+  }
+  if (!snapshot_file) {
+    casky_errno = CASKY_ERR_INVALID_PATH;
+    return -1;
+  }
+  FILE *f = fopen(snapshot_file, "wb");
+  if (!f) {
+    casky_errno = CASKY_ERR_IO;
+    return -1;
+  }
+
+  // The snapshot is a log in the format of new log files
+  casky_dump_ctx ctx = { kd, { 0 }, (uint64_t)time(NULL), 0 };
+  if (casky_log_writer_init(&ctx.w, f, kd->log_format) != 0) {
+    fclose(f);
+    return -1;
+  }
+
+  // Writers are held off for the whole dump, readers are not
+  casky_kd_lock_all(kd, 0);
+  if (kd->frozen)
+    casky_frozen_foreach(kd->frozen, casky_snapshot_entry, &ctx);
+  else if (kd->disk)
+    ctx.failed |= casky_disk_foreach(kd, casky_snapshot_entry, &ctx) != 0;
+  else
+    casky_kd_foreach(kd, casky_snapshot_cb, &ctx);
+  casky_kd_unlock_all(kd);
+  ctx.failed |= casky_log_writer_finish(&ctx.w) != 0;
+  if (ctx.failed) {
+    fclose(f);
+    casky_errno = CASKY_ERR_IO;
+    return -1;
+  }
+  fflush(f);
+  if (kd->sync_on_write) fsync(fileno(f));
+  fclose(f);
+  casky_errno = CASKY_OK;
+  return 0;
+}
+KeyDir *casky_load_snapshot(const char *snapshot_file) {
+  return casky_init_kd_from_file(snapshot_file, 0);
+}
+
+/**
+ * casky_load_snapshot_frozen - Loads a snapshot as a read-only KeyDir
+ * indexed by a minimal perfect hash (see casky_freeze()).
+ *
+ * Returns: the KeyDir, or NULL with casky_errno set.
+ */
+KeyDir *casky_load_snapshot_frozen(const char *snapshot_file) {
+  KeyDir *kd = casky_load_snapshot(snapshot_file);
+  if (!kd) return NULL;
+  if (casky_freeze(kd) != 0) {
+    CaskyError err = casky_errno;
+    casky_close(kd);
+    casky_errno = err;
+    return NULL;
+  }
+  return kd;
 }
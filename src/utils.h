@@ -1,24 +1,191 @@
 #ifndef __UTILS_H
 #define __UTILS_H
 
+#include <string.h>
+#include "arena.h"
+
 typedef struct {
     uint64_t total_keys;
     uint64_t memory_bytes;
     uint64_t num_puts;
     uint64_t num_gets;
     uint64_t num_deletes;
-#ifdef THREAD_SAFE
-    pthread_mutex_t lock;
-#endif
 } casky_stat_t;
 
+// Un-synced window of a KeyDir, see casky_sync_stats()
+typedef struct {
+    uint64_t unsynced_bytes;  // log bytes not known to be on disk yet
+    uint64_t unsynced_ms;     // time since the last flush, 0 if nothing is
+                              // pending
+    uint64_t num_syncs;       // flushes issued so far
+} casky_sync_stat_t;
+
 const char*   casky_strerror(CaskyError err);
 int           casky_is_regular_file(const char *path);
 unsigned long casky_djb2_hash_xor(unsigned char *str);
+// [CRC][Timestamp][Expires][KeyLen][ValueLen] preceding key and value
+#define CASKY_RECORD_HEADER_SIZE 28
+// The top byte of the KeyLen field holds the flags of the record, so keys
+// are at most CASKY_KEY_LEN_MAX bytes. Records of older releases have no
+// flags.
+#define CASKY_KEY_LEN_MAX        0x00FFFFFFu
+#define CASKY_RECORD_FLAGS_SHIFT 24
+#define CASKY_RECORD_CODEC_MASK  0x03u   // flags: CaskyCodec of the value
+#define CASKY_RECORD_TYPE_SHIFT  2       // flags: CaskyRecordType
+#define CASKY_RECORD_TYPE_MASK   0x03u
+
+// Type bits of a record of `value_len` bytes of value, and back
+static inline uint32_t casky_record_type_bits(CaskyRecordType type, uint32_t value_len) {
+  return type == CASKY_RECORD_PUT && value_len == 0 ? CASKY_RECORD_PUT_EMPTY : type;
+}
+
+static inline CaskyRecordType casky_record_type_of(uint32_t bits, uint32_t value_len) {
+  if (bits == CASKY_RECORD_PUT_EMPTY)
+    return CASKY_RECORD_PUT;
+  return bits == CASKY_RECORD_PUT && value_len == 0 ? CASKY_RECORD_DELETE : (CaskyRecordType)bits;
+}
+
+// KeyLen field of a record, and back
+static inline uint32_t casky_record_key_field(uint32_t key_len, CaskyCodec codec,
+                                              CaskyRecordType type, uint32_t value_len) {
+  uint32_t flags = codec | casky_record_type_bits(type, value_len) << CASKY_RECORD_TYPE_SHIFT;
+  return key_len | flags << CASKY_RECORD_FLAGS_SHIFT;
+}
+
+static inline uint32_t casky_record_key_len(uint32_t field) {
+  return field & CASKY_KEY_LEN_MAX;
+}
+
+static inline CaskyCodec casky_record_codec(uint32_t field) {
+  return (CaskyCodec)(field >> CASKY_RECORD_FLAGS_SHIFT & CASKY_RECORD_CODEC_MASK);
+}
+
+static inline CaskyRecordType casky_record_type(uint32_t field, uint32_t value_len) {
+  uint32_t bits = field >> (CASKY_RECORD_FLAGS_SHIFT + CASKY_RECORD_TYPE_SHIFT);
+  return casky_record_type_of(bits & CASKY_RECORD_TYPE_MASK, value_len);
+}
+
+struct iovec;
+struct CaskyLogWriter;
+
+int           casky_write_record(FILE *fp, int sync_on_write, const char *key, uint32_t key_len, const char *value, uint32_t value_len, uint64_t timestamp, uint64_t expires);
+int           casky_write_record_codec(FILE *fp, int sync_on_write, CaskyRecordType type, const char *key, uint32_t key_len, const char *value, uint32_t value_len, CaskyCodec codec, uint64_t timestamp, uint64_t expires);
+int           casky_write_entry(KeyDir *kd, struct CaskyLogWriter *w, const Entry *e, int compress, uint32_t *stored_len, CaskyCodec *codec, uint64_t *value_offset);
+int           casky_record_verify(const unsigned char *record, size_t record_len);
+int           casky_write_record_fd(int fd, int sync_on_write, CaskyRecordType type, const char *key, uint32_t key_len, const char *value, uint32_t value_len, CaskyCodec codec, uint64_t timestamp, uint64_t expires);
+int           casky_writev_all(int fd, struct iovec *iov, int count);
 int           casky_write_data_to_file(FILE *fp, int sync_on_write, const char *key, const char *value, uint64_t timestamp, uint64_t expires);
+uint64_t      casky_now_ms(void);
+int           casky_log_sync(KeyDir *kd, uint64_t lsn);
+int           casky_log_rotate(KeyDir *kd);
+void          casky_log_sync_due(KeyDir *kd);
+int           casky_flusher_start(KeyDir *kd);
+void          casky_flusher_stop(KeyDir *kd);
+casky_sync_stat_t casky_sync_stats(KeyDir *kd);
+int           casky_log_append(KeyDir *kd, CaskyRecordType type, const char *key, uint32_t key_len, const char *value, uint32_t value_len, CaskyCodec codec, uint64_t timestamp, uint64_t expires, uint64_t *value_offset);
+int           casky_put_entry(KeyDir *kd, const char *key, uint32_t key_len, const char *value, uint32_t value_len, uint32_t file_id, uint64_t value_offset, uint64_t timestamp, uint64_t expires);
+char*         casky_read_value(KeyDir *kd, const Entry *e);
+size_t        casky_entry_bytes(const Entry *e);
 void          casky_put_in_memory(KeyDir *kd, const char *key, const char *value, uint64_t timestamp, uint64_t expires);
+void          casky_put_in_memory_n(KeyDir *kd, const char *key, uint32_t key_len, const char *value, uint32_t value_len, uint64_t timestamp, uint64_t expires);
 int           casky_delete_from_memory(KeyDir *kd, const char *key);
+int           casky_delete_from_memory_n(KeyDir *kd, const char *key, uint32_t key_len);
 char*         casky_get_from_memory(KeyDir *kd, const char *key);
+int           casky_copy_value(int fd, const Entry *e, char *buf);
+int           casky_load_value(int fd, const Entry *e, char *buf, size_t cap, char **value, size_t *len);
+
+// casky_kd_read() callback: 0 on success, -1 with casky_errno set
+typedef int (*casky_entry_fn)(const Entry *e, int fd, void *ctx);
+int           casky_kd_read(KeyDir *kd, const char *key, size_t key_len, casky_entry_fn fn, void *ctx);
+
+uint64_t casky_kd_hash(const KeyDir *kd, const char *key, size_t key_len);
+
+// Key bytes of a node, followed by a NUL
+static inline const char *casky_node_key(const EntryNode *node) {
+  return (const char *)(node + 1);
+}
+
+// Log offsets stay below 2^62: the top two bits of offset_hi are free for
+// the codec of the value
+#define CASKY_NODE_CODEC_SHIFT 30
+
+static inline uint64_t casky_node_offset(const EntryNode *node) {
+  uint32_t hi = node->offset_hi & ((1u << CASKY_NODE_CODEC_SHIFT) - 1);
+  return (uint64_t)hi << 32 | node->offset_lo;
+}
+
+static inline CaskyCodec casky_node_codec(const EntryNode *node) {
+  return (CaskyCodec)(node->offset_hi >> CASKY_NODE_CODEC_SHIFT);
+}
+
+static inline void casky_node_set_offset(EntryNode *node, uint64_t value_offset, CaskyCodec codec) {
+  node->offset_lo = (uint32_t)value_offset;
+  node->offset_hi = (uint32_t)(value_offset >> 32) | (uint32_t)codec << CASKY_NODE_CODEC_SHIFT;
+}
+
+// Value of a node kept in memory, or NULL when it is read from the log
+static inline const char *casky_node_value(const CaskyShard *s, const EntryNode *node) {
+  if (node->file_id != CASKY_FILE_ID_MEMORY)
+    return NULL;
+  if (node->offset_lo == CASKY_REF_NULL)
+    return casky_node_key(node) + node->key_len + 1;
+  return casky_arena_ptr(s->arena, node->offset_lo);
+}
+
+/*
+ * Node timestamps are 32-bit offsets from kd->time_base, which lies 2^31
+ * seconds before the KeyDir was created: about 68 years either way. 0 is
+ * kept for "no timestamp" (never expires); times out of range saturate.
+ */
+static inline uint32_t casky_time_enc(const KeyDir *kd, uint64_t t) {
+  if (t == 0) return 0;
+  if (t <= kd->time_base) return 1;
+  return t - kd->time_base >= UINT32_MAX ? UINT32_MAX : (uint32_t)(t - kd->time_base);
+}
+
+static inline uint64_t casky_time_dec(const KeyDir *kd, uint32_t t) {
+  return t ? kd->time_base + t : 0;
+}
+
+void casky_node_entry(const KeyDir *kd, const CaskyShard *s, const EntryNode *node, Entry *e);
+
+// Keys are compared by length and bytes, after the cached hash
+static inline int casky_key_eq(const EntryNode *node, const char *key, size_t key_len, uint64_t hash) {
+  return node->hash == (uint32_t)hash && node->key_len == key_len &&
+         memcmp(casky_node_key(node), key, key_len) == 0;
+}
+size_t casky_next_pow2(size_t n);
+void   casky_kd_rehash_finish(KeyDir *kd);
+int    casky_kd_init_index(KeyDir *kd, const CaskyOptions *opts);
+void   casky_kd_free_index(KeyDir *kd);
+
+int           casky_kd_read_fd(KeyDir *kd, uint32_t file_id);
+
+// Shards. Callers of the casky_shard_*() functions hold the write lock of
+// the shard, except for casky_shard_find(), which can also run inside an
+// EBR critical section (see ebr.h).
+CaskyShard *casky_kd_shard(const KeyDir *kd, uint64_t hash);
+void        casky_kd_lock_all(KeyDir *kd, int write);
+void        casky_kd_unlock_all(KeyDir *kd);
+void        casky_kd_reclaim(KeyDir *kd);
+void        casky_shard_rehash_step(CaskyShard *s, size_t steps);
+EntryNode  *casky_shard_find(CaskyShard *s, const char *key, size_t key_len, uint64_t hash);
+CaskyRef    casky_shard_clone(CaskyShard *s, const EntryNode *node);
+void        casky_shard_discard(CaskyShard *s, CaskyRef ref);
+int         casky_shard_replace(CaskyShard *s, EntryNode *old_node, CaskyRef new_ref);
+int         casky_shard_put(KeyDir *kd, CaskyShard *s, const char *key, uint32_t key_len, uint64_t hash, const char *value, uint32_t value_len, uint32_t file_id, uint64_t value_offset, CaskyCodec codec, uint64_t timestamp, uint64_t expires);
+int         casky_shard_delete(KeyDir *kd, CaskyShard *s, const char *key, uint32_t key_len, uint64_t hash);
+int         casky_shard_touch(KeyDir *kd, CaskyShard *s, const char *key, uint32_t key_len, uint64_t hash, uint64_t now, uint64_t expires);
+
+// casky_kd_foreach() callback results
+#define CASKY_ITER_CONTINUE 0
+#define CASKY_ITER_STOP     1
+#define CASKY_ITER_REMOVE   2
+
+// `e` is the expanded node, valid until the callback returns
+typedef int (*casky_iter_cb)(EntryNode *node, const Entry *e, void *ctx);
+void   casky_kd_foreach(KeyDir *kd, casky_iter_cb cb, void *ctx);
+int    casky_shard_foreach(KeyDir *kd, CaskyShard *s, casky_iter_cb cb, void *ctx);
 
 void casky_flush_log(KeyDir *kd);
 
@@ -32,6 +199,7 @@ void casky_stats_inc_get(void);
 
 int casky_do_snapshot(KeyDir *kd, const char *snapshot_file);
 KeyDir *casky_load_snapshot(const char *snapshot_file);
+KeyDir *casky_load_snapshot_frozen(const char *snapshot_file);
 
 // int casky_do_incremental_backup(KeyDir *kd,
 //                                 const char *snapshot_file,
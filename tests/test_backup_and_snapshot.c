@@ -1,8 +1,11 @@
 #include "../src/casky.h"
 #include "../src/utils.h"
 #include "../src/crc.h"
+#include "../src/frozen.h"
+#include "../src/skiplist.h"
 #include <assert.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
@@ -42,6 +45,99 @@ void test_snapshot_creation() {
   printf("✔ test_open_close_fail passed\n");
 }
 
+static int count_keys_cb(const char *key, size_t key_len, const char *value,
+                         size_t value_len, void *ctx) {
+  (void)key; (void)key_len; (void)value; (void)value_len;
+  (*(size_t *)ctx)++;
+  return 0;
+}
+
+// Test: snapshot loaded as a frozen, perfectly hashed KeyDir
+void test_snapshot_frozen() {
+  const char *logfile = "test_frozen.log";
+  const char *snapshot = "test_frozen.snap";
+  const char *resnap = "test_frozen2.snap";
+  const int nkeys = 5000;
+  char key[32], value[32];
+
+  CaskyValueMode modes[] = { CASKY_VALUES_ON_DISK, CASKY_VALUES_IN_MEMORY };
+  for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+    cleanup(logfile);
+    cleanup(snapshot);
+    cleanup(resnap);
+
+    CaskyOptions opts;
+    casky_options_init(&opts);
+    opts.value_mode = modes[m];
+    opts.ordered_index = 1;
+    KeyDir *db = casky_open_with_options(logfile, &opts);
+    assert(db != NULL);
+    for (int i = 0; i < nkeys; i++) {
+      snprintf(key, sizeof(key), "key:%d", i);
+      snprintf(value, sizeof(value), "value:%d", i);
+      assert(casky_put(db, key, value, 0) == 0);
+    }
+    assert(casky_delete(db, "key:0") == 0);
+
+    // In place: every key is found at its slot, writes are refused
+    assert(casky_freeze(db) == 0);
+    assert(db->frozen && db->num_entries == (size_t)nkeys - 1);
+    assert(db->frozen->num_buckets * 32 <= db->num_entries * 8 + 32);
+    for (int i = 1; i < nkeys; i++) {
+      snprintf(key, sizeof(key), "key:%d", i);
+      snprintf(value, sizeof(value), "value:%d", i);
+      char *v = casky_get(db, key);
+      assert(v && strcmp(v, value) == 0);
+      free(v);
+    }
+    assert(casky_get(db, "key:0") == NULL);
+    assert(casky_errno == CASKY_ERR_KEY_NOT_FOUND);
+    assert(casky_get(db, "missing") == NULL);
+    assert(casky_put(db, "new", "1", 0) == -1);
+    assert(casky_errno == CASKY_ERR_NOT_SUPPORTED);
+    assert(casky_delete(db, "key:1") == -1);
+    assert(casky_errno == CASKY_ERR_NOT_SUPPORTED);
+    assert(casky_compact(db) == -1);
+    assert(casky_freeze(db) == 0);
+
+    // The ordered index survives, and snapshots walk the frozen entries
+    size_t count = 0;
+    assert(casky_scan_prefix(db, "key:1", 0, count_keys_cb, &count) == 1111);
+    assert(casky_do_snapshot(db, snapshot) == 0);
+    casky_close(db);
+
+    db = casky_load_snapshot_frozen(snapshot);
+    assert(db && db->frozen && db->num_entries == (size_t)nkeys - 1);
+    size_t len = 0;
+    char buf[32];
+    assert(casky_get_into(db, "key:4999", buf, sizeof(buf), &len) == 0);
+    assert(len == strlen("value:4999") && memcmp(buf, "value:4999", len) == 0);
+    assert(casky_get(db, "key:0") == NULL);
+    assert(casky_do_snapshot(db, resnap) == 0);
+    casky_close(db);
+
+    db = casky_load_snapshot(resnap);
+    assert(db && !db->frozen && db->num_entries == (size_t)nkeys - 1);
+    casky_close(db);
+  }
+
+  // An empty snapshot freezes too
+  cleanup(logfile);
+  cleanup(snapshot);
+  KeyDir *db = casky_open(logfile);
+  assert(casky_do_snapshot(db, snapshot) == 0);
+  casky_close(db);
+  db = casky_load_snapshot_frozen(snapshot);
+  assert(db && db->num_entries == 0);
+  assert(casky_get(db, "key:1") == NULL);
+  casky_close(db);
+
+  cleanup(logfile);
+  cleanup(snapshot);
+  cleanup(resnap);
+  printf("✔ test_snapshot_frozen passed\n");
+}
+
 // Test: incremental backup generation
 // void test_incremental_backup() {
   // const char *logfile = "test_inc.log";
@@ -115,6 +211,7 @@ void test_snapshot_creation() {
 
 int main() {
   test_snapshot_creation();
+  test_snapshot_frozen();
   // test_incremental_backup();
   // test_incremental_contains_only_new_data();
 
@@ -1,11 +1,23 @@
 #include "../src/casky.h"
 #include "../src/utils.h"
 #include "../src/crc.h"
+#include "../src/arena.h"
+#include "../src/skiplist.h"
+#include "../src/diskindex.h"
+#include "../src/segment.h"
+#include "../src/hint.h"
+#include "../src/recovery.h"
+#include "../src/codec.h"
+#include "../src/block.h"
+#include "../src/hash.h"
 #include <assert.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
 
 #ifdef THREAD_SAFE
 #include <pthread.h>
@@ -16,22 +28,28 @@
 #define UNLOCK(kd)
 #endif
 
+static int simulate_expired_cb(EntryNode *node, const Entry *e, void *arg) {
+  uint64_t now = *(uint64_t *)arg;
+  printf("Key=%s, exp=%llu\n", e->key, (unsigned long long)e->expiration_ts);
+  if (e->expiration_ts > 0 || e->expiration_ts > now) {
+    node->expiration_ts = 1; // scade subito: earliest encoded time
+  }
+  return CASKY_ITER_CONTINUE;
+}
+
+static int count_cb(EntryNode *node, const Entry *e, void *arg) {
+  (void)node;
+  (void)e;
+  (*(size_t *)arg)++;
+  return CASKY_ITER_CONTINUE;
+}
+
 void simulate_all_expired(KeyDir *kd) {
   uint64_t now = time(NULL);
 
-  LOCK(kd);
-  for (size_t i = 0; i < kd->num_buckets; i++) {
-    EntryNode *e = kd->root[i];
-    while (e) {
-      printf("Simulating bucket %zu\n", i);
-      printf("Key=%s, exp=%llu\n", e->entry.key, (unsigned long long)e->entry.expiration_ts);
-      if (e->entry.expiration_ts > 0 || e->entry.expiration_ts > now) {
-        e->entry.expiration_ts = now - 1; // scade subito
-      }
-      e = e->next;
-    }
-  }
-  UNLOCK(kd);
+  casky_kd_lock_all(kd, 1);
+  casky_kd_foreach(kd, simulate_expired_cb, &now);
+  casky_kd_unlock_all(kd);
 }
 // ------------------------ Test Open/Close ------------------------
 void test_open_close(const char *file) {
@@ -53,6 +71,18 @@ void test_open_close_fail() {
 }
 
 // ------------------------ Test Hash Function ------------------------
+typedef struct {
+  KeyDir *kd;
+  size_t checked;
+} node_hash_ctx;
+
+static int check_node_hash_cb(EntryNode *node, const Entry *e, void *arg) {
+  node_hash_ctx *ctx = arg;
+  assert(node->hash == (uint32_t)casky_kd_hash(ctx->kd, e->key, e->key_len));
+  ctx->checked++;
+  return CASKY_ITER_CONTINUE;
+}
+
 void test_hashes() {
   unsigned long h1 = casky_djb2_hash_xor((unsigned char *)"foo");
   unsigned long h2 = casky_djb2_hash_xor((unsigned char *)"foo");
@@ -60,6 +90,68 @@ void test_hashes() {
 
   assert(h1 == h2);
   assert(h1 != h3);
+
+  // casky_hash() values are stored in on-disk indexes: they must not
+  // change from one build or release to the next
+  assert(casky_hash("", 0, 0) == 0x93228a4de0eec5a2ULL);
+  assert(casky_hash("foo", 3, 0) == 0x7858d0763614e879ULL);
+  assert(casky_hash("user:000123", 11, 42) == 0x241d14f689831161ULL);
+  assert(casky_hash("0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMN", 50, 7) ==
+         0x45b9696ae6e5ba27ULL);
+
+  // Every length of the short-key paths, and of the 16- and 48-byte loops:
+  // only the `len` bytes count, each of them does, and so does the seed
+  unsigned char buf[72], copy[72];
+  for (size_t i = 0; i < sizeof(buf); i++)
+    buf[i] = (unsigned char)(i * 37 + 11);
+  uint64_t seen[65];
+  for (size_t len = 0; len <= 64; len++) {
+    uint64_t h = casky_hash(buf, len, 1);
+    assert(h == casky_hash(buf, len, 1));
+    assert(h != casky_hash(buf, len, 2));
+    memcpy(copy, buf, sizeof(copy));
+    copy[len] ^= 0xFF;
+    assert(casky_hash(copy, len, 1) == h);
+    for (size_t i = 0; i < len; i++) {
+      memcpy(copy, buf, sizeof(copy));
+      copy[i] ^= 0x01;
+      assert(casky_hash(copy, len, 1) != h);
+    }
+    for (size_t l = 0; l < len; l++)
+      assert(seen[l] != h);
+    seen[len] = h;
+  }
+  // Keys ending right at the end of their allocation (see ASan builds)
+  for (size_t len = 1; len <= 16; len++) {
+    unsigned char *key = malloc(len);
+    memcpy(key, buf, len);
+    assert(casky_hash(key, len, 1) == seen[len]);
+    free(key);
+  }
+
+  // Each node caches the low bits of the hash of its key, with the seed of
+  // its KeyDir, in both engines
+  for (int engine = 0; engine < 2; engine++) {
+    remove("testdb");
+    CaskyOptions opts;
+    casky_options_init(&opts);
+    opts.engine = engine ? CASKY_ENGINE_SWISS : CASKY_ENGINE_CHAINED;
+    opts.hash_seed = 42;
+    KeyDir *db = casky_open_with_options("testdb", &opts);
+    assert(db && db->hash_seed == 42);
+    char key[32];
+    for (int i = 0; i < 1000; i++) {
+      snprintf(key, sizeof(key), "user:%06d", i);
+      assert(casky_put(db, key, "v", 0) == 0);
+    }
+    assert(casky_put_n(db, "", 0, "empty key", 9, 0) == 0);
+    assert(casky_kd_hash(db, "user:000123", 11) == 0x241d14f689831161ULL);
+    node_hash_ctx ctx = { db, 0 };
+    casky_kd_foreach(db, check_node_hash_cb, &ctx);
+    assert(ctx.checked == 1001);
+    casky_close(db);
+  }
+  remove("testdb");
   printf("✔ test_hashes passed\n");
 }
 
@@ -108,6 +200,137 @@ void test_get() {
   printf("✔ test_get passed\n");
 }
 
+// ------------------------ Test GET without copies ------------------------
+typedef struct {
+  char value[8192];
+  size_t len;
+  int calls;
+} get_with_result;
+
+static void collect_value_cb(const char *value, size_t len, void *ctx) {
+  get_with_result *res = ctx;
+  assert(len < sizeof(res->value) && value[len] == '\0');
+  memcpy(res->value, value, len + 1);
+  res->len = len;
+  res->calls++;
+}
+
+void test_get_into_with() {
+  char big[6000];
+  memset(big, 'z', sizeof(big) - 1);
+  big[sizeof(big) - 1] = '\0';
+
+  CaskyValueMode modes[] = { CASKY_VALUES_ON_DISK, CASKY_VALUES_IN_MEMORY };
+  for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+    remove("testdb");
+    CaskyOptions opts;
+    casky_options_init(&opts);
+    opts.value_mode = modes[m];
+    KeyDir *db = casky_open_with_options("testdb", &opts);
+    assert(casky_put(db, "foo", "bar", 0) == 0);
+    assert(casky_put(db, "big", big, 0) == 0);
+
+    char buf[16];
+    size_t len = 0;
+    assert(casky_get_into(db, "foo", buf, sizeof(buf), &len) == 0);
+    assert(casky_errno == CASKY_OK);
+    assert(len == 3 && strcmp(buf, "bar") == 0);
+
+    // The needed length is reported when the buffer is too small
+    assert(casky_get_into(db, "foo", buf, 3, &len) == -1);
+    assert(casky_errno == CASKY_ERR_BUFFER_TOO_SMALL && len == 3);
+    assert(casky_get_into(db, "big", buf, sizeof(buf), &len) == -1);
+    assert(casky_errno == CASKY_ERR_BUFFER_TOO_SMALL && len == sizeof(big) - 1);
+    char *large = malloc(len + 1);
+    assert(casky_get_into(db, "big", large, len + 1, NULL) == 0);
+    assert(strcmp(large, big) == 0);
+    free(large);
+
+    assert(casky_get_into(db, "unknown", buf, sizeof(buf), &len) == -1);
+    assert(casky_errno == CASKY_ERR_KEY_NOT_FOUND);
+    assert(casky_get_into(db, NULL, buf, sizeof(buf), &len) == -1);
+    assert(casky_errno == CASKY_ERR_INVALID_KEY);
+
+    get_with_result res = { .calls = 0 };
+    assert(casky_get_with(db, "foo", collect_value_cb, &res) == 0);
+    assert(res.calls == 1 && res.len == 3 && strcmp(res.value, "bar") == 0);
+    assert(casky_get_with(db, "big", collect_value_cb, &res) == 0);
+    assert(res.calls == 2 && strcmp(res.value, big) == 0);
+    assert(casky_get_with(db, "unknown", collect_value_cb, &res) == -1);
+    assert(casky_errno == CASKY_ERR_KEY_NOT_FOUND && res.calls == 2);
+    assert(casky_get_with(db, "foo", NULL, NULL) == -1);
+    assert(casky_errno == CASKY_ERR_INVALID_POINTER);
+
+    casky_close(db);
+  }
+  printf("✔ test_get_into_with passed\n");
+}
+
+// ------------------------ Test binary keys and values ------------------------
+void test_binary_keys() {
+  const char k1[] = { 'a', '\0', 'b' };
+  const char k2[] = { 'a', '\0', 'c' };
+  const char v1[] = { '\0', '\xff', '\n', '\0', 'x' };
+  const char v2[] = { 'v', '\0' };
+  size_t len = 0;
+
+  CaskyValueMode modes[] = { CASKY_VALUES_ON_DISK, CASKY_VALUES_IN_MEMORY };
+  for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+    remove("testdb");
+    CaskyOptions opts;
+    casky_options_init(&opts);
+    opts.value_mode = modes[m];
+    KeyDir *db = casky_open_with_options("testdb", &opts);
+
+    // Keys sharing a prefix up to a NUL are distinct, and distinct from
+    // the NUL-terminated key "a"
+    assert(casky_put_n(db, k1, sizeof(k1), v1, sizeof(v1), 0) == 0);
+    assert(casky_put_n(db, k2, sizeof(k2), v2, sizeof(v2), 0) == 0);
+    assert(casky_put(db, "a", "plain", 0) == 0);
+    assert(db->num_entries == 3);
+
+    char *val = casky_get_n(db, k1, sizeof(k1), &len);
+    assert(val && len == sizeof(v1) && memcmp(val, v1, len) == 0);
+    free(val);
+    val = casky_get_n(db, k2, sizeof(k2), &len);
+    assert(val && len == sizeof(v2) && memcmp(val, v2, len) == 0);
+    free(val);
+    val = casky_get(db, "a");
+    assert(val && strcmp(val, "plain") == 0);
+    free(val);
+
+    char buf[16];
+    assert(casky_get_into_n(db, k1, sizeof(k1), buf, sizeof(buf), &len) == 0);
+    assert(len == sizeof(v1) && memcmp(buf, v1, len) == 0);
+    get_with_result res = { .calls = 0 };
+    assert(casky_get_with_n(db, k2, sizeof(k2), collect_value_cb, &res) == 0);
+    assert(res.len == sizeof(v2) && memcmp(res.value, v2, res.len) == 0);
+
+    // An empty value is a value, not a delete
+    assert(casky_put_n(db, k1, sizeof(k1), v1, 0, 0) == 0);
+    val = casky_get_n(db, k1, sizeof(k1), &len);
+    assert(val && len == 0);
+    free(val);
+    assert(casky_put_n(db, k1, sizeof(k1), v1, sizeof(v1), 0) == 0);
+
+    // Lengths survive compaction and replay
+    assert(casky_delete_n(db, k2, sizeof(k2)) == 0);
+    assert(casky_get_n(db, k2, sizeof(k2), NULL) == NULL);
+    assert(casky_errno == CASKY_ERR_KEY_NOT_FOUND);
+    assert(casky_compact(db) == 0);
+    casky_close(db);
+
+    db = casky_open_with_options("testdb", &opts);
+    assert(db->num_entries == 2);
+    val = casky_get_n(db, k1, sizeof(k1), &len);
+    assert(val && len == sizeof(v1) && memcmp(val, v1, len) == 0);
+    free(val);
+    assert(casky_get_n(db, k2, sizeof(k2), NULL) == NULL);
+    casky_close(db);
+  }
+  printf("✔ test_binary_keys passed\n");
+}
+
 // ------------------------ Test DELETE ------------------------
 void test_delete() {
   remove("testdb");
@@ -131,13 +354,7 @@ void test_delete() {
 
   // Check that num_entries matches actual nodes
   size_t count = 0;
-  for (size_t i = 0; i < db->num_buckets; i++) {
-    EntryNode *node = db->root[i];
-    while (node) {
-      count++;
-      node = node->next;
-    }
-  }
+  casky_kd_foreach(db, count_cb, &count);
   assert(count == db->num_entries);
 
   casky_close(db);
@@ -168,6 +385,551 @@ void test_collisions() {
   printf("✔ test_collisions passed\n");
 }
 
+// ------------------------ Test Resize ------------------------
+void test_resize() {
+  remove("testdb");
+  CaskyOptions opts;
+  casky_options_init(&opts);
+  opts.initial_buckets = 3; // rounded up to 4
+  opts.num_shards = 1;      // a single table to look at
+  KeyDir *db = casky_open_with_options("testdb", &opts);
+  assert(db != NULL);
+  CaskyShard *shard = &db->shards[0];
+  assert(shard->num_buckets == 4);
+
+  char key[32], value[32];
+  for (int i = 0; i < 1000; i++) {
+    snprintf(key, sizeof(key), "user:%06d", i);
+    snprintf(value, sizeof(value), "v%d", i);
+    assert(casky_put(db, key, value, 0) == 0);
+  }
+  assert(db->num_entries == 1000);
+  assert(shard->num_buckets >= 1000 / CASKY_MAX_LOAD_FACTOR);
+
+  // Deletes keep migrating buckets; every key must stay reachable meanwhile
+  for (int i = 0; i < 1000; i += 2) {
+    snprintf(key, sizeof(key), "user:%06d", i);
+    assert(casky_delete(db, key) == 0);
+  }
+  for (int i = 0; i < 1000; i++) {
+    snprintf(key, sizeof(key), "user:%06d", i);
+    char *val = casky_get(db, key);
+    if (i % 2 == 0) {
+      assert(val == NULL);
+    } else {
+      snprintf(value, sizeof(value), "v%d", i);
+      assert(val != NULL && strcmp(val, value) == 0);
+      free(val);
+    }
+  }
+
+  casky_kd_rehash_finish(db);
+  assert(shard->old_root == NULL);
+  size_t count = 0;
+  for (size_t i = 0; i < shard->num_buckets; i++)
+    for (CaskyRef ref = shard->root[i]; ref;
+         ref = ((EntryNode *)casky_arena_ptr(shard->arena, ref))->next)
+      count++;
+  assert(count == db->num_entries);
+
+  casky_close(db);
+
+  // Replay into a pre-sized table
+  opts.initial_buckets = 4096;
+  db = casky_open_with_options("testdb", &opts);
+  assert(db->num_entries == 500);
+  assert(db->shards[0].num_buckets == 4096 && db->shards[0].old_root == NULL);
+  casky_close(db);
+  printf("✔ test_resize passed\n");
+}
+
+// ------------------------ Test Swiss engine ------------------------
+void test_swiss_engine() {
+  remove("testdb");
+  CaskyOptions opts;
+  casky_options_init(&opts);
+  opts.engine = CASKY_ENGINE_SWISS;
+  opts.initial_buckets = 16;
+  KeyDir *db = casky_open_with_options("testdb", &opts);
+  assert(db != NULL);
+  assert(db->engine == CASKY_ENGINE_SWISS);
+  assert(db->shards[0].root == NULL && db->shards[0].swiss != NULL);
+
+  char key[32], value[32];
+  for (int i = 0; i < 2000; i++) {
+    snprintf(key, sizeof(key), "user:%06d", i);
+    snprintf(value, sizeof(value), "v%d", i);
+    assert(casky_put(db, key, value, 0) == 0);
+  }
+  assert(casky_put(db, "user:000007", "updated", 0) == 0);
+  assert(db->num_entries == 2000);
+
+  // Delete and re-insert to exercise tombstones
+  for (int i = 0; i < 2000; i += 3) {
+    snprintf(key, sizeof(key), "user:%06d", i);
+    assert(casky_delete(db, key) == 0);
+  }
+  assert(casky_delete(db, "user:000000") == -1);
+  for (int i = 0; i < 2000; i += 6) {
+    snprintf(key, sizeof(key), "user:%06d", i);
+    assert(casky_put(db, key, "again", 0) == 0);
+  }
+
+  for (int i = 0; i < 2000; i++) {
+    snprintf(key, sizeof(key), "user:%06d", i);
+    char *val = casky_get(db, key);
+    if (i % 6 == 0) {
+      assert(val != NULL && strcmp(val, "again") == 0);
+    } else if (i % 3 == 0) {
+      assert(val == NULL);
+    } else if (i == 7) {
+      assert(val != NULL && strcmp(val, "updated") == 0);
+    } else {
+      snprintf(value, sizeof(value), "v%d", i);
+      assert(val != NULL && strcmp(val, value) == 0);
+    }
+    free(val);
+  }
+  size_t live = db->num_entries;
+  assert(casky_compact(db) == 0);
+  casky_close(db);
+
+  // The log format does not depend on the engine
+  db = casky_open("testdb");
+  assert(db->num_entries == live);
+  char *val = casky_get(db, "user:000007");
+  assert(val != NULL && strcmp(val, "updated") == 0);
+  free(val);
+  casky_close(db);
+  printf("✔ test_swiss_engine passed\n");
+}
+
+// ------------------------ Test value modes ------------------------
+static EntryNode *find_node(KeyDir *db, const char *key) {
+  uint64_t hash = casky_kd_hash(db, key, strlen(key));
+  return casky_shard_find(casky_kd_shard(db, hash), key, strlen(key), hash);
+}
+
+// Value a node keeps in memory, or NULL
+static const char *node_value(KeyDir *db, const EntryNode *node) {
+  const char *key = casky_node_key(node);
+  return casky_node_value(casky_kd_shard(db, casky_kd_hash(db, key, node->key_len)), node);
+}
+
+void test_value_modes() {
+  remove("testdb");
+  char big[8192];
+  memset(big, 'x', sizeof(big) - 1);
+  big[sizeof(big) - 1] = '\0';
+
+  // Default: only the location of the value is kept in memory
+  KeyDir *db = casky_open("testdb");
+  assert(db->value_mode == CASKY_VALUES_ON_DISK);
+  assert(casky_put(db, "big", big, 0) == 0);
+  assert(casky_put(db, "small", "v1", 0) == 0);
+  assert(casky_put(db, "small", "v2", 0) == 0);
+  EntryNode *node = find_node(db, "big");
+  assert(node && node_value(db, node) == NULL);
+  assert(node->value_len == sizeof(big) - 1);
+
+  char *val = casky_get(db, "big");
+  assert(val != NULL && strcmp(val, big) == 0);
+  free(val);
+  val = casky_get(db, "small");
+  assert(val != NULL && strcmp(val, "v2") == 0);
+  free(val);
+
+  // Compaction moves the records: the offsets must follow
+  assert(casky_compact(db) == 0);
+  val = casky_get(db, "small");
+  assert(val != NULL && strcmp(val, "v2") == 0);
+  free(val);
+  assert(casky_put(db, "after", "compact", 0) == 0);
+  val = casky_get(db, "after");
+  assert(val != NULL && strcmp(val, "compact") == 0);
+  free(val);
+  casky_close(db);
+
+  // Reopen: offsets rebuilt from the log without reading the values
+  db = casky_open("testdb");
+  assert(node_value(db, find_node(db, "big")) == NULL);
+  val = casky_get(db, "big");
+  assert(val != NULL && strcmp(val, big) == 0);
+  free(val);
+  casky_close(db);
+
+  // In-memory mode keeps a copy of every value
+  CaskyOptions opts;
+  casky_options_init(&opts);
+  opts.value_mode = CASKY_VALUES_IN_MEMORY;
+  db = casky_open_with_options("testdb", &opts);
+  node = find_node(db, "small");
+  assert(node && node_value(db, node) && strcmp(node_value(db, node), "v2") == 0);
+  assert(node->file_id == CASKY_FILE_ID_MEMORY);
+  val = casky_get(db, "after");
+  assert(val != NULL && strcmp(val, "compact") == 0);
+  free(val);
+  casky_close(db);
+  printf("✔ test_value_modes passed\n");
+}
+
+// ------------------------ Test arena nodes ------------------------
+void test_arena_nodes() {
+  remove("testdb");
+  CaskyOptions opts;
+  casky_options_init(&opts);
+  opts.value_mode = CASKY_VALUES_IN_MEMORY;
+  opts.num_shards = 1;
+  KeyDir *db = casky_open_with_options("testdb", &opts);
+  CaskyArena *arena = db->shards[0].arena;
+  assert(arena != NULL);
+
+  char big[2048];
+  memset(big, 'b', sizeof(big) - 1);
+  big[sizeof(big) - 1] = '\0';
+
+  // Key and small value share the block of the node
+  assert(casky_put(db, "k", "small", 0) == 0);
+  EntryNode *node = find_node(db, "k");
+  assert(sizeof(EntryNode) == 36);
+  assert(casky_node_key(node) == (char *)(node + 1));
+  assert(node_value(db, node) == casky_node_key(node) + 2);
+
+  // A value too large for the block moves out of line, and back again.
+  // Updates replace the node, so it has to be looked up every time.
+  assert(casky_put(db, "k", big, 0) == 0);
+  node = find_node(db, "k");
+  assert(node_value(db, node) != casky_node_key(node) + 2);
+  assert(strcmp(node_value(db, node), big) == 0);
+  assert(casky_put(db, "k", "tiny", 0) == 0);
+  node = find_node(db, "k");
+  assert(node_value(db, node) == casky_node_key(node) + 2);
+  char *val = casky_get(db, "k");
+  assert(val && strcmp(val, "tiny") == 0);
+  free(val);
+
+  // Freed blocks are reused instead of growing the arena. Retired nodes
+  // only go back to the arena once reclaimed.
+  char key[32];
+  for (int i = 0; i < 1000; i++) {
+    snprintf(key, sizeof(key), "key-%d", i);
+    assert(casky_put(db, key, i % 10 ? "value" : big, 0) == 0);
+  }
+  casky_kd_reclaim(db);
+  size_t chunks = arena->num_chunks;
+  size_t in_use = arena->bytes_in_use;
+  for (int i = 0; i < 1000; i++) {
+    snprintf(key, sizeof(key), "key-%d", i);
+    assert(casky_delete(db, key) == 0);
+  }
+  casky_kd_reclaim(db);
+  assert(arena->bytes_in_use < in_use);
+  for (int i = 0; i < 1000; i++) {
+    snprintf(key, sizeof(key), "key-%d", i);
+    assert(casky_put(db, key, i % 10 ? "value" : big, 0) == 0);
+  }
+  casky_kd_reclaim(db);
+  assert(arena->num_chunks == chunks);
+  assert(arena->bytes_in_use == in_use);
+
+  casky_close(db);
+  printf("✔ test_arena_nodes passed\n");
+}
+
+// ------------------------ Test shards ------------------------
+#define SHARD_TEST_THREADS 4
+#define SHARD_TEST_KEYS    2000
+
+#ifdef THREAD_SAFE
+typedef struct {
+  KeyDir *db;
+  int id;
+} shard_worker_arg;
+
+// Each worker owns the keys "w<id>:<n>" and also hammers a shared key
+static void *shard_worker(void *p) {
+  shard_worker_arg *arg = p;
+  char key[32], value[32];
+  for (int i = 0; i < SHARD_TEST_KEYS; i++) {
+    snprintf(key, sizeof(key), "w%d:%d", arg->id, i);
+    snprintf(value, sizeof(value), "v%d", i);
+    assert(casky_put(arg->db, key, value, 0) == 0);
+    assert(casky_put(arg->db, "shared", value, 0) == 0);
+    char *val = casky_get(arg->db, key);
+    assert(val && strcmp(val, value) == 0);
+    free(val);
+    if (i % 4 == 0)
+      assert(casky_delete(arg->db, key) == 0);
+  }
+  return NULL;
+}
+#endif
+
+void test_shards() {
+  remove("testdb");
+  KeyDir *db = casky_open("testdb");
+  assert(db->num_shards == CASKY_NUM_SHARDS);
+
+  // Keys spread over every shard
+  char key[32];
+  for (int i = 0; i < 1000; i++) {
+    snprintf(key, sizeof(key), "user:%06d", i);
+    assert(casky_put(db, key, "x", 0) == 0);
+  }
+  size_t total = 0;
+  for (size_t i = 0; i < db->num_shards; i++) {
+    assert(db->shards[i].num_entries > 0);
+    total += db->shards[i].num_entries;
+  }
+  assert(total == db->num_entries);
+  casky_close(db);
+
+#ifdef THREAD_SAFE
+  remove("testdb");
+  db = casky_open("testdb");
+  pthread_t threads[SHARD_TEST_THREADS];
+  shard_worker_arg args[SHARD_TEST_THREADS];
+  for (int t = 0; t < SHARD_TEST_THREADS; t++) {
+    args[t] = (shard_worker_arg){ db, t };
+    pthread_create(&threads[t], NULL, shard_worker, &args[t]);
+  }
+  for (int t = 0; t < SHARD_TEST_THREADS; t++)
+    pthread_join(threads[t], NULL);
+
+  size_t live = SHARD_TEST_THREADS * (SHARD_TEST_KEYS - SHARD_TEST_KEYS / 4) + 1;
+  assert(db->num_entries == live);
+  char *last = casky_get(db, "shared");
+  assert(last != NULL);
+
+  // The log replays to the same content
+  casky_close(db);
+  db = casky_open("testdb");
+  assert(db->num_entries == live);
+  char *val = casky_get(db, "shared");
+  assert(val && strcmp(val, last) == 0);
+  free(val);
+  free(last);
+  casky_close(db);
+#endif
+  printf("✔ test_shards passed\n");
+}
+
+// ------------------------ Test lock-free reads ------------------------
+#define LF_TEST_READERS 3
+#define LF_TEST_KEYS    500
+#define LF_TEST_ROUNDS  20
+
+#ifdef THREAD_SAFE
+typedef struct {
+  KeyDir *db;
+  int stop;
+  unsigned long reads;
+} lf_test_ctx;
+
+// Every key "k<n>" always holds a value "k<n>:<round>", and only keys with
+// n % 8 == 0 are ever missing
+static void *lf_reader(void *p) {
+  lf_test_ctx *ctx = p;
+  char key[32], prefix[32];
+  unsigned seed = 1;
+  while (!__atomic_load_n(&ctx->stop, __ATOMIC_ACQUIRE)) {
+    int n = rand_r(&seed) % LF_TEST_KEYS;
+    snprintf(key, sizeof(key), "k%d", n);
+    snprintf(prefix, sizeof(prefix), "k%d:", n);
+    char *val = casky_get(ctx->db, key);
+    if (val) {
+      assert(strncmp(val, prefix, strlen(prefix)) == 0);
+      free(val);
+    } else {
+      assert(casky_errno == CASKY_ERR_KEY_NOT_FOUND && n % 8 == 0);
+    }
+    __atomic_add_fetch(&ctx->reads, 1, __ATOMIC_RELAXED);
+  }
+  return NULL;
+}
+#endif
+
+// Readers run against updates, deletes, table growth and compactions
+void test_lockfree_reads() {
+#ifdef THREAD_SAFE
+  CaskyEngine engines[] = { CASKY_ENGINE_CHAINED, CASKY_ENGINE_SWISS };
+  for (size_t e = 0; e < sizeof(engines) / sizeof(engines[0]); e++) {
+    remove("testdb");
+    CaskyOptions opts;
+    casky_options_init(&opts);
+    opts.engine = engines[e];
+    opts.num_shards = 2;
+    opts.initial_buckets = 8;
+    KeyDir *db = casky_open_with_options("testdb", &opts);
+    char key[32], value[32];
+    for (int i = 0; i < LF_TEST_KEYS; i++) {
+      snprintf(key, sizeof(key), "k%d", i);
+      snprintf(value, sizeof(value), "k%d:0", i);
+      assert(casky_put(db, key, value, 0) == 0);
+    }
+
+    lf_test_ctx ctx = { db, 0, 0 };
+    pthread_t readers[LF_TEST_READERS];
+    for (int t = 0; t < LF_TEST_READERS; t++)
+      pthread_create(&readers[t], NULL, lf_reader, &ctx);
+
+    for (int r = 1; r <= LF_TEST_ROUNDS; r++) {
+      for (int i = 0; i < LF_TEST_KEYS; i++) {
+        snprintf(key, sizeof(key), "k%d", i);
+        snprintf(value, sizeof(value), "k%d:%d", i, r);
+        if (i % 8 == 0 && r % 2)
+          assert(casky_delete(db, key) == 0);
+        else
+          assert(casky_put(db, key, value, 0) == 0);
+      }
+      if (r % 5 == 0)
+        assert(casky_compact(db) == 0);
+    }
+    __atomic_store_n(&ctx.stop, 1, __ATOMIC_RELEASE);
+    for (int t = 0; t < LF_TEST_READERS; t++)
+      pthread_join(readers[t], NULL);
+    assert(ctx.reads > 0);
+
+    for (int i = 0; i < LF_TEST_KEYS; i++) {
+      snprintf(key, sizeof(key), "k%d", i);
+      snprintf(value, sizeof(value), "k%d:%d", i, LF_TEST_ROUNDS);
+      char *val = casky_get(db, key);
+      assert(val && strcmp(val, value) == 0);
+      free(val);
+    }
+    casky_close(db);
+  }
+#endif
+  printf("✔ test_lockfree_reads passed\n");
+}
+
+// ------------------------ Test group commit ------------------------
+#define GC_TEST_WRITERS 8
+#define GC_TEST_KEYS    100
+
+#ifdef THREAD_SAFE
+typedef struct {
+  KeyDir *db;
+  int id;
+} gc_test_arg;
+
+static void *gc_writer(void *p) {
+  gc_test_arg *arg = p;
+  char key[32], value[32];
+  for (int i = 0; i < GC_TEST_KEYS; i++) {
+    snprintf(key, sizeof(key), "w%d:%d", arg->id, i);
+    snprintf(value, sizeof(value), "v%d", i);
+    assert(casky_put(arg->db, key, value, 0) == 0);
+  }
+  return NULL;
+}
+#endif
+
+// Durable writes share their flushes, also across a compaction
+void test_group_commit() {
+  remove("testdb");
+  KeyDir *db = casky_open("testdb");
+  assert(db->sync_on_write == 1);
+  // Alone, every write flushes the log once
+  assert(casky_put(db, "a", "1", 0) == 0);
+  assert(casky_delete(db, "a") == 0);
+  assert(db->log_syncs == 2);
+  assert(db->log_synced == db->log_appended);
+
+#ifdef THREAD_SAFE
+  pthread_t threads[GC_TEST_WRITERS];
+  gc_test_arg args[GC_TEST_WRITERS];
+  for (int t = 0; t < GC_TEST_WRITERS; t++) {
+    args[t] = (gc_test_arg){ db, t };
+    pthread_create(&threads[t], NULL, gc_writer, &args[t]);
+  }
+  assert(casky_compact(db) == 0);
+  for (int t = 0; t < GC_TEST_WRITERS; t++)
+    pthread_join(threads[t], NULL);
+
+  assert(db->num_entries == GC_TEST_WRITERS * GC_TEST_KEYS);
+  assert(db->log_synced == db->log_appended);
+  assert(db->log_syncs <= 2 + GC_TEST_WRITERS * GC_TEST_KEYS);
+  printf("  %d durable writes, %llu flushes\n", GC_TEST_WRITERS * GC_TEST_KEYS,
+         (unsigned long long)db->log_syncs - 2);
+
+  casky_close(db);
+  db = casky_open("testdb");
+  assert(db->num_entries == GC_TEST_WRITERS * GC_TEST_KEYS);
+  char *val = casky_get(db, "w7:99");
+  assert(val && strcmp(val, "v99") == 0);
+  free(val);
+#endif
+  casky_close(db);
+  printf("✔ test_group_commit passed\n");
+}
+
+// Polls the un-synced window until the flusher brings it under `bytes`
+static casky_sync_stat_t wait_synced(KeyDir *db, uint64_t bytes) {
+  casky_sync_stat_t st = casky_sync_stats(db);
+  for (int i = 0; i < 200 && st.unsynced_bytes > bytes; i++) {
+    usleep(10 * 1000);
+    st = casky_sync_stats(db);
+  }
+  return st;
+}
+
+// Periodic sync: writes never flush inline, the window closes on its own
+void test_sync_periodic() {
+  remove("testdb");
+  CaskyOptions opts;
+  casky_options_init(&opts);
+  assert(opts.sync_mode == CASKY_SYNC_ALWAYS);
+  assert(opts.sync_interval_ms == CASKY_SYNC_INTERVAL_MS);
+  opts.sync_mode = CASKY_SYNC_PERIODIC;
+  opts.sync_interval_ms = 50;
+  opts.sync_bytes = 0;
+
+  KeyDir *db = casky_open_with_options("testdb", &opts);
+  assert(db && db->sync_on_write == 0);
+  assert(casky_put(db, "a", "1", 0) == 0);
+  casky_sync_stat_t st = casky_sync_stats(db);
+  assert(st.unsynced_bytes > 0);
+
+  // Bounded by time
+  usleep(100 * 1000);
+#ifndef THREAD_SAFE
+  // No flusher thread: the next write notices the interval has passed
+  assert(casky_put(db, "b", "2", 0) == 0);
+#endif
+  st = wait_synced(db, 0);
+  assert(st.unsynced_bytes == 0 && st.unsynced_ms == 0);
+  assert(st.num_syncs >= 1);
+  casky_close(db);
+
+  // Bounded by size
+  opts.sync_interval_ms = 60 * 1000;
+  opts.sync_bytes = 256;
+  db = casky_open_with_options("testdb", &opts);
+  assert(db);
+  char key[32];
+  for (int i = 0; i < 16; i++) {
+    snprintf(key, sizeof(key), "k%d", i);
+    assert(casky_put(db, key, "some value", 0) == 0);
+  }
+  st = wait_synced(db, opts.sync_bytes - 1);
+  assert(st.num_syncs >= 1);
+  assert(st.unsynced_bytes < opts.sync_bytes);
+  casky_close(db);
+
+  db = casky_open("testdb");
+  char *val = casky_get(db, "a");
+  assert(val && strcmp(val, "1") == 0);
+  free(val);
+  val = casky_get(db, "k15");
+  assert(val && strcmp(val, "some value") == 0);
+  free(val);
+  st = casky_sync_stats(db);
+  assert(st.unsynced_bytes == 0);
+  casky_close(db);
+  printf("✔ test_sync_periodic passed\n");
+}
+
 void test_open_creates_or_reads_log() {
   const char *logfile = "testdb2.log";
 
@@ -207,6 +969,49 @@ void test_put_writes_log() {
   printf("✔ test_put_writes_log passed\n");
 }
 
+void test_record_encoding() {
+  const char *logfile = "testdb2.log";
+  remove(logfile);
+
+  // Chained CRC over the pieces of a record == CRC of the whole record
+  const unsigned char data[] = "header|key|value";
+  uint32_t crc = casky_crc32_update(0, data, 7);
+  crc = casky_crc32_update(crc, data + 7, 4);
+  crc = casky_crc32_update(crc, data + 11, sizeof(data) - 12);
+  assert(crc == casky_crc32(data, sizeof(data) - 1));
+
+  KeyDir *db = casky_open(logfile);
+  assert(casky_put_n(db, "k\0y", 3, "v\0lue", 5, 0) == 0);
+  assert(casky_delete_n(db, "k\0y", 3) == 0);
+  casky_close(db);
+
+  unsigned char buf[256];
+  FILE *f = fopen(logfile, "rb");
+  size_t n = fread(buf, 1, sizeof(buf), f);
+  fclose(f);
+  size_t put_len = CASKY_RECORD_HEADER_SIZE + 3 + 5;
+  assert(n == put_len + CASKY_RECORD_HEADER_SIZE + 3);
+
+  uint32_t stored, key_len, value_len;
+  memcpy(&stored, buf, 4);
+  memcpy(&key_len, buf + 20, 4);
+  memcpy(&value_len, buf + 24, 4);
+  assert(key_len == 3 && value_len == 5);
+  assert(memcmp(buf + CASKY_RECORD_HEADER_SIZE, "k\0yv\0lue", 8) == 0);
+  assert(stored == casky_crc32c(buf + 4, put_len - 4));
+  assert(casky_record_verify(buf, put_len) == 0);
+
+  // DELETE record: no value bytes
+  unsigned char *del = buf + put_len;
+  memcpy(&stored, del, 4);
+  memcpy(&value_len, del + 24, 4);
+  assert(value_len == 0);
+  assert(stored == casky_crc32c(del + 4, CASKY_RECORD_HEADER_SIZE - 4 + 3));
+
+  remove(logfile);
+  printf("✔ test_record_encoding passed\n");
+}
+
 void test_delete_writes_log() {
   const char *logfile = "testdb2.log";
   remove(logfile);
@@ -253,6 +1058,55 @@ void test_log_integrity() {
   printf("✔ test_log_integrity passed\n");
 }
 
+// A record torn by a failed append, or found at the end of the log on
+// open, is cut off: the records appended after it are not lost on replay
+void test_torn_append() {
+  const char *logfile = "testdb2.log";
+  remove(logfile);
+
+  KeyDir *db = casky_open(logfile);
+  assert(db && casky_put(db, "a", "1", 0) == 0);
+  struct stat st;
+  assert(stat(logfile, &st) == 0);
+  char big[4096];
+  memset(big, 'x', sizeof(big) - 1);
+  big[sizeof(big) - 1] = '\0';
+
+  struct rlimit old, lim;
+  assert(getrlimit(RLIMIT_FSIZE, &old) == 0);
+  void (*handler)(int) = signal(SIGXFSZ, SIG_IGN);
+  lim = old;
+  lim.rlim_cur = st.st_size + 100;
+  assert(setrlimit(RLIMIT_FSIZE, &lim) == 0);
+  assert(casky_put(db, "b", big, 0) == -1);
+  assert(setrlimit(RLIMIT_FSIZE, &old) == 0);
+  signal(SIGXFSZ, handler);
+  assert(casky_put(db, "c", "3", 0) == 0);
+  casky_close(db);
+
+  db = casky_open(logfile);
+  assert(db && casky_errno == CASKY_OK && db->corrupted_dir == 0);
+  char *val = casky_get(db, "c");
+  assert(val && strcmp(val, "3") == 0 && !casky_get(db, "b"));
+  free(val);
+  casky_close(db);
+
+  // A torn record left by a crash
+  assert(stat(logfile, &st) == 0 && truncate(logfile, st.st_size - 1) == 0);
+  db = casky_open(logfile);
+  assert(db && casky_errno == CASKY_OK && !casky_get(db, "c"));
+  assert(casky_put(db, "d", "4", 0) == 0);
+  casky_close(db);
+  db = casky_open(logfile);
+  assert(db && casky_errno == CASKY_OK);
+  val = casky_get(db, "d");
+  assert(val && strcmp(val, "4") == 0);
+  free(val);
+  casky_close(db);
+  remove(logfile);
+  printf("✔ test_torn_append passed\n");
+}
+
 void test_multiple_operations_persist() {
   const char *logfile = "testdb2.log";
   remove(logfile);
@@ -334,6 +1188,1492 @@ void test_ttl_simulation() {
 }
 
 // ------------------------ Main ------------------------
+typedef struct {
+  char keys[64][32];
+  char values[64][32];
+  size_t n;
+  size_t stop_after;  // 0: never stop
+  KeyDir *db;         // if set, every visited key is deleted
+} scan_result;
+
+static int collect_scan_cb(const char *key, size_t key_len,
+                           const char *value, size_t value_len, void *ctx) {
+  scan_result *r = ctx;
+  assert(r->n < 64 && key_len < 32 && value_len < 32);
+  memcpy(r->keys[r->n], key, key_len + 1);
+  memcpy(r->values[r->n], value, value_len + 1);
+  r->n++;
+  if (r->db)
+    assert(casky_delete_n(r->db, key, key_len) == 0);
+  return r->stop_after > 0 && r->n == r->stop_after;
+}
+
+typedef struct {
+  unsigned char last[8];
+  size_t last_len;
+  size_t n;
+} count_scan_result;
+
+// Counts the keys, checking they come in strictly ascending order
+static int count_scan_cb(const char *key, size_t key_len,
+                         const char *value, size_t value_len, void *ctx) {
+  count_scan_result *r = ctx;
+  (void)value;
+  (void)value_len;
+  assert(key_len <= sizeof(r->last));
+  if (r->n > 0) {
+    size_t min = key_len < r->last_len ? key_len : r->last_len;
+    int c = memcmp(r->last, key, min);
+    assert(c < 0 || (c == 0 && r->last_len < key_len));
+  }
+  memcpy(r->last, key, key_len);
+  r->last_len = key_len;
+  r->n++;
+  return 0;
+}
+
+void test_ordered_scan() {
+  const char *keys[] = { "tenant2:b", "tenant1:c", "tenant10:a", "tenant1:a",
+                         "tenant1:b", "tenant2:a", "tenant1", "other" };
+  const size_t nkeys = sizeof(keys) / sizeof(keys[0]);
+
+  // Not available without the ordered index
+  remove("testdb");
+  KeyDir *db = casky_open("testdb");
+  scan_result res = { .n = 0 };
+  assert(casky_scan(db, NULL, NULL, 0, collect_scan_cb, &res) == -1);
+  assert(casky_errno == CASKY_ERR_NOT_SUPPORTED);
+  casky_close(db);
+
+  CaskyEngine engines[] = { CASKY_ENGINE_CHAINED, CASKY_ENGINE_SWISS };
+  for (size_t e = 0; e < sizeof(engines) / sizeof(engines[0]); e++) {
+    remove("testdb");
+    CaskyOptions opts;
+    casky_options_init(&opts);
+    opts.engine = engines[e];
+    opts.ordered_index = 1;
+    db = casky_open_with_options("testdb", &opts);
+    assert(db && db->ordered);
+
+    for (size_t i = 0; i < nkeys; i++)
+      assert(casky_put(db, keys[i], keys[i], 0) == 0);
+    // Updates do not duplicate keys
+    assert(casky_put(db, "tenant1:b", "updated", 0) == 0);
+
+    // Prefix scan: only the keys of tenant1, in order. A bare "tenant1"
+    // prefix also matches "tenant1" itself and "tenant10:a", which sorts
+    // before "tenant1:a" ('0' < ':')
+    memset(&res, 0, sizeof(res));
+    assert(casky_scan_prefix(db, "tenant1:", 0, collect_scan_cb, &res) == 3);
+    assert(strcmp(res.keys[0], "tenant1:a") == 0);
+    assert(strcmp(res.keys[1], "tenant1:b") == 0);
+    assert(strcmp(res.values[1], "updated") == 0);
+    assert(strcmp(res.keys[2], "tenant1:c") == 0);
+    memset(&res, 0, sizeof(res));
+    assert(casky_scan_prefix(db, "tenant1", 0, collect_scan_cb, &res) == 5);
+    assert(strcmp(res.keys[0], "tenant1") == 0);
+    assert(strcmp(res.keys[1], "tenant10:a") == 0);
+    assert(strcmp(res.keys[4], "tenant1:c") == 0);
+
+    // Full scan and half-open ranges
+    memset(&res, 0, sizeof(res));
+    assert(casky_scan(db, NULL, NULL, 0, collect_scan_cb, &res) == (long)nkeys);
+    for (size_t i = 1; i < res.n; i++)
+      assert(strcmp(res.keys[i - 1], res.keys[i]) < 0);
+    memset(&res, 0, sizeof(res));
+    assert(casky_scan(db, "tenant1:b", "tenant2:b", 0, collect_scan_cb, &res) == 3);
+    assert(strcmp(res.keys[0], "tenant1:b") == 0);
+    assert(strcmp(res.keys[2], "tenant2:a") == 0);
+    memset(&res, 0, sizeof(res));
+    assert(casky_scan(db, "tenant2", NULL, 0, collect_scan_cb, &res) == 2);
+    memset(&res, 0, sizeof(res));
+    assert(casky_scan(db, "z", NULL, 0, collect_scan_cb, &res) == 0);
+
+    // Limit, and the callback stopping the scan
+    memset(&res, 0, sizeof(res));
+    assert(casky_scan_prefix(db, "tenant", 2, collect_scan_cb, &res) == 2);
+    assert(strcmp(res.keys[1], "tenant10:a") == 0);
+    memset(&res, 0, sizeof(res));
+    res.stop_after = 1;
+    assert(casky_scan_prefix(db, "tenant", 0, collect_scan_cb, &res) == 1);
+
+    // Deleted keys leave the index; the callback may delete as it goes
+    assert(casky_delete(db, "tenant1:a") == 0);
+    memset(&res, 0, sizeof(res));
+    assert(casky_scan_prefix(db, "tenant1:", 0, collect_scan_cb, &res) == 2);
+    assert(strcmp(res.keys[0], "tenant1:b") == 0);
+    memset(&res, 0, sizeof(res));
+    res.db = db;
+    assert(casky_scan_prefix(db, "tenant2:", 0, collect_scan_cb, &res) == 2);
+    assert(db->ordered->size == db->num_entries);
+    casky_close(db);
+
+    // The index is rebuilt in order while replaying the log
+    db = casky_open_with_options("testdb", &opts);
+    assert(db->ordered->size == nkeys - 3);
+    memset(&res, 0, sizeof(res));
+    assert(casky_scan(db, NULL, NULL, 0, collect_scan_cb, &res) == (long)nkeys - 3);
+    assert(strcmp(res.keys[0], "other") == 0);
+    assert(strcmp(res.keys[1], "tenant1") == 0);
+    casky_close(db);
+
+    // Binary keys sort bytewise, across batch boundaries
+    remove("testdb");
+    db = casky_open_with_options("testdb", &opts);
+    for (int i = 199; i >= 0; i--) {
+      unsigned char k[3] = { 0xff, (unsigned char)(i >> 8), (unsigned char)i };
+      assert(casky_put_n(db, k, sizeof(k), "v", 1, 0) == 0);
+    }
+    assert(casky_put(db, "a", "v", 0) == 0);
+    const unsigned char ff = 0xff;
+    count_scan_result cnt = { .n = 0 };
+    assert(casky_scan_prefix_n(db, &ff, 1, 0, count_scan_cb, &cnt) == 200);
+    memset(&cnt, 0, sizeof(cnt));
+    assert(casky_scan_prefix_n(db, &ff, 1, 150, count_scan_cb, &cnt) == 150);
+    memset(&cnt, 0, sizeof(cnt));
+    assert(casky_scan(db, NULL, NULL, 0, count_scan_cb, &cnt) == 201);
+    casky_close(db);
+  }
+  printf("✔ test_ordered_scan passed\n");
+}
+
+static void check_disk_keys(KeyDir *db, int n) {
+  char key[32], expected[32];
+  for (int i = 0; i < n; i++) {
+    snprintf(key, sizeof(key), "key%d", i);
+    char *value = casky_get(db, key);
+    if (i % 3 == 0) {
+      assert(!value && casky_errno == CASKY_ERR_KEY_NOT_FOUND);
+      continue;
+    }
+    snprintf(expected, sizeof(expected), i % 3 == 1 ? "value%d" : "updated%d", i);
+    assert(value && strcmp(value, expected) == 0);
+    free(value);
+  }
+}
+
+void test_disk_index() {
+  const int n = 5000;
+  char key[32], value[32];
+  CaskyOptions opts;
+  casky_options_init(&opts);
+  opts.disk_index = 1;
+
+  // Needs the KeyDir in memory
+  opts.ordered_index = 1;
+  assert(!casky_open_with_options("testdb", &opts));
+  assert(casky_errno == CASKY_ERR_NOT_SUPPORTED);
+  opts.ordered_index = 0;
+
+  remove("testdb");
+  remove("testdb.idx");
+  KeyDir *db = casky_open_with_options("testdb", &opts);
+  assert(db && db->disk && db->disk->fresh);
+  db->sync_on_write = 0;
+  for (int i = 0; i < n; i++) {
+    snprintf(key, sizeof(key), "key%d", i);
+    snprintf(value, sizeof(value), "value%d", i);
+    assert(casky_put(db, key, value, 0) == 0);
+  }
+  // Pages split, and the directory grew
+  assert(casky_disk_header(db->disk)->global_depth >= 6);
+  for (int i = 0; i < n; i++) {
+    snprintf(key, sizeof(key), "key%d", i);
+    if (i % 3 == 0) {
+      assert(casky_delete(db, key) == 0);
+    } else if (i % 3 == 2) {
+      snprintf(value, sizeof(value), "updated%d", i);
+      assert(casky_put(db, key, value, 0) == 0);
+    }
+  }
+  assert(casky_delete(db, "key0") == -1 && casky_errno == CASKY_ERR_KEY_NOT_FOUND);
+  size_t live = db->num_entries;
+  assert(live == (size_t)(n - (n + 2) / 3));
+  check_disk_keys(db, n);
+  assert(casky_freeze(db) == -1 && casky_errno == CASKY_ERR_NOT_SUPPORTED);
+  casky_close(db);
+
+  // A clean index is mapped, not rebuilt
+  db = casky_open_with_options("testdb", &opts);
+  assert(db && !db->disk->fresh && db->num_entries == live);
+  check_disk_keys(db, n);
+  casky_close(db);
+
+  // Records appended without the index are replayed on top of it
+  db = casky_open("testdb");
+  assert(casky_put(db, "key0", "back", 0) == 0);
+  casky_close(db);
+  db = casky_open_with_options("testdb", &opts);
+  assert(db && !db->disk->fresh && db->num_entries == live + 1);
+  char *v = casky_get(db, "key0");
+  assert(v && strcmp(v, "back") == 0);
+  free(v);
+  assert(casky_delete(db, "key0") == 0);
+
+  // Compaction moves every key to the new log
+  assert(casky_compact(db) == 0);
+  check_disk_keys(db, n);
+  casky_close(db);
+  db = casky_open_with_options("testdb", &opts);
+  assert(db && !db->disk->fresh && db->num_entries == live);
+  check_disk_keys(db, n);
+
+  assert(casky_put(db, "short-lived", "v", 1) == 0);
+  assert(db->num_entries == live + 1);
+  sleep(1);
+  casky_expire(db);
+  assert(db->num_entries == live);
+  assert(!casky_get(db, "short-lived"));
+  casky_close(db);
+
+  // An index left dirty, as after a crash, is rebuilt from the log
+  FILE *idx = fopen("testdb.idx", "r+b");
+  uint32_t dirty = 0;
+  fseek(idx, offsetof(CaskyDiskHeader, clean), SEEK_SET);
+  fwrite(&dirty, sizeof(dirty), 1, idx);
+  fclose(idx);
+  db = casky_open_with_options("testdb", &opts);
+  assert(db && db->disk->fresh && db->num_entries == live);
+  check_disk_keys(db, n);
+  casky_close(db);
+
+  remove("testdb.idx");
+  printf("✔ test_disk_index passed\n");
+}
+
+#ifdef THREAD_SAFE
+static void *disk_expirer(void *p) {
+  lf_test_ctx *ctx = p;
+  while (!__atomic_load_n(&ctx->stop, __ATOMIC_ACQUIRE)) {
+    casky_expire(ctx->db);
+  }
+  return NULL;
+}
+#endif
+
+// Expiry erases slots of an on-disk index while compaction relocates them
+void test_disk_expire_compact() {
+#ifdef THREAD_SAFE
+  const int n = 2000, rounds = 3;
+  char key[32], value[32];
+  CaskyOptions opts;
+  casky_options_init(&opts);
+  opts.disk_index = 1;
+  remove("testdb");
+  remove("testdb.idx");
+  KeyDir *db = casky_open_with_options("testdb", &opts);
+  assert(db && db->disk);
+  db->sync_on_write = 0;
+
+  for (int r = 0; r < rounds; r++) {
+    for (int i = 0; i < n; i++) {
+      snprintf(key, sizeof(key), "short%d:%d", r, i);
+      assert(casky_put(db, key, "short-lived", 1) == 0);
+      snprintf(key, sizeof(key), "key%d", i);
+      snprintf(value, sizeof(value), "value%d:%d", r, i);
+      assert(casky_put(db, key, value, 0) == 0);
+    }
+    sleep(1);
+
+    lf_test_ctx ctx = { db, 0, 0 };
+    pthread_t expirer;
+    pthread_create(&expirer, NULL, disk_expirer, &ctx);
+    for (int c = 0; c < 4; c++)
+      assert(casky_compact(db) == 0);
+    __atomic_store_n(&ctx.stop, 1, __ATOMIC_RELEASE);
+    pthread_join(expirer, NULL);
+    casky_expire(db);
+    assert(db->num_entries == (size_t)n);
+  }
+
+  for (int pass = 0; pass < 2; pass++) {
+    for (int i = 0; i < n; i++) {
+      snprintf(key, sizeof(key), "key%d", i);
+      snprintf(value, sizeof(value), "value%d:%d", rounds - 1, i);
+      char *val = casky_get(db, key);
+      assert(val && strcmp(val, value) == 0);
+      free(val);
+    }
+    casky_close(db);
+    if (pass == 0)
+      db = casky_open_with_options("testdb", &opts);
+  }
+  remove("testdb.idx");
+#endif
+  printf("✔ test_disk_expire_compact passed\n");
+}
+
+// ------------------------ Test segments ------------------------
+#define SEG_TEST_DIR  "testdb.segs"
+#define SEG_TEST_KEYS 200
+
+static void remove_segments(const char *dir) {
+  uint32_t *ids;
+  size_t count;
+  if (casky_segment_list(dir, &ids, &count) != 0) return;
+  for (size_t i = 0; i < count; i++) {
+    char *path = casky_segment_path(dir, ids[i]);
+    remove(path);
+    free(path);
+    path = casky_segment_hint_path(dir, ids[i]);
+    remove(path);
+    free(path);
+  }
+  free(ids);
+  rmdir(dir);
+}
+
+static void check_segment_keys(KeyDir *db, int round) {
+  char key[32], value[32];
+  for (int i = 0; i < SEG_TEST_KEYS; i++) {
+    snprintf(key, sizeof(key), "key%d", i);
+    char *val = casky_get(db, key);
+    if (i % 10 == 0) {
+      assert(!val);
+      continue;
+    }
+    snprintf(value, sizeof(value), "value%d:%d", i, i % 2 ? round : 0);
+    assert(val && strcmp(val, value) == 0);
+    free(val);
+  }
+}
+
+// Segmented database: rotation, reopen, compaction and torn segment tails
+void test_segments() {
+  remove_segments(SEG_TEST_DIR);
+  CaskyOptions opts;
+  casky_options_init(&opts);
+  opts.segment_size = 1024;
+  opts.sync_mode = CASKY_SYNC_NONE;
+
+  KeyDir *db = casky_open_with_options(SEG_TEST_DIR, &opts);
+  assert(db && db->segment_size == 1024);
+  char key[32], value[32];
+  for (int i = 0; i < SEG_TEST_KEYS; i++) {
+    snprintf(key, sizeof(key), "key%d", i);
+    snprintf(value, sizeof(value), "value%d:0", i);
+    assert(casky_put(db, key, value, 0) == 0);
+  }
+  for (int i = 1; i < SEG_TEST_KEYS; i += 2) {
+    snprintf(key, sizeof(key), "key%d", i);
+    snprintf(value, sizeof(value), "value%d:1", i);
+    assert(casky_put(db, key, value, 0) == 0);
+  }
+  for (int i = 0; i < SEG_TEST_KEYS; i += 10) {
+    snprintf(key, sizeof(key), "key%d", i);
+    assert(casky_delete(db, key) == 0);
+  }
+  check_segment_keys(db, 1);
+
+  // Segments never grow past segment_size, and every one stays readable
+  uint32_t *ids;
+  size_t count;
+  assert(casky_segment_list(SEG_TEST_DIR, &ids, &count) == 0);
+  assert(count > 10 && ids[0] == 0 && ids[count - 1] == db->active_id);
+  for (size_t i = 0; i < count; i++) {
+    char *path = casky_segment_path(SEG_TEST_DIR, ids[i]);
+    struct stat st;
+    assert(stat(path, &st) == 0 && st.st_size <= 1024);
+    assert(casky_kd_read_fd(db, ids[i]) >= 0);
+    free(path);
+  }
+  free(ids);
+  uint32_t active = db->active_id;
+  casky_close(db);
+
+  // The directory is recognised without options; the last segment, not
+  // full, stays the active one
+  db = casky_open(SEG_TEST_DIR);
+  assert(db && db->segment_size == CASKY_SEGMENT_SIZE && db->active_id == active);
+  assert(db->num_entries == SEG_TEST_KEYS - SEG_TEST_KEYS / 10);
+  check_segment_keys(db, 1);
+  casky_close(db);
+
+  // Compaction writes new segments and removes the old ones
+  db = casky_open_with_options(SEG_TEST_DIR, &opts);
+  assert(casky_compact(db) == 0);
+  check_segment_keys(db, 1);
+  assert(casky_segment_list(SEG_TEST_DIR, &ids, &count) == 0);
+  assert(count > 1 && ids[0] == active + 1 && ids[count - 1] == db->active_id);
+  assert(casky_kd_read_fd(db, active) < 0);
+  free(ids);
+  for (int i = 1; i < SEG_TEST_KEYS; i += 2) {
+    snprintf(key, sizeof(key), "key%d", i);
+    snprintf(value, sizeof(value), "value%d:2", i);
+    assert(casky_put(db, key, value, 0) == 0);
+  }
+  active = db->active_id;
+  casky_close(db);
+
+  // A torn record at the end of the active segment is never appended to
+  char *path = casky_segment_path(SEG_TEST_DIR, active);
+  FILE *f = fopen(path, "ab");
+  fwrite("torn", 1, 4, f);
+  fclose(f);
+  free(path);
+  db = casky_open_with_options(SEG_TEST_DIR, &opts);
+  assert(db && db->active_id == active + 1);
+  check_segment_keys(db, 2);
+  assert(casky_put(db, "after", "torn", 0) == 0);
+  casky_close(db);
+  db = casky_open_with_options(SEG_TEST_DIR, &opts);
+  check_segment_keys(db, 2);
+  char *val = casky_get(db, "after");
+  assert(val && strcmp(val, "torn") == 0);
+  free(val);
+  casky_close(db);
+
+  remove_segments(SEG_TEST_DIR);
+  printf("✔ test_segments passed\n");
+}
+
+static void check_compact_keys(KeyDir *db, int count) {
+  char key[32], value[32];
+  for (int i = 0; i < count; i++) {
+    snprintf(key, sizeof(key), "key%d", i);
+    snprintf(value, sizeof(value), "value%d", i);
+    char *val = casky_get(db, key);
+    assert(val && strcmp(val, value) == 0);
+    free(val);
+  }
+}
+
+// A compaction short of file descriptors, wherever it runs out of them,
+// fails with the database untouched and still writable
+void test_compact_out_of_fds() {
+  const char *paths[] = { "testdb.fds", SEG_TEST_DIR };
+  for (int seg = 0; seg < 2; seg++) {
+    remove(paths[0]);
+    remove("testdb.fds.hint");
+    remove_segments(SEG_TEST_DIR);
+    CaskyOptions opts;
+    casky_options_init(&opts);
+    opts.sync_mode = CASKY_SYNC_NONE;
+    opts.segment_size = seg ? 4096 : 0;
+    KeyDir *db = casky_open_with_options(paths[seg], &opts);
+    assert(db);
+    char key[32], value[32];
+    int count = 0;
+    for (; count < 200; count++) {
+      snprintf(key, sizeof(key), "key%d", count);
+      snprintf(value, sizeof(value), "value%d", count);
+      assert(casky_put(db, key, value, 0) == 0);
+    }
+
+    struct rlimit old, lim;
+    assert(getrlimit(RLIMIT_NOFILE, &old) == 0);
+    int failed = 0;
+    for (rlim_t extra = 0; ; extra++) {
+      int lowest = dup(0);  // the next descriptor open() would return
+      assert(lowest >= 0);
+      close(lowest);
+      lim = old;
+      lim.rlim_cur = lowest + extra;
+      assert(setrlimit(RLIMIT_NOFILE, &lim) == 0);
+      int ret = casky_compact(db);
+      assert(setrlimit(RLIMIT_NOFILE, &old) == 0);
+      if (ret != 0) {
+        assert(casky_errno != CASKY_OK);
+        failed++;
+      }
+      check_compact_keys(db, count);
+      snprintf(key, sizeof(key), "key%d", count);
+      snprintf(value, sizeof(value), "value%d", count);
+      assert(casky_put(db, key, value, 0) == 0);
+      count++;
+      if (ret == 0) break;
+      assert(extra < 16);
+    }
+    assert(failed > 0);
+    casky_close(db);
+
+    db = casky_open_with_options(paths[seg], &opts);
+    assert(db && casky_errno == CASKY_OK && db->num_entries == (size_t)count);
+    check_compact_keys(db, count);
+    casky_close(db);
+  }
+  remove(paths[0]);
+  remove("testdb.fds.hint");
+  remove_segments(SEG_TEST_DIR);
+  printf("✔ test_compact_out_of_fds passed\n");
+}
+
+// Overwrites, in place, the first occurrence of `from` in a file
+// Returns: its offset
+static size_t patch_file(const char *path, const char *from, const char *to) {
+  FILE *f = fopen(path, "r+b");
+  assert(f);
+  char buf[4096];
+  size_t n = fread(buf, 1, sizeof(buf), f), len = strlen(from);
+  for (size_t i = 0; i + len <= n; i++) {
+    if (memcmp(buf + i, from, len) != 0) continue;
+    fseek(f, i, SEEK_SET);
+    fwrite(to, 1, len, f);
+    fclose(f);
+    return i;
+  }
+  assert(!"pattern not found");
+  return 0;
+}
+
+// patch_file() on a log: the CRC of the record patched is updated, so
+// that the record is still replayed
+static void patch_record(const char *path, const char *from, const char *to) {
+  size_t at = patch_file(path, from, to);
+  FILE *f = fopen(path, "r+b");
+  assert(f);
+  unsigned char buf[4096];
+  size_t n = fread(buf, 1, sizeof(buf), f);
+  for (size_t pos = 0; pos + CASKY_RECORD_HEADER_SIZE <= n;) {
+    uint32_t key_len, value_len;
+    memcpy(&key_len, buf + pos + 20, 4);
+    memcpy(&value_len, buf + pos + 24, 4);
+    size_t record_len = CASKY_RECORD_HEADER_SIZE + key_len + value_len;
+    if (at < pos + record_len) {
+      uint32_t crc = casky_crc32c(buf + pos + 4, record_len - 4);
+      fseek(f, pos, SEEK_SET);
+      fwrite(&crc, sizeof(crc), 1, f);
+      fclose(f);
+      return;
+    }
+    pos += record_len;
+  }
+  assert(!"record not found");
+}
+
+static int file_exists(const char *path) {
+  struct stat st;
+  return stat(path, &st) == 0;
+}
+
+// Hint files: written when segments are sealed or compacted, loaded
+// instead of the records they describe. A key renamed in a log behind a
+// valid hint is not seen, which tells whether the hint was used.
+void test_hint_files() {
+  remove_segments(SEG_TEST_DIR);
+  CaskyOptions opts;
+  casky_options_init(&opts);
+  opts.segment_size = 1024;
+  opts.sync_mode = CASKY_SYNC_NONE;
+
+  KeyDir *db = casky_open_with_options(SEG_TEST_DIR, &opts);
+  assert(db);
+  char key[32], value[32];
+  for (int i = 0; i < SEG_TEST_KEYS; i++) {
+    snprintf(key, sizeof(key), "key%d", i);
+    snprintf(value, sizeof(value), "value%d:0", i);
+    assert(casky_put(db, key, value, 0) == 0);
+  }
+  for (int i = 1; i < SEG_TEST_KEYS; i += 2) {
+    snprintf(key, sizeof(key), "key%d", i);
+    snprintf(value, sizeof(value), "value%d:1", i);
+    assert(casky_put(db, key, value, 0) == 0);
+  }
+  for (int i = 0; i < SEG_TEST_KEYS; i += 10) {
+    snprintf(key, sizeof(key), "key%d", i);
+    assert(casky_delete(db, key) == 0);
+  }
+  casky_close(db);
+
+  // Every segment, the active one included, has its hint
+  uint32_t *ids;
+  size_t count;
+  assert(casky_segment_list(SEG_TEST_DIR, &ids, &count) == 0);
+  for (size_t i = 0; i < count; i++) {
+    char *hint = casky_segment_hint_path(SEG_TEST_DIR, ids[i]);
+    assert(file_exists(hint));
+    free(hint);
+  }
+  char *log = casky_segment_path(SEG_TEST_DIR, ids[0]);
+  char *hint = casky_segment_hint_path(SEG_TEST_DIR, ids[0]);
+  free(ids);
+
+  patch_record(log, "key2value2:0", "kez2value2:0");
+  db = casky_open_with_options(SEG_TEST_DIR, &opts);
+  assert(db && db->num_entries == SEG_TEST_KEYS - SEG_TEST_KEYS / 10);
+  check_segment_keys(db, 1);
+  assert(!casky_get(db, "kez2"));
+  casky_close(db);
+
+  // A damaged hint is ignored: the segment is replayed
+  patch_file(hint, "key5", "kez5");
+  db = casky_open_with_options(SEG_TEST_DIR, &opts);
+  char *val = casky_get(db, "kez2");
+  assert(val && strcmp(val, "value2:0") == 0);
+  free(val);
+  assert(!casky_get(db, "key2"));
+  casky_close(db);
+  patch_record(log, "kez2value2:0", "key2value2:0");
+  free(log);
+  free(hint);
+
+  // A hint older than its segment: the records after it are replayed
+  db = casky_open_with_options(SEG_TEST_DIR, &opts);
+  char *active = casky_segment_hint_path(SEG_TEST_DIR, db->active_id);
+  assert(rename(active, "testdb.hint.saved") == 0);
+  for (int i = 1; i < SEG_TEST_KEYS; i += 2) {
+    snprintf(key, sizeof(key), "key%d", i);
+    snprintf(value, sizeof(value), "value%d:2", i);
+    assert(casky_put(db, key, value, 0) == 0);
+  }
+  casky_close(db);
+  assert(rename("testdb.hint.saved", active) == 0);
+  free(active);
+  db = casky_open_with_options(SEG_TEST_DIR, &opts);
+  check_segment_keys(db, 2);
+
+  // Compacted segments get hints too, the old ones go with their segment
+  assert(casky_compact(db) == 0);
+  casky_close(db);
+  assert(casky_segment_list(SEG_TEST_DIR, &ids, &count) == 0);
+  for (size_t i = 0; i < count; i++) {
+    hint = casky_segment_hint_path(SEG_TEST_DIR, ids[i]);
+    assert(file_exists(hint));
+    free(hint);
+  }
+  uint32_t first = ids[0];
+  free(ids);
+  hint = casky_segment_hint_path(SEG_TEST_DIR, first - 1);
+  assert(!file_exists(hint));
+  free(hint);
+  db = casky_open_with_options(SEG_TEST_DIR, &opts);
+  check_segment_keys(db, 2);
+  casky_close(db);
+  remove_segments(SEG_TEST_DIR);
+
+  // A single log file gets its hint from casky_compact(); the records
+  // appended afterwards are replayed
+  remove("testdb.single");
+  remove("testdb.single.hint");
+  db = casky_open("testdb.single");
+  assert(casky_put(db, "key2", "stale", 0) == 0);
+  assert(casky_put(db, "key2", "value2:0", 0) == 0);
+  assert(casky_compact(db) == 0);
+  assert(file_exists("testdb.single.hint"));
+  assert(casky_put(db, "tail", "replayed", 0) == 0);
+  casky_close(db);
+  patch_record("testdb.single", "key2value2:0", "kez2value2:0");
+  db = casky_open("testdb.single");
+  assert(db && db->num_entries == 2);
+  val = casky_get(db, "key2");
+  assert(val && strcmp(val, "value2:0") == 0);
+  free(val);
+  val = casky_get(db, "tail");
+  assert(val && strcmp(val, "replayed") == 0);
+  free(val);
+  casky_close(db);
+
+  // The hint of a replaced log is not used, even if the new one is the
+  // same size
+  char buf[4096];
+  FILE *f = fopen("testdb.single", "rb");
+  size_t n = fread(buf, 1, sizeof(buf), f);
+  fclose(f);
+  f = fopen("testdb.single.new", "wb");
+  assert(fwrite(buf, 1, n, f) == n);
+  fclose(f);
+  assert(rename("testdb.single.new", "testdb.single") == 0);
+  db = casky_open("testdb.single");
+  val = casky_get(db, "kez2");
+  assert(val && strcmp(val, "value2:0") == 0);
+  free(val);
+
+  // A log emptied, or removed and created again on the same inode, leaves
+  // the hint of its compaction behind: it must not stand for the new log
+  assert(casky_compact(db) == 0);
+  casky_close(db);
+  assert(file_exists("testdb.single.hint"));
+  struct stat st;
+  assert(stat("testdb.single", &st) == 0 && truncate("testdb.single", 0) == 0);
+  db = casky_open("testdb.single");
+  assert(db && db->num_entries == 0);
+  for (int i = 0; i < SEG_TEST_KEYS; i++) {
+    snprintf(key, sizeof(key), "new%d", i);
+    assert(casky_put(db, key, "value", 0) == 0);
+  }
+  casky_close(db);
+  struct stat grown;
+  assert(stat("testdb.single", &grown) == 0 && grown.st_size >= st.st_size);
+  db = casky_open("testdb.single");
+  assert(db && db->num_entries == SEG_TEST_KEYS && !casky_get(db, "kez2"));
+  casky_close(db);
+  remove("testdb.single");
+  remove("testdb.single.hint");
+  printf("✔ test_hint_files passed\n");
+}
+
+// ------------------------ Test parallel recovery ------------------------
+#define RECOVERY_TEST_KEYS 20000
+
+static void check_recovered_keys(const char *path, CaskyValueMode mode, uint32_t threads,
+                                 int replay_pread) {
+  CaskyOptions opts;
+  casky_options_init(&opts);
+  opts.value_mode = mode;
+  opts.recovery_threads = threads;
+  opts.replay_pread = replay_pread;
+  KeyDir *db = casky_open_with_options(path, &opts);
+  assert(db && db->recovery_threads >= 1 && db->recovery_threads <= threads);
+  assert(db->num_entries == RECOVERY_TEST_KEYS - (RECOVERY_TEST_KEYS + 6) / 7 + 1);
+  char key[32], value[32];
+  for (int i = 0; i < RECOVERY_TEST_KEYS; i++) {
+    snprintf(key, sizeof(key), "key%d", i);
+    char *val = casky_get(db, key);
+    if (i % 7 == 0) {
+      assert(!val);
+      continue;
+    }
+    snprintf(value, sizeof(value), "value%d:%d", i, i % 3 ? 2 : 0);
+    assert(val && strcmp(val, value) == 0);
+    free(val);
+  }
+  size_t len;
+  char *big = casky_get_n(db, "big", 3, &len);
+  assert(big && len == CASKY_REPLAY_BUFFER + 100 && big[0] == 'b' && big[len - 1] == 'g');
+  free(big);
+  casky_close(db);
+}
+
+// Batches replayed by several threads give the same KeyDir as a
+// sequential replay, including a record larger than the replay buffer,
+// whether the log is mapped or read
+void test_parallel_recovery() {
+  const char *path = "testdb.recovery";
+  remove(path);
+  CaskyOptions opts;
+  casky_options_init(&opts);
+  opts.sync_mode = CASKY_SYNC_NONE;
+  KeyDir *db = casky_open_with_options(path, &opts);
+  assert(db);
+  char key[32], value[32];
+  for (int round = 0; round < 3; round++) {
+    for (int i = 0; i < RECOVERY_TEST_KEYS; i++) {
+      if (round > 0 && i % 3 == 0) continue;
+      snprintf(key, sizeof(key), "key%d", i);
+      snprintf(value, sizeof(value), "value%d:%d", i, round);
+      assert(casky_put(db, key, value, 0) == 0);
+    }
+    if (round == 1) {
+      char *big = malloc(CASKY_REPLAY_BUFFER + 101);
+      memset(big, 'x', CASKY_REPLAY_BUFFER + 100);
+      big[0] = 'b';
+      big[CASKY_REPLAY_BUFFER + 99] = 'g';
+      big[CASKY_REPLAY_BUFFER + 100] = '\0';
+      assert(casky_put(db, "big", big, 0) == 0);
+      free(big);
+    }
+  }
+  for (int i = 0; i < RECOVERY_TEST_KEYS; i += 7) {
+    snprintf(key, sizeof(key), "key%d", i);
+    assert(casky_delete(db, key) == 0);
+  }
+  casky_close(db);
+
+  // The log spans two replay windows of the mapping, and the big record
+  // outgrows the buffer of the pread() fallback
+  check_recovered_keys(path, CASKY_VALUES_ON_DISK, 1, 0);
+  check_recovered_keys(path, CASKY_VALUES_ON_DISK, 4, 0);
+  check_recovered_keys(path, CASKY_VALUES_IN_MEMORY, 4, 0);
+  check_recovered_keys(path, CASKY_VALUES_ON_DISK, 1, 1);
+  check_recovered_keys(path, CASKY_VALUES_IN_MEMORY, 4, 1);
+
+  // Same in a block file, where the big record has a group of its own
+  opts.log_format = CASKY_LOG_BLOCKS;
+  db = casky_open_with_options(path, &opts);
+  assert(db && casky_compact(db) == 0);
+  casky_close(db);
+  remove("testdb.recovery.hint");  // replay the log itself
+  check_recovered_keys(path, CASKY_VALUES_ON_DISK, 4, 0);
+  check_recovered_keys(path, CASKY_VALUES_ON_DISK, 1, 1);
+  check_recovered_keys(path, CASKY_VALUES_IN_MEMORY, 4, 1);
+  remove(path);
+  printf("✔ test_parallel_recovery passed\n");
+}
+
+// ------------------------------ Test CRC32C ------------------------------
+#define CRC_TEST_KEYS 10000
+
+// One bit at a time, as in the definition of CRC32C
+static uint32_t crc32c_reference(const unsigned char *buf, size_t len) {
+  uint32_t crc = 0xFFFFFFFF;
+  for (size_t i = 0; i < len; i++) {
+    crc ^= buf[i];
+    for (int j = 0; j < 8; j++)
+      crc = (crc & 1) ? 0x82F63B78 ^ (crc >> 1) : crc >> 1;
+  }
+  return crc ^ 0xFFFFFFFF;
+}
+
+static void check_corrupted_log(const char *path, uint32_t threads) {
+  CaskyOptions opts;
+  casky_options_init(&opts);
+  opts.recovery_threads = threads;
+  KeyDir *db = casky_open_with_options(path, &opts);
+  assert(db && casky_errno == CASKY_ERR_CORRUPT && db->corrupted_dir == 1);
+  assert(db->num_entries == CRC_TEST_KEYS / 2);
+  char key[32];
+  for (int i = 0; i < CRC_TEST_KEYS; i++) {
+    snprintf(key, sizeof(key), "key%d", i);
+    char *val = casky_get(db, key);
+    assert(i < CRC_TEST_KEYS / 2 ? val != NULL : val == NULL);
+    free(val);
+  }
+  casky_close(db);
+}
+
+// The CRC32C of any length and alignment matches the definition, whatever
+// the implementation; replay stops at the first record whose CRC does not
+// match, and still accepts the CRC32 of older releases
+void test_crc32c() {
+  const unsigned char check[] = "123456789";
+  assert(casky_crc32c(check, 9) == 0xE3069283);
+  assert(casky_crc32(check, 9) == 0xCBF43926);
+  printf("CRC32C implementation: %s\n", casky_crc32c_impl());
+
+  size_t size = 8192 * 3 * 2 + 1000;
+  unsigned char *buf = malloc(size + 8);
+  srand(7);
+  for (size_t i = 0; i < size + 8; i++)
+    buf[i] = rand();
+  const size_t lens[] = { 0, 1, 7, 8, 9, 63, 255, 767, 768, 769, 1000, 8192 * 3 - 1,
+                          8192 * 3, 8192 * 3 + 1, 8192 * 3 + 768, size };
+  for (size_t l = 0; l < sizeof(lens) / sizeof(lens[0]); l++) {
+    for (size_t align = 0; align < 8; align++) {
+      uint32_t crc = crc32c_reference(buf + align, lens[l]);
+      assert(casky_crc32c(buf + align, lens[l]) == crc);
+      size_t half = lens[l] / 3;
+      uint32_t split = casky_crc32c_update(0, buf + align, half);
+      assert(casky_crc32c_update(split, buf + align + half, lens[l] - half) == crc);
+    }
+  }
+  free(buf);
+
+  // A damaged value in the middle of the log
+  const char *path = "testdb.crc";
+  remove(path);
+  CaskyOptions opts;
+  casky_options_init(&opts);
+  opts.sync_mode = CASKY_SYNC_NONE;
+  KeyDir *db = casky_open_with_options(path, &opts);
+  assert(db);
+  char key[32], value[32];
+  long offset = 0;
+  for (int i = 0; i < CRC_TEST_KEYS; i++) {
+    int key_len = snprintf(key, sizeof(key), "key%d", i);
+    int value_len = snprintf(value, sizeof(value), "value%d", i);
+    assert(casky_put(db, key, value, 0) == 0);
+    if (i < CRC_TEST_KEYS / 2)
+      offset += CASKY_RECORD_HEADER_SIZE + key_len + value_len;
+  }
+  casky_close(db);
+  FILE *f = fopen(path, "r+b");
+  snprintf(key, sizeof(key), "key%d", CRC_TEST_KEYS / 2);
+  fseek(f, offset + CASKY_RECORD_HEADER_SIZE + strlen(key), SEEK_SET);
+  fputc('V', f);
+  fclose(f);
+  check_corrupted_log(path, 1);
+  check_corrupted_log(path, 4);
+  remove(path);
+
+  // A record of an older release, checksummed with CRC32
+  f = fopen(path, "wb");
+  assert(casky_write_record(f, 0, "old", 3, "crc32", 5, 1, 0) == 0);
+  fclose(f);
+  unsigned char record[CASKY_RECORD_HEADER_SIZE + 8];
+  f = fopen(path, "r+b");
+  assert(fread(record, 1, sizeof(record), f) == sizeof(record));
+  uint32_t crc = casky_crc32(record + 4, sizeof(record) - 4);
+  memcpy(record, &crc, sizeof(crc));
+  assert(casky_record_verify(record, sizeof(record)) == 1);
+  fseek(f, 0, SEEK_SET);
+  fwrite(&crc, sizeof(crc), 1, f);
+  fclose(f);
+  db = casky_open(path);
+  assert(db && casky_errno == CASKY_OK && !db->corrupted_dir);
+  char *val = casky_get(db, "old");
+  assert(val && strcmp(val, "crc32") == 0);
+  free(val);
+  casky_close(db);
+  record[sizeof(record) - 1] ^= 1;
+  assert(casky_record_verify(record, sizeof(record)) == -1);
+  remove(path);
+  printf("✔ test_crc32c passed\n");
+}
+
+// ---------------------------- Test compression ----------------------------
+#define COMPRESS_TEST_KEYS 2000
+
+// Even keys get a compressible value, odd ones a value below the threshold
+static size_t compress_test_value(int i, char *buf, size_t cap) {
+  if (i % 2)
+    return snprintf(buf, cap, "v%d", i);
+  size_t len = snprintf(buf, cap, "value%d:", i);
+  memset(buf + len, 'a' + i % 26, 400);
+  buf[len + 400] = '\0';
+  return len + 400;
+}
+
+static void compress_check_cb(const char *value, size_t len, void *ctx) {
+  const char *expected = ctx;
+  assert(len == strlen(expected) && memcmp(value, expected, len) == 0);
+}
+
+static int compressed_count_cb(EntryNode *node, const Entry *e, void *arg) {
+  (void)node;
+  if (e->codec != CASKY_CODEC_NONE)
+    (*(size_t *)arg)++;
+  return CASKY_ITER_CONTINUE;
+}
+
+static size_t compressed_count(KeyDir *kd) {
+  size_t count = 0;
+  casky_kd_lock_all(kd, 0);
+  casky_kd_foreach(kd, compressed_count_cb, &count);
+  casky_kd_unlock_all(kd);
+  return count;
+}
+
+static void check_compressed_keys(KeyDir *db) {
+  char key[32], value[512], buf[512];
+  assert(db && db->num_entries == COMPRESS_TEST_KEYS);
+  for (int i = 0; i < COMPRESS_TEST_KEYS; i++) {
+    snprintf(key, sizeof(key), "key%d", i);
+    size_t value_len = compress_test_value(i, value, sizeof(value)), len;
+    char *val = casky_get(db, key);
+    assert(val && strcmp(val, value) == 0);
+    free(val);
+    val = casky_get_n(db, key, strlen(key), &len);
+    assert(val && len == value_len && memcmp(val, value, len) == 0);
+    free(val);
+    assert(casky_get_into(db, key, buf, 2, &len) == -1 &&
+           casky_errno == CASKY_ERR_BUFFER_TOO_SMALL && len == value_len);
+    assert(casky_get_into(db, key, buf, sizeof(buf), &len) == 0 && strcmp(buf, value) == 0);
+    assert(casky_get_with(db, key, compress_check_cb, value) == 0);
+  }
+}
+
+static KeyDir *open_compressed(const char *path, CaskyCodec codec, CaskyValueMode mode,
+                               uint32_t threads, uint64_t segment_size) {
+  CaskyOptions opts;
+  casky_options_init(&opts);
+  opts.sync_mode = CASKY_SYNC_NONE;
+  opts.compression = codec;
+  opts.value_mode = mode;
+  opts.recovery_threads = threads;
+  opts.segment_size = segment_size;
+  return casky_open_with_options(path, &opts);
+}
+
+// Values are compressed per record: records written before the codec was
+// set stay readable, short values are stored as they are, and every read
+// path, replay, compaction, snapshots and hint files give back the value
+void test_compression() {
+  const char *path = "testdb.compress";
+  const char *snapshot = "testdb.compress.snap";
+  if (!casky_codec_available(CASKY_CODEC_LZ4) || !casky_codec_available(CASKY_CODEC_ZSTD)) {
+    CaskyCodec missing = casky_codec_available(CASKY_CODEC_LZ4) ? CASKY_CODEC_ZSTD : CASKY_CODEC_LZ4;
+    assert(!open_compressed(path, missing, CASKY_VALUES_ON_DISK, 1, 0) &&
+           casky_errno == CASKY_ERR_NOT_SUPPORTED);
+  }
+
+  for (CaskyCodec codec = CASKY_CODEC_LZ4; codec <= CASKY_CODEC_ZSTD; codec++) {
+    if (!casky_codec_available(codec)) {
+      printf("Codec %s not built in\n", casky_codec_name(codec));
+      continue;
+    }
+    char key[32], value[512];
+    remove(path);
+    KeyDir *db = open_compressed(path, CASKY_CODEC_NONE, CASKY_VALUES_ON_DISK, 1, 0);
+    assert(db);
+    for (int i = 0; i < COMPRESS_TEST_KEYS / 2; i++) {
+      snprintf(key, sizeof(key), "key%d", i);
+      compress_test_value(i, value, sizeof(value));
+      assert(casky_put(db, key, value, 0) == 0);
+    }
+    casky_close(db);
+
+    db = open_compressed(path, codec, CASKY_VALUES_ON_DISK, 1, 0);
+    assert(db && compressed_count(db) == 0);
+    for (int i = COMPRESS_TEST_KEYS / 2; i < COMPRESS_TEST_KEYS; i++) {
+      snprintf(key, sizeof(key), "key%d", i);
+      compress_test_value(i, value, sizeof(value));
+      assert(casky_put(db, key, value, 0) == 0);
+    }
+    assert(compressed_count(db) == COMPRESS_TEST_KEYS / 4);
+    check_compressed_keys(db);
+    casky_close(db);
+
+    db = open_compressed(path, CASKY_CODEC_NONE, CASKY_VALUES_ON_DISK, 1, 0);
+    assert(compressed_count(db) == COMPRESS_TEST_KEYS / 4);
+    check_compressed_keys(db);
+    casky_close(db);
+    db = open_compressed(path, CASKY_CODEC_NONE, CASKY_VALUES_ON_DISK, 4, 0);
+    check_compressed_keys(db);
+    casky_close(db);
+    db = open_compressed(path, CASKY_CODEC_NONE, CASKY_VALUES_IN_MEMORY, 4, 0);
+    assert(compressed_count(db) == 0);
+    check_compressed_keys(db);
+    casky_close(db);
+
+    // Compaction compresses what older records left uncompressed
+    struct stat st;
+    assert(stat(path, &st) == 0);
+    off_t before = st.st_size;
+    db = open_compressed(path, codec, CASKY_VALUES_ON_DISK, 1, 0);
+    assert(casky_compact(db) == 0);
+    assert(compressed_count(db) == COMPRESS_TEST_KEYS / 2);
+    check_compressed_keys(db);
+    casky_close(db);
+    assert(stat(path, &st) == 0 && st.st_size < before / 2);
+    db = open_compressed(path, codec, CASKY_VALUES_ON_DISK, 4, 0);
+    check_compressed_keys(db);
+
+    // Snapshots, written from values kept in memory too
+    remove(snapshot);
+    assert(casky_do_snapshot(db, snapshot) == 0);
+    casky_close(db);
+    db = casky_load_snapshot(snapshot);
+    check_compressed_keys(db);
+    casky_close(db);
+    remove(snapshot);
+    db = open_compressed(path, codec, CASKY_VALUES_IN_MEMORY, 1, 0);
+    assert(casky_do_snapshot(db, snapshot) == 0);
+    casky_close(db);
+    db = casky_load_snapshot(snapshot);
+    assert(compressed_count(db) == COMPRESS_TEST_KEYS / 2);
+    check_compressed_keys(db);
+    casky_close(db);
+    remove(snapshot);
+    remove(path);
+
+    // Hint files carry the codec of the records
+    remove_segments(SEG_TEST_DIR);
+    db = open_compressed(SEG_TEST_DIR, codec, CASKY_VALUES_ON_DISK, 1, 16 * 1024);
+    assert(db);
+    for (int i = 0; i < COMPRESS_TEST_KEYS; i++) {
+      snprintf(key, sizeof(key), "key%d", i);
+      compress_test_value(i, value, sizeof(value));
+      assert(casky_put(db, key, value, 0) == 0);
+    }
+    casky_close(db);
+    db = open_compressed(SEG_TEST_DIR, codec, CASKY_VALUES_ON_DISK, 4, 16 * 1024);
+    assert(compressed_count(db) == COMPRESS_TEST_KEYS / 2);
+    check_compressed_keys(db);
+    casky_close(db);
+    remove_segments(SEG_TEST_DIR);
+    printf("Codec %s checked\n", casky_codec_name(codec));
+  }
+  printf("✔ test_compression passed\n");
+}
+
+// ----------------------------- Test block log -----------------------------
+#define BLOCK_TEST_KEYS 5000
+#define BLOCK_TEST_BIG  (3 * CASKY_BLOCK_SIZE + 100)
+
+static KeyDir *open_blocks(CaskyLogFormat format, const char *path, CaskyValueMode mode,
+                           uint32_t threads, uint64_t segment_size, CaskyCodec codec) {
+  CaskyOptions opts;
+  casky_options_init(&opts);
+  opts.sync_mode = CASKY_SYNC_NONE;
+  opts.log_format = format;
+  opts.value_mode = mode;
+  opts.recovery_threads = threads;
+  opts.segment_size = segment_size;
+  opts.compression = codec;
+  return casky_open_with_options(path, &opts);
+}
+
+static void put_block_keys(KeyDir *db) {
+  char key[32], value[512];
+  for (int i = 0; i < BLOCK_TEST_KEYS; i++) {
+    snprintf(key, sizeof(key), "key%d", i);
+    compress_test_value(i, value, sizeof(value));
+    assert(casky_put(db, key, value, i % 5 == 0 ? 3600 : 0) == 0);
+  }
+  for (int i = 0; i < BLOCK_TEST_KEYS; i += 7) {
+    snprintf(key, sizeof(key), "key%d", i);
+    assert(casky_delete(db, key) == 0);
+  }
+  char *big = malloc(BLOCK_TEST_BIG);
+  memset(big, 'x', BLOCK_TEST_BIG);
+  big[0] = 'b';
+  big[BLOCK_TEST_BIG - 1] = 'g';
+  assert(casky_put_n(db, "big", 3, big, BLOCK_TEST_BIG, 0) == 0);
+  free(big);
+}
+
+// Returns: the keys of put_block_keys() found, all with their value
+static int check_block_keys(KeyDir *db) {
+  char key[32], value[512];
+  int found = 0;
+  for (int i = 0; i < BLOCK_TEST_KEYS; i++) {
+    snprintf(key, sizeof(key), "key%d", i);
+    char *val = casky_get(db, key);
+    if (i % 7 == 0)
+      assert(!val);
+    if (!val) continue;
+    compress_test_value(i, value, sizeof(value));
+    assert(strcmp(val, value) == 0);
+    free(val);
+    found++;
+  }
+  size_t len;
+  char *big = casky_get_n(db, "big", 3, &len);
+  if (big) {
+    assert(len == BLOCK_TEST_BIG && big[0] == 'b' && big[len - 1] == 'g');
+    found++;
+  }
+  free(big);
+  return found;
+}
+
+static int log_is_blocks(const char *path) {
+  char magic[8] = "";
+  FILE *f = fopen(path, "rb");
+  assert(f);
+  size_t n = fread(magic, 1, sizeof(magic), f);
+  fclose(f);
+  return n == sizeof(magic) && memcmp(magic, CASKY_LOG_MAGIC, sizeof(magic)) == 0;
+}
+
+// Block-framed logs: written on request only, an existing log being
+// converted by compaction. Every read path sees the same records; a
+// damaged group only loses its own block, and a torn group at the end of
+// the log is cut off so that appends go on from there.
+void test_block_format(CaskyLogFormat format) {
+  const char *path = "testdb.blocks";
+  const char *snapshot = "testdb.blocks.snap";
+  const int expected = BLOCK_TEST_KEYS - (BLOCK_TEST_KEYS + 6) / 7 + 1;
+  remove(path);
+
+  CaskyOptions opts;
+  casky_options_init(&opts);
+  opts.disk_index = 1;
+  opts.log_format = format;
+  assert(!casky_open_with_options(path, &opts) && casky_errno == CASKY_ERR_NOT_SUPPORTED);
+
+  // A log of records stays one until it is compacted
+  KeyDir *db = casky_open(path);
+  assert(db && casky_put(db, "old", "record", 0) == 0);
+  casky_close(db);
+  db = open_blocks(format, path, CASKY_VALUES_ON_DISK, 1, 0, CASKY_CODEC_NONE);
+  assert(db && db->log_header.format == CASKY_LOG_RECORDS);
+  put_block_keys(db);
+  assert(casky_compact(db) == 0 && db->log_header.format == format);
+  assert(check_block_keys(db) == expected);
+  casky_close(db);
+  assert(log_is_blocks(path));
+
+  // Appends, one group each, then replay with every mode
+  db = open_blocks(format, path, CASKY_VALUES_ON_DISK, 1, 0, CASKY_CODEC_NONE);
+  put_block_keys(db);
+  assert(casky_put(db, "short", "lived", 1) == 0);
+  casky_close(db);
+  db = open_blocks(format, path, CASKY_VALUES_ON_DISK, 1, 0, CASKY_CODEC_NONE);
+  assert(db && casky_errno == CASKY_OK && check_block_keys(db) == expected);
+  char *val = casky_get(db, "old");
+  assert(val && strcmp(val, "record") == 0);
+  free(val);
+  casky_close(db);
+  db = open_blocks(format, path, CASKY_VALUES_ON_DISK, 4, 0, CASKY_CODEC_NONE);
+  assert(db && check_block_keys(db) == expected);
+  casky_close(db);
+  db = open_blocks(format, path, CASKY_VALUES_IN_MEMORY, 4, 0, CASKY_CODEC_NONE);
+  assert(db && check_block_keys(db) == expected);
+  sleep(2);
+  assert(!casky_get(db, "short"));
+
+  // Snapshots are written in the format of new logs
+  remove(snapshot);
+  assert(casky_do_snapshot(db, snapshot) == 0);
+  casky_close(db);
+  assert(log_is_blocks(snapshot));
+  db = casky_load_snapshot(snapshot);
+  assert(db && check_block_keys(db) == expected);
+  casky_close(db);
+  remove(snapshot);
+
+  // A damaged group: the blocks around it are still replayed
+  db = open_blocks(format, path, CASKY_VALUES_ON_DISK, 1, 0, CASKY_CODEC_NONE);
+  assert(casky_compact(db) == 0);
+  casky_close(db);
+  struct stat st;
+  assert(stat(path, &st) == 0 && st.st_size > 8 * CASKY_BLOCK_SIZE);
+  FILE *f = fopen(path, "r+b");
+  assert(f && fseek(f, 5 * CASKY_BLOCK_SIZE + 100, SEEK_SET) == 0);
+  int c = fgetc(f);
+  fseek(f, 5 * CASKY_BLOCK_SIZE + 100, SEEK_SET);
+  fputc(c ^ 0xFF, f);
+  fclose(f);
+  remove("testdb.blocks.hint");  // or the log is not replayed
+  for (uint32_t threads = 1; threads <= 4; threads += 3) {
+    db = open_blocks(format, path, CASKY_VALUES_ON_DISK, threads, 0, CASKY_CODEC_NONE);
+    assert(db && casky_errno == CASKY_ERR_CORRUPT && db->corrupted_dir == 1);
+    int found = check_block_keys(db);
+    assert(found < expected && found > expected - CASKY_BLOCK_SIZE / 32);
+    casky_close(db);
+  }
+
+  // A torn group at the end of the log
+  db = open_blocks(format, path, CASKY_VALUES_ON_DISK, 1, 0, CASKY_CODEC_NONE);
+  assert(casky_compact(db) == 0);
+  assert(casky_put(db, "torn", "group", 0) == 0);
+  casky_close(db);
+  assert(stat(path, &st) == 0 && truncate(path, st.st_size - 3) == 0);
+  db = open_blocks(format, path, CASKY_VALUES_ON_DISK, 1, 0, CASKY_CODEC_NONE);
+  assert(db && !casky_get(db, "torn"));
+  assert(casky_put(db, "after", "torn", 0) == 0);
+  casky_close(db);
+  db = open_blocks(format, path, CASKY_VALUES_ON_DISK, 4, 0, CASKY_CODEC_NONE);
+  assert(db && casky_errno == CASKY_OK && !casky_get(db, "torn"));
+  val = casky_get(db, "after");
+  assert(val && strcmp(val, "torn") == 0);
+  free(val);
+  casky_close(db);
+  remove(path);
+  remove("testdb.blocks.hint");
+
+  // Segments and their hint files, with compressed values when available
+  CaskyCodec codec = casky_codec_available(CASKY_CODEC_LZ4) ? CASKY_CODEC_LZ4 : CASKY_CODEC_NONE;
+  remove_segments(SEG_TEST_DIR);
+  db = open_blocks(format, SEG_TEST_DIR, CASKY_VALUES_ON_DISK, 1, 64 * 1024, codec);
+  assert(db);
+  put_block_keys(db);
+  casky_close(db);
+  db = open_blocks(format, SEG_TEST_DIR, CASKY_VALUES_ON_DISK, 4, 64 * 1024, codec);
+  assert(db && casky_errno == CASKY_OK && check_block_keys(db) == expected);
+  assert(casky_compact(db) == 0 && check_block_keys(db) == expected);
+  casky_close(db);
+  db = open_blocks(format, SEG_TEST_DIR, CASKY_VALUES_IN_MEMORY, 1, 64 * 1024, codec);
+  assert(db && check_block_keys(db) == expected);
+  casky_close(db);
+  remove_segments(SEG_TEST_DIR);
+  printf("✔ test_block_format(%d) passed\n", format);
+}
+
+static int sum_times_cb(EntryNode *node, const Entry *e, void *arg) {
+  (void)node;
+  uint64_t *sum = arg;
+  sum[0] += e->timestamp;
+  sum[1] += e->expiration_ts;
+  return CASKY_ITER_CONTINUE;
+}
+
+// Size of a log of `n` records of 16-byte keys and 32-byte values
+static off_t small_records_log(CaskyLogFormat format, const char *path, int n) {
+  remove(path);
+  KeyDir *db = open_blocks(format, path, CASKY_VALUES_ON_DISK, 1, 0, CASKY_CODEC_NONE);
+  assert(db);
+  char key[32], value[64];
+  for (int i = 0; i < n; i++) {
+    snprintf(key, sizeof(key), "key:%012d", i);
+    snprintf(value, sizeof(value), "value:%026d", i);
+    assert(casky_put(db, key, value, 0) == 0);
+  }
+  casky_close(db);
+  struct stat st;
+  assert(stat(path, &st) == 0);
+  return st.st_size;
+}
+
+// Varint record headers: far smaller than the fixed ones for short records,
+// and timestamps before the base timestamp of the file (records compacted
+// into it) or TTLs left out when there is none come back unchanged
+void test_varint_format() {
+  const char *path = "testdb.varint";
+  CaskyOptions opts;
+  casky_options_init(&opts);
+  opts.log_format = CASKY_LOG_VARINT + 1;
+  assert(!casky_open_with_options(path, &opts) && casky_errno == CASKY_ERR_INVALID_VALUE);
+
+  off_t records = small_records_log(CASKY_LOG_RECORDS, path, 1000);
+  off_t blocks = small_records_log(CASKY_LOG_BLOCKS, path, 1000);
+  off_t varint = small_records_log(CASKY_LOG_VARINT, path, 1000);
+  assert(blocks < records && varint < blocks);
+  assert(varint < CASKY_LOG_HEADER_SIZE + 1000 * (CASKY_GROUP_HEADER_SIZE + 16 + 32 + 7));
+
+  KeyDir *db = open_blocks(CASKY_LOG_VARINT, path, CASKY_VALUES_ON_DISK, 1, 0, CASKY_CODEC_NONE);
+  char key[32];
+  for (int i = 0; i < 100; i++) {
+    snprintf(key, sizeof(key), "ttl%d", i);
+    assert(casky_put(db, key, "value", i % 2 ? 3600 : 0) == 0);
+  }
+  uint64_t before[2] = { 0, 0 }, after[2] = { 0, 0 };
+  casky_kd_foreach(db, sum_times_cb, before);
+  sleep(1);
+  assert(casky_compact(db) == 0);
+  casky_close(db);
+  remove("testdb.varint.hint");  // replay the log itself
+  db = open_blocks(CASKY_LOG_VARINT, path, CASKY_VALUES_ON_DISK, 1, 0, CASKY_CODEC_NONE);
+  assert(db && casky_errno == CASKY_OK && db->num_entries == 1100);
+  casky_kd_foreach(db, sum_times_cb, after);
+  assert(before[0] == after[0] && before[1] == after[1]);
+  casky_close(db);
+  remove(path);
+  printf("✔ test_varint_format passed\n");
+}
+
+static off_t file_size(const char *path) {
+  struct stat st;
+  assert(stat(path, &st) == 0);
+  return st.st_size;
+}
+
+// Typed records: empty values are values, TTL touches take a few bytes of
+// log instead of a copy of the value, and both survive replay, hint files
+// and compaction in every log format
+void test_record_types() {
+  const char *path = "testdb.types";
+  const char *hint = "testdb.types.hint";
+  char big[4096];
+  memset(big, 'v', sizeof(big) - 1);
+  big[sizeof(big) - 1] = '\0';
+
+  for (CaskyLogFormat format = CASKY_LOG_RECORDS; format <= CASKY_LOG_VARINT; format++) {
+    remove(path);
+    remove(hint);
+    KeyDir *db = open_blocks(format, path, CASKY_VALUES_ON_DISK, 1, 0, CASKY_CODEC_NONE);
+    assert(db);
+    if (format != CASKY_LOG_RECORDS) assert(casky_compact(db) == 0);  // switch formats
+    assert(casky_put(db, "empty", "", 0) == 0);
+    assert(casky_put(db, "big", big, 0) == 0);
+    assert(casky_put(db, "expiring", "soon", 0) == 0);
+    assert(casky_put(db, "kept", "value", 1) == 0);
+    assert(casky_touch(db, "missing", 10) == -1 && casky_errno == CASKY_ERR_KEY_NOT_FOUND);
+
+    off_t before = file_size(path);
+    assert(casky_touch(db, "big", 3600) == 0);
+    assert(file_size(path) - before < 64);
+    assert(casky_touch(db, "expiring", 1) == 0);
+    assert(casky_touch(db, "kept", 0) == 0);
+    char *val = casky_get(db, "empty");
+    assert(val && val[0] == '\0');
+    free(val);
+    casky_close(db);
+
+    // Replay, with values on disk and in memory
+    for (int m = 0; m < 2; m++) {
+      CaskyValueMode mode = m ? CASKY_VALUES_IN_MEMORY : CASKY_VALUES_ON_DISK;
+      db = open_blocks(format, path, mode, 1 + 3 * m, 0, CASKY_CODEC_NONE);
+      assert(db && casky_errno == CASKY_OK && db->num_entries == 4);
+      size_t len = 1;
+      val = casky_get_n(db, "empty", 5, &len);
+      assert(val && len == 0);
+      free(val);
+      uint64_t times[2] = { 0, 0 };
+      casky_kd_foreach(db, sum_times_cb, times);
+      assert(times[1] >= (uint64_t)time(NULL) + 3600 - 5);
+      casky_close(db);
+    }
+
+    // Compaction rewrites touched keys as plain puts, with their new expiry
+    sleep(2);
+    db = open_blocks(format, path, CASKY_VALUES_ON_DISK, 1, 0, CASKY_CODEC_NONE);
+    assert(db && !casky_get(db, "expiring"));
+    assert(casky_touch(db, "expiring", 10) == -1 && casky_errno == CASKY_ERR_KEY_NOT_FOUND);
+    val = casky_get(db, "kept");
+    assert(val && strcmp(val, "value") == 0);
+    free(val);
+    assert(casky_compact(db) == 0);
+    casky_close(db);
+    for (int h = 0; h < 2; h++) {
+      if (h) remove(hint);  // replay the log itself
+      db = open_blocks(format, path, CASKY_VALUES_ON_DISK, 1, 0, CASKY_CODEC_NONE);
+      assert(db && casky_errno == CASKY_OK && db->num_entries == 3);
+      val = casky_get(db, "big");
+      assert(val && strcmp(val, big) == 0);
+      free(val);
+      val = casky_get(db, "empty");
+      assert(val && val[0] == '\0');
+      free(val);
+      val = casky_get(db, "kept");
+      assert(val);
+      free(val);
+      casky_close(db);
+    }
+    remove(path);
+    remove(hint);
+  }
+
+  // Segments, through their hint files
+  remove_segments(SEG_TEST_DIR);
+  KeyDir *db = open_blocks(CASKY_LOG_VARINT, SEG_TEST_DIR, CASKY_VALUES_ON_DISK, 1, 4096, CASKY_CODEC_NONE);
+  assert(db && casky_compact(db) == 0);
+  assert(casky_put(db, "a", "1", 1) == 0 && casky_put(db, "b", "", 1) == 0);
+  for (int i = 0; i < 8; i++) assert(casky_put(db, "filler", big, 0) == 0);
+  assert(casky_touch(db, "a", 0) == 0 && casky_touch(db, "b", 0) == 0);
+  for (int i = 0; i < 8; i++) assert(casky_put(db, "filler", big, 0) == 0);
+  casky_close(db);
+  sleep(2);
+  db = open_blocks(CASKY_LOG_VARINT, SEG_TEST_DIR, CASKY_VALUES_ON_DISK, 4, 4096, CASKY_CODEC_NONE);
+  assert(db && casky_errno == CASKY_OK && db->num_entries == 3);
+  char *val = casky_get(db, "b");
+  assert(val && val[0] == '\0');
+  free(val);
+  casky_close(db);
+  remove_segments(SEG_TEST_DIR);
+
+  // An on-disk index, built from a log with empty values, reopened from
+  // its checkpoint and compacted, then rebuilt from the log
+  remove(path);
+  remove("testdb.types.idx");
+  db = casky_open(path);
+  assert(db && casky_put(db, "old", "", 0) == 0);
+  casky_close(db);
+  CaskyOptions opts;
+  casky_options_init(&opts);
+  opts.disk_index = 1;
+  db = casky_open_with_options(path, &opts);
+  assert(db);
+  assert(casky_put(db, "empty", "", 0) == 0);
+  assert(casky_put(db, "short", "lived", 1) == 0);
+  assert(casky_touch(db, "short", 0) == 0);
+  assert(casky_touch(db, "missing", 0) == -1 && casky_errno == CASKY_ERR_KEY_NOT_FOUND);
+  casky_close(db);
+  sleep(2);
+  for (int rebuild = 0; rebuild < 2; rebuild++) {
+    if (rebuild) remove("testdb.types.idx");
+    db = casky_open_with_options(path, &opts);
+    assert(db && casky_errno == CASKY_OK && db->num_entries == 3);
+    val = casky_get(db, "short");
+    assert(val && strcmp(val, "lived") == 0);
+    free(val);
+    const char *empty[] = { "old", "empty" };
+    for (int i = 0; i < 2; i++) {
+      size_t len = 1;
+      val = casky_get_n(db, empty[i], strlen(empty[i]), &len);
+      assert(val && len == 0);
+      free(val);
+    }
+    if (!rebuild) assert(casky_compact(db) == 0);
+    casky_close(db);
+  }
+
+  // An expired key of the on-disk index gets no TOUCH record
+  db = casky_open_with_options(path, &opts);
+  assert(db && casky_put(db, "gone", "soon", 1) == 0);
+  sleep(2);
+  off_t size = file_size(path);
+  assert(casky_touch(db, "gone", 0) == -1 && casky_errno == CASKY_ERR_KEY_NOT_FOUND);
+  assert(file_size(path) == size);
+  casky_close(db);
+  remove(path);
+  remove(hint);
+  remove("testdb.types.idx");
+
+  // Records of older releases with no value are still deletes
+  FILE *f = fopen(path, "wb");
+  assert(f);
+  assert(casky_write_record(f, 0, "gone", 4, "was", 3, time(NULL), 0) == 0);
+  assert(casky_write_record(f, 0, "gone", 4, NULL, 0, time(NULL), 0) == 0);
+  fclose(f);
+  db = casky_open(path);
+  assert(db && db->num_entries == 0 && !casky_get(db, "gone"));
+  casky_close(db);
+  remove(path);
+  printf("✔ test_record_types passed\n");
+}
+
 int main(void) {
   const char *testfile = "testdb";
 
@@ -342,11 +2682,35 @@ int main(void) {
   test_hashes();
   test_put();
   test_get();
+  test_get_into_with();
+  test_binary_keys();
   test_delete();
   test_collisions();
+  test_resize();
+  test_swiss_engine();
+  test_value_modes();
+  test_arena_nodes();
+  test_shards();
+  test_lockfree_reads();
+  test_group_commit();
+  test_sync_periodic();
+  test_ordered_scan();
+  test_disk_index();
+  test_disk_expire_compact();
+  test_segments();
+  test_compact_out_of_fds();
+  test_hint_files();
+  test_parallel_recovery();
+  test_crc32c();
+  test_compression();
+  test_block_format(CASKY_LOG_BLOCKS);
+  test_block_format(CASKY_LOG_VARINT);
+  test_varint_format();
+  test_record_types();
 
   test_open_creates_or_reads_log();
   test_put_writes_log();
+  test_record_encoding();
   test_delete_writes_log();
 
   test_compact_empty();
@@ -355,7 +2719,9 @@ int main(void) {
   test_ttl_simulation();
 
   test_log_integrity();
+  test_torn_append();
   test_multiple_operations_persist();
+  remove("testdb.hint");
   if (remove(testfile) == 0) {
     printf("✔ test file '%s' removed\n", testfile);
   } else {